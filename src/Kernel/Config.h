@@ -17,5 +17,23 @@ constexpr const char* config_BootFS_DevFile = "/dev/ram0";
 // The filesystem type of the boot filesystem
 constexpr const char* config_BootFS_FSID = "ext2";
 
+// Mount options of the TempFS mounted at /, limits its memory and node usage
+constexpr const char* config_RootFS_Options = "size=128M,nr_inodes=65536";
+
 // The command that will be executed after boot to start the first process
-constexpr const char* config_Init_Command = "/boot/Init.elf";
\ No newline at end of file
+constexpr const char* config_Init_Command = "/boot/Init.elf";
+
+// Maximum number of unreferenced nodes each mount point keeps cached
+constexpr uint64 config_NodeCacheLRUSize = 1024;
+
+// Memory budget of the block cache shared by all block devices, in bytes
+constexpr uint64 config_BlockCacheSize = 16 * 1024 * 1024;
+// Time after which a queued block request is dispatched before all others, in milliseconds
+constexpr uint64 config_BlockRequestDeadline = 500;
+// Dirty blocks are written back by the writeback thread once they are older than this, in milliseconds
+constexpr uint64 config_BlockDirtyExpire = 5000;
+constexpr uint64 config_BlockWritebackInterval = 1000;
+// In percent of the block cache budget. Above the background ratio the writeback thread writes back every dirty block,
+// above the dirty ratio threads that modify blocks write them back themselves
+constexpr uint64 config_BlockDirtyBackgroundRatio = 10;
+constexpr uint64 config_BlockDirtyRatio = 40;
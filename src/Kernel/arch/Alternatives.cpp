@@ -0,0 +1,56 @@
+#include "Alternatives.h"
+
+#include "CPUFeatures.h"
+#include "klib/stdio.h"
+
+extern "C" int ALTERNATIVES_START;
+extern "C" int ALTERNATIVES_END;
+
+namespace Alternatives {
+
+    struct Entry {
+        uint64 site;
+        uint64 replacement;
+        uint32 feature;
+        uint8 siteLength;
+        uint8 replacementLength;
+        uint16 reserved;
+    } __attribute__((packed));
+
+    static_assert(sizeof(Entry) == 24, "Alternatives::Entry does not match the layout of ALTERNATIVE()");
+
+    void Apply() {
+        Entry* entries = (Entry*)&ALTERNATIVES_START;
+        Entry* entriesEnd = (Entry*)&ALTERNATIVES_END;
+
+        uint64 numPatched = 0;
+        for(Entry* e = entries; e < entriesEnd; e++) {
+            if(!CPUFeatures::Has((CPUFeatures::Feature)e->feature))
+                continue;
+
+            // kmemcpy itself contains patch sites, so copy byte by byte
+            volatile uint8* site = (volatile uint8*)e->site;
+            const uint8* repl = (const uint8*)e->replacement;
+            for(uint8 i = 0; i < e->replacementLength; i++)
+                site[i] = repl[i];
+            for(uint8 i = e->replacementLength; i < e->siteLength; i++)
+                site[i] = 0x90;
+
+            // call rel32 / jmp rel32 have to be relocated to the patch site
+            if(e->replacementLength == 5 && (repl[0] == 0xE8 || repl[0] == 0xE9)) {
+                int32 disp = *(const int32*)(repl + 1);
+                disp += (int32)(e->replacement - e->site);
+                *(volatile int32*)(site + 1) = disp;
+            }
+
+            numPatched++;
+        }
+
+        // Serialize, so that no stale instructions are executed on this core
+        uint64 rax = 0;
+        __asm__ __volatile__ ("cpuid" : "+a"(rax) : : "rbx", "rcx", "rdx", "memory");
+
+        klog_info_isr("Alternatives", "Patched %i of %i sites", numPatched, (uint64)(entriesEnd - entries));
+    }
+
+}
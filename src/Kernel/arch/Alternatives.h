@@ -0,0 +1,62 @@
+#pragma once
+
+#include "types.h"
+
+/**
+ * Boot time code patching.
+ *
+ * ALTERNATIVE() emits oldInstr into the code and records a patch site in the .kalternatives section.
+ * Alternatives::Apply() overwrites every site whose feature is supported by the CPU with newInstr,
+ * so hot paths can select the best instruction sequence without a runtime branch.
+ * If newInstr is longer than oldInstr, oldInstr is padded with nops. A newInstr that is a single
+ * call/jmp with a 32-bit displacement is relocated to its patch site.
+ *
+ * feature is an asm operand reference to a CPUFeatures::Feature constant, e.g.
+ *      __asm__ __volatile__ (ALTERNATIVE("rep movsq", "rep movsb", "%c[feature]") : ... : [feature] "i"(CPUFeatures::FEATURE_ERMS));
+ * Multiple alternatives for the same site can be chained with ALTERNATIVE_2(), the last supported one wins.
+ **/
+
+#define _ALT_ENTRY(site, siteEnd, repl, replEnd, feature) \
+    ".pushsection .kalternatives,\"a\"\n" \
+    ".quad " site "\n" \
+    ".quad " repl "\n" \
+    ".long " feature "\n" \
+    ".byte " siteEnd "-" site "\n" \
+    ".byte " replEnd "-" repl "\n" \
+    ".short 0\n" \
+    ".popsection\n"
+
+#define _ALT_PAD(len, siteLen) \
+    ".skip -((" len ")-(" siteLen ") > 0) * ((" len ")-(" siteLen ")), 0x90\n"
+
+#define ALTERNATIVE(oldInstr, newInstr, feature) \
+    "661:\n\t" oldInstr "\n662:\n" \
+    _ALT_PAD("665f-664f", "662b-661b") \
+    "663:\n" \
+    _ALT_ENTRY("661b", "663b", "664f", "665f", feature) \
+    ".pushsection .text.kalt_replacement,\"ax\"\n" \
+    "664:\n\t" newInstr "\n665:\n" \
+    ".popsection\n"
+
+#define ALTERNATIVE_2(oldInstr, newInstr1, feature1, newInstr2, feature2) \
+    "661:\n\t" oldInstr "\n662:\n" \
+    _ALT_PAD("665f-664f", "662b-661b") \
+    "663:\n" \
+    _ALT_PAD("667f-666f", "663b-661b") \
+    "668:\n" \
+    _ALT_ENTRY("661b", "668b", "664f", "665f", feature1) \
+    _ALT_ENTRY("661b", "668b", "666f", "667f", feature2) \
+    ".pushsection .text.kalt_replacement,\"ax\"\n" \
+    "664:\n\t" newInstr1 "\n665:\n" \
+    "666:\n\t" newInstr2 "\n667:\n" \
+    ".popsection\n"
+
+namespace Alternatives {
+
+    /**
+     * Patches every recorded site whose feature is supported.
+     * Has to be called on the boot core before the other cores are started and after CPUFeatures::Init().
+     **/
+    void Apply();
+
+}
@@ -0,0 +1,87 @@
+#include "CPUFeatures.h"
+
+#include "CPU.h"
+#include "klib/stdio.h"
+
+namespace CPUFeatures {
+
+    static uint64 g_Features = 0;
+
+    static const char* g_FeatureNames[FEATURE_COUNT] = {
+        "TSC", "PAT", "FXSR", "SSE", "SSE2", "XSAVE", "XSAVEOPT", "AVX", "AVX2",
+        "ERMS", "FSRM", "RDTSCP", "InvariantTSC", "PCID", "INVPCID", "x2APIC",
+    };
+
+    static void Set(Feature feature, bool supported) {
+        if(supported)
+            g_Features |= (1ULL << feature);
+    }
+
+    void Init() {
+        uint64 eax, ebx, ecx, edx;
+
+        CPU::CPUID(0x0, 0x0, eax, ebx, ecx, edx);
+        uint64 maxLeaf = eax;
+        CPU::CPUID(0x80000000, 0x0, eax, ebx, ecx, edx);
+        uint64 maxExtLeaf = eax;
+
+        CPU::CPUID(0x1, 0x0, eax, ebx, ecx, edx);
+        Set(FEATURE_TSC, edx & (1 << 4));
+        Set(FEATURE_PAT, edx & (1 << 16));
+        Set(FEATURE_FXSR, edx & (1 << 24));
+        Set(FEATURE_SSE, edx & (1 << 25));
+        Set(FEATURE_SSE2, edx & (1 << 26));
+        Set(FEATURE_PCID, ecx & (1 << 17));
+        Set(FEATURE_X2APIC, ecx & (1 << 21));
+        Set(FEATURE_XSAVE, ecx & (1 << 26));
+        bool avx = ecx & (1 << 28);
+
+        if(maxLeaf >= 0x7) {
+            CPU::CPUID(0x7, 0x0, eax, ebx, ecx, edx);
+            Set(FEATURE_AVX2, avx && (ebx & (1 << 5)));
+            Set(FEATURE_ERMS, ebx & (1 << 9));
+            Set(FEATURE_INVPCID, ebx & (1 << 10));
+            Set(FEATURE_FSRM, edx & (1 << 4));
+        }
+
+        if(Has(FEATURE_XSAVE) && maxLeaf >= 0xD) {
+            CPU::CPUID(0xD, 0x0, eax, ebx, ecx, edx);
+            // AVX is only usable if its register state can be saved
+            Set(FEATURE_AVX, avx && (eax & (1 << 2)));
+            CPU::CPUID(0xD, 0x1, eax, ebx, ecx, edx);
+            Set(FEATURE_XSAVEOPT, eax & (1 << 0));
+        }
+
+        if(maxExtLeaf >= 0x80000001) {
+            CPU::CPUID(0x80000001, 0x0, eax, ebx, ecx, edx);
+            Set(FEATURE_RDTSCP, edx & (1 << 27));
+        }
+        if(maxExtLeaf >= 0x80000007) {
+            CPU::CPUID(0x80000007, 0x0, eax, ebx, ecx, edx);
+            Set(FEATURE_INVARIANT_TSC, edx & (1 << 8));
+        }
+
+        char buffer[256];
+        uint64 pos = 0;
+        for(uint32 f = 0; f < FEATURE_COUNT; f++) {
+            if(!Has((Feature)f))
+                continue;
+            for(const char* n = g_FeatureNames[f]; *n != '\0' && pos < sizeof(buffer) - 2; n++)
+                buffer[pos++] = *n;
+            buffer[pos++] = ' ';
+        }
+        buffer[pos] = '\0';
+        klog_info_isr("CPU", "Features: %s", buffer);
+    }
+
+    bool Has(Feature feature) {
+        return g_Features & (1ULL << feature);
+    }
+
+    const char* GetName(Feature feature) {
+        if(feature >= FEATURE_COUNT)
+            return "Unknown";
+        return g_FeatureNames[feature];
+    }
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+/**
+ * Central table of the CPU features the kernel cares about.
+ * Filled once on the boot core, every core is assumed to support the same features.
+ **/
+namespace CPUFeatures {
+
+    enum Feature : uint32 {
+        FEATURE_TSC,
+        FEATURE_PAT,
+        FEATURE_FXSR,
+        FEATURE_SSE,
+        FEATURE_SSE2,
+        FEATURE_XSAVE,
+        FEATURE_XSAVEOPT,
+        FEATURE_AVX,            // CPU supports AVX and its register state can be enabled with XSAVE
+        FEATURE_AVX2,
+        FEATURE_ERMS,           // Enhanced rep movsb/stosb
+        FEATURE_FSRM,           // Fast short rep movsb
+        FEATURE_RDTSCP,
+        FEATURE_INVARIANT_TSC,
+        FEATURE_PCID,
+        FEATURE_INVPCID,
+        FEATURE_X2APIC,
+
+        FEATURE_COUNT,
+    };
+
+    /**
+     * Queries CPUID and fills the feature table. Has to be called before any other function of this namespace.
+     **/
+    void Init();
+
+    bool Has(Feature feature);
+    const char* GetName(Feature feature);
+
+}
@@ -4,6 +4,8 @@
 #include "klib/stdio.h"
 
 #include "arch/CPU.h"
+#include "arch/CPUFeatures.h"
+#include "arch/Alternatives.h"
 
 namespace SSE {
 
@@ -11,29 +13,24 @@ namespace SSE {
     static uint64 g_FPUBlockSize;
 
     static bool CheckFeatures() {
-        uint64 eax, ebx, ecx, edx;
-        CPU::CPUID(0x1, 0x0, eax, ebx, ecx, edx);
-
-        if(!(edx & (1 << 25))) {    // no SSE1
+        if(!CPUFeatures::Has(CPUFeatures::FEATURE_SSE)) {
             klog_fatal_isr("SSE", "SSE1 not supported");
             return false;
         }
-        if(!(edx & (1 << 26))) {    // no SSE2
+        if(!CPUFeatures::Has(CPUFeatures::FEATURE_SSE2)) {
             klog_fatal_isr("SSE", "SSE2 not supported");
             return false;
         }
-        if(!(edx & (1 << 24))) {    // no FXSAVE / FXRSTOR
+        if(!CPUFeatures::Has(CPUFeatures::FEATURE_FXSR)) {
             klog_fatal_isr("SSE", "FXSAVE/FXRSTOR not supported");
             return false;
         }
 
-        bool xsave = false;
-
-        if(ecx & (1 << 26)) {    // XSAVE / XRSTOR supported
+        bool xsave = CPUFeatures::Has(CPUFeatures::FEATURE_XSAVE);
+        if(xsave)
             klog_info_isr("SSE", "XSAVE/XRSTOR supported");
-            xsave = true;
-        }
 
+        uint64 eax, ebx, ecx, edx;
         CPU::CPUID(0xD, 0x0, eax, ebx, ecx, edx);
         if(xsave && (eax & (1 << 2))) {
             klog_info_isr("SSE", "Extended SSE supported");
@@ -141,8 +138,8 @@ namespace SSE {
     void SaveFPUBlock(char* buffer) {
         if(g_ExtendedSSE) {
             __asm__ __volatile__ (
-                "xsaveq (%0)"
-                : : "r"(buffer), "d"(0), "a"(0b111)
+                ALTERNATIVE("xsaveq (%0)", "xsaveopt64 (%0)", "%c[xsaveopt]")
+                : : "r"(buffer), "d"(0), "a"(0b111), [xsaveopt] "i"(CPUFeatures::FEATURE_XSAVEOPT)
             );
         } else {
             __asm__ __volatile__ (
@@ -0,0 +1,387 @@
+#include "BlockCache.h"
+#include "DeviceDriver.h"
+
+#include "locks/StickyLock.h"
+#include "scheduler/Scheduler.h"
+#include "time/Time.h"
+#include "init/Init.h"
+#include "errno.h"
+#include "Config.h"
+
+#include <new>
+
+namespace BlockCache {
+
+    struct Bucket {
+        StickyLock lock;
+        ktl::AnchorList<Buffer, &Buffer::hashAnchor> buffers;
+    };
+
+    static constexpr uint64 NumBuckets = 4096;
+
+    static Bucket g_Buckets[NumBuckets];
+
+    // Every buffer is on the clock list, the front of the list is the position of the clock hand
+    static StickyLock g_ClockLock;
+    static ktl::AnchorList<Buffer, &Buffer::clockAnchor> g_Clock;
+    static uint64 g_NumBuffers = 0;
+    static uint64 g_UsedBytes = 0;
+    static uint64 g_MaxBytes = config_BlockCacheSize;
+
+    // Dirty buffers in the order in which they became dirty
+    static StickyLock g_DirtyLock;
+    static ktl::AnchorList<Buffer, &Buffer::dirtyAnchor> g_Dirty;
+    static uint64 g_DirtyBytes = 0;
+
+    static Atomic<uint64> g_Hits = 0;
+    static Atomic<uint64> g_Misses = 0;
+    static Atomic<uint64> g_Evictions = 0;
+    static Atomic<uint64> g_Writebacks = 0;
+
+    // Maximum number of buffers that are locked and written back at once
+    static constexpr uint64 WritebackBatch = 256;
+
+    static uint64 Hash(BlockDeviceDriver* driver, uint64 subID, uint64 blockID) {
+        uint64 hash = blockID * 0x9E3779B97F4A7C15;
+        hash ^= subID * 0xC2B2AE3D27D4EB4F;
+        hash ^= (uint64)driver >> 4;
+        return hash;
+    }
+
+    static Bucket& GetBucket(uint64 hash) {
+        return g_Buckets[(hash ^ (hash >> 32)) % NumBuckets];
+    }
+
+    static Buffer* Find(Bucket& bucket, BlockDeviceDriver* driver, uint64 subID, uint64 blockID) {
+        for(Buffer& b : bucket.buffers) {
+            if(b.blockID == blockID && b.subID == subID && b.driver == driver)
+                return &b;
+        }
+        return nullptr;
+    }
+
+    static void FreeBuffer(Buffer* buffer) {
+        buffer->~Buffer();
+        delete[] (char*)buffer;
+    }
+
+    /**
+     * Moves the clock hand until the cache fits into its budget again, or every buffer was looked at twice.
+     * g_ClockLock has to be held.
+     **/
+    static void Evict() {
+        uint64 maxSteps = g_NumBuffers * 2;
+        for(uint64 step = 0; step < maxSteps && g_UsedBytes > g_MaxBytes; step++) {
+            Buffer* buffer = &g_Clock.front();
+            g_Clock.pop_front();
+
+            // Recently used buffers get a second chance
+            if(buffer->accessed.Read() != 0) {
+                buffer->accessed.Write(0);
+                g_Clock.push_back(buffer);
+                continue;
+            }
+
+            Bucket& bucket = GetBucket(buffer->hash);
+            bucket.lock.Spinlock();
+            if(buffer->refCount != 0) {
+                bucket.lock.Unlock();
+                g_Clock.push_back(buffer);
+                continue;
+            }
+            bucket.buffers.erase(decltype(bucket.buffers)::Iterator(buffer));
+            bucket.lock.Unlock();
+
+            g_NumBuffers--;
+            g_UsedBytes -= buffer->size;
+            g_Evictions.Inc();
+            FreeBuffer(buffer);
+        }
+    }
+
+    Buffer* Acquire(BlockDeviceDriver* driver, uint64 subID, uint64 blockID, uint64 blockSize) {
+        uint64 hash = Hash(driver, subID, blockID);
+        Bucket& bucket = GetBucket(hash);
+
+        bucket.lock.Spinlock();
+        Buffer* buffer = Find(bucket, driver, subID, blockID);
+        if(buffer != nullptr) {
+            buffer->refCount++;
+            bucket.lock.Unlock();
+
+            buffer->accessed.Write(1);
+            g_Hits.Inc();
+            return buffer;
+        }
+        bucket.lock.Unlock();
+
+        Buffer* newBuffer = new(new char[sizeof(Buffer) + blockSize]) Buffer();
+        newBuffer->driver = driver;
+        newBuffer->subID = subID;
+        newBuffer->blockID = blockID;
+        newBuffer->hash = hash;
+        newBuffer->size = blockSize;
+        newBuffer->refCount = 1;
+        newBuffer->accessed = 1;
+        newBuffer->valid = false;
+        newBuffer->dirty = false;
+
+        bucket.lock.Spinlock();
+        // Another thread might have created the buffer in the meantime
+        buffer = Find(bucket, driver, subID, blockID);
+        if(buffer != nullptr) {
+            buffer->refCount++;
+            bucket.lock.Unlock();
+
+            FreeBuffer(newBuffer);
+            buffer->accessed.Write(1);
+            g_Hits.Inc();
+            return buffer;
+        }
+        bucket.buffers.push_back(newBuffer);
+        bucket.lock.Unlock();
+        g_Misses.Inc();
+
+        g_ClockLock.Spinlock();
+        g_Clock.push_back(newBuffer);
+        g_NumBuffers++;
+        g_UsedBytes += blockSize;
+        Evict();
+        g_ClockLock.Unlock();
+
+        return newBuffer;
+    }
+
+    void Release(Buffer* buffer) {
+        Bucket& bucket = GetBucket(buffer->hash);
+        bucket.lock.Spinlock();
+        buffer->refCount--;
+        bucket.lock.Unlock();
+    }
+
+    static void AddRef(Buffer* buffer) {
+        Bucket& bucket = GetBucket(buffer->hash);
+        bucket.lock.Spinlock();
+        buffer->refCount++;
+        bucket.lock.Unlock();
+    }
+
+    void MarkDirty(Buffer* buffer) {
+        if(buffer->dirty)
+            return;
+
+        buffer->dirty = true;
+        AddRef(buffer);
+
+        g_DirtyLock.Spinlock();
+        buffer->dirtyTime = Time::GetTSC();
+        g_Dirty.push_back(buffer);
+        g_DirtyBytes += buffer->size;
+        g_DirtyLock.Unlock();
+    }
+
+    static void ClearDirty(Buffer* buffer) {
+        g_DirtyLock.Spinlock();
+        g_Dirty.erase(decltype(g_Dirty)::Iterator(buffer));
+        g_DirtyBytes -= buffer->size;
+        g_DirtyLock.Unlock();
+
+        buffer->dirty = false;
+        Release(buffer);
+    }
+
+    static bool IsBefore(const Buffer* a, const Buffer* b) {
+        if(a->driver != b->driver)
+            return a->driver < b->driver;
+        if(a->subID != b->subID)
+            return a->subID < b->subID;
+        return a->blockID < b->blockID;
+    }
+
+    // Sorts buffers by device and block, heapsort
+    static void SortBuffers(Buffer** buffers, uint64 count) {
+        auto siftDown = [buffers](uint64 root, uint64 end) {
+            while(root * 2 + 1 < end) {
+                uint64 child = root * 2 + 1;
+                if(child + 1 < end && IsBefore(buffers[child], buffers[child + 1]))
+                    child++;
+                if(!IsBefore(buffers[root], buffers[child]))
+                    return;
+                Buffer* tmp = buffers[root];
+                buffers[root] = buffers[child];
+                buffers[child] = tmp;
+                root = child;
+            }
+        };
+
+        for(uint64 i = count / 2; i > 0; i--)
+            siftDown(i - 1, count);
+        for(uint64 end = count; end > 1; end--) {
+            Buffer* tmp = buffers[0];
+            buffers[0] = buffers[end - 1];
+            buffers[end - 1] = tmp;
+            siftDown(0, end - 1);
+        }
+    }
+
+    /**
+     * Writes back the buffers, which are sorted and referenced by the caller.
+     * Every buffer is locked before any write is submitted, a plugged driver must not wait for a lock.
+     **/
+    static int64 WriteBatch(Buffer** buffers, uint64 count) {
+        BlockRequest* requests = new BlockRequest[count];
+        bool submitted[WritebackBatch];
+
+        for(uint64 i = 0; i < count; i++) {
+            buffers[i]->lock.Lock();
+            // Another thread might have written the buffer back in the meantime
+            submitted[i] = buffers[i]->dirty;
+        }
+
+        BlockDeviceDriver* plugged = nullptr;
+        for(uint64 i = 0; i < count; i++) {
+            if(!submitted[i])
+                continue;
+
+            Buffer* b = buffers[i];
+            if(b->driver != plugged) {
+                if(plugged != nullptr)
+                    plugged->Unplug();
+                plugged = b->driver;
+                plugged->Plug();
+            }
+            b->driver->SubmitRequest(&requests[i], b->subID, b->blockID, 1, true, b->data);
+        }
+        if(plugged != nullptr)
+            plugged->Unplug();
+
+        int64 res = OK;
+        for(uint64 i = 0; i < count; i++) {
+            if(submitted[i]) {
+                int64 status = BlockDeviceDriver::WaitForRequest(&requests[i]);
+                if(status == OK) {
+                    g_Writebacks.Inc();
+                    ClearDirty(buffers[i]);
+                } else {
+                    // Retried by a later writeback
+                    g_DirtyLock.Spinlock();
+                    g_Dirty.erase(decltype(g_Dirty)::Iterator(buffers[i]));
+                    buffers[i]->dirtyTime = Time::GetTSC();
+                    g_Dirty.push_back(buffers[i]);
+                    g_DirtyLock.Unlock();
+
+                    if(res == OK)
+                        res = status;
+                }
+            }
+            buffers[i]->lock.Unlock();
+        }
+
+        delete[] requests;
+        return res;
+    }
+
+    /**
+     * Writes back the buffers of the device that became dirty before dirtiedBefore, in batches sorted by block.
+     * driver == nullptr writes back the buffers of every device.
+     **/
+    static int64 WriteBack(BlockDeviceDriver* driver, uint64 subID, uint64 dirtiedBefore) {
+        int64 res = OK;
+        Buffer* batch[WritebackBatch];
+
+        while(true) {
+            uint64 count = 0;
+            g_DirtyLock.Spinlock();
+            for(Buffer& b : g_Dirty) {
+                if(b.dirtyTime >= dirtiedBefore || count == WritebackBatch)
+                    break;
+                if(driver != nullptr && (b.driver != driver || b.subID != subID))
+                    continue;
+
+                // Keeps the buffer alive if another thread writes it back and drops its dirty reference
+                AddRef(&b);
+                batch[count++] = &b;
+            }
+            g_DirtyLock.Unlock();
+
+            if(count == 0)
+                break;
+
+            SortBuffers(batch, count);
+            int64 error = WriteBatch(batch, count);
+            if(error != OK && res == OK)
+                res = error;
+
+            for(uint64 i = 0; i < count; i++)
+                Release(batch[i]);
+        }
+
+        return res;
+    }
+
+    static uint64 GetDirtyLimit(uint64 ratio) {
+        g_ClockLock.Spinlock();
+        uint64 limit = g_MaxBytes / 100 * ratio;
+        g_ClockLock.Unlock();
+        return limit;
+    }
+    static uint64 GetDirtyBytes() {
+        g_DirtyLock.Spinlock();
+        uint64 res = g_DirtyBytes;
+        g_DirtyLock.Unlock();
+        return res;
+    }
+
+    void BalanceDirty() {
+        if(GetDirtyBytes() > GetDirtyLimit(config_BlockDirtyRatio))
+            WriteBack(nullptr, 0, Time::GetTSC());
+    }
+
+    int64 Sync(BlockDeviceDriver* driver, uint64 subID) {
+        return WriteBack(driver, subID, Time::GetTSC());
+    }
+
+    static int64 WritebackThread(uint64, uint64) {
+        uint64 expireTicks = config_BlockDirtyExpire * Time::GetTSCTicksPerMilli();
+
+        while(true) {
+            Scheduler::ThreadSleep(config_BlockWritebackInterval);
+
+            // Above the background threshold everything is written back, otherwise only the buffers that expired
+            uint64 now = Time::GetTSC();
+            uint64 dirtiedBefore = now;
+            if(GetDirtyBytes() <= GetDirtyLimit(config_BlockDirtyBackgroundRatio))
+                dirtiedBefore = now > expireTicks ? now - expireTicks : 0;
+            WriteBack(nullptr, 0, dirtiedBefore);
+        }
+
+        return 0;
+    }
+
+    static void Init() {
+        Scheduler::CreateKernelThread(WritebackThread);
+    }
+    REGISTER_INIT_FUNC(Init, INIT_STAGE_DEVDRIVERS);
+
+    void SetMemoryBudget(uint64 bytes) {
+        g_ClockLock.Spinlock();
+        g_MaxBytes = bytes;
+        Evict();
+        g_ClockLock.Unlock();
+    }
+
+    void GetStats(Stats& outStats) {
+        outStats.hits = g_Hits.Read();
+        outStats.misses = g_Misses.Read();
+        outStats.evictions = g_Evictions.Read();
+        outStats.writebacks = g_Writebacks.Read();
+        outStats.dirtyBytes = GetDirtyBytes();
+
+        g_ClockLock.Spinlock();
+        outStats.numBuffers = g_NumBuffers;
+        outStats.usedBytes = g_UsedBytes;
+        outStats.maxBytes = g_MaxBytes;
+        g_ClockLock.Unlock();
+    }
+
+}
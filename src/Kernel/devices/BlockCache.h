@@ -0,0 +1,89 @@
+#pragma once
+
+#include "types.h"
+#include "atomic/Atomics.h"
+#include "locks/QueueLock.h"
+#include "ktl/AnchorList.h"
+
+class BlockDeviceDriver;
+
+/**
+ * Global cache of device blocks, shared by all BlockDeviceDrivers.
+ * Buffers are hashed by (driver, subID, blockID), every hash bucket has its own lock.
+ * Buffers that are not referenced are evicted in CLOCK order once the cache uses more memory than its budget.
+ * Modified buffers are written back to their device by a writeback thread, the oldest first.
+ **/
+namespace BlockCache {
+
+    struct Buffer {
+        ktl::Anchor<Buffer> hashAnchor;
+        ktl::Anchor<Buffer> clockAnchor;
+
+        BlockDeviceDriver* driver;
+        uint64 subID;
+        uint64 blockID;
+        uint64 hash;
+        uint64 size;
+
+        // Protected by the lock of the buffer's hash bucket, a referenced buffer is never evicted
+        uint64 refCount;
+        // Set on every access, cleared when the clock hand passes the buffer
+        Atomic<uint64> accessed;
+
+        // Held while the data is read, modified or written back
+        QueueLock lock;
+        // data holds the contents of the block, protected by lock
+        bool valid;
+        // data differs from the device, protected by lock. A dirty buffer holds a reference until it was written back
+        bool dirty;
+
+        // Protected by the dirty list lock
+        ktl::Anchor<Buffer> dirtyAnchor;
+        // In TSC ticks
+        uint64 dirtyTime;
+
+        uint8 data[];
+    };
+
+    struct Stats {
+        uint64 hits;
+        uint64 misses;
+        uint64 evictions;
+        uint64 writebacks;
+        uint64 numBuffers;
+        uint64 usedBytes;
+        uint64 maxBytes;
+        uint64 dirtyBytes;
+    };
+
+    /**
+     * Returns the buffer of the given block with an additional reference, the buffer stays in memory until it is released.
+     * A buffer that was just created is not valid yet, callers have to check and fill it while holding buffer->lock.
+     **/
+    Buffer* Acquire(BlockDeviceDriver* driver, uint64 subID, uint64 blockID, uint64 blockSize);
+    void Release(Buffer* buffer);
+
+    /**
+     * Marks the data of a valid buffer as modified, buffer->lock has to be held.
+     **/
+    void MarkDirty(Buffer* buffer);
+    /**
+     * Writes dirty buffers back right away if too much of the cache is dirty.
+     * Should be called after buffers were modified, while no buffer lock is held.
+     **/
+    void BalanceDirty();
+    /**
+     * Writes every buffer of the device that was modified before the call back and waits for the writes,
+     * driver == nullptr writes back the buffers of every device.
+     * @returns OK or the error of the first failed write, failed buffers stay dirty
+     **/
+    int64 Sync(BlockDeviceDriver* driver, uint64 subID);
+
+    /**
+     * Sets the number of bytes that the cache may use and evicts buffers until it fits.
+     * Referenced buffers are kept even if they exceed the budget.
+     **/
+    void SetMemoryBudget(uint64 bytes);
+    void GetStats(Stats& outStats);
+
+}
@@ -0,0 +1,228 @@
+#include "BlockQueue.h"
+#include "DeviceDriver.h"
+
+#include "scheduler/Scheduler.h"
+#include "time/Time.h"
+#include "klib/memory.h"
+#include "errno.h"
+#include "Config.h"
+
+// Maximum number of device operations that a driver has in flight at once, unless the driver allows less
+static constexpr uint64 MaxInFlight = 32;
+// Limits of a single device operation
+static constexpr uint64 MaxMergeBlocks = 256;
+static constexpr uint64 MaxMergeSegments = 64;
+
+static bool IsBefore(const BlockRequest* a, const BlockRequest* b) {
+    if(a->subID != b->subID)
+        return a->subID < b->subID;
+    return a->startBlock < b->startBlock;
+}
+
+static bool IsContiguous(const BlockRequest* first, const BlockRequest* second) {
+    return first->subID == second->subID && first->write == second->write
+        && first->startBlock + first->numBlocks == second->startBlock;
+}
+
+BlockQueue::BlockQueue(BlockDeviceDriver* driver)
+    : m_Driver(driver), m_PosSubID(0), m_PosBlock(0), m_InFlight(0), m_MaxInFlight(MaxInFlight), m_PlugCount(0), m_Dispatching(false)
+{
+    Scheduler::CreateKernelThread(DispatchThread, (uint64)this);
+}
+
+void BlockQueue::Submit(BlockRequest* request) {
+    request->totalBlocks = request->numBlocks;
+    request->deadline = Time::GetTSC() + config_BlockRequestDeadline * Time::GetTSCTicksPerMilli();
+
+    m_Lock.Spinlock_Cli();
+
+    // A read that lies within a queued read is served from the data of that read
+    if(!request->write) {
+        for(BlockRequest& r : m_Sorted) {
+            if(!r.write && r.subID == request->subID && r.startBlock <= request->startBlock
+                && request->startBlock + request->numBlocks <= r.startBlock + r.numBlocks) {
+                r.copies.push_back(request);
+                m_Lock.Unlock_Cli();
+                return;
+            }
+        }
+    }
+
+    auto pos = m_Sorted.begin();
+    while(pos != m_Sorted.end() && !IsBefore(request, &*pos))
+        ++pos;
+    m_Sorted.insert(pos, request);
+    m_Fifo.push_back(request);
+
+    bool dispatch = m_PlugCount == 0;
+    m_Lock.Unlock_Cli();
+
+    if(dispatch)
+        Dispatch();
+}
+
+void BlockQueue::Plug() {
+    m_Lock.Spinlock_Cli();
+    m_PlugCount++;
+    m_Lock.Unlock_Cli();
+}
+void BlockQueue::Unplug() {
+    m_Lock.Spinlock_Cli();
+    m_PlugCount--;
+    m_Lock.Unlock_Cli();
+
+    Dispatch();
+}
+
+void BlockQueue::LimitInFlight(uint64 max) {
+    m_Lock.Spinlock_Cli();
+    if(max < m_MaxInFlight)
+        m_MaxInFlight = max;
+    m_Lock.Unlock_Cli();
+}
+
+bool BlockQueue::CanDispatch() const {
+    return m_PlugCount == 0 && m_InFlight < m_MaxInFlight && !m_Sorted.empty();
+}
+
+BlockRequest* BlockQueue::TakeNext() {
+    BlockRequest* op = &m_Fifo.front();
+
+    // Requests are only served in elevator order as long as none of them waited too long
+    if(Time::GetTSC() < op->deadline) {
+        op = nullptr;
+        for(BlockRequest& r : m_Sorted) {
+            if(r.subID > m_PosSubID || (r.subID == m_PosSubID && r.startBlock >= m_PosBlock)) {
+                op = &r;
+                break;
+            }
+        }
+        // Every request lies behind the elevator, start over at the lowest block
+        if(op == nullptr)
+            op = &m_Sorted.front();
+    }
+
+    while(op->anchor.prev != nullptr && IsContiguous(op->anchor.prev, op))
+        op = op->anchor.prev;
+
+    BlockRequest* next = op->anchor.next;
+    m_Sorted.erase(decltype(m_Sorted)::Iterator(op));
+    m_Fifo.erase(decltype(m_Fifo)::Iterator(op));
+
+    BlockRequest* last = op;
+    uint64 numSegments = 1;
+    while(next != nullptr && numSegments < MaxMergeSegments && IsContiguous(last, next)
+        && op->totalBlocks + next->numBlocks <= MaxMergeBlocks) {
+        BlockRequest* r = next;
+        next = r->anchor.next;
+        m_Sorted.erase(decltype(m_Sorted)::Iterator(r));
+        m_Fifo.erase(decltype(m_Fifo)::Iterator(r));
+
+        op->merged.push_back(r);
+        op->totalBlocks += r->numBlocks;
+        numSegments++;
+        last = r;
+    }
+
+    m_PosSubID = op->subID;
+    m_PosBlock = op->startBlock + op->totalBlocks;
+    return op;
+}
+
+void BlockQueue::Dispatch() {
+    m_Lock.Spinlock_Cli();
+    if(m_Dispatching) {
+        // The dispatching thread checks the queue again before it stops
+        m_Lock.Unlock_Cli();
+        return;
+    }
+
+    m_Dispatching = true;
+    while(CanDispatch()) {
+        BlockRequest* op = TakeNext();
+        m_InFlight++;
+        m_Lock.Unlock_Cli();
+
+        m_Driver->ScheduleOperation(op);
+
+        m_Lock.Spinlock_Cli();
+    }
+    m_Dispatching = false;
+    m_Lock.Unlock_Cli();
+}
+
+void BlockQueue::Finish(BlockRequest* request, int64 status, bool isr) {
+    request->status = status;
+    if(request->callback != nullptr) {
+        request->callback(request);
+        return;
+    }
+
+    if(isr) {
+        request->lock.Spinlock_Raw();
+        request->done = true;
+        request->waiters.WakeAll();
+        request->lock.Unlock_Raw();
+    } else {
+        request->lock.Spinlock_Cli();
+        request->done = true;
+        request->waiters.WakeAll();
+        request->lock.Unlock_Cli();
+    }
+}
+
+void BlockQueue::FinishSegment(BlockRequest* segment, int64 status, bool isr, uint64 blockSize) {
+    while(!segment->copies.empty()) {
+        BlockRequest* copy = &segment->copies.front();
+        segment->copies.pop_front();
+
+        if(status == OK) {
+            uint64 offset = (copy->startBlock - segment->startBlock) * blockSize;
+            kmemcpy(copy->buffer, (char*)segment->buffer + offset, copy->numBlocks * blockSize);
+        }
+        Finish(copy, status, isr);
+    }
+
+    Finish(segment, status, isr);
+}
+
+void BlockQueue::Complete(BlockRequest* op, int64 status, bool isr) {
+    uint64 blockSize = m_Driver->GetBlockSize(op->subID);
+
+    // op itself is finished last, its callback may free it
+    while(!op->merged.empty()) {
+        BlockRequest* segment = &op->merged.front();
+        op->merged.pop_front();
+        FinishSegment(segment, status, isr, blockSize);
+    }
+    FinishSegment(op, status, isr, blockSize);
+
+    if(isr) {
+        m_Lock.Spinlock_Raw();
+        m_InFlight--;
+        if(!m_Dispatching && CanDispatch())
+            m_DispatchWaiters.WakeAll();
+        m_Lock.Unlock_Raw();
+    } else {
+        m_Lock.Spinlock_Cli();
+        m_InFlight--;
+        m_Lock.Unlock_Cli();
+
+        Dispatch();
+    }
+}
+
+int64 BlockQueue::DispatchThread(uint64 queue, uint64) {
+    BlockQueue* q = (BlockQueue*)queue;
+
+    while(true) {
+        q->m_Lock.Spinlock_Cli();
+        while(q->m_Dispatching || !q->CanDispatch())
+            q->m_DispatchWaiters.Wait_Cli(q->m_Lock);
+        q->m_Lock.Unlock_Cli();
+
+        q->Dispatch();
+    }
+
+    return 0;
+}
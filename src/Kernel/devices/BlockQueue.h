@@ -0,0 +1,115 @@
+#pragma once
+
+#include "types.h"
+#include "locks/StickyLock.h"
+#include "locks/WaitQueue.h"
+#include "ktl/AnchorList.h"
+
+class BlockDeviceDriver;
+
+/**
+ * A read or write of consecutive blocks, submitted with BlockDeviceDriver::SubmitRequest.
+ * A request either has a callback, which is the last access to the request once it is done and may free it,
+ * or threads wait for it with BlockDeviceDriver::WaitForRequest.
+ * Requests that touch the same blocks must not be in flight at the same time, unless all of them are reads.
+ **/
+struct BlockRequest {
+    // Used by the BlockQueue, and by the driver while the request is in flight
+    ktl::Anchor<BlockRequest> anchor;
+    ktl::Anchor<BlockRequest> fifoAnchor;
+    ktl::Anchor<BlockRequest> mergeAnchor;
+
+    uint64 subID;
+    uint64 startBlock;
+    uint64 numBlocks;
+    bool write;
+    void* buffer;
+
+    // Called when the request is done, possibly from interrupt context, so it must neither sleep nor submit requests
+    void (*callback)(BlockRequest* request);
+    void* context;
+
+    // OK or an error code once the request is done
+    int64 status;
+
+    StickyLock lock;
+    WaitQueue waiters;
+    bool done;
+
+    // Requests that directly follow this one on the device and are transferred with it,
+    // the driver transfers totalBlocks blocks starting at startBlock
+    ktl::AnchorList<BlockRequest, &BlockRequest::mergeAnchor> merged;
+    uint64 totalBlocks;
+    // Reads that lie within this request and get copied from its buffer
+    ktl::AnchorList<BlockRequest, &BlockRequest::mergeAnchor> copies;
+
+    // In TSC ticks
+    uint64 deadline;
+};
+
+/**
+ * Queue of pending requests between a BlockDeviceDriver and its users.
+ * Requests are kept sorted by block and dispatched in elevator order, requests that exceeded
+ * their deadline are dispatched first. Consecutive requests are merged into a single device operation.
+ **/
+class BlockQueue {
+public:
+    BlockQueue(BlockDeviceDriver* driver);
+
+    void Submit(BlockRequest* request);
+
+    /**
+     * While the queue is plugged nothing is dispatched, so that requests submitted in between can be merged.
+     * The queue has to be unplugged before waiting for any of those requests.
+     **/
+    void Plug();
+    void Unplug();
+
+    /**
+     * Lowers the number of device operations that the driver has in flight at once to max.
+     **/
+    void LimitInFlight(uint64 max);
+
+    /**
+     * Finishes a device operation and every request that was merged into it, then dispatches further requests.
+     **/
+    void Complete(BlockRequest* op, int64 status, bool isr);
+
+private:
+    /**
+     * Dispatches requests until the queue is empty, plugged or the device has enough operations in flight.
+     * Only one thread dispatches at a time, others return right away.
+     **/
+    void Dispatch();
+    bool CanDispatch() const;
+    /**
+     * Removes the next device operation from the queue, m_Lock has to be held.
+     **/
+    BlockRequest* TakeNext();
+
+    void FinishSegment(BlockRequest* segment, int64 status, bool isr, uint64 blockSize);
+    static void Finish(BlockRequest* request, int64 status, bool isr);
+
+    static int64 DispatchThread(uint64 queue, uint64);
+
+private:
+    BlockDeviceDriver* m_Driver;
+
+    StickyLock m_Lock;
+    // Sorted by (subID, startBlock)
+    ktl::AnchorList<BlockRequest, &BlockRequest::anchor> m_Sorted;
+    // Sorted by deadline
+    ktl::AnchorList<BlockRequest, &BlockRequest::fifoAnchor> m_Fifo;
+
+    // Position of the elevator, the end of the last dispatched operation
+    uint64 m_PosSubID;
+    uint64 m_PosBlock;
+
+    uint64 m_InFlight;
+    uint64 m_MaxInFlight;
+    uint64 m_PlugCount;
+    bool m_Dispatching;
+
+    // Operations completed in interrupt context cannot dispatch, they wake up the dispatch thread instead
+    WaitQueue m_DispatchWaiters;
+};
@@ -4,6 +4,7 @@
 #include "klib/string.h"
 #include "init/Init.h"
 #include "klib/stdio.h"
+#include "fs/DentryCache.h"
 
 #include <vector>
 
@@ -30,14 +31,14 @@ void DevFS::RegisterCharDevice(const char* name, uint64 driverID, uint64 devID)
     if(g_NewDir == nullptr)
         g_NewDir = VFS::Directory::Create(10);
 
-    VFS::DirectoryEntry* entry;
-    VFS::Directory::AddEntry(&g_NewDir, &entry);
-
-    kstrcpy(entry->name, name);
-    entry->nodeID = g_Devices.size() + 1;
+    g_NewDir->AddEntry(name, g_Devices.size() + 1);
 
     g_Devices.push_back({ name, false, driverID, devID, g_Devices.size() });
 
+    // The directory changes behind the VFS' back
+    if(g_MP != nullptr)
+        VFS::DentryCache::InvalidateMount(g_MP);
+
     g_Lock.Unlock();
 }
 void DevFS::RegisterBlockDevice(const char* name, uint64 driverID, uint64 devID) {
@@ -46,14 +47,14 @@ void DevFS::RegisterBlockDevice(const char* name, uint64 driverID, uint64 devID)
     if(g_NewDir == nullptr)
         g_NewDir = VFS::Directory::Create(10);
 
-    VFS::DirectoryEntry* entry;
-    VFS::Directory::AddEntry(&g_NewDir, &entry);
-
-    kstrcpy(entry->name, name);
-    entry->nodeID = g_Devices.size() + 1;
+    g_NewDir->AddEntry(name, g_Devices.size() + 1);
 
     g_Devices.push_back({ name, true, driverID, devID, g_Devices.size() });
 
+    // The directory changes behind the VFS' back
+    if(g_MP != nullptr)
+        VFS::DentryCache::InvalidateMount(g_MP);
+
     g_Lock.Unlock();
 }
 void DevFS::UnregisterDevice(uint64 driverID, uint64 devID) {
@@ -70,7 +71,7 @@ void DevFS::GetSuperBlock(VFS::SuperBlock* sb) {
 void DevFS::SetMountPoint(VFS::MountPoint* mp) { g_MP = mp; }
 void DevFS::PrepareUnmount() { }
 
-void DevFS::CreateNode(VFS::Node* node) { }
+int64 DevFS::CreateNode(VFS::Node* parent, VFS::Node* node) { return OK; }
 void DevFS::DestroyNode(VFS::Node* node) { }
 
 void DevFS::UpdateDir(VFS::Node* node) {
@@ -125,6 +126,7 @@ void DevFS::ReadNode(uint64 id, VFS::Node* node) {
 }
 
 void DevFS::WriteNode(VFS::Node* node) { }
+void DevFS::EvictNode(VFS::Node* node) { }
 
 uint64 DevFS::ReadNodeData(VFS::Node* node, uint64 pos, void* buffer, uint64 bufferSize) { return 0; }
 uint64 DevFS::WriteNodeData(VFS::Node* node, uint64 pos, const void* buffer, uint64 bufferSize) { return 0; }
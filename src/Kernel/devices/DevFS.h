@@ -17,11 +17,12 @@ public:
 
     void UpdateDir(VFS::Node* node) override;
 
-    void CreateNode(VFS::Node* node) override;
+    int64 CreateNode(VFS::Node* parent, VFS::Node* node) override;
     void DestroyNode(VFS::Node* node) override;
 
     void ReadNode(uint64 id, VFS::Node* node) override;
     void WriteNode(VFS::Node* node) override;
+    void EvictNode(VFS::Node* node) override;
 
     uint64 ReadNodeData(VFS::Node* node, uint64 pos, void* buffer, uint64 bufferSize) override;
     uint64 WriteNodeData(VFS::Node* node, uint64 pos, const void* buffer, uint64 bufferSize) override;
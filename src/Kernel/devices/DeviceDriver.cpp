@@ -1,8 +1,10 @@
 #include "DeviceDriver.h"
+#include "BlockCache.h"
 
 #include "ktl/AnchorList.h"
 #include "scheduler/Scheduler.h"
 #include "locks/QueueLock.h"
+#include "locks/RCU.h"
 #include "fs/VFS.h"
 #include "klib/string.h"
 #include "klib/memory.h"
@@ -20,172 +22,296 @@ CharDeviceDriver::CharDeviceDriver(const char* name)
 { }
 
 BlockDeviceDriver::BlockDeviceDriver(const char* name)
-    : DeviceDriver(TYPE_BLOCK, name)
+    : DeviceDriver(TYPE_BLOCK, name), m_Queue(this)
 { }
 
 
-struct CachedBlock {
-    uint64 subID;
-    uint64 blockID;
-    uint64 refCount;
-    QueueLock dataLock;
-    char data[];
-};
+void BlockDeviceDriver::SubmitRequest(BlockRequest* request, uint64 subID, uint64 startBlock, uint64 numBlocks, bool write, void* buffer,
+                                      void (*callback)(BlockRequest*), void* context) {
+    request->subID = subID;
+    request->startBlock = startBlock;
+    request->numBlocks = numBlocks;
+    request->write = write;
+    request->buffer = buffer;
+    request->callback = callback;
+    request->context = context;
+    request->status = OK;
+    request->done = false;
 
-static bool GetCachedBlock(uint64 subID, uint64 blockID, uint64 blockSize, std::vector<CachedBlock*>& cache, CachedBlock** block) {
-    for(CachedBlock* cb : cache) {
-        if(cb->subID == subID && cb->blockID == blockID) {
-            cb->refCount++;
-            *block = cb;
-            return true;
-        }
+    m_Queue.Submit(request);
+}
+
+int64 BlockDeviceDriver::WaitForRequest(BlockRequest* request) {
+    request->lock.Spinlock_Cli();
+    // The device owns the buffer until the request is done, so the wait cannot be interrupted
+    while(!request->done)
+        request->waiters.Wait_Cli(request->lock);
+    int64 status = request->status;
+    request->lock.Unlock_Cli();
+    return status;
+}
+
+void BlockDeviceDriver::CompleteRequest(BlockRequest* request, int64 status) {
+    m_Queue.Complete(request, status, false);
+}
+void BlockDeviceDriver::CompleteRequest_isr(BlockRequest* request, int64 status) {
+    m_Queue.Complete(request, status, true);
+}
+
+int64 BlockDeviceDriver::LoadBuffers(uint64 subID, BlockCache::Buffer** buffers, uint64 count) {
+    uint64 numInvalid = 0;
+    for(uint64 i = 0; i < count; i++) {
+        if(!buffers[i]->valid)
+            numInvalid++;
     }
+    if(numInvalid == 0)
+        return OK;
+
+    BlockRequest* requests = new BlockRequest[count];
+    Plug();
+    for(uint64 i = 0; i < count; i++) {
+        if(!buffers[i]->valid)
+            SubmitRequest(&requests[i], subID, buffers[i]->blockID, 1, false, buffers[i]->data);
+    }
+    Unplug();
+
+    int64 res = OK;
+    for(uint64 i = 0; i < count; i++) {
+        if(buffers[i]->valid)
+            continue;
+
+        int64 status = WaitForRequest(&requests[i]);
+        if(status == OK)
+            buffers[i]->valid = true;
+        else if(res == OK)
+            res = status;
+    }
+
+    delete[] requests;
+    return res;
+}
+
+// Maximum number of blocks that GetData and SetData keep locked and in flight at once
+static constexpr uint64 MaxBatchBlocks = 32;
 
-    char* buffer = new char[sizeof(CachedBlock) + blockSize];
-    CachedBlock* cb = new(buffer) CachedBlock();
-    cb->subID = subID;
-    cb->blockID = blockID;
-    cb->refCount = 1;
-    cache.push_back(cb);
-    *block = cb;
-    return false;
-}
-static void ReleaseCachedBlock(CachedBlock* cb, std::vector<CachedBlock*>& cache) {
-    cb->refCount--;
-    if(cb->refCount == 0) {
-        // TODO: Cache clean logic
+static void AcquireBatch(BlockDeviceDriver* driver, uint64 subID, uint64 startBlock, uint64 count, uint64 blockSize, BlockCache::Buffer** batch) {
+    // Buffers are always locked in ascending block order
+    for(uint64 i = 0; i < count; i++) {
+        batch[i] = BlockCache::Acquire(driver, subID, startBlock + i, blockSize);
+        batch[i]->lock.Lock();
     }
 }
+static void ReleaseBatch(BlockCache::Buffer** batch, uint64 count) {
+    for(uint64 i = 0; i < count; i++) {
+        batch[i]->lock.Unlock();
+        BlockCache::Release(batch[i]);
+    }
+}
+
+void* BlockDeviceDriver::GetDirectAccess(uint64 subID, uint64 startBlock, uint64 numBlocks) {
+    return nullptr;
+}
+
+char* BlockDeviceDriver::GetDirectRange(uint64 subID, uint64 pos, uint64 size) {
+    uint64 blockSize = GetBlockSize(subID);
+    uint64 startBlock = pos / blockSize;
+    uint64 endBlock = (pos + size + blockSize - 1) / blockSize;
+
+    char* data = (char*)GetDirectAccess(subID, startBlock, endBlock - startBlock);
+    if(data == nullptr)
+        return nullptr;
+    return data + pos % blockSize;
+}
 
 uint64 BlockDeviceDriver::GetData(uint64 subID, uint64 pos, void* buffer, uint64 bufferSize) {
+    if(bufferSize == 0)
+        return 0;
+
+    // Devices with direct access are not cached
+    if(const char* direct = GetDirectRange(subID, pos, bufferSize))
+        return kmemcpy_usersafe(buffer, direct, bufferSize) ? 0 : ErrorInvalidBuffer;
+
     char* realBuffer = (char*)buffer;
+    uint64 blockSize = GetBlockSize(subID);
+    BlockCache::Buffer* batch[MaxBatchBlocks];
 
-    uint64 startBlock = pos / GetBlockSize(subID);
-    uint64 endBlock = (pos + bufferSize) / GetBlockSize(subID);
-    uint64 numBlocks = endBlock - startBlock + 1;
-
-    for(uint64 b = 0; b < numBlocks; b++) {
-        uint64 blockID = startBlock + b;
-        
-        m_CacheLock.Spinlock();
-        CachedBlock* cb;
-        if(!GetCachedBlock(subID, blockID, GetBlockSize(subID), m_Cache, &cb)) {
-            m_CacheLock.Unlock();
-            cb->dataLock.Lock();
-
-            Atomic<uint64> finished;
-            finished = 0;
-            ScheduleOperation(subID, blockID, 1, false, cb->data, &finished);
-            while(finished.Read() == 0) ;
-                // TODO: Yield
-        } else {
-            m_CacheLock.Unlock();
-            cb->dataLock.Lock();
-        }
+    while(bufferSize > 0) {
+        uint64 startBlock = pos / blockSize;
+        uint64 count = (pos + bufferSize + blockSize - 1) / blockSize - startBlock;
+        if(count > MaxBatchBlocks)
+            count = MaxBatchBlocks;
+
+        AcquireBatch(this, subID, startBlock, count, blockSize, batch);
+        int64 error = LoadBuffers(subID, batch, count);
+        for(uint64 i = 0; i < count && error == OK; i++) {
+            uint64 offs = pos % blockSize;
+            uint64 rem = blockSize - offs;
+            if(rem > bufferSize)
+                rem = bufferSize;
+
+            if(!kmemcpy_usersafe(realBuffer, batch[i]->data + offs, rem))
+                error = ErrorInvalidBuffer;
 
-        uint64 offs = pos - (blockID * GetBlockSize(subID));
-        uint64 rem = GetBlockSize(subID) - offs;
-        if(rem > bufferSize)
-            rem = bufferSize;
-
-        if(!kmemcpy_usersafe(realBuffer, cb->data + offs, rem)) {
-            cb->dataLock.Unlock();
-            m_CacheLock.Spinlock();
-            ReleaseCachedBlock(cb, m_Cache);
-            m_CacheLock.Unlock();
-            return ErrorInvalidBuffer;
+            pos += rem;
+            realBuffer += rem;
+            bufferSize -= rem;
         }
-        cb->dataLock.Unlock();
-        m_CacheLock.Spinlock();
-        ReleaseCachedBlock(cb, m_Cache);
-        m_CacheLock.Unlock();
-
-        pos += rem;
-        realBuffer += rem;
-        bufferSize -= rem;
+        ReleaseBatch(batch, count);
+
+        if(error != OK)
+            return error;
     }
 
     return 0;
 }
-uint64 BlockDeviceDriver::SetData(uint64 subID, uint64 pos, const void* buffer, uint64 bufferSize) {
-    char* realBuffer = (char*)buffer;
+void BlockDeviceDriver::Prefetch(uint64 subID, uint64 pos, uint64 size) {
+    if(size == 0 || GetDirectRange(subID, pos, size) != nullptr)
+        return;
+
+    uint64 blockSize = GetBlockSize(subID);
+    uint64 startBlock = pos / blockSize;
+    uint64 endBlock = (pos + size + blockSize - 1) / blockSize;
 
-    uint64 startBlock = pos / GetBlockSize(subID);
-    uint64 endBlock = (pos + bufferSize) / GetBlockSize(subID);
-    uint64 numBlocks = endBlock - startBlock + 1;
-
-    // TODO: no-read optimization of offs == 0
-
-    for(uint64 b = 0; b < numBlocks; b++) {
-        uint64 blockID = startBlock + b;
-        
-        m_CacheLock.Spinlock();
-        CachedBlock* cb;
-        if(!GetCachedBlock(subID, blockID, GetBlockSize(subID), m_Cache, &cb)) {
-            m_CacheLock.Unlock();
-            cb->dataLock.Lock();
-
-            Atomic<uint64> finished;
-            finished = 0;
-            ScheduleOperation(subID, blockID, 1, false, cb->data, &finished);
-            while(finished.Read() == 0) ;
-                // TODO: Yield
+    std::vector<BlockCache::Buffer*> buffers;
+    for(uint64 blockID = startBlock; blockID < endBlock; blockID++) {
+        // Buffers that are not valid stay locked and referenced until they were read
+        BlockCache::Buffer* cb = BlockCache::Acquire(this, subID, blockID, blockSize);
+        cb->lock.Lock();
+        if(cb->valid) {
+            cb->lock.Unlock();
+            BlockCache::Release(cb);
         } else {
-            m_CacheLock.Unlock();
-            cb->dataLock.Lock();
+            buffers.push_back(cb);
         }
+    }
+
+    // Reads of consecutive blocks are merged by the queue
+    LoadBuffers(subID, buffers.data(), buffers.size());
+    ReleaseBatch(buffers.data(), buffers.size());
+}
+
+uint64 BlockDeviceDriver::SetData(uint64 subID, uint64 pos, const void* buffer, uint64 bufferSize) {
+    if(bufferSize == 0)
+        return 0;
+
+    if(char* direct = GetDirectRange(subID, pos, bufferSize))
+        return kmemcpy_usersafe(direct, buffer, bufferSize) ? 0 : ErrorInvalidBuffer;
+
+    const char* realBuffer = (const char*)buffer;
+    uint64 blockSize = GetBlockSize(subID);
+    BlockCache::Buffer* batch[MaxBatchBlocks];
+
+    while(bufferSize > 0) {
+        uint64 startBlock = pos / blockSize;
+        uint64 count = (pos + bufferSize + blockSize - 1) / blockSize - startBlock;
+        if(count > MaxBatchBlocks)
+            count = MaxBatchBlocks;
+
+        AcquireBatch(this, subID, startBlock, count, blockSize, batch);
 
-        uint64 offs = pos - (blockID * GetBlockSize(subID));
-        uint64 rem = GetBlockSize(subID) - offs;
-        if(rem > bufferSize)
-            rem = bufferSize;
-
-        if(!kmemcpy_usersafe(cb->data + offs, realBuffer, rem)) {
-            cb->dataLock.Unlock();
-            m_CacheLock.Spinlock();
-            ReleaseCachedBlock(cb, m_Cache);
-            m_CacheLock.Unlock();
-            return ErrorInvalidBuffer;
+        // Only blocks that are partially overwritten have to be read first
+        BlockCache::Buffer* partial[2];
+        uint64 numPartial = 0;
+        if(pos % blockSize != 0 || bufferSize < blockSize)
+            partial[numPartial++] = batch[0];
+        if(count > 1 && pos + bufferSize < (startBlock + count) * blockSize)
+            partial[numPartial++] = batch[count - 1];
+        int64 error = LoadBuffers(subID, partial, numPartial);
+
+        for(uint64 i = 0; i < count && error == OK; i++) {
+            uint64 offs = pos % blockSize;
+            uint64 rem = blockSize - offs;
+            if(rem > bufferSize)
+                rem = bufferSize;
+
+            BlockCache::Buffer* cb = batch[i];
+            if(!kmemcpy_usersafe(cb->data + offs, realBuffer, rem))
+                error = ErrorInvalidBuffer;
+
+            // A partially copied block is modified as well, unless it did not hold valid data before
+            if(error == OK)
+                cb->valid = true;
+            if(cb->valid)
+                BlockCache::MarkDirty(cb);
+
+            pos += rem;
+            realBuffer += rem;
+            bufferSize -= rem;
         }
-        cb->dataLock.Unlock();
-        m_CacheLock.Spinlock();
-        ReleaseCachedBlock(cb, m_Cache);
-        m_CacheLock.Unlock();
-
-        pos += rem;
-        realBuffer += rem;
-        bufferSize -= rem;
+        ReleaseBatch(batch, count);
+        BlockCache::BalanceDirty();
+
+        if(error != OK)
+            return error;
     }
 
     return 0;
 }
 
+int64 BlockDeviceDriver::Sync(uint64 subID) {
+    return BlockCache::Sync(this, subID);
+}
+
 static StickyLock g_DriverLock;
 static uint64 g_DriverIDCounter = 0;
 static ktl::AnchorList<DeviceDriver, &DeviceDriver::m_Anchor> g_Drivers;
 
+// Maps driver IDs to drivers, read without taking g_DriverLock
+struct DriverTable {
+    RCU::Callback rcu;
+    uint64 capacity;
+    DeviceDriver* drivers[];
+};
+static DriverTable* g_DriverTable = nullptr;
+
+static void FreeDriverTable(RCU::Callback* cb) {
+    delete[] (char*)cb;
+}
+
+static DriverTable* AllocDriverTable(uint64 capacity) {
+    DriverTable* table = (DriverTable*)new char[sizeof(DriverTable) + capacity * sizeof(DeviceDriver*)];
+    table->capacity = capacity;
+    kmemset(table->drivers, 0, capacity * sizeof(DeviceDriver*));
+    return table;
+}
+
 uint64 DeviceDriverRegistry::RegisterDriver(DeviceDriver* driver) {
     g_DriverLock.Spinlock();
     uint64 res = g_DriverIDCounter++;
     g_Drivers.push_back(driver);
+
+    DriverTable* oldTable = g_DriverTable;
+    if(oldTable == nullptr || res >= oldTable->capacity) {
+        DriverTable* newTable = AllocDriverTable(oldTable == nullptr ? 16 : oldTable->capacity * 2);
+        if(oldTable != nullptr)
+            kmemcpy(newTable->drivers, oldTable->drivers, oldTable->capacity * sizeof(DeviceDriver*));
+        newTable->drivers[res] = driver;
+        RCU::Assign(g_DriverTable, newTable);
+        if(oldTable != nullptr)
+            RCU::CallAfterGracePeriod(&oldTable->rcu, FreeDriverTable);
+    } else {
+        RCU::Assign(oldTable->drivers[res], driver);
+    }
+
     g_DriverLock.Unlock();
     return res;
 }
 void DeviceDriverRegistry::UnregisterDriver(DeviceDriver* driver) {
     g_DriverLock.Spinlock();
     g_Drivers.erase(driver);
+    RCU::Assign(g_DriverTable->drivers[driver->GetDriverID()], (DeviceDriver*)nullptr);
     g_DriverLock.Unlock();
 }
 DeviceDriver* DeviceDriverRegistry::GetDriver(uint64 id) {
-    g_DriverLock.Spinlock();
-    for(DeviceDriver& driver : g_Drivers) {
-        if(driver.GetDriverID() == id) {
-            g_DriverLock.Unlock();
-            return &driver;
-        }
-    }
-    g_DriverLock.Unlock();
-    return nullptr;
+    DeviceDriver* res = nullptr;
+
+    RCU::ReadLock();
+    DriverTable* table = RCU::Dereference(g_DriverTable);
+    if(table != nullptr && id < table->capacity)
+        res = RCU::Dereference(table->drivers[id]);
+    RCU::ReadUnlock();
+
+    return res;
 }
 DeviceDriver* DeviceDriverRegistry::GetDriver(const char* name) {
     g_DriverLock.Spinlock();
@@ -3,6 +3,7 @@
 #include "types.h"
 #include "atomic/Atomics.h"
 #include "locks/StickyLock.h"
+#include "BlockQueue.h"
 #include "ktl/AnchorList.h"
 
 #include <vector>
@@ -44,23 +45,88 @@ public:
     virtual uint64 Write(uint64 subID, const void* buffer, uint64 bufferSize) = 0;
 };
 
-struct CachedBlock;
+namespace BlockCache {
+    struct Buffer;
+}
 
 class BlockDeviceDriver : public DeviceDriver {
+    friend class BlockQueue;
 public:
     BlockDeviceDriver(const char* name);
 
+    /**
+     * Fills in request and queues it for the driver without waiting for it.
+     * request and its buffer have to stay valid until the request is done.
+     **/
+    void SubmitRequest(BlockRequest* request, uint64 subID, uint64 startBlock, uint64 numBlocks, bool write, void* buffer,
+                       void (*callback)(BlockRequest*) = nullptr, void* context = nullptr);
+    /**
+     * Sleeps until a request without callback is done.
+     * @returns the status of the request
+     **/
+    static int64 WaitForRequest(BlockRequest* request);
+    /**
+     * Requests submitted between Plug() and Unplug() are held back and dispatched together,
+     * so that consecutive ones get merged. Never wait for a request while the driver is plugged.
+     **/
+    void Plug() { m_Queue.Plug(); }
+    void Unplug() { m_Queue.Unplug(); }
+
+    /**
+     * Read / write the byte range [pos, pos + bufferSize) through the BlockCache.
+     * Written data stays in the cache and is written back to the device later, blocks that are overwritten completely are not read.
+     **/
     uint64 GetData(uint64 subID, uint64 pos, void* buffer, uint64 bufferSize);
     uint64 SetData(uint64 subID, uint64 pos, const void* buffer, uint64 bufferSize);
+    /**
+     * Writes back every block of the device that was modified before the call and waits until it is on the device.
+     **/
+    int64 Sync(uint64 subID);
+    /**
+     * Loads every block touched by the byte range [pos, pos + size) into the cache,
+     * the reads of consecutive uncached blocks are merged into larger device operations.
+     **/
+    void Prefetch(uint64 subID, uint64 pos, uint64 size);
 
     virtual uint64 GetBlockSize(uint64 subID) const = 0;
 
+    /**
+     * Returns a kernel pointer to the blocks [startBlock, startBlock + numBlocks) for devices that reside in memory,
+     * or nullptr if the range cannot be accessed directly. The default implementation returns nullptr.
+     * GetData and SetData access such ranges directly instead of going through the BlockCache.
+     **/
+    virtual void* GetDirectAccess(uint64 subID, uint64 startBlock, uint64 numBlocks);
+
 protected:
-    virtual void ScheduleOperation(uint64 subID, uint64 startBlock, uint64 numBlocks, bool write, void* buffer, Atomic<uint64>* finishFlag) = 0;
+    /**
+     * Starts the transfer of request->totalBlocks blocks from request->startBlock, the data goes to the buffer of request
+     * followed by the buffers of every request in request->merged. Drivers may have several operations in flight
+     * and call CompleteRequest (or CompleteRequest_isr from interrupt handlers) once a transfer finished.
+     **/
+    virtual void ScheduleOperation(BlockRequest* request) = 0;
+
+    void CompleteRequest(BlockRequest* request, int64 status);
+    void CompleteRequest_isr(BlockRequest* request, int64 status);
+
+    /**
+     * Makes sure that ScheduleOperation is never called while max operations are in flight.
+     **/
+    void LimitOperations(uint64 max) { m_Queue.LimitInFlight(max); }
+
+private:
+    /**
+     * Returns the direct access pointer to the byte range [pos, pos + size), or nullptr
+     **/
+    char* GetDirectRange(uint64 subID, uint64 pos, uint64 size);
+    /**
+     * Reads the blocks of every buffer that is not valid yet, the reads are in flight at the same time.
+     * The lock of every buffer has to be held.
+     * @returns OK or the error of the first failed read, the failed buffers stay invalid
+     **/
+    int64 LoadBuffers(uint64 subID, BlockCache::Buffer** buffers, uint64 count);
 
 private:
-    StickyLock m_CacheLock;
-    std::vector<CachedBlock*> m_Cache;
+    BlockQueue m_Queue;
 };
 
 class DeviceDriverRegistry {
@@ -1,6 +1,7 @@
 #include "RamDeviceDriver.h"
 
 #include "klib/memory.h"
+#include "errno.h"
 
 #include "init/Init.h"
 
@@ -28,18 +29,41 @@ uint64 RamDeviceDriver::GetBlockSize(uint64 subID) const {
     return m_Devices[subID].blockSize;
 }
 
+void* RamDeviceDriver::GetDirectAccess(uint64 subID, uint64 startBlock, uint64 numBlocks) {
+    const DevInfo& dev = m_Devices[subID];
+    if(startBlock + numBlocks > dev.numBlocks)
+        return nullptr;
+    return dev.buffer + startBlock * dev.blockSize;
+}
+
 int64 RamDeviceDriver::DeviceCommand(uint64 subID, int64 command, void* buffer) {
     return OK;
 }
 
-void RamDeviceDriver::ScheduleOperation(uint64 subID, uint64 startBlock, uint64 numBlocks, bool write, void* buffer, Atomic<uint64>* finishFlag) {
-    const DevInfo& dev = m_Devices[subID];
-
-    if(write) {
-        kmemcpy(dev.buffer + startBlock * GetBlockSize(subID), buffer, GetBlockSize(subID) * numBlocks);
+static void CopySegment(BlockRequest* segment, char* devBuffer, uint64 blockSize) {
+    if(segment->write) {
+        kmemcpy(devBuffer, segment->buffer, blockSize * segment->numBlocks);
     } else {
-        kmemcpy(buffer, dev.buffer + startBlock * GetBlockSize(subID), GetBlockSize(subID) * numBlocks);
+        kmemcpy(segment->buffer, devBuffer, blockSize * segment->numBlocks);
+    }
+}
+
+void RamDeviceDriver::ScheduleOperation(BlockRequest* request) {
+    const DevInfo& dev = m_Devices[request->subID];
+
+    if(request->startBlock + request->totalBlocks > dev.numBlocks) {
+        CompleteRequest(request, ErrorInvalidDevice);
+        return;
+    }
+
+    // The data is already in memory, so every request completes right away
+    char* devBuffer = dev.buffer + request->startBlock * dev.blockSize;
+    CopySegment(request, devBuffer, dev.blockSize);
+    devBuffer += request->numBlocks * dev.blockSize;
+    for(BlockRequest& segment : request->merged) {
+        CopySegment(&segment, devBuffer, dev.blockSize);
+        devBuffer += segment.numBlocks * dev.blockSize;
     }
 
-    finishFlag->Write(1);
+    CompleteRequest(request, OK);
 }
\ No newline at end of file
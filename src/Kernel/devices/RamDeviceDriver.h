@@ -18,11 +18,12 @@ public:
     uint64 AddDevice(char* buffer, uint64 blockSize, uint64 numBlocks);
 
     uint64 GetBlockSize(uint64 subID) const override;
+    void* GetDirectAccess(uint64 subID, uint64 startBlock, uint64 numBlocks) override;
 
     int64 DeviceCommand(uint64 subID, int64 command, void* buffer) override;
 
 protected:
-    void ScheduleOperation(uint64 subID, uint64 startBlock, uint64 numBlocks, bool write, void* buffer, Atomic<uint64>* finishFlag) override;
+    void ScheduleOperation(BlockRequest* request) override;
 
 private:
     struct DevInfo {
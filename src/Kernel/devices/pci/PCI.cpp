@@ -21,10 +21,14 @@ namespace PCI {
     };
     
     constexpr uint8 CAP_MSI = 0x05;
+    constexpr uint8 CAP_MSIX = 0x11;
 
     constexpr uint16 MSI_CONTROL_64BIT = 0x80;
     constexpr uint16 MSI_CONTROL_ENABLE = 0x01;
 
+    constexpr uint16 MSIX_CONTROL_ENABLE = 0x8000;
+    constexpr uint16 MSIX_CONTROL_MASK = 0x4000;
+
     struct __attribute__((packed)) CapHeader {
         uint8 typeID;
         uint8 nextPtr;
@@ -50,6 +54,20 @@ namespace PCI {
         uint16 data;
     };
 
+    struct __attribute__((packed)) CapMSIX {
+        CapHeader header;
+        uint16 control;
+        uint32 table;
+        uint32 pba;
+    };
+
+    struct __attribute__((packed)) MSIXEntry {
+        uint32 addressLow;
+        uint32 addressHigh;
+        uint32 data;
+        uint32 control;
+    };
+
     static std::vector<Group> g_Groups;
     static std::vector<Device> g_Devices;
 
@@ -109,7 +127,7 @@ namespace PCI {
                 if(type == 0) {
                     dev.BARs[dev.numBARs] = bar & 0xFFFFFFF0;
                     dev.numBARs++;
-                } else if(type == 1) {
+                } else if(type == 2) {
                     uint64 bar2 = ReadConfigDWord(group, bus, device, func, 0x10 + i * 4 + 4);
                     dev.BARs[dev.numBARs] = (bar2 << 32) | (bar & 0xFFFFFFF0);
                     dev.numBARs++;
@@ -119,6 +137,7 @@ namespace PCI {
         }
 
         dev.msi = nullptr;
+        dev.msix = nullptr;
         uint8 status = ReadConfigDWord(group, bus, device, func, 0x06);
         if(status & 0x10) {
             uint8 capPtr = ReadConfigDWord(group, bus, device, func, 0x34);
@@ -136,6 +155,8 @@ namespace PCI {
                     }
 
                     dev.msi = msi;
+                } else if(cap->typeID == CAP_MSIX) {
+                    dev.msix = cap;
                 }
 
                 capPtr = cap->nextPtr;
@@ -172,7 +193,7 @@ namespace PCI {
         for(const auto& [info, factory] : g_Drivers) {
             if(info.vendorID != 0xFFFF && info.vendorID != dev.vendorID)
                 continue;
-            if(info.deviceID != 0xFFFF && info.deviceID != dev.deviceID);
+            if(info.deviceID != 0xFFFF && info.deviceID != dev.deviceID)
                 continue;
             if(info.classCode != 0xFF && info.classCode != dev.classCode)
                 continue;
@@ -238,18 +259,52 @@ namespace PCI {
             msi32->data = vect;
         }
 
-        IDT::SetInternalISR(vect, handler);
+        IDT::SetISR(vect, handler);
 
         klog_info("PCIe", "Allocated interrupt %i for device %i:%i:%i:%i", vect, dev.group, dev.bus, dev.device, dev.function);
     }
 
+    static bool SetMSIX(const Device& dev, uint8 apicID, IDT::ISR handler) {
+        auto msix = (volatile CapMSIX*)dev.msix;
+
+        uint64 tableBase = GetBARAddress(dev, msix->table & 0x7);
+        if(tableBase == 0)
+            return false;
+
+        uint8 vect = g_VectCounter;
+        g_VectCounter++;
+        IDT::SetISR(vect, handler);
+
+        uint16 tableSize = (msix->control & 0x7FF) + 1;
+        auto table = (volatile MSIXEntry*)MemoryManager::MapDeviceMemory((void*)(tableBase + (msix->table & ~0x7)), tableSize * sizeof(MSIXEntry));
+
+        // Mask the whole function while entry 0 is changed, every other entry stays masked
+        msix->control = msix->control | MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASK;
+
+        for(uint16 i = 0; i < tableSize; i++)
+            table[i].control = 1;
+
+        table[0].addressLow = 0xFEE00000 | ((uint32)apicID << 12);
+        table[0].addressHigh = 0;
+        table[0].data = vect;
+        table[0].control = 0;
+
+        msix->control = msix->control & ~MSIX_CONTROL_MASK;
+
+        klog_info("PCIe", "Allocated MSI-X interrupt %i for device %i:%i:%i:%i", vect, dev.group, dev.bus, dev.device, dev.function);
+        return true;
+    }
+
     void RegisterDriver(const DriverInfo& info, PCIDriverFactory factory) {
         g_Drivers.push_back({ info, factory });
     }
 
-    void SetInterruptHandler(const Device& dev, IDT::ISR handler) {
+    InterruptType SetInterruptHandler(const Device& dev, IDT::ISR handler) {
         if(dev.msi != nullptr) {
             SetMSI(dev, APIC::GetID(), handler);
+            return INTERRUPT_MSI;
+        } else if(dev.msix != nullptr && SetMSIX(dev, APIC::GetID(), handler)) {
+            return INTERRUPT_MSIX;
         } else {
             uint8 pin = ReadConfigByte(dev, 0x3D);
             ACPI::AcpiIRQInfo irqInfo;
@@ -261,13 +316,38 @@ namespace PCI {
                 IOAPIC::RegisterGSI(irqInfo.number, handler);
             else
                 IOAPIC::RegisterIRQ(irqInfo.number, handler);
+            return INTERRUPT_LEGACY;
         }
     }
 
+    uint64 GetBARAddress(const Device& dev, uint8 barIndex) {
+        uint32 bar = ReadConfigDWord(dev, 0x10 + barIndex * 4);
+        if(bar & 0x1)
+            return 0;
+
+        uint64 addr = bar & 0xFFFFFFF0;
+        if(((bar & 0x7) >> 1) == 2)
+            addr |= (uint64)ReadConfigDWord(dev, 0x10 + barIndex * 4 + 4) << 32;
+        return addr;
+    }
+
+    uint8 FindCapability(const Device& dev, uint8 capID, uint8 start) {
+        if(!(ReadConfigWord(dev, 0x06) & 0x10))
+            return 0;
+
+        uint8 capPtr = start == 0 ? ReadConfigByte(dev, 0x34) : ReadConfigByte(dev, start + 1);
+        while(capPtr != 0) {
+            if(ReadConfigByte(dev, capPtr) == capID)
+                return capPtr;
+            capPtr = ReadConfigByte(dev, capPtr + 1);
+        }
+        return 0;
+    }
+
     uint8 ReadConfigByte(const Device& dev, uint32 reg) {
         for(const auto& g : g_Groups) {
             if(g.id == dev.group) {
-                uint8* addr = (uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg;
+                volatile uint8* addr = (volatile uint8*)((uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg);
                 return *addr;
             }
         }
@@ -277,7 +357,7 @@ namespace PCI {
     uint16 ReadConfigWord(const Device& dev, uint32 reg) {
         for(const auto& g : g_Groups) {
             if(g.id == dev.group) {
-                uint16* addr = (uint16*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg;
+                volatile uint16* addr = (volatile uint16*)((uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg);
                 return *addr;
             }
         }
@@ -287,7 +367,7 @@ namespace PCI {
     uint32 ReadConfigDWord(const Device& dev, uint32 reg) {
         for(const auto& g : g_Groups) {
             if(g.id == dev.group) {
-                uint32* addr = (uint32*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg;
+                volatile uint32* addr = (volatile uint32*)((uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg);
                 return *addr;
             }
         }
@@ -297,7 +377,7 @@ namespace PCI {
     uint64 ReadConfigQWord(const Device& dev, uint32 reg) {
         for(const auto& g : g_Groups) {
             if(g.id == dev.group) {
-                uint64* addr = (uint64*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg;
+                volatile uint64* addr = (volatile uint64*)((uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg);
                 return *addr;
             }
         }
@@ -308,7 +388,7 @@ namespace PCI {
     void WriteConfigByte(const Device& dev, uint32 reg, uint8 val) {
         for(const auto& g : g_Groups) {
             if(g.id == dev.group) {
-                uint8* addr = (uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg;
+                volatile uint8* addr = (volatile uint8*)((uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg);
                 *addr = val;
                 break;
             }
@@ -317,7 +397,7 @@ namespace PCI {
     void WriteConfigWord(const Device& dev, uint32 reg, uint16 val) {
         for(const auto& g : g_Groups) {
             if(g.id == dev.group) {
-                uint16* addr = (uint16*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg;
+                volatile uint16* addr = (volatile uint16*)((uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg);
                 *addr = val;
                 break;
             }
@@ -326,7 +406,7 @@ namespace PCI {
     void WriteConfigDWord(const Device& dev, uint32 reg, uint32 val) {
         for(const auto& g : g_Groups) {
             if(g.id == dev.group) {
-                uint32* addr = (uint32*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg;
+                volatile uint32* addr = (volatile uint32*)((uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg);
                 *addr = val;
                 break;
             }
@@ -335,7 +415,7 @@ namespace PCI {
     void WriteConfigQWord(const Device& dev, uint32 reg, uint64 val) {
         for(const auto& g : g_Groups) {
             if(g.id == dev.group) {
-                uint64* addr = (uint64*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg;
+                volatile uint64* addr = (volatile uint64*)((uint8*)GetMemBase(g, dev.bus, dev.device, dev.function) + reg);
                 *addr = val;
                 break;
             }
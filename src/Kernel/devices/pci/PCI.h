@@ -26,6 +26,7 @@ namespace PCI {
         uint64 memBase;
 
         void* msi;
+        void* msix;
     };
 
     struct DriverInfo {
@@ -40,7 +41,29 @@ namespace PCI {
     typedef void (*PCIDriverFactory)(const Device& dev);
     void RegisterDriver(const DriverInfo& info, PCIDriverFactory factory);
 
-    void SetInterruptHandler(const Device& dev, IDT::ISR handler);
+    enum InterruptType {
+        INTERRUPT_LEGACY,
+        INTERRUPT_MSI,
+        INTERRUPT_MSIX,
+    };
+
+    /**
+     * Routes the interrupts of the device to handler, using MSI or MSI-X if the device supports it.
+     * With MSI-X every interrupt source of the device has to use table entry 0.
+     * Legacy interrupts may be shared with other devices.
+     **/
+    InterruptType SetInterruptHandler(const Device& dev, IDT::ISR handler);
+
+    /**
+     * Returns the physical address of the memory BAR with the given register index (0 - 5),
+     * or 0 if it is an IO BAR. For 64-bit BARs barIndex is the index of the lower half.
+     **/
+    uint64 GetBARAddress(const Device& dev, uint8 barIndex);
+    /**
+     * Returns the config space offset of the first capability with the given ID after the capability at start,
+     * or 0 if there is none. start == 0 begins at the first capability.
+     **/
+    uint8 FindCapability(const Device& dev, uint8 capID, uint8 start = 0);
 
     uint8 ReadConfigByte(const Device& dev, uint32 reg);
     uint16 ReadConfigWord(const Device& dev, uint32 reg);
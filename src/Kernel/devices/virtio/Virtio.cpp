@@ -0,0 +1,209 @@
+#include "Virtio.h"
+
+#include "memory/MemoryManager.h"
+#include "klib/memory.h"
+
+namespace Virtio {
+
+    constexpr uint8 CAP_VENDOR = 0x09;
+
+    constexpr uint8 CFG_TYPE_COMMON = 1;
+    constexpr uint8 CFG_TYPE_NOTIFY = 2;
+    constexpr uint8 CFG_TYPE_ISR = 3;
+    constexpr uint8 CFG_TYPE_DEVICE = 4;
+
+    // Offsets of the fields of a virtio PCI capability
+    constexpr uint32 CAP_CFG_TYPE = 3;
+    constexpr uint32 CAP_BAR = 4;
+    constexpr uint32 CAP_OFFSET = 8;
+    constexpr uint32 CAP_LENGTH = 12;
+    constexpr uint32 CAP_NOTIFY_MULTIPLIER = 16;
+
+    // The device accesses the rings concurrently, so the compiler must not reorder accesses around these
+    static inline void CompilerBarrier() {
+        __asm__ __volatile__ ("" : : : "memory");
+    }
+    // Also keeps the CPU from moving a load in front of an earlier store
+    static inline void MemoryBarrier() {
+        __asm__ __volatile__ ("mfence" : : : "memory");
+    }
+
+    static volatile void* MapStructure(const PCI::Device& dev, uint8 cap) {
+        uint8 bar = PCI::ReadConfigByte(dev, cap + CAP_BAR);
+        if(bar > 5)
+            return nullptr;
+        uint64 base = PCI::GetBARAddress(dev, bar);
+        if(base == 0)
+            return nullptr;
+
+        uint64 phys = base + PCI::ReadConfigDWord(dev, cap + CAP_OFFSET);
+        return MemoryManager::MapDeviceMemory((void*)phys, PCI::ReadConfigDWord(dev, cap + CAP_LENGTH));
+    }
+
+    bool Transport::Init(const PCI::Device& dev) {
+        m_Common = nullptr;
+        m_ISR = nullptr;
+        m_DeviceConfig = nullptr;
+        m_Notify = nullptr;
+        m_NotifyMultiplier = 0;
+
+        // Devices may provide several capabilities of the same type, the first one is the preferred one
+        for(uint8 cap = PCI::FindCapability(dev, CAP_VENDOR); cap != 0; cap = PCI::FindCapability(dev, CAP_VENDOR, cap)) {
+            uint8 type = PCI::ReadConfigByte(dev, cap + CAP_CFG_TYPE);
+
+            if(type == CFG_TYPE_COMMON && m_Common == nullptr) {
+                m_Common = (volatile CommonConfig*)MapStructure(dev, cap);
+            } else if(type == CFG_TYPE_NOTIFY && m_Notify == nullptr) {
+                m_Notify = (volatile uint8*)MapStructure(dev, cap);
+                m_NotifyMultiplier = PCI::ReadConfigDWord(dev, cap + CAP_NOTIFY_MULTIPLIER);
+            } else if(type == CFG_TYPE_ISR && m_ISR == nullptr) {
+                m_ISR = (volatile uint8*)MapStructure(dev, cap);
+            } else if(type == CFG_TYPE_DEVICE && m_DeviceConfig == nullptr) {
+                m_DeviceConfig = MapStructure(dev, cap);
+            }
+        }
+
+        if(m_Common == nullptr || m_Notify == nullptr || m_ISR == nullptr || m_DeviceConfig == nullptr)
+            return false;
+
+        // Enable memory space and bus mastering, the device accesses the queues in memory by itself
+        PCI::WriteConfigWord(dev, 0x04, PCI::ReadConfigWord(dev, 0x04) | 0x6);
+
+        m_Common->deviceStatus = 0;
+        while(m_Common->deviceStatus != 0)
+            ;
+
+        return true;
+    }
+
+    bool Transport::NegotiateFeatures(uint64 wanted, uint64& outFeatures) {
+        m_Common->deviceStatus = STATUS_ACKNOWLEDGE;
+        m_Common->deviceStatus = STATUS_ACKNOWLEDGE | STATUS_DRIVER;
+
+        m_Common->deviceFeatureSelect = 0;
+        uint64 offered = m_Common->deviceFeature;
+        m_Common->deviceFeatureSelect = 1;
+        offered |= (uint64)m_Common->deviceFeature << 32;
+
+        outFeatures = offered & wanted;
+        m_Common->driverFeatureSelect = 0;
+        m_Common->driverFeature = (uint32)outFeatures;
+        m_Common->driverFeatureSelect = 1;
+        m_Common->driverFeature = (uint32)(outFeatures >> 32);
+
+        m_Common->deviceStatus = STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK;
+        return (m_Common->deviceStatus & STATUS_FEATURES_OK) != 0;
+    }
+
+    void Transport::SetDriverOK() {
+        m_Common->deviceStatus = m_Common->deviceStatus | STATUS_DRIVER_OK;
+    }
+    void Transport::SetFailed() {
+        m_Common->deviceStatus = m_Common->deviceStatus | STATUS_FAILED;
+    }
+
+    uint8 Transport::ReadISRStatus() {
+        return *m_ISR;
+    }
+
+    volatile uint16* Transport::GetNotifyAddress(uint16 notifyOff) const {
+        return (volatile uint16*)(m_Notify + (uint64)notifyOff * m_NotifyMultiplier);
+    }
+
+    bool VirtQueue::Init(Transport& transport, uint16 index, uint16 maxSize, uint16 msixVector, bool eventIdx) {
+        volatile CommonConfig* common = transport.GetCommonConfig();
+
+        common->queueSelect = index;
+        uint16 deviceSize = common->queueSize;
+        if(deviceSize == 0)
+            return false;
+
+        common->queueMsixVector = msixVector;
+        if(common->queueMsixVector != msixVector)
+            return false;
+
+        m_Size = deviceSize < maxSize ? deviceSize : maxSize;
+        m_EventIdx = eventIdx;
+        m_Index = index;
+        m_AvailIdx = 0;
+        m_KickedIdx = 0;
+        m_LastUsed = 0;
+
+        // The used ring gets its own page, as the device writes to it while the driver writes the other parts.
+        // Both rings are followed by the event index of the other side.
+        uint64 availOffset = m_Size * sizeof(Descriptor);
+        uint64 usedOffset = (availOffset + sizeof(AvailRing) + (m_Size + 1) * sizeof(uint16) + 4095) & ~4095ull;
+        uint64 numPages = NUM_PAGES(usedOffset + sizeof(UsedRing) + m_Size * sizeof(UsedElement) + sizeof(uint16));
+
+        uint64 phys = (uint64)MemoryManager::AllocatePages(numPages);
+        char* mem = (char*)MemoryManager::PhysToKernelPtr((void*)phys);
+        kmemset(mem, 0, numPages * 4096);
+
+        m_Desc = (Descriptor*)mem;
+        m_Avail = (volatile AvailRing*)(mem + availOffset);
+        m_Used = (volatile UsedRing*)(mem + usedOffset);
+
+        common->queueSize = m_Size;
+        common->queueDescLow = (uint32)phys;
+        common->queueDescHigh = (uint32)(phys >> 32);
+        common->queueDriverLow = (uint32)(phys + availOffset);
+        common->queueDriverHigh = (uint32)((phys + availOffset) >> 32);
+        common->queueDeviceLow = (uint32)(phys + usedOffset);
+        common->queueDeviceHigh = (uint32)((phys + usedOffset) >> 32);
+
+        m_Notify = transport.GetNotifyAddress(common->queueNotifyOff);
+
+        common->queueEnable = 1;
+        return true;
+    }
+
+    void VirtQueue::Push(uint16 head) {
+        // The descriptors have to be written before the device can see the chain
+        CompilerBarrier();
+        m_Avail->ring[m_AvailIdx % m_Size] = head;
+        m_AvailIdx++;
+        m_Avail->idx = m_AvailIdx;
+    }
+
+    void VirtQueue::Kick() {
+        // The new avail index has to be visible before the device's notification preferences are read
+        MemoryBarrier();
+
+        uint16 old = m_KickedIdx;
+        m_KickedIdx = m_AvailIdx;
+
+        bool notify;
+        if(m_EventIdx) {
+            // Notify only if the device asked to be notified for one of the new chains
+            uint16 event = *(volatile uint16*)&m_Used->ring[m_Size];
+            notify = (uint16)(m_AvailIdx - event - 1) < (uint16)(m_AvailIdx - old);
+        } else {
+            notify = !(m_Used->flags & 0x1);
+        }
+
+        if(notify)
+            *m_Notify = m_Index;
+    }
+
+    bool VirtQueue::PopUsed(uint32& outHead, uint32& outLength) {
+        if(m_Used->idx == m_LastUsed)
+            return false;
+
+        CompilerBarrier();
+        volatile UsedElement& elem = m_Used->ring[m_LastUsed % m_Size];
+        outHead = elem.id;
+        outLength = elem.length;
+        m_LastUsed++;
+        return true;
+    }
+
+    bool VirtQueue::EnableInterrupts() {
+        // Without event indices interrupts are never suppressed
+        if(m_EventIdx)
+            m_Avail->ring[m_Size] = m_LastUsed;
+
+        MemoryBarrier();
+        return m_Used->idx == m_LastUsed;
+    }
+
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "types.h"
+#include "devices/pci/PCI.h"
+
+/**
+ * Common parts of virtio 1.x devices that are attached through PCI
+ **/
+namespace Virtio {
+
+    constexpr uint16 PCI_VENDOR_ID = 0x1AF4;
+
+    constexpr uint8 STATUS_ACKNOWLEDGE = 0x01;
+    constexpr uint8 STATUS_DRIVER = 0x02;
+    constexpr uint8 STATUS_DRIVER_OK = 0x04;
+    constexpr uint8 STATUS_FEATURES_OK = 0x08;
+    constexpr uint8 STATUS_FAILED = 0x80;
+
+    constexpr uint64 FEATURE_INDIRECT_DESC = 1ull << 28;
+    constexpr uint64 FEATURE_EVENT_IDX = 1ull << 29;
+    constexpr uint64 FEATURE_VERSION_1 = 1ull << 32;
+
+    constexpr uint16 DESC_NEXT = 0x1;
+    constexpr uint16 DESC_WRITE = 0x2;
+    constexpr uint16 DESC_INDIRECT = 0x4;
+
+    constexpr uint16 NO_VECTOR = 0xFFFF;
+
+    struct __attribute__((packed)) CommonConfig {
+        uint32 deviceFeatureSelect;
+        uint32 deviceFeature;
+        uint32 driverFeatureSelect;
+        uint32 driverFeature;
+        uint16 msixConfig;
+        uint16 numQueues;
+        uint8 deviceStatus;
+        uint8 configGeneration;
+
+        uint16 queueSelect;
+        uint16 queueSize;
+        uint16 queueMsixVector;
+        uint16 queueEnable;
+        uint16 queueNotifyOff;
+        uint32 queueDescLow;
+        uint32 queueDescHigh;
+        uint32 queueDriverLow;
+        uint32 queueDriverHigh;
+        uint32 queueDeviceLow;
+        uint32 queueDeviceHigh;
+    };
+
+    struct Descriptor {
+        uint64 addr;
+        uint32 length;
+        uint16 flags;
+        uint16 next;
+    };
+
+    /**
+     * The configuration structures of a device, which are located through its vendor specific PCI capabilities
+     **/
+    class Transport {
+    public:
+        /**
+         * Maps the configuration structures of the device and resets it.
+         * @returns false if the device does not provide the virtio 1.x interface
+         **/
+        bool Init(const PCI::Device& dev);
+        /**
+         * Acknowledges the device and accepts every feature in wanted that the device offers.
+         * @returns false if the device rejected the features, outFeatures holds the accepted ones
+         **/
+        bool NegotiateFeatures(uint64 wanted, uint64& outFeatures);
+        /**
+         * Marks the device as ready after its queues were set up, or as unusable.
+         **/
+        void SetDriverOK();
+        void SetFailed();
+
+        /**
+         * Reads and clears the interrupt status, only needed for legacy interrupts.
+         **/
+        uint8 ReadISRStatus();
+        volatile void* GetDeviceConfig() const { return m_DeviceConfig; }
+        uint8 GetConfigGeneration() const { return m_Common->configGeneration; }
+
+        volatile CommonConfig* GetCommonConfig() const { return m_Common; }
+        volatile uint16* GetNotifyAddress(uint16 notifyOff) const;
+
+    private:
+        volatile CommonConfig* m_Common;
+        volatile uint8* m_ISR;
+        volatile void* m_DeviceConfig;
+        volatile uint8* m_Notify;
+        uint32 m_NotifyMultiplier;
+    };
+
+    /**
+     * A split virtqueue. The caller owns the descriptor table and serializes all calls.
+     **/
+    class VirtQueue {
+    public:
+        /**
+         * Allocates the rings with at most maxSize descriptors and enables the queue on the device.
+         * msixVector is the MSI-X table entry for the queue's interrupts, or NO_VECTOR.
+         **/
+        bool Init(Transport& transport, uint16 index, uint16 maxSize, uint16 msixVector, bool eventIdx);
+
+        uint16 GetSize() const { return m_Size; }
+        Descriptor* GetDescriptors() { return m_Desc; }
+
+        /**
+         * Makes the descriptor chain starting at head available to the device.
+         * The device only learns about new chains once Kick is called.
+         **/
+        void Push(uint16 head);
+        /**
+         * Notifies the device of the chains pushed since the last call, unless the device suppressed notifications.
+         **/
+        void Kick();
+
+        /**
+         * Takes the next chain that the device is done with.
+         * @returns false if there is none
+         **/
+        bool PopUsed(uint32& outHead, uint32& outLength);
+        /**
+         * Asks for an interrupt once the device uses the next chain.
+         * @returns false if chains were used in the meantime, which have to be popped before calling this again
+         **/
+        bool EnableInterrupts();
+
+    private:
+        struct AvailRing {
+            uint16 flags;
+            uint16 idx;
+            uint16 ring[];
+        };
+        struct UsedElement {
+            uint32 id;
+            uint32 length;
+        };
+        struct UsedRing {
+            uint16 flags;
+            uint16 idx;
+            UsedElement ring[];
+        };
+
+    private:
+        uint16 m_Size;
+        bool m_EventIdx;
+
+        Descriptor* m_Desc;
+        volatile AvailRing* m_Avail;
+        volatile UsedRing* m_Used;
+        volatile uint16* m_Notify;
+        uint16 m_Index;
+
+        uint16 m_AvailIdx;
+        uint16 m_KickedIdx;
+        uint16 m_LastUsed;
+    };
+
+}
@@ -0,0 +1,348 @@
+#include "VirtioBlock.h"
+
+#include "devices/DevFS.h"
+#include "memory/MemoryManager.h"
+#include "klib/memory.h"
+#include "klib/stdio.h"
+#include "init/Init.h"
+#include "errno.h"
+
+constexpr uint16 PCI_DEVICE_BLOCK_TRANSITIONAL = 0x1001;
+constexpr uint16 PCI_DEVICE_BLOCK = 0x1042;
+
+constexpr uint64 FEATURE_SEG_MAX = 1ull << 2;
+constexpr uint64 FEATURE_RO = 1ull << 5;
+
+constexpr uint32 REQUEST_IN = 0;
+constexpr uint32 REQUEST_OUT = 1;
+constexpr uint8 REQUEST_STATUS_OK = 0;
+
+// Requests always address the device in 512 byte sectors
+static constexpr uint64 SectorSize = 512;
+// Every slot of a queue with indirect descriptors needs a page for its descriptor table
+static constexpr uint16 MaxQueueSize = 128;
+static constexpr uint64 MaxIndirectDescs = 4096 / sizeof(Virtio::Descriptor);
+
+struct __attribute__((packed)) BlockConfig {
+    uint64 capacity;
+    uint32 sizeMax;
+    uint32 segMax;
+};
+
+static VirtioBlockDriver* g_Driver = nullptr;
+
+static void Probe(const PCI::Device& dev) {
+    if(g_Driver == nullptr)
+        g_Driver = new VirtioBlockDriver();
+    g_Driver->AddDevice(dev);
+}
+
+static void Init() {
+    PCI::RegisterDriver({ Virtio::PCI_VENDOR_ID, PCI_DEVICE_BLOCK, 0xFF, 0xFF, 0xFF }, Probe);
+    // Transitional devices provide the modern interface as well, AddDevice rejects those that don't
+    PCI::RegisterDriver({ Virtio::PCI_VENDOR_ID, PCI_DEVICE_BLOCK_TRANSITIONAL, 0xFF, 0xFF, 0xFF }, Probe);
+}
+REGISTER_INIT_FUNC(Init, INIT_STAGE_DEVDRIVERS);
+
+VirtioBlockDriver::VirtioBlockDriver()
+    : BlockDeviceDriver("virtio-blk"), m_NumDevices(0)
+{ }
+
+bool VirtioBlockDriver::AddDevice(const PCI::Device& pciDev) {
+    if(m_NumDevices == MaxDevices) {
+        klog_error("VirtioBlock", "Too many devices, ignoring %i:%i:%i:%i", pciDev.group, pciDev.bus, pciDev.device, pciDev.function);
+        return false;
+    }
+
+    Device* dev = new Device();
+    if(!InitDevice(dev, pciDev)) {
+        klog_error("VirtioBlock", "Failed to initialize device %i:%i:%i:%i", pciDev.group, pciDev.bus, pciDev.device, pciDev.function);
+        delete dev;
+        return false;
+    }
+
+    uint64 subID = m_NumDevices;
+    m_Devices[subID] = dev;
+    // The interrupt handler must not see the device before the entry was written
+    __asm__ __volatile__ ("" : : : "memory");
+    m_NumDevices++;
+
+    // Operations are only dispatched once a slot is guaranteed to be free for them
+    LimitOperations(dev->numSlots);
+
+    char* name = new char[4] { 'v', 'd', (char)('a' + subID), '\0' };
+    DevFS::RegisterBlockDevice(name, GetDriverID(), subID);
+
+    klog_info("VirtioBlock", "Added %s: %i sectors, %i slots, indirect=%i", name, dev->numSectors, dev->numSlots, dev->indirect);
+    return true;
+}
+
+bool VirtioBlockDriver::InitDevice(Device* dev, const PCI::Device& pciDev) {
+    if(!dev->transport.Init(pciDev))
+        return false;
+
+    uint64 features;
+    uint64 wanted = Virtio::FEATURE_VERSION_1 | Virtio::FEATURE_INDIRECT_DESC | Virtio::FEATURE_EVENT_IDX | FEATURE_SEG_MAX | FEATURE_RO;
+    if(!dev->transport.NegotiateFeatures(wanted, features) || !(features & Virtio::FEATURE_VERSION_1)) {
+        dev->transport.SetFailed();
+        return false;
+    }
+
+    dev->indirect = (features & Virtio::FEATURE_INDIRECT_DESC) != 0;
+    dev->readOnly = (features & FEATURE_RO) != 0;
+
+    // The device may change its config while it is read
+    volatile BlockConfig* config = (volatile BlockConfig*)dev->transport.GetDeviceConfig();
+    uint8 generation;
+    uint32 segMax;
+    do {
+        generation = dev->transport.GetConfigGeneration();
+        dev->numSectors = config->capacity;
+        segMax = config->segMax;
+    } while(generation != dev->transport.GetConfigGeneration());
+
+    dev->interruptType = PCI::SetInterruptHandler(pciDev, OnInterrupt);
+    uint16 vector = dev->interruptType == PCI::INTERRUPT_MSIX ? 0 : Virtio::NO_VECTOR;
+    dev->transport.GetCommonConfig()->msixConfig = Virtio::NO_VECTOR;
+
+    if(!dev->queue.Init(dev->transport, 0, MaxQueueSize, vector, (features & Virtio::FEATURE_EVENT_IDX) != 0)) {
+        dev->transport.SetFailed();
+        return false;
+    }
+
+    // No chain may have more descriptors than the queue, including the descriptors in an indirect table.
+    // Every request needs one descriptor for the header and one for the status.
+    uint16 queueSize = dev->queue.GetSize();
+    if(dev->indirect) {
+        dev->numSlots = queueSize;
+        dev->maxSegments = (queueSize < MaxIndirectDescs ? queueSize : MaxIndirectDescs) - 2;
+    } else {
+        dev->numSlots = queueSize / 3;
+        dev->maxSegments = 1;
+    }
+    if((features & FEATURE_SEG_MAX) && segMax != 0 && segMax < dev->maxSegments)
+        dev->maxSegments = segMax;
+
+    if(dev->numSlots == 0 || dev->maxSegments == 0) {
+        dev->transport.SetFailed();
+        return false;
+    }
+
+    uint64 headerPages = NUM_PAGES(dev->numSlots * sizeof(SlotHeader));
+    uint64 headerPhys = (uint64)MemoryManager::AllocatePages(headerPages);
+    SlotHeader* headers = (SlotHeader*)MemoryManager::PhysToKernelPtr((void*)headerPhys);
+
+    dev->slots = new Slot[dev->numSlots];
+    dev->freeSlots = new uint16[dev->numSlots];
+    for(uint16 i = 0; i < dev->numSlots; i++) {
+        Slot& slot = dev->slots[i];
+        slot.op = nullptr;
+        slot.header = &headers[i];
+        slot.headerPhys = headerPhys + i * sizeof(SlotHeader);
+
+        if(dev->indirect) {
+            slot.tablePhys = (uint64)MemoryManager::AllocatePages(1);
+            slot.table = (Virtio::Descriptor*)MemoryManager::PhysToKernelPtr((void*)slot.tablePhys);
+        } else {
+            slot.tablePhys = 0;
+            slot.table = nullptr;
+        }
+
+        slot.bounce = nullptr;
+        slot.bouncePages = 0;
+        slot.bounced = false;
+
+        dev->freeSlots[i] = i;
+    }
+    dev->numFree = dev->numSlots;
+
+    dev->transport.SetDriverOK();
+    return true;
+}
+
+uint64 VirtioBlockDriver::GetBlockSize(uint64 subID) const {
+    return SectorSize;
+}
+
+int64 VirtioBlockDriver::DeviceCommand(uint64 subID, int64 command, void* arg) {
+    return OK;
+}
+
+/**
+ * Appends descriptors for the kernel buffer [buffer, buffer + size) to descs, physically contiguous pages share a descriptor.
+ * Descriptors before descs[first] are never extended.
+ * @returns false if more than maxCount descriptors would be needed
+ **/
+static bool AddBuffer(Virtio::Descriptor* descs, uint16& count, uint16 first, uint64 maxCount, const void* buffer, uint64 size, uint16 flags) {
+    const char* pos = (const char*)buffer;
+    while(size > 0) {
+        uint64 length = 4096 - ((uint64)pos & 0xFFF);
+        if(length > size)
+            length = size;
+        uint64 phys = (uint64)MemoryManager::TranslateKernelPtr(pos);
+
+        Virtio::Descriptor* prev = count > first ? &descs[count - 1] : nullptr;
+        if(prev != nullptr && prev->flags == flags && prev->addr + prev->length == phys) {
+            prev->length += length;
+        } else {
+            if(count == maxCount)
+                return false;
+            descs[count] = { phys, (uint32)length, flags, 0 };
+            count++;
+        }
+
+        pos += length;
+        size -= length;
+    }
+    return true;
+}
+
+static void CopyBounce(BlockRequest* op, char* bounce, bool toBounce) {
+    if(toBounce)
+        kmemcpy(bounce, op->buffer, op->numBlocks * SectorSize);
+    else
+        kmemcpy(op->buffer, bounce, op->numBlocks * SectorSize);
+    bounce += op->numBlocks * SectorSize;
+
+    for(BlockRequest& segment : op->merged) {
+        if(toBounce)
+            kmemcpy(bounce, segment.buffer, segment.numBlocks * SectorSize);
+        else
+            kmemcpy(segment.buffer, bounce, segment.numBlocks * SectorSize);
+        bounce += segment.numBlocks * SectorSize;
+    }
+}
+
+static void LinkChain(Virtio::Descriptor* descs, uint16 firstIndex, uint16 count) {
+    for(uint16 i = 0; i + 1 < count; i++) {
+        descs[i].flags |= Virtio::DESC_NEXT;
+        descs[i].next = firstIndex + i + 1;
+    }
+}
+
+void VirtioBlockDriver::AddData(Device* dev, Slot& slot, Virtio::Descriptor* descs, uint16& count, uint64 maxDescs) {
+    BlockRequest* op = slot.op;
+    uint16 flags = op->write ? 0 : Virtio::DESC_WRITE;
+    uint16 first = count;
+    uint64 maxCount = first + maxDescs;
+
+    slot.bounced = false;
+    bool fits = AddBuffer(descs, count, first, maxCount, op->buffer, op->numBlocks * SectorSize, flags);
+    for(BlockRequest& segment : op->merged) {
+        if(!fits)
+            break;
+        fits = AddBuffer(descs, count, first, maxCount, segment.buffer, segment.numBlocks * SectorSize, flags);
+    }
+    if(fits)
+        return;
+
+    // The buffers are too scattered, transfer the data through a physically contiguous copy instead
+    uint64 size = op->totalBlocks * SectorSize;
+    if(slot.bouncePages < NUM_PAGES(size)) {
+        if(slot.bounce != nullptr)
+            MemoryManager::FreePages(MemoryManager::KernelToPhysPtr(slot.bounce), slot.bouncePages);
+        slot.bouncePages = NUM_PAGES(size);
+        slot.bounce = (char*)MemoryManager::PhysToKernelPtr(MemoryManager::AllocatePages(slot.bouncePages));
+    }
+
+    if(op->write)
+        CopyBounce(op, slot.bounce, true);
+    slot.bounced = true;
+
+    count = first;
+    AddBuffer(descs, count, first, maxCount, slot.bounce, size, flags);
+}
+
+void VirtioBlockDriver::ScheduleOperation(BlockRequest* request) {
+    Device* dev = m_Devices[request->subID];
+
+    if(request->startBlock + request->totalBlocks > dev->numSectors) {
+        CompleteRequest(request, ErrorInvalidDevice);
+        return;
+    }
+    if(request->write && dev->readOnly) {
+        CompleteRequest(request, ErrorIO);
+        return;
+    }
+
+    // LimitOperations guarantees that there is a free slot
+    dev->lock.Spinlock_Cli();
+    uint16 slotID = dev->freeSlots[--dev->numFree];
+    dev->lock.Unlock_Cli();
+
+    // The slot belongs to this request now, so it can be filled in without holding the lock
+    Slot& slot = dev->slots[slotID];
+    slot.op = request;
+    slot.header->request.type = request->write ? REQUEST_OUT : REQUEST_IN;
+    slot.header->request.reserved = 0;
+    slot.header->request.sector = request->startBlock;
+    slot.header->status = 0xFF;
+
+    uint64 statusPhys = slot.headerPhys + sizeof(RequestHeader);
+    uint16 head;
+    uint16 count = 0;
+    if(dev->indirect) {
+        // The queue only holds a single descriptor which points to the slot's table
+        Virtio::Descriptor* descs = slot.table;
+        descs[count++] = { slot.headerPhys, sizeof(RequestHeader), 0, 0 };
+        AddData(dev, slot, descs, count, dev->maxSegments);
+        descs[count++] = { statusPhys, 1, Virtio::DESC_WRITE, 0 };
+        LinkChain(descs, 0, count);
+
+        head = slotID;
+        dev->queue.GetDescriptors()[head] = { slot.tablePhys, (uint32)(count * sizeof(Virtio::Descriptor)), Virtio::DESC_INDIRECT, 0 };
+    } else {
+        // Every slot owns three consecutive descriptors of the queue
+        head = slotID * 3;
+        Virtio::Descriptor* descs = dev->queue.GetDescriptors() + head;
+        descs[count++] = { slot.headerPhys, sizeof(RequestHeader), 0, 0 };
+        AddData(dev, slot, descs, count, dev->maxSegments);
+        descs[count++] = { statusPhys, 1, Virtio::DESC_WRITE, 0 };
+        LinkChain(descs, head, count);
+    }
+
+    dev->lock.Spinlock_Cli();
+    dev->queue.Push(head);
+    dev->queue.Kick();
+    dev->lock.Unlock_Cli();
+}
+
+void VirtioBlockDriver::HandleInterrupt(Device* dev) {
+    // Legacy interrupts may be shared, reading the status acknowledges the interrupt
+    if(dev->interruptType == PCI::INTERRUPT_LEGACY && !(dev->transport.ReadISRStatus() & 0x1))
+        return;
+
+    ktl::AnchorList<BlockRequest, &BlockRequest::anchor> done;
+
+    dev->lock.Spinlock_Raw();
+    do {
+        uint32 head, length;
+        while(dev->queue.PopUsed(head, length)) {
+            uint16 slotID = dev->indirect ? head : head / 3;
+            Slot& slot = dev->slots[slotID];
+
+            BlockRequest* op = slot.op;
+            op->status = slot.header->status == REQUEST_STATUS_OK ? OK : ErrorIO;
+            if(slot.bounced && !op->write && op->status == OK)
+                CopyBounce(op, slot.bounce, false);
+
+            slot.op = nullptr;
+            dev->freeSlots[dev->numFree++] = slotID;
+            done.push_back(op);
+        }
+    } while(!dev->queue.EnableInterrupts());
+    dev->lock.Unlock_Raw();
+
+    // Callbacks of the requests run outside of the device lock
+    while(!done.empty()) {
+        BlockRequest* op = &done.front();
+        done.pop_front();
+        CompleteRequest_isr(op, op->status);
+    }
+}
+
+void VirtioBlockDriver::OnInterrupt(IDT::Registers* regs) {
+    // The handler is shared by all devices, devices without used chains return right away
+    for(uint64 i = 0; i < g_Driver->m_NumDevices; i++)
+        g_Driver->HandleInterrupt(g_Driver->m_Devices[i]);
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "devices/DeviceDriver.h"
+#include "devices/pci/PCI.h"
+#include "locks/StickyLock.h"
+#include "Virtio.h"
+
+/**
+ * Driver for virtio block devices on PCI (e.g. QEMU's -drive if=virtio), the devices are registered to DevFS as vda, vdb, ...
+ * Every device uses a single virtqueue with many requests in flight, scattered buffers are described with indirect descriptors
+ * and requests are completed from the interrupt handler.
+ **/
+class VirtioBlockDriver : public BlockDeviceDriver {
+public:
+    VirtioBlockDriver();
+
+    /**
+     * Sets up the given PCI device.
+     * @returns false if the device could not be initialized
+     **/
+    bool AddDevice(const PCI::Device& pciDev);
+
+    uint64 GetBlockSize(uint64 subID) const override;
+
+    int64 DeviceCommand(uint64 subID, int64 command, void* arg) override;
+
+protected:
+    void ScheduleOperation(BlockRequest* request) override;
+
+private:
+    struct RequestHeader {
+        uint32 type;
+        uint32 reserved;
+        uint64 sector;
+    };
+    // Written by the device, the status byte directly follows the header
+    struct SlotHeader {
+        RequestHeader request;
+        uint8 status;
+    };
+
+    /**
+     * A request that can be in flight on the device, with the memory that describes it
+     **/
+    struct Slot {
+        BlockRequest* op;
+
+        SlotHeader* header;
+        uint64 headerPhys;
+
+        // Indirect descriptor table, only if the device supports them
+        Virtio::Descriptor* table;
+        uint64 tablePhys;
+
+        // Physically contiguous copy of the data, used if the buffers cannot be described with the available descriptors
+        char* bounce;
+        uint64 bouncePages;
+        bool bounced;
+    };
+
+    struct Device {
+        Virtio::Transport transport;
+        Virtio::VirtQueue queue;
+        PCI::InterruptType interruptType;
+
+        uint64 numSectors;
+        bool readOnly;
+        bool indirect;
+        // Maximum number of data descriptors per request
+        uint64 maxSegments;
+
+        // Protects queue and the free slots
+        StickyLock lock;
+        Slot* slots;
+        uint16 numSlots;
+        uint16* freeSlots;
+        uint16 numFree;
+    };
+
+private:
+    bool InitDevice(Device* dev, const PCI::Device& pciDev);
+    /**
+     * Describes the data of the operation in slot, either with at most maxDescs descriptors starting at descs[count]
+     * or with the slot's bounce buffer.
+     **/
+    void AddData(Device* dev, Slot& slot, Virtio::Descriptor* descs, uint16& count, uint64 maxDescs);
+
+    void HandleInterrupt(Device* dev);
+    static void OnInterrupt(IDT::Registers* regs);
+
+private:
+    static constexpr uint64 MaxDevices = 26;
+
+    // Devices are only added, never removed, so the interrupt handler can walk the array without a lock
+    Device* m_Devices[MaxDevices];
+    uint64 m_NumDevices;
+};
@@ -26,6 +26,12 @@ const char* ErrorToString(int64 error) {
     case ErrorMountPointBusy: return "MountPoint is busy";
     case ErrorOpenFolder: return "Opening a folder is not allowed";
     case ErrorNotADevice: return "Not a device";
+    case ErrorTooManyFDs: return "Too many open file descriptors";
+    case ErrorBrokenPipe: return "The read end of the pipe was closed";
+    case ErrorNoSpace: return "No space left on the file system";
+    case ErrorInvalidMountOptions: return "Invalid mount options";
+    case ErrorBufferTooSmall: return "Buffer too small";
+    case ErrorIO: return "Input/output error";
     
     case ErrorThreadNotFound: return "Thread not found";
     case ErrorDetachSubThread: return "Detaching a subthread is not allowed";
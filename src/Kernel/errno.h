@@ -27,6 +27,12 @@ constexpr int64 ErrorUnmountRoot = -24;
 constexpr int64 ErrorMountPointBusy = -25;
 constexpr int64 ErrorOpenFolder = -26;
 constexpr int64 ErrorNotADevice = -27;
+constexpr int64 ErrorTooManyFDs = -28;
+constexpr int64 ErrorBrokenPipe = -29;
+constexpr int64 ErrorNoSpace = -30;
+constexpr int64 ErrorInvalidMountOptions = -31;
+constexpr int64 ErrorBufferTooSmall = -32;
+constexpr int64 ErrorIO = -33;
 
 constexpr int64 ErrorThreadNotFound = -100;
 constexpr int64 ErrorDetachSubThread = -101;
@@ -9,7 +9,7 @@ void ExecHandlerRegistry::UnregisterHandler(ExecHandler* handler) {
     g_Handlers.erase(handler);
 }
 
-bool ExecHandlerRegistry::Prepare(uint8* buffer, uint64 bufferSize, uint64 pml4Entry, IDT::Registers* regs, int argc, const char* const* argv) {
+bool ExecHandlerRegistry::Prepare(const uint8* buffer, uint64 bufferSize, uint64 pml4Entry, IDT::Registers* regs, int argc, const char* const* argv) {
     for(ExecHandler& handler : g_Handlers) {
         if(handler.CheckAndPrepare(buffer, bufferSize, pml4Entry, regs, argc, argv))
             return true;
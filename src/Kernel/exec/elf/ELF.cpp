@@ -17,20 +17,20 @@ static void Init() {
 }
 REGISTER_INIT_FUNC(Init, INIT_STAGE_EXECHANDLERS);
 
-bool ELFExecHandler::CheckAndPrepare(uint8* buffer, uint64 bufferSize, uint64 pml4Entry, IDT::Registers* regs, int argc, const char* const* argv)
+bool ELFExecHandler::CheckAndPrepare(const uint8* buffer, uint64 bufferSize, uint64 pml4Entry, IDT::Registers* regs, int argc, const char* const* argv)
 {
     constexpr uint64 stackBase = 0x1000;
 
-    ELFHeader* header = (ELFHeader*)buffer;
+    const ELFHeader* header = (const ELFHeader*)buffer;
 
     if(header->magic[0] != 0x7F || header->magic[1] != 'E' || header->magic[2] != 'L' || header->magic[3] != 'F')
         return false;
 
     ELFProgramInfo progInfo = { 0 };
 
-    ElfSegmentHeader* segList = (ElfSegmentHeader*)(buffer + header->phOffset);
+    const ElfSegmentHeader* segList = (const ElfSegmentHeader*)(buffer + header->phOffset);
     for(int s = 0; s < header->phEntryCount; s++) {
-        ElfSegmentHeader* segment = &segList[s];
+        const ElfSegmentHeader* segment = &segList[s];
         if(segment->type == PT_LOAD || segment->type == PT_TLS) {
             const uint8* src = buffer + segment->dataOffset;
             uint8* dest = (uint8*)segment->virtualAddress;
@@ -4,5 +4,5 @@
 
 class ELFExecHandler : public ExecHandler {
 public:
-    bool CheckAndPrepare(uint8* buffer, uint64 bufferSize, uint64 pml4Entry, IDT::Registers* regs, int argc, const char* const* argv) override;
+    bool CheckAndPrepare(const uint8* buffer, uint64 bufferSize, uint64 pml4Entry, IDT::Registers* regs, int argc, const char* const* argv) override;
 };
\ No newline at end of file
@@ -0,0 +1,202 @@
+#include "DentryCache.h"
+
+#include "ktl/AnchorList.h"
+#include "locks/StickyLock.h"
+#include "atomic/Atomics.h"
+#include "klib/memory.h"
+#include "klib/string.h"
+
+#include <new>
+
+namespace VFS {
+
+    namespace DentryCache {
+
+        struct Entry {
+            ktl::Anchor<Entry> anchor;
+
+            MountPoint* mp;
+            uint64 parentID;
+            uint64 hash;
+
+            bool negative;
+            uint64 nodeID;
+
+            uint64 nameLength;
+            char name[];
+        };
+
+        struct Bucket {
+            StickyLock lock;
+            uint64 count;
+            // most recently used entry first
+            ktl::AnchorList<Entry, &Entry::anchor> entries;
+        };
+
+        static constexpr uint64 NumBuckets = 1024;
+        // Least recently used entries of a bucket are evicted when it grows beyond this size
+        static constexpr uint64 MaxBucketEntries = 8;
+
+        static Bucket g_Buckets[NumBuckets];
+        static Atomic<uint64> g_Generation = 0;
+
+        static uint64 Hash(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength) {
+            // FNV-1a
+            uint64 hash = 0xCBF29CE484222325;
+            for(uint64 i = 0; i < nameLength; i++) {
+                hash ^= (uint8)name[i];
+                hash *= 0x100000001B3;
+            }
+            hash ^= parentID * 0x9E3779B97F4A7C15;
+            hash ^= (uint64)mp >> 4;
+            return hash;
+        }
+
+        static Bucket& GetBucket(uint64 hash) {
+            return g_Buckets[(hash ^ (hash >> 32)) % NumBuckets];
+        }
+
+        static Entry* Find(Bucket& bucket, MountPoint* mp, uint64 parentID, uint64 hash, const char* name, uint64 nameLength) {
+            for(Entry& e : bucket.entries) {
+                if(e.hash == hash && e.mp == mp && e.parentID == parentID && e.nameLength == nameLength && kstrcmp(e.name, 0, nameLength, name) == 0)
+                    return &e;
+            }
+            return nullptr;
+        }
+
+        static void FreeEntry(Entry* e) {
+            e->~Entry();
+            delete[] (char*)e;
+        }
+
+        LookupResult Lookup(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength, uint64& outNodeID) {
+            uint64 hash = Hash(mp, parentID, name, nameLength);
+            Bucket& bucket = GetBucket(hash);
+
+            bucket.lock.Spinlock();
+            Entry* e = Find(bucket, mp, parentID, hash, name, nameLength);
+            if(e == nullptr) {
+                bucket.lock.Unlock();
+                return LOOKUP_MISS;
+            }
+
+            LookupResult res = e->negative ? LOOKUP_NEGATIVE : LOOKUP_FOUND;
+            outNodeID = e->nodeID;
+            bucket.entries.erase(e);
+            bucket.entries.push_front(e);
+            bucket.lock.Unlock();
+            return res;
+        }
+
+        uint64 GetGeneration() {
+            return g_Generation.Read();
+        }
+
+        static void DoInsert(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength, bool negative, uint64 nodeID, uint64 generation) {
+            uint64 hash = Hash(mp, parentID, name, nameLength);
+            Bucket& bucket = GetBucket(hash);
+
+            Entry* newEntry = new(new char[sizeof(Entry) + nameLength]) Entry();
+            newEntry->mp = mp;
+            newEntry->parentID = parentID;
+            newEntry->hash = hash;
+            newEntry->negative = negative;
+            newEntry->nodeID = nodeID;
+            newEntry->nameLength = nameLength;
+            kmemcpy(newEntry->name, name, nameLength);
+
+            Entry* evicted = nullptr;
+
+            bucket.lock.Spinlock();
+            // Checked under the bucket lock, InvalidateMount() increments the generation before clearing the buckets
+            if(g_Generation.Read() != generation) {
+                bucket.lock.Unlock();
+                FreeEntry(newEntry);
+                return;
+            }
+
+            Entry* old = Find(bucket, mp, parentID, hash, name, nameLength);
+            if(old != nullptr) {
+                bucket.entries.erase(old);
+                bucket.count--;
+            }
+
+            bucket.entries.push_front(newEntry);
+            bucket.count++;
+
+            if(bucket.count > MaxBucketEntries) {
+                evicted = &bucket.entries.back();
+                bucket.entries.pop_back();
+                bucket.count--;
+            }
+            bucket.lock.Unlock();
+
+            if(old != nullptr)
+                FreeEntry(old);
+            if(evicted != nullptr)
+                FreeEntry(evicted);
+        }
+
+        void Insert(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength, uint64 nodeID, uint64 generation) {
+            DoInsert(mp, parentID, name, nameLength, false, nodeID, generation);
+        }
+        void InsertNegative(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength, uint64 generation) {
+            DoInsert(mp, parentID, name, nameLength, true, 0, generation);
+        }
+
+        void Remove(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength) {
+            uint64 hash = Hash(mp, parentID, name, nameLength);
+            Bucket& bucket = GetBucket(hash);
+
+            bucket.lock.Spinlock();
+            Entry* e = Find(bucket, mp, parentID, hash, name, nameLength);
+            if(e != nullptr) {
+                bucket.entries.erase(e);
+                bucket.count--;
+            }
+            bucket.lock.Unlock();
+
+            if(e != nullptr)
+                FreeEntry(e);
+        }
+
+        template<typename Pred>
+        static void RemoveIf(Pred pred) {
+            for(uint64 b = 0; b < NumBuckets; b++) {
+                Bucket& bucket = g_Buckets[b];
+
+                while(true) {
+                    bucket.lock.Spinlock();
+                    Entry* found = nullptr;
+                    for(Entry& e : bucket.entries) {
+                        if(pred(e)) {
+                            found = &e;
+                            break;
+                        }
+                    }
+                    if(found != nullptr) {
+                        bucket.entries.erase(found);
+                        bucket.count--;
+                    }
+                    bucket.lock.Unlock();
+
+                    if(found == nullptr)
+                        break;
+                    FreeEntry(found);
+                }
+            }
+        }
+
+        void InvalidateDir(MountPoint* mp, uint64 parentID) {
+            g_Generation.Inc();
+            RemoveIf([mp, parentID](const Entry& e) { return e.mp == mp && e.parentID == parentID; });
+        }
+
+        void InvalidateMount(MountPoint* mp) {
+            g_Generation.Inc();
+            RemoveIf([mp](const Entry& e) { return e.mp == mp; });
+        }
+
+    }
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.h"
+
+namespace VFS {
+
+    struct MountPoint;
+
+    /**
+     * Global hashed cache of path component lookups.
+     * Maps (MountPoint, parent node ID, name) to the node ID of the entry, or remembers that the entry does not exist.
+     *
+     * The VFS only reads and modifies the entries of a directory while holding its dirLock,
+     * which keeps the cache consistent with directory changes made through the VFS.
+     * FileSystems that change directories on their own have to call InvalidateMount().
+     **/
+    namespace DentryCache {
+
+        enum LookupResult {
+            LOOKUP_MISS,        // Nothing is known about this name
+            LOOKUP_FOUND,       // The name exists, outNodeID is valid
+            LOOKUP_NEGATIVE,    // The name is known to not exist
+        };
+
+        LookupResult Lookup(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength, uint64& outNodeID);
+
+        /**
+         * Returns the current cache generation.
+         * Has to be read before scanning a directory, Insert() and InsertNegative() discard their entry
+         * if the cache was invalidated in the meantime.
+         **/
+        uint64 GetGeneration();
+        void Insert(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength, uint64 nodeID, uint64 generation);
+        void InsertNegative(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength, uint64 generation);
+
+        /**
+         * Forgets everything about the given name.
+         **/
+        void Remove(MountPoint* mp, uint64 parentID, const char* name, uint64 nameLength);
+        /**
+         * Forgets every entry of the given directory.
+         **/
+        void InvalidateDir(MountPoint* mp, uint64 parentID);
+        /**
+         * Forgets every entry of the given MountPoint.
+         **/
+        void InvalidateMount(MountPoint* mp);
+
+    }
+
+}
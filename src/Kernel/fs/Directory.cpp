@@ -1,78 +1,217 @@
 #include "Directory.h"
 
+#include "klib/memory.h"
+#include "klib/string.h"
+
 namespace VFS {
 
-    static bool PathWalk(const char** pathPtr, const char* nameCmp) {
-        const char* path = *pathPtr;
-
-        int index = 0;
-        while(true) {
-            if(nameCmp[index] == '\0') {
-                if(path[index] == '/') {
-                    *pathPtr += index + 1;
-                    return true;
-                } else if(path[index] == '\0') {
-                    *pathPtr += index;
-                    return true;
-                } else {
-                    return false;
-                }
-            }
+    uint32 Directory::Hash(const char* name, uint64 nameLength) const {
+        // FNV-1a
+        uint32 hash = 0x811C9DC5;
+        for(uint64 i = 0; i < nameLength; i++) {
+            hash ^= (uint8)name[i];
+            hash *= 0x01000193;
+        }
+        return hash;
+    }
 
-            if(path[index] != nameCmp[index])
-                return false;
+    uint64 Directory::FindSlot(const char* name, uint64 nameLength, uint32 hash) const {
+        uint64 mask = m_IndexSize - 1;
+        for(uint64 slot = hash & mask; ; slot = (slot + 1) & mask) {
+            uint32 val = m_Index[slot];
+            if(val == SlotEmpty)
+                return m_IndexSize;
+            if(val == SlotRemoved)
+                continue;
 
-            index++;
+            const DirectoryEntry& e = m_Entries[val - 1];
+            if(e.hash == hash && e.nameLength == nameLength && kstrcmp(&m_Names[e.nameOffset], 0, nameLength, name) == 0)
+                return slot;
         }
     }
 
-    DirectoryEntry* Directory::FindEntry(const char** pathPtr, uint64* entryIndex) {
-        for(uint64 i = 0; i < numEntries; i++) {
-            if(PathWalk(pathPtr, entries[i].name)) {
-                if(entryIndex != nullptr)
-                    *entryIndex = i;
-                return &entries[i];
-            }
+    void Directory::RebuildIndex(uint64 indexSize) {
+        delete[] m_Index;
+        m_Index = new uint32[indexSize];
+        m_IndexSize = indexSize;
+        m_IndexUsed = 0;
+        kmemset(m_Index, 0, indexSize * sizeof(uint32));
+
+        uint64 mask = indexSize - 1;
+        for(uint64 i = 0; i < m_NumSlots; i++) {
+            if(m_Entries[i].removed)
+                continue;
+
+            uint64 slot = m_Entries[i].hash & mask;
+            while(m_Index[slot] != SlotEmpty)
+                slot = (slot + 1) & mask;
+            m_Index[slot] = i + 1;
+            m_IndexUsed++;
         }
+    }
 
-        return nullptr;
+    void Directory::Compact() {
+        uint64 newSlots = 0;
+        uint64 newNamesSize = 0;
+        for(uint64 i = 0; i < m_NumSlots; i++) {
+            DirectoryEntry e = m_Entries[i];
+            if(e.removed)
+                continue;
+
+            // Both stores only ever move towards their start, so copying in place is safe
+            kmemmove(&m_Names[newNamesSize], &m_Names[e.nameOffset], e.nameLength + 1);
+            e.nameOffset = newNamesSize;
+            newNamesSize += e.nameLength + 1;
+            m_Entries[newSlots++] = e;
+        }
+
+        m_NumSlots = newSlots;
+        m_NamesSize = newNamesSize;
+        RebuildIndex(m_IndexSize);
     }
 
-    Directory* Directory::Create(uint64 capacity) {
-        Directory* dir = (Directory*)new char[sizeof(Directory) + capacity * sizeof(DirectoryEntry)];
-        dir->capacity = capacity;
-        dir->numEntries = 0;
-        return dir;
+    DirectoryEntry* Directory::FindEntry(const char* name, uint64 nameLength) {
+        uint64 slot = FindSlot(name, nameLength, Hash(name, nameLength));
+        if(slot == m_IndexSize)
+            return nullptr;
+        return &m_Entries[m_Index[slot] - 1];
     }
-    void Directory::Destroy(Directory* dir) {
-        delete[] (char*)dir;
+    DirectoryEntry* Directory::FindEntry(const char* name) {
+        return FindEntry(name, kstrlen(name));
     }
-    void Directory::AddEntry(Directory** dirPtr, DirectoryEntry** outEntry) {
-        Directory* dir = *dirPtr;
-
-        if(dir->capacity > dir->numEntries) {
-            *outEntry = &dir->entries[dir->numEntries];
-            dir->numEntries++;
-            return;
-        } else {
-            Directory* newDir = Directory::Create(dir->capacity + 16);
-            newDir->numEntries = dir->numEntries + 1;
-            for(uint64 i = 0; i < dir->numEntries; i++) {
-                newDir->entries[i] = dir->entries[i];
+
+    void Directory::AddEntry(const char* name, uint64 nameLength, uint64 nodeID) {
+        if(m_NumSlots == m_SlotCapacity) {
+            if(numEntries < m_NumSlots / 2) {
+                Compact();
+            } else {
+                uint64 newCapacity = m_SlotCapacity * 2;
+                DirectoryEntry* newEntries = new DirectoryEntry[newCapacity];
+                kmemcpy(newEntries, m_Entries, m_NumSlots * sizeof(DirectoryEntry));
+                delete[] m_Entries;
+                m_Entries = newEntries;
+                m_SlotCapacity = newCapacity;
             }
-            Directory::Destroy(dir);
-            *dirPtr = newDir;
-            *outEntry = &newDir->entries[newDir->numEntries - 1];
         }
+
+        if(m_NamesSize + nameLength + 1 > m_NamesCapacity) {
+            uint64 newCapacity = m_NamesCapacity * 2;
+            while(m_NamesSize + nameLength + 1 > newCapacity)
+                newCapacity *= 2;
+            char* newNames = new char[newCapacity];
+            kmemcpy(newNames, m_Names, m_NamesSize);
+            delete[] m_Names;
+            m_Names = newNames;
+            m_NamesCapacity = newCapacity;
+        }
+
+        // Keep the index at most 3/4 full, removed slots count as used
+        if((m_IndexUsed + 1) * 4 > m_IndexSize * 3) {
+            uint64 newSize = m_IndexSize;
+            while((numEntries + 1) * 4 > newSize * 3 / 2)
+                newSize *= 2;
+            RebuildIndex(newSize);
+        }
+
+        uint64 index = m_NumSlots++;
+        DirectoryEntry& e = m_Entries[index];
+        e.nodeID = nodeID;
+        e.cookie = m_NextCookie++;
+        e.nameOffset = m_NamesSize;
+        e.nameLength = nameLength;
+        e.hash = Hash(name, nameLength);
+        e.removed = false;
+
+        kmemcpy(&m_Names[m_NamesSize], name, nameLength);
+        m_Names[m_NamesSize + nameLength] = '\0';
+        m_NamesSize += nameLength + 1;
+
+        uint64 mask = m_IndexSize - 1;
+        uint64 slot = e.hash & mask;
+        while(m_Index[slot] != SlotEmpty && m_Index[slot] != SlotRemoved)
+            slot = (slot + 1) & mask;
+        if(m_Index[slot] == SlotEmpty)
+            m_IndexUsed++;
+        m_Index[slot] = index + 1;
+
+        numEntries++;
+        version++;
+    }
+    void Directory::AddEntry(const char* name, uint64 nodeID) {
+        AddEntry(name, kstrlen(name), nodeID);
+    }
+
+    bool Directory::RemoveEntry(const char* name, uint64 nameLength) {
+        uint64 slot = FindSlot(name, nameLength, Hash(name, nameLength));
+        if(slot == m_IndexSize)
+            return false;
+
+        m_Entries[m_Index[slot] - 1].removed = true;
+        m_Index[slot] = SlotRemoved;
+        numEntries--;
+        version++;
+        return true;
+    }
+    bool Directory::RemoveEntry(const char* name) {
+        return RemoveEntry(name, kstrlen(name));
     }
-    void Directory::RemoveEntry(Directory** dirPtr, uint64 index) {
-        Directory* dir = *dirPtr;
 
-        for(uint64 i = index + 1; i < dir->numEntries; i++) {
-            dir->entries[i-1] = dir->entries[i];
+    DirectoryEntry* Directory::GetFirstEntry(uint64 cookie) {
+        // Entries are sorted by cookie
+        uint64 low = 0;
+        uint64 high = m_NumSlots;
+        while(low < high) {
+            uint64 mid = (low + high) / 2;
+            if(m_Entries[mid].cookie < cookie)
+                low = mid + 1;
+            else
+                high = mid;
         }
 
-        dir->numEntries--;
+        for(uint64 i = low; i < m_NumSlots; i++) {
+            if(!m_Entries[i].removed)
+                return &m_Entries[i];
+        }
+        return nullptr;
+    }
+    DirectoryEntry* Directory::GetNextEntry(DirectoryEntry* entry) {
+        for(uint64 i = entry - m_Entries + 1; i < m_NumSlots; i++) {
+            if(!m_Entries[i].removed)
+                return &m_Entries[i];
+        }
+        return nullptr;
+    }
+
+    Directory* Directory::Create(uint64 capacity) {
+        if(capacity < 4)
+            capacity = 4;
+
+        Directory* dir = new Directory();
+        dir->numEntries = 0;
+        dir->version = 0;
+
+        dir->m_Entries = new DirectoryEntry[capacity];
+        dir->m_NumSlots = 0;
+        dir->m_SlotCapacity = capacity;
+
+        dir->m_NamesCapacity = capacity * 16;
+        dir->m_Names = new char[dir->m_NamesCapacity];
+        dir->m_NamesSize = 0;
+
+        uint64 indexSize = 8;
+        while(indexSize * 3 < capacity * 4)
+            indexSize *= 2;
+        dir->m_Index = nullptr;
+        dir->RebuildIndex(indexSize);
+
+        dir->m_NextCookie = 1;
+        return dir;
+    }
+    void Directory::Destroy(Directory* dir) {
+        delete[] dir->m_Entries;
+        delete[] dir->m_Names;
+        delete[] dir->m_Index;
+        delete dir;
     }
 
-}
\ No newline at end of file
+}
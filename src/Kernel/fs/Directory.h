@@ -5,24 +5,86 @@
 namespace VFS {
 
     struct DirectoryEntry {
-        char name[50];
         uint64 nodeID;
+        // Increases with every added entry, iteration order is ascending cookie order
+        uint64 cookie;
+
+        uint32 nameOffset;
+        uint32 nameLength;
+        uint32 hash;
+        bool removed;
     };
-    
+
+    /**
+     * The entries of a directory.
+     * Names are kept null terminated in a packed name store, a hash index over the names makes lookups O(1) on average.
+     * Entries are iterated in the order they were added. The cookie of an entry can be used to continue an iteration later,
+     * even if entries were added or removed in the meantime.
+     * A Directory never moves in memory, so pointers to it stay valid until it is destroyed.
+     **/
     class Directory {
     public:
         uint64 numEntries;
-        uint64 capacity;
-        DirectoryEntry entries[];
+        // Incremented by every AddEntry and RemoveEntry, FileSystems use it to tell whether the directory changed
+        uint64 version;
 
     public:
-        DirectoryEntry* FindEntry(const char** pathPtr, uint64* entryIndex);
+        /**
+         * Returns the entry with the given name, or nullptr if no such entry exists
+         **/
+        DirectoryEntry* FindEntry(const char* name, uint64 nameLength);
+        DirectoryEntry* FindEntry(const char* name);
+
+        void AddEntry(const char* name, uint64 nameLength, uint64 nodeID);
+        void AddEntry(const char* name, uint64 nodeID);
+        /**
+         * Removes the entry with the given name.
+         * Returns false if no such entry exists.
+         **/
+        bool RemoveEntry(const char* name, uint64 nameLength);
+        bool RemoveEntry(const char* name);
+
+        const char* GetName(const DirectoryEntry* entry) const { return &m_Names[entry->nameOffset]; }
+
+        /**
+         * Returns the first entry whose cookie is at least the given cookie, or nullptr if there is none.
+         * GetFirstEntry(0) starts a new iteration.
+         **/
+        DirectoryEntry* GetFirstEntry(uint64 cookie = 0);
+        /**
+         * Returns the entry following the given entry, or nullptr if entry was the last one
+         **/
+        DirectoryEntry* GetNextEntry(DirectoryEntry* entry);
 
     public:
         static Directory* Create(uint64 capacity);
         static void Destroy(Directory* dir);
-        static void AddEntry(Directory** dir, DirectoryEntry** outEntry);
-        static void RemoveEntry(Directory** dir, uint64 index);
+
+    private:
+        uint32 Hash(const char* name, uint64 nameLength) const;
+        uint64 FindSlot(const char* name, uint64 nameLength, uint32 hash) const;
+        void RebuildIndex(uint64 indexSize);
+        void Compact();
+
+    private:
+        static constexpr uint32 SlotEmpty = 0;
+        static constexpr uint32 SlotRemoved = 0xFFFFFFFF;
+
+        // Entries in cookie order, removed entries stay in place until the next Compact()
+        DirectoryEntry* m_Entries;
+        uint64 m_NumSlots;
+        uint64 m_SlotCapacity;
+
+        char* m_Names;
+        uint64 m_NamesSize;
+        uint64 m_NamesCapacity;
+
+        // Open addressing hash table of entry index + 1, SlotEmpty or SlotRemoved
+        uint32* m_Index;
+        uint64 m_IndexSize;
+        uint64 m_IndexUsed;
+
+        uint64 m_NextCookie;
     };
-    
+
 }
@@ -6,6 +6,49 @@
 
 namespace VFS {
 
+    int64 FileSystem::SetOptions(const char* options) {
+        return options[0] == '\0' ? OK : ErrorInvalidMountOptions;
+    }
+    void FileSystem::GetStats(FileSystemStats& outStats) {
+        outStats.usedBytes = 0;
+        outStats.maxBytes = 0;
+        outStats.usedNodes = 0;
+        outStats.maxNodes = 0;
+    }
+
+    uint64 FileSystem::ReadNodeDataV(Node* node, uint64 pos, const IOVec* iov, uint64 iovCount) {
+        uint64 total = 0;
+        for(uint64 i = 0; i < iovCount; i++) {
+            if(iov[i].length == 0)
+                continue;
+
+            int64 res = ReadNodeData(node, pos + total, iov[i].base, iov[i].length);
+            if(res < 0)
+                return total == 0 ? res : total;
+
+            total += res;
+            if((uint64)res < iov[i].length)
+                break;
+        }
+        return total;
+    }
+    uint64 FileSystem::WriteNodeDataV(Node* node, uint64 pos, const IOVec* iov, uint64 iovCount) {
+        uint64 total = 0;
+        for(uint64 i = 0; i < iovCount; i++) {
+            if(iov[i].length == 0)
+                continue;
+
+            int64 res = WriteNodeData(node, pos + total, iov[i].base, iov[i].length);
+            if(res < 0)
+                return total == 0 ? res : total;
+
+            total += res;
+            if((uint64)res < iov[i].length)
+                break;
+        }
+        return total;
+    }
+
     struct FSEntry {
         ktl::Anchor<FSEntry> anchor;
 
@@ -17,6 +60,51 @@ namespace VFS {
         const char* id;
     };
 
+    uint64 FileSystem::SendNodeData(Node* node, uint64 pos, uint64 count, DataSink& sink) {
+        uint64 chunkSize = count < SendChunkSize ? count : SendChunkSize;
+        char* buffer = new char[chunkSize];
+
+        uint64 total = 0;
+        while(total < count) {
+            uint64 size = count - total < chunkSize ? count - total : chunkSize;
+            int64 res = ReadNodeData(node, pos + total, buffer, size);
+            if(res <= 0) {
+                if(total == 0)
+                    total = res;
+                break;
+            }
+
+            int64 put = sink.Put(buffer, res);
+            if(put < 0) {
+                if(total == 0)
+                    total = put;
+                break;
+            }
+
+            total += put;
+            // Either eof, the sink is full or a pipe ran empty
+            if(put < res || (uint64)res < size)
+                break;
+        }
+
+        delete[] buffer;
+        return total;
+    }
+
+    void FileSystem::CloseNodeDescriptor(Node* node, uint8 permissions) { }
+
+    void FileSystem::LoadDirEntries(Node* node, const char* name, uint64 nameLength) { }
+    void FileSystem::DirEntriesChanged(Node* node) { }
+
+    int64 FileSystem::SyncNode(Node* node) {
+        return OK;
+    }
+
+    const void* FileSystem::GetDirectData(Node* node, uint64 pos, uint64 size) {
+        return nullptr;
+    }
+    void FileSystem::ReleaseDirectData(Node* node) { }
+
     static StickyLock g_Lock;
     static ktl::AnchorList<FSEntry, &FSEntry::anchor> g_FileSystems;
 
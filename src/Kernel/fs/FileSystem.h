@@ -10,6 +10,23 @@ namespace VFS {
 
     struct Node;
     struct MountPoint;
+    struct IOVec;
+    struct FileSystemStats;
+
+    // Size of the kernel buffer used to copy data between two nodes
+    constexpr uint64 SendChunkSize = 16 * 1024;
+
+    /**
+     * Receives the data that a FileSystem streams out of a node with SendNodeData.
+     **/
+    class DataSink {
+    public:
+        /**
+         * Consumes up to size bytes of data, the data is only valid during the call.
+         * Returns the number of bytes consumed, or an error code.
+         **/
+        virtual int64 Put(const void* data, uint64 size) = 0;
+    };
 
     class FileSystem
     {
@@ -21,11 +38,24 @@ namespace VFS {
 
         virtual void SetMountPoint(MountPoint* mp) = 0;
         virtual void PrepareUnmount() = 0;
+
+        /**
+         * Applies a comma separated list of key=value mount options.
+         * The default implementation only accepts an empty list.
+         * Returns OK or ErrorInvalidMountOptions.
+         **/
+        virtual int64 SetOptions(const char* options);
+        /**
+         * Fills in the usage and limits of the FileSystem, the default implementation reports everything as 0.
+         **/
+        virtual void GetStats(FileSystemStats& outStats);
         
         /**
-         * Seeks for a suitable free Node and creates a new Node out of it
+         * Seeks for a suitable free Node and creates a new Node out of it.
+         * node->type is already set, parent is the directory the node is going to be linked into, or nullptr.
+         * Returns OK, or ErrorNoSpace if the FileSystem cannot hold any more nodes.
          **/
-        virtual void CreateNode(Node* node) = 0;
+        virtual int64 CreateNode(Node* parent, Node* node) = 0;
         /**
          * Destroys the given node and marks it free
          **/
@@ -38,12 +68,29 @@ namespace VFS {
         virtual void ReadNode(uint64 id, Node* node) = 0; 
         /**
          * Writes the given node.
-         * Will only get called if a node is ejected from the VFS node cache.
+         * Will only get called for modified nodes that are ejected from the VFS node cache.
          **/
         virtual void WriteNode(Node* node) = 0;
+        /**
+         * Frees the in-memory data (e.g. fsData) of a node that is ejected from the VFS node cache.
+         * The node still exists in the FileSystem and can be read again with ReadNode, which does not happen before EvictNode returned.
+         **/
+        virtual void EvictNode(Node* node) = 0;
 
         // Get uncachable dir entries
         virtual void UpdateDir(Node* node) = 0;
+        /**
+         * Makes sure that the entry with the given name is in the cachedDir of the directory node if it exists,
+         * or that all entries are in it if name is nullptr.
+         * Called without holding the node's dirLock, so FileSystems that read directories lazily can block here.
+         * The default implementation does nothing.
+         **/
+        virtual void LoadDirEntries(Node* node, const char* name, uint64 nameLength);
+        /**
+         * Called after entries were added to or removed from the cachedDir of the directory node, once its dirLock was released.
+         * The default implementation does nothing.
+         **/
+        virtual void DirEntriesChanged(Node* node);
 
         /**
          * Reads data from the given File node.
@@ -57,12 +104,51 @@ namespace VFS {
          * Blocks until at least on byte was written, or returns an error code, never 0
          **/
         virtual uint64 WriteNodeData(Node* node, uint64 pos, const void* buffer, uint64 bufferSize) = 0;
+        /**
+         * Vectored versions of ReadNodeData and WriteNodeData, the buffers are accessed as if they were one contiguous buffer.
+         * The default implementations call ReadNodeData / WriteNodeData once per buffer, FileSystems can override them
+         * to handle all buffers in one pass.
+         * Reading stops at the first buffer that could not be filled completely.
+         **/
+        virtual uint64 ReadNodeDataV(Node* node, uint64 pos, const IOVec* iov, uint64 iovCount);
+        virtual uint64 WriteNodeDataV(Node* node, uint64 pos, const IOVec* iov, uint64 iovCount);
+        /**
+         * Streams up to count bytes of the given node, starting at pos, into sink.
+         * The default implementation copies the data through a kernel buffer with ReadNodeData, FileSystems that keep
+         * node data in memory can override it to give their own buffers to the sink.
+         * Returns the number of bytes consumed by sink, 0 on eof, or an error code.
+         **/
+        virtual uint64 SendNodeData(Node* node, uint64 pos, uint64 count, DataSink& sink);
+        /**
+         * Returns a kernel pointer to the data [pos, pos + size) of the given node if it can be read in place,
+         * e.g. because it lies contiguously on a device that resides in memory. Otherwise nullptr is returned.
+         * The data must not change until ReleaseDirectData is called, writes and truncation of the node have to wait until then.
+         * The default implementation returns nullptr.
+         **/
+        virtual const void* GetDirectData(Node* node, uint64 pos, uint64 size);
+        /**
+         * Called once for every pointer returned by GetDirectData when it is not used anymore.
+         * The default implementation does nothing.
+         **/
+        virtual void ReleaseDirectData(Node* node);
+
+        /**
+         * Called when the last reference to a FileDescriptor of the given node was closed.
+         * permissions are the access permissions the FileDescriptor was opened with.
+         **/
+        virtual void CloseNodeDescriptor(Node* node, uint8 permissions);
 
         /**
          * Clears the node to an empty state.
          * Will only be called for regular file nodes.
          **/
         virtual void ClearNodeData(Node* node) = 0;
+
+        /**
+         * Writes everything that is still buffered for the node to the underlying device.
+         * The default implementation does nothing and returns OK.
+         **/
+        virtual int64 SyncNode(Node* node);
     };
 
     typedef FileSystem* (*FileSystemFactory)();
@@ -5,12 +5,22 @@
 #include "Node.h"
 #include "SuperBlock.h"
 #include "ktl/AnchorList.h"
+#include "locks/WaitQueue.h"
 
 namespace VFS {
 
     struct FileSystem;
 
+    struct NodeCacheBucket {
+        StickyLock lock;
+        ktl::AnchorList<Node, &Node::anchor> nodes;
+        // Woken up when an evicted node was removed from nodes
+        WaitQueue evictQueue;
+    };
+
     struct MountPoint {
+        static constexpr uint64 NodeCacheBuckets = 256;
+
         ktl::Anchor<MountPoint> anchor;
 
         MountPoint* parent;
@@ -22,8 +32,13 @@ namespace VFS {
         StickyLock childMountLock;
         ktl::AnchorList<MountPoint, &MountPoint::anchor> childMounts;
 
-        StickyLock nodeCacheLock;
-        ktl::AnchorList<Node, &Node::anchor> nodeCache;
+        NodeCacheBucket nodeCache[NodeCacheBuckets];
+
+        // Nodes in the cache that are not referenced anymore, least recently used first.
+        // Lock order: NodeCacheBucket::lock before lruLock
+        StickyLock lruLock;
+        ktl::AnchorList<Node, &Node::lruAnchor> lru;
+        uint64 lruSize;
 
         Atomic<uint64> refCount;
     };
@@ -15,6 +15,8 @@ namespace VFS {
     struct Node
     {
         ktl::Anchor<Node> anchor;
+        ktl::Anchor<Node> lruAnchor;
+        bool inLRU;
 
         uint64 id;
         MountPoint* mp;
@@ -25,6 +27,12 @@ namespace VFS {
         bool ready;
         QueueLock readyQueue;
 
+        // Set while the node is written back and evicted, it stays in its cache bucket until that is done
+        bool evicting;
+
+        // Set whenever the node was modified, the node is written back with FileSystem::WriteNode before it is evicted from the cache
+        bool dirty;
+
         enum Type {
             TYPE_FILE,              // Normal File
             TYPE_DIRECTORY,         // Directory, containing other nodes
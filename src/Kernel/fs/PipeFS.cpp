@@ -1,187 +1,260 @@
 #include "PipeFS.h"
 
 #include "klib/memory.h"
+#include "memory/MemoryManager.h"
 #include "scheduler/Scheduler.h"
 #include "klib/stdio.h"
-
-#include <vector>
+#include "Permissions.h"
 
 namespace VFS {
 
+    static uint8* AllocPipePage() {
+        return (uint8*)MemoryManager::PhysToKernelPtr(MemoryManager::AllocatePages());
+    }
+    static void FreePipePage(uint8* page) {
+        MemoryManager::FreePages(MemoryManager::KernelToPhysPtr(page));
+    }
+
+    static uint64 GetCapacity(Pipe* p) {
+        return p->numPages * 4096;
+    }
+
+    /**
+     * Moves the data of p into a ring of newNumPages pages.
+     * p->lock has to be held, newNumPages has to be large enough to hold the data.
+     **/
+    static void Resize(Pipe* p, uint64 newNumPages) {
+        uint8** newPages = new uint8*[newNumPages];
+        for(uint64 i = 0; i < newNumPages; i++)
+            newPages[i] = AllocPipePage();
+
+        // Pages are aligned to the same positions in both rings, so data only moves between pages
+        uint64 pos = p->readPos;
+        while(pos < p->writePos) {
+            uint64 offset = pos % 4096;
+            uint64 count = 4096 - offset;
+            if(count > p->writePos - pos)
+                count = p->writePos - pos;
+
+            kmemcpy(newPages[pos / 4096 % newNumPages] + offset, p->pages[pos / 4096 % p->numPages] + offset, count);
+            pos += count;
+        }
+
+        for(uint64 i = 0; i < p->numPages; i++)
+            FreePipePage(p->pages[i]);
+        delete[] p->pages;
+
+        p->pages = newPages;
+        p->numPages = newNumPages;
+    }
+
+    static bool CopyFromPipe(Pipe* p, void* buffer, uint64 count) {
+        uint8* realBuffer = (uint8*)buffer;
+
+        uint64 pos = p->readPos;
+        uint64 end = pos + count;
+        while(pos < end) {
+            uint64 offset = pos % 4096;
+            uint64 chunk = 4096 - offset;
+            if(chunk > end - pos)
+                chunk = end - pos;
+
+            if(!kmemcpy_usersafe(realBuffer, p->pages[pos / 4096 % p->numPages] + offset, chunk))
+                return false;
+            realBuffer += chunk;
+            pos += chunk;
+        }
+        return true;
+    }
+    static bool CopyToPipe(Pipe* p, const void* buffer, uint64 count) {
+        const uint8* realBuffer = (const uint8*)buffer;
+
+        uint64 pos = p->writePos;
+        uint64 end = pos + count;
+        while(pos < end) {
+            uint64 offset = pos % 4096;
+            uint64 chunk = 4096 - offset;
+            if(chunk > end - pos)
+                chunk = end - pos;
+
+            if(!kmemcpy_usersafe(p->pages[pos / 4096 % p->numPages] + offset, realBuffer, chunk))
+                return false;
+            realBuffer += chunk;
+            pos += chunk;
+        }
+        return true;
+    }
+
     void PipeFS::GetSuperBlock(SuperBlock* sb) { }
     void PipeFS::SetMountPoint(MountPoint* mp) { }
     void PipeFS::PrepareUnmount() { }
 
-    void PipeFS::CreateNode(Node* node) {
-        m_PipesLock.Spinlock();
-        for(Pipe* p : m_Pipes) {
-            if(p->free) {
-                p->free = false;
-                p->readPos = 0;
-                p->writePos = 0;
-                node->id = p->id;
-                node->linkCount = 0;
-                m_PipesLock.Unlock();
-                return;
-            }
-        }
+    int64 PipeFS::CreateNode(Node* parent, Node* node) {
+        Pipe* p = new Pipe();
+        p->pages = new uint8*[1];
+        p->pages[0] = AllocPipePage();
+        p->numPages = 1;
+        p->maxPages = PipeDefaultMaxCapacity / 4096;
+        p->readPos = 0;
+        p->writePos = 0;
+        // A new pipe is always opened by one read and one write FileDescriptor, see VFS::CreatePipe
+        p->readers = 1;
+        p->writers = 1;
 
-        Pipe* newPipe = new Pipe();
-        newPipe->id = m_Pipes.size();
-        newPipe->free = false;
-        newPipe->readPos = 0;
-        newPipe->writePos = 0;
-        m_Pipes.push_back(newPipe);
-        m_PipesLock.Unlock();
-        node->id = newPipe->id;
+        node->id = m_NextID.PostInc();
         node->linkCount = 0;
+        node->fsData = p;
+        return OK;
     }
     void PipeFS::DestroyNode(Node* node) {
-        m_PipesLock.Spinlock();
-        m_Pipes[node->id]->free = true;
-        m_PipesLock.Unlock();
+        // Every FileDescriptor is closed, so nobody can access the pipe anymore
+        Pipe* p = (Pipe*)node->fsData;
+        for(uint64 i = 0; i < p->numPages; i++)
+            FreePipePage(p->pages[i]);
+        delete[] p->pages;
+        delete p;
+        node->fsData = nullptr;
     }
 
     void PipeFS::UpdateDir(Node* node) { }
 
     void PipeFS::ReadNode(uint64 id, Node* node) { }
     void PipeFS::WriteNode(Node* node) { }
+    void PipeFS::EvictNode(Node* node) { }
 
-    static uint64 _Read(Pipe* p, void* buffer, uint64 bufferSize) {
-        char* realBuffer = (char*)buffer;
-
-        p->lock.Spinlock();
+    static Pipe* GetPipe(Node* node) {
+        return (Pipe*)node->fsData;
+    }
 
-        if(p->readPos == p->writePos) {
-            p->lock.Unlock();
+    uint64 PipeFS::ReadNodeData(Node* node, uint64 pos, void* buffer, uint64 bufferSize)  {
+        Pipe* p = GetPipe(node);
+        if(bufferSize == 0)
             return 0;
-        } else if(p->readPos < p->writePos) {
-            uint64 rem = p->writePos - p->readPos;
-            if(rem > bufferSize)
-                rem = bufferSize;
 
-            if(!kmemcpy_usersafe(realBuffer, p->buffer + p->readPos, rem)) {
+        p->lock.Spinlock();
+        while(p->readPos == p->writePos) {
+            // eof
+            if(p->writers == 0) {
                 p->lock.Unlock();
-                return ErrorInvalidBuffer;
+                return 0;
             }
-
-            p->readPos += rem;
-            p->lock.Unlock();
-            return rem;
-        } else {
-            uint64 remA = sizeof(p->buffer) - p->readPos;
-            uint64 remB = p->writePos;
-
-            if(remA > bufferSize) {
-                remA = bufferSize;
-                remB = 0;
-            } else if(remA + remB > bufferSize)
-                remB = bufferSize - remA;
-
-            if(!kmemcpy_usersafe(realBuffer, p->buffer + p->readPos, remA)) {
+            if(p->readQueue.Wait(p->lock) != OK) {
                 p->lock.Unlock();
-                return ErrorInvalidBuffer;
-            }
-            if(!kmemcpy_usersafe(realBuffer + remA, p->buffer, remB)) {
-                p->lock.Unlock();
-                return ErrorInvalidBuffer;
+                return ErrorInterrupted;
             }
+        }
+
+        uint64 count = p->writePos - p->readPos;
+        if(count > bufferSize)
+            count = bufferSize;
 
-            p->readPos += remA + remB;
-            p->readPos %= sizeof(p->buffer);
+        if(!CopyFromPipe(p, buffer, count)) {
             p->lock.Unlock();
-            return remA + remB;
+            return ErrorInvalidBuffer;
         }
-    }
-    uint64 PipeFS::ReadNodeData(Node* node, uint64 pos, void* buffer, uint64 bufferSize)  {
-        m_PipesLock.Spinlock();
-        Pipe* p = m_Pipes[node->id];
-        m_PipesLock.Unlock();
-
-        uint64 res;
-        while((res = _Read(p, buffer, bufferSize)) == 0)
-            Scheduler::ThreadYield();
-        return res;
+        p->readPos += count;
+
+        p->writeQueue.WakeAll();
+        p->lock.Unlock();
+        return count;
     }
 
-    static uint64 _Write(Pipe* p, const void* buffer, uint64 bufferSize) {
-        char* realBuffer = (char*)buffer;
+    uint64 PipeFS::WriteNodeData(Node* node, uint64 pos, const void* buffer, uint64 bufferSize) {
+        const char* realBuffer = (const char*)buffer;
 
-        p->lock.Spinlock();
+        Pipe* p = GetPipe(node);
+        if(bufferSize == 0)
+            return 0;
 
-        if(p->writePos < p->readPos) {
-            uint64 rem = p->readPos - p->writePos - 1;
-            if(rem > bufferSize)
-                rem = bufferSize;
+        p->lock.Spinlock();
 
-            if(!kmemcpy_usersafe(p->buffer + p->writePos, realBuffer, rem)) {
+        uint64 written = 0;
+        while(written < bufferSize) {
+            if(p->readers == 0) {
                 p->lock.Unlock();
-                return ErrorInvalidBuffer;
+                return written > 0 ? written : ErrorBrokenPipe;
             }
 
-            p->writePos += rem;
-            p->lock.Unlock();
-            return rem;
-        } else {
-            if(p->readPos > 0) {
-                uint64 remA = sizeof(p->buffer) - p->writePos;
-                uint64 remB = p->readPos - 1;
-                if(remA > bufferSize) {
-                    remA = bufferSize;
-                    remB = 0;
-                } else if(remA + remB > bufferSize)
-                    remB = bufferSize - remA;
-
-                if(!kmemcpy_usersafe(p->buffer + p->writePos, realBuffer, remA)) {
-                    p->lock.Unlock();
-                    return ErrorInvalidBuffer;
-                }
-                if(!kmemcpy_usersafe(p->buffer, realBuffer + remA, remB)) {
-                    p->lock.Unlock();
-                    return ErrorInvalidBuffer;
-                }
+            uint64 rem = bufferSize - written;
+            uint64 space = GetCapacity(p) - (p->writePos - p->readPos);
 
-                p->writePos += remA + remB;
-                p->writePos %= sizeof(p->buffer);
-                p->lock.Unlock();
-                return remA + remB;
-            } else {
-                uint64 rem = sizeof(p->buffer) - p->writePos - 1;
-                if(rem > bufferSize)
-                    rem = bufferSize;
+            // Grow instead of waiting for the reader, as long as the pipe is allowed to
+            if(space < rem && p->numPages < p->maxPages) {
+                uint64 newNumPages = p->numPages * 2;
+                while(newNumPages * 4096 - (p->writePos - p->readPos) < rem && newNumPages < p->maxPages)
+                    newNumPages *= 2;
+                if(newNumPages > p->maxPages)
+                    newNumPages = p->maxPages;
+                Resize(p, newNumPages);
+                continue;
+            }
 
-                if(!kmemcpy_usersafe(p->buffer + p->writePos, realBuffer, rem)) {
+            // Small writes have to fit completely, so that they are not interleaved with other writes
+            uint64 needed = bufferSize <= PipeAtomicWriteSize ? rem : 1;
+            if(space < needed) {
+                if(p->writeQueue.Wait(p->lock) != OK) {
                     p->lock.Unlock();
-                    return ErrorInvalidBuffer;
+                    return written > 0 ? written : ErrorInterrupted;
                 }
+                continue;
+            }
 
-                p->writePos += rem;
+            uint64 count = rem < space ? rem : space;
+            if(!CopyToPipe(p, realBuffer + written, count)) {
                 p->lock.Unlock();
-                return rem;
+                return ErrorInvalidBuffer;
             }
+            p->writePos += count;
+            written += count;
+
+            p->readQueue.WakeAll();
         }
-    }
-    uint64 PipeFS::WriteNodeData(Node* node, uint64 pos, const void* buffer, uint64 bufferSize) {
-        char* realBuffer = (char*)buffer;
 
-        m_PipesLock.Spinlock();
-        Pipe* p = m_Pipes[node->id];
-        m_PipesLock.Unlock();
+        p->lock.Unlock();
+        return written;
+    }
+    void PipeFS::ClearNodeData(Node* node) { }
 
-        uint64 res = 0;
-        while(true) {
-            uint64 count = _Write(p, realBuffer + res, bufferSize - res);
-            if(count == ErrorInvalidBuffer)
-                return ErrorInvalidBuffer;
-            res += count;
-            if(res == bufferSize)
-                break;
+    void PipeFS::CloseNodeDescriptor(Node* node, uint8 permissions) {
+        Pipe* p = GetPipe(node);
 
-            Scheduler::ThreadYield();
+        p->lock.Spinlock();
+        if(permissions & Permissions::Read) {
+            p->readers--;
+            // Writers have to notice that nobody reads anymore
+            if(p->readers == 0)
+                p->writeQueue.WakeAll();
         }
+        if(permissions & Permissions::Write) {
+            p->writers--;
+            // Readers have to notice the end of file
+            if(p->writers == 0)
+                p->readQueue.WakeAll();
+        }
+        p->lock.Unlock();
+    }
+
+    uint64 PipeFS::SetCapacity(Node* node, uint64 capacity) {
+        Pipe* p = GetPipe(node);
+
+        if(capacity > PipeMaxCapacity)
+            capacity = PipeMaxCapacity;
+        uint64 maxPages = NUM_PAGES(capacity);
+        if(maxPages == 0)
+            maxPages = 1;
 
-        return bufferSize;
+        p->lock.Spinlock();
+        uint64 usedPages = NUM_PAGES(p->writePos - p->readPos);
+        if(maxPages < usedPages)
+            maxPages = usedPages;
+        p->maxPages = maxPages;
+
+        if(p->numPages > maxPages)
+            Resize(p, maxPages);
+        p->writeQueue.WakeAll();
+        p->lock.Unlock();
+
+        return maxPages * 4096;
     }
-    void PipeFS::ClearNodeData(Node* node) { }
 
-}
\ No newline at end of file
+}
@@ -2,18 +2,37 @@
 
 #include "FileSystem.h"
 #include "locks/StickyLock.h"
-
-#include <vector>
+#include "locks/WaitQueue.h"
+#include "atomic/Atomics.h"
 
 namespace VFS {
 
+    // Writes of at most this size are never interleaved with other writes
+    constexpr uint64 PipeAtomicWriteSize = 4096;
+    // A pipe starts with a single page and grows on demand up to its maximum capacity
+    constexpr uint64 PipeDefaultMaxCapacity = 64 * 1024;
+    constexpr uint64 PipeMaxCapacity = 1024 * 1024;
+
+    /**
+     * Every pipe node points to its Pipe through fsData.
+     * All accesses to the pipe data are synchronized by the pipe's own lock.
+     **/
     struct Pipe {
-        uint64 id;
-        bool free;
         StickyLock lock;
+
+        uint64 readers;         // number of open read FileDescriptors
+        uint64 writers;         // number of open write FileDescriptors
+
+        // Ring buffer of numPages pages, the byte at position pos is stored at pages[pos / 4096 % numPages][pos % 4096]
+        uint8** pages;
+        uint64 numPages;
+        uint64 maxPages;
+        // Total number of bytes read from / written to the pipe
         uint64 readPos;
         uint64 writePos;
-        char buffer[4096];
+
+        WaitQueue readQueue;    // readers waiting for data
+        WaitQueue writeQueue;   // writers waiting for space
     };
 
     class PipeFS : public FileSystem {
@@ -22,21 +41,30 @@ namespace VFS {
         void SetMountPoint(MountPoint* mp) override;
         void PrepareUnmount() override;
 
-        void CreateNode(Node* node) override;
+        int64 CreateNode(Node* parent, Node* node) override;
         void DestroyNode(Node* node) override;
 
         void UpdateDir(Node* node) override;
 
         void ReadNode(uint64 id, Node* node) override;
         void WriteNode(Node* node) override;
+        void EvictNode(Node* node) override;
 
         uint64 ReadNodeData(Node* node, uint64 pos, void* buffer, uint64 bufferSize) override;
         uint64 WriteNodeData(Node* node, uint64 pos, const void* buffer, uint64 bufferSize) override;
         void ClearNodeData(Node* node) override;
 
+        void CloseNodeDescriptor(Node* node, uint8 permissions) override;
+
+        /**
+         * Sets the maximum capacity of the pipe, rounded up to whole pages.
+         * The pipe never shrinks below the amount of data it currently holds.
+         * Returns the new maximum capacity.
+         **/
+        uint64 SetCapacity(Node* node, uint64 capacity);
+
     private:
-        StickyLock m_PipesLock;
-        std::vector<Pipe*> m_Pipes;
+        Atomic<uint64> m_NextID = 0;
     };
 
-}
\ No newline at end of file
+}
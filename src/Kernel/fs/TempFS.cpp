@@ -1,22 +1,213 @@
 #include "TempFS.h"
 
 #include "klib/memory.h"
+#include "klib/string.h"
+#include "memory/MemoryManager.h"
+#include "locks/StickyLock.h"
+#include "locks/WaitQueue.h"
 
 #include "init/Init.h"
 
+/**
+ * File data is kept in a radix tree of pages, indexed by the page number within the file.
+ * Every interior node is a page of PageTreeFanout pointers. A tree of height 0 consists of a single data page.
+ * Missing pages are holes and read as zeros. Bytes behind the end of file are always zero.
+ **/
+static constexpr uint64 PageTreeBits = 9;
+static constexpr uint64 PageTreeFanout = 1 << PageTreeBits;
+
+struct PageTree {
+    void* root;
+    uint64 height;
+};
+
 struct TestNode {
     VFS::Node::Type type;
-    VFS::Directory* dir;
     uint64 linkRefCount;
 
+    // The type specific data of the node, which has to be restored when an evicted node is read again
+    VFS::Directory* dir;
+    uint64 driverID;
+    uint64 subID;
+    char* linkPath;
+
     uint64 uid;
     uint64 gid;
     VFS::Permissions perms;
     
+    StickyLock lock;        // protects fileSize, the structure of fileData and the fields below
     uint64 fileSize;
-    char* fileData;
+    PageTree fileData;
+
+    // Reads and writes copy from and to the pages without holding lock, as the copy may fault or block.
+    // They are counted in dataUsers, and pages are only freed while there are none.
+    uint64 dataUsers;
+    bool truncating;
+    WaitQueue dataWaiters;
 };
 
+static const uint8 g_ZeroPage[4096] = { };
+
+/**
+ * Allocates a zeroed page and charges it to usage.
+ * Returns nullptr if the page limit was reached.
+ **/
+static void* AllocTreePage(TempFSUsage& usage) {
+    usage.lock.Spinlock();
+    if(usage.maxPages != 0 && usage.usedPages >= usage.maxPages) {
+        usage.lock.Unlock();
+        return nullptr;
+    }
+    usage.usedPages++;
+    usage.lock.Unlock();
+
+    void* page = MemoryManager::PhysToKernelPtr(MemoryManager::AllocatePages());
+    kmemset(page, 0, 4096);
+    return page;
+}
+static void FreeTreePage(TempFSUsage& usage, void* page) {
+    MemoryManager::FreePages(MemoryManager::KernelToPhysPtr(page));
+
+    usage.lock.Spinlock();
+    usage.usedPages--;
+    usage.lock.Unlock();
+}
+
+// Number of data pages covered by a subtree of the given height
+static uint64 TreeSpan(uint64 height) {
+    return 1ull << (height * PageTreeBits);
+}
+
+/**
+ * Returns the data page with the given index, or nullptr if it does not exist and create is false.
+ * When creating pages, nullptr is returned if the page limit of usage was reached.
+ * The lock of the node owning the tree has to be held.
+ **/
+static uint8* LookupPage(TempFSUsage& usage, PageTree& tree, uint64 index, bool create) {
+    if(index >= TreeSpan(tree.height)) {
+        if(!create)
+            return nullptr;
+
+        // Add levels on top until index fits, the old tree becomes the first child of the new root
+        while(index >= TreeSpan(tree.height)) {
+            if(tree.root != nullptr) {
+                void** newRoot = (void**)AllocTreePage(usage);
+                if(newRoot == nullptr)
+                    return nullptr;
+                newRoot[0] = tree.root;
+                tree.root = newRoot;
+            }
+            tree.height++;
+        }
+    }
+
+    void** slot = &tree.root;
+    for(uint64 level = tree.height; level > 0; level--) {
+        if(*slot == nullptr) {
+            if(!create)
+                return nullptr;
+            if((*slot = AllocTreePage(usage)) == nullptr)
+                return nullptr;
+        }
+        void** node = (void**)*slot;
+        slot = &node[(index >> ((level - 1) * PageTreeBits)) % PageTreeFanout];
+    }
+
+    if(*slot == nullptr) {
+        if(!create)
+            return nullptr;
+        *slot = AllocTreePage(usage);
+    }
+    return (uint8*)*slot;
+}
+
+static void FreeSubtree(TempFSUsage& usage, void* node, uint64 height) {
+    if(height > 0) {
+        void** children = (void**)node;
+        for(uint64 i = 0; i < PageTreeFanout; i++) {
+            if(children[i] != nullptr)
+                FreeSubtree(usage, children[i], height - 1);
+        }
+    }
+    FreeTreePage(usage, node);
+}
+
+/**
+ * Frees every data page with an index of at least first in the subtree at slot, which covers the pages starting at base.
+ **/
+static void TruncateSubtree(TempFSUsage& usage, void** slot, uint64 height, uint64 base, uint64 first) {
+    if(*slot == nullptr)
+        return;
+
+    if(first <= base) {
+        FreeSubtree(usage, *slot, height);
+        *slot = nullptr;
+        return;
+    }
+    if(height == 0 || first >= base + TreeSpan(height))
+        return;
+
+    void** node = (void**)*slot;
+    uint64 childSpan = TreeSpan(height - 1);
+    for(uint64 i = 0; i < PageTreeFanout; i++)
+        TruncateSubtree(usage, &node[i], height - 1, base + i * childSpan, first);
+}
+
+/**
+ * Shrinks the file to newSize bytes and frees the pages that are not needed anymore.
+ * The lock of refNode has to be held.
+ **/
+static void TruncateData(TempFSUsage& usage, TestNode* refNode, uint64 newSize) {
+    PageTree& tree = refNode->fileData;
+
+    TruncateSubtree(usage, &tree.root, tree.height, 0, NUM_PAGES(newSize));
+    if(tree.root == nullptr)
+        tree.height = 0;
+
+    // Keep the bytes behind the end of file zeroed
+    if(newSize % 4096 != 0) {
+        uint8* page = LookupPage(usage, tree, newSize / 4096, false);
+        if(page != nullptr)
+            kmemset(page + newSize % 4096, 0, 4096 - newSize % 4096);
+    }
+
+    refNode->fileSize = newSize;
+}
+
+static void BeginDataAccess(TestNode* refNode) {
+    refNode->lock.Spinlock();
+    while(refNode->truncating)
+        refNode->dataWaiters.Wait(refNode->lock);
+    refNode->dataUsers++;
+    refNode->lock.Unlock();
+}
+static void EndDataAccess(TestNode* refNode) {
+    refNode->lock.Spinlock();
+    refNode->dataUsers--;
+    if(refNode->dataUsers == 0 && refNode->truncating)
+        refNode->dataWaiters.WakeAll();
+    refNode->lock.Unlock();
+}
+
+/**
+ * Same as TruncateData, but waits until no read or write uses the pages anymore.
+ * New reads and writes wait until the truncation is done.
+ **/
+static void TruncateDataSafe(TempFSUsage& usage, TestNode* refNode, uint64 newSize) {
+    refNode->lock.Spinlock();
+    while(refNode->truncating)
+        refNode->dataWaiters.Wait(refNode->lock);
+    refNode->truncating = true;
+    while(refNode->dataUsers > 0)
+        refNode->dataWaiters.Wait(refNode->lock);
+
+    TruncateData(usage, refNode, newSize);
+
+    refNode->truncating = false;
+    refNode->dataWaiters.WakeAll();
+    refNode->lock.Unlock();
+}
+
 static VFS::FileSystem* TempFSFactory() {
     return new TempFS();
 }
@@ -41,6 +232,11 @@ TempFS::TempFS() {
     node->perms.specialFlags = 0;
     
     m_RootNodeID = (uint64)node;
+
+    m_Usage.usedPages = 0;
+    m_Usage.maxPages = 0;
+    m_Usage.usedNodes = 1;
+    m_Usage.maxNodes = 0;
 }
 
 void TempFS::GetSuperBlock(SuperBlock* sb) {
@@ -53,28 +249,135 @@ void TempFS::PrepareUnmount() {
 
 }
 
-void TempFS::CreateNode(Node* node) {
+/**
+ * Parses a decimal number with an optional K, M or G suffix, stopping at the end of the option
+ **/
+static bool ParseOptionValue(const char*& str, uint64& outValue) {
+    if(*str < '0' || *str > '9')
+        return false;
+
+    uint64 value = 0;
+    while(*str >= '0' && *str <= '9') {
+        value = value * 10 + (*str - '0');
+        str++;
+    }
+
+    switch(*str) {
+    case 'k': case 'K': value *= 1024; str++; break;
+    case 'm': case 'M': value *= 1024 * 1024; str++; break;
+    case 'g': case 'G': value *= 1024 * 1024 * 1024; str++; break;
+    }
+
+    if(*str != ',' && *str != '\0')
+        return false;
+    outValue = value;
+    return true;
+}
+
+int64 TempFS::SetOptions(const char* options) {
+    bool hasSize = false, hasNodes = false;
+    uint64 size = 0, nodes = 0;
+
+    // Parse everything before applying anything, so that invalid options change nothing
+    const char* str = options;
+    while(*str != '\0') {
+        if(kstrcmp(str, 0, 5, "size=") == 0) {
+            str += 5;
+            if(!ParseOptionValue(str, size))
+                return ErrorInvalidMountOptions;
+            hasSize = true;
+        } else if(kstrcmp(str, 0, 10, "nr_inodes=") == 0) {
+            str += 10;
+            if(!ParseOptionValue(str, nodes))
+                return ErrorInvalidMountOptions;
+            hasNodes = true;
+        } else {
+            return ErrorInvalidMountOptions;
+        }
+
+        if(*str == ',')
+            str++;
+    }
+
+    m_Usage.lock.Spinlock();
+    if(hasSize)
+        m_Usage.maxPages = NUM_PAGES(size);
+    if(hasNodes)
+        m_Usage.maxNodes = nodes;
+    m_Usage.lock.Unlock();
+
+    return OK;
+}
+void TempFS::GetStats(FileSystemStats& outStats) {
+    m_Usage.lock.Spinlock();
+    outStats.usedBytes = m_Usage.usedPages * 4096;
+    outStats.maxBytes = m_Usage.maxPages * 4096;
+    outStats.usedNodes = m_Usage.usedNodes;
+    outStats.maxNodes = m_Usage.maxNodes;
+    m_Usage.lock.Unlock();
+}
+
+int64 TempFS::CreateNode(Node* parent, Node* node) {
+    m_Usage.lock.Spinlock();
+    if(m_Usage.maxNodes != 0 && m_Usage.usedNodes >= m_Usage.maxNodes) {
+        m_Usage.lock.Unlock();
+        return ErrorNoSpace;
+    }
+    m_Usage.usedNodes++;
+    m_Usage.lock.Unlock();
+
     TestNode* newNode = new TestNode();
     newNode->dir = nullptr;
+    newNode->driverID = 0;
+    newNode->subID = 0;
+    newNode->linkPath = nullptr;
     newNode->linkRefCount = 0;
     newNode->fileSize = 0;
-    newNode->fileData = nullptr;
+    newNode->fileData.root = nullptr;
+    newNode->fileData.height = 0;
+    newNode->dataUsers = 0;
+    newNode->truncating = false;
     
     node->id = (uint64)newNode;
     node->linkCount.Write(0);
     node->ready = true;
+    return OK;
 }
 void TempFS::DestroyNode(Node* node) {
     TestNode* oldNode = (TestNode*)(node->id);
-    if(oldNode->type == Node::TYPE_FILE && oldNode->fileData != nullptr)
-        delete[] oldNode->fileData;
+    // Only files have pages, the tree of every other node is empty
+    TruncateData(m_Usage, oldNode, 0);
     delete oldNode;
+
+    m_Usage.lock.Spinlock();
+    m_Usage.usedNodes--;
+    m_Usage.lock.Unlock();
 }
 
 void TempFS::ReadNode(uint64 id, VFS::Node* node) {
     TestNode* refNode = (TestNode*)id;
 
-    node->infoFolder.cachedDir = refNode->dir;
+    switch(refNode->type) {
+    case Node::TYPE_FILE:
+        // A node that was evicted and is read again takes its size from the TestNode, which always holds the current size
+        refNode->lock.Spinlock();
+        node->infoFile.fileSize.Write(refNode->fileSize);
+        refNode->lock.Unlock();
+        break;
+    case Node::TYPE_DIRECTORY:
+        node->infoFolder.cachedDir = refNode->dir;
+        break;
+    case Node::TYPE_DEVICE_CHAR:
+    case Node::TYPE_DEVICE_BLOCK:
+        node->infoDevice.driverID = refNode->driverID;
+        node->infoDevice.subID = refNode->subID;
+        break;
+    case Node::TYPE_SYMLINK:
+        node->infoSymlink.linkPath = refNode->linkPath;
+        break;
+    default:
+        break;
+    }
     node->mp = m_MP;
     node->id = id;
     node->linkCount = refNode->linkRefCount;
@@ -87,7 +390,21 @@ void TempFS::ReadNode(uint64 id, VFS::Node* node) {
 void TempFS::WriteNode(Node* node) {
     TestNode* refNode = (TestNode*)(node->id);
 
-    refNode->dir = node->infoFolder.cachedDir;
+    switch(node->type) {
+    case Node::TYPE_DIRECTORY:
+        refNode->dir = node->infoFolder.cachedDir;
+        break;
+    case Node::TYPE_DEVICE_CHAR:
+    case Node::TYPE_DEVICE_BLOCK:
+        refNode->driverID = node->infoDevice.driverID;
+        refNode->subID = node->infoDevice.subID;
+        break;
+    case Node::TYPE_SYMLINK:
+        refNode->linkPath = node->infoSymlink.linkPath;
+        break;
+    default:
+        break;
+    }
     refNode->type = node->type;
     refNode->linkRefCount = node->linkCount.Read();
     refNode->gid = node->ownerGID;
@@ -95,45 +412,144 @@ void TempFS::WriteNode(Node* node) {
     refNode->perms = node->permissions;
 }
 
+void TempFS::EvictNode(Node* node) {
+    // Everything lives in the TestNode, which WriteNode() keeps up to date
+}
+
 void TempFS::UpdateDir(VFS::Node* node) {
 
 }
 
 uint64 TempFS::ReadNodeData(Node* node, uint64 pos, void* buffer, uint64 bufferSize) {
     TestNode* refNode = (TestNode*)(node->id);
+    uint8* realBuffer = (uint8*)buffer;
+
+    BeginDataAccess(refNode);
+
+    refNode->lock.Spinlock();
+    uint64 fileSize = refNode->fileSize;
+    refNode->lock.Unlock();
 
-    uint64 rem = refNode->fileSize - pos;
-    if(rem == 0) // eof
-        return 0;
+    uint64 rem = 0;
+    if(pos < fileSize)
+        rem = fileSize - pos;
     if(rem > bufferSize)
         rem = bufferSize;
 
-    if(!kmemcpy_usersafe(buffer, refNode->fileData + pos, rem))
-        return ErrorInvalidBuffer;
+    uint64 done = 0;
+    while(done < rem) {
+        uint64 offset = (pos + done) % 4096;
+        uint64 count = 4096 - offset;
+        if(count > rem - done)
+            count = rem - done;
+
+        refNode->lock.Spinlock();
+        uint8* page = LookupPage(m_Usage, refNode->fileData, (pos + done) / 4096, false);
+        refNode->lock.Unlock();
+
+        bool ok = page == nullptr ? kmemset_usersafe(realBuffer + done, 0, count) : kmemcpy_usersafe(realBuffer + done, page + offset, count);
+        if(!ok) {
+            EndDataAccess(refNode);
+            return ErrorInvalidBuffer;
+        }
+        done += count;
+    }
+
+    EndDataAccess(refNode);
     return rem;
 }
 uint64 TempFS::WriteNodeData(Node* node, uint64 pos, const void* buffer, uint64 bufferSize) {
     TestNode* refNode = (TestNode*)(node->id);
+    const uint8* realBuffer = (const uint8*)buffer;
+
+    BeginDataAccess(refNode);
+
+    uint64 done = 0;
+    int64 error = OK;
+    while(done < bufferSize) {
+        uint64 offset = (pos + done) % 4096;
+        uint64 count = 4096 - offset;
+        if(count > bufferSize - done)
+            count = bufferSize - done;
 
-    uint64 cap = refNode->fileSize - pos;
-    if(cap < bufferSize) {
-        char* newData = new char[pos + bufferSize];
-        kmemcpy(newData, refNode->fileData, refNode->fileSize);
-        delete[] refNode->fileData;
-        refNode->fileData = newData;
-        refNode->fileSize = pos + bufferSize;
+        refNode->lock.Spinlock();
+        uint8* page = LookupPage(m_Usage, refNode->fileData, (pos + done) / 4096, true);
+        refNode->lock.Unlock();
+
+        if(page == nullptr) {
+            error = ErrorNoSpace;
+            break;
+        }
+        if(!kmemcpy_usersafe(page + offset, realBuffer + done, count)) {
+            error = ErrorInvalidBuffer;
+            break;
+        }
+        done += count;
+    }
+
+    // Only the part that was actually written extends the file
+    refNode->lock.Spinlock();
+    if(done > 0 && pos + done > refNode->fileSize) {
+        refNode->fileSize = pos + done;
         node->infoFile.fileSize.Write(refNode->fileSize);
     }
+    refNode->lock.Unlock();
 
-    if(!kmemcpy_usersafe(refNode->fileData + pos, buffer, bufferSize))
-        return ErrorInvalidBuffer;
+    EndDataAccess(refNode);
+
+    // Running out of space after writing some data is a short write
+    if(error == ErrorNoSpace && done > 0)
+        return done;
+    if(error != OK)
+        return error;
     return bufferSize;
 }
 
-void TempFS::ClearNodeData(VFS::Node* node) {
+uint64 TempFS::SendNodeData(Node* node, uint64 pos, uint64 count, DataSink& sink) {
     TestNode* refNode = (TestNode*)(node->id);
 
-    delete[] refNode->fileData;
-    refNode->fileSize = 0;
-    refNode->fileData = nullptr;
-}
\ No newline at end of file
+    BeginDataAccess(refNode);
+
+    refNode->lock.Spinlock();
+    uint64 fileSize = refNode->fileSize;
+    refNode->lock.Unlock();
+
+    uint64 rem = 0;
+    if(pos < fileSize)
+        rem = fileSize - pos;
+    if(rem > count)
+        rem = count;
+
+    // Give the pages to the sink directly, holes are sent from the zero page
+    int64 done = 0;
+    while((uint64)done < rem) {
+        uint64 offset = (pos + done) % 4096;
+        uint64 chunk = 4096 - offset;
+        if(chunk > rem - done)
+            chunk = rem - done;
+
+        refNode->lock.Spinlock();
+        const uint8* page = LookupPage(m_Usage, refNode->fileData, (pos + done) / 4096, false);
+        refNode->lock.Unlock();
+        if(page == nullptr)
+            page = g_ZeroPage;
+
+        int64 put = sink.Put(page + offset, chunk);
+        if(put < 0) {
+            if(done == 0)
+                done = put;
+            break;
+        }
+        done += put;
+        if((uint64)put < chunk)
+            break;
+    }
+
+    EndDataAccess(refNode);
+    return done;
+}
+
+void TempFS::ClearNodeData(VFS::Node* node) {
+    TestNode* refNode = (TestNode*)(node->id);
+    TruncateDataSafe(m_Usage, refNode, 0);
+}
@@ -1,6 +1,19 @@
 #pragma once
 
 #include "FileSystem.h"
+#include "locks/StickyLock.h"
+
+/**
+ * Memory and node usage of a TempFS, a limit of 0 means that there is no limit.
+ * Every page of file data or of the page trees holding it counts towards the used bytes.
+ **/
+struct TempFSUsage {
+    StickyLock lock;
+    uint64 usedPages;
+    uint64 maxPages;
+    uint64 usedNodes;
+    uint64 maxNodes;
+};
 
 class TempFS : public VFS::FileSystem {
 public:
@@ -10,19 +23,33 @@ public:
     void SetMountPoint(VFS::MountPoint* mp) override;
     void PrepareUnmount() override;
 
-    void CreateNode(VFS::Node* node) override;
+    /**
+     * Supported options:
+     *  size=<bytes>[K|M|G]     maximum amount of memory used for file data
+     *  nr_inodes=<count>       maximum number of nodes
+     * Lowering a limit below the current usage only prevents further allocations.
+     **/
+    int64 SetOptions(const char* options) override;
+    void GetStats(VFS::FileSystemStats& outStats) override;
+
+    int64 CreateNode(VFS::Node* parent, VFS::Node* node) override;
     void DestroyNode(VFS::Node* node) override;
 
     void UpdateDir(VFS::Node* node) override;
     
     void ReadNode(uint64 id, VFS::Node* node) override;
     void WriteNode(VFS::Node* node) override;
+    void EvictNode(VFS::Node* node) override;
 
     virtual uint64 ReadNodeData(VFS::Node* node, uint64 pos, void* buffer, uint64 bufferSize) override;
     virtual uint64 WriteNodeData(VFS::Node* node, uint64 pos, const void* buffer, uint64 bufferSize) override;
     virtual void ClearNodeData(VFS::Node* node) override;
 
+    virtual uint64 SendNodeData(VFS::Node* node, uint64 pos, uint64 count, VFS::DataSink& sink) override;
+
 private:
     uint64 m_RootNodeID;
     VFS::MountPoint* m_MP;
+
+    TempFSUsage m_Usage;
 };
\ No newline at end of file
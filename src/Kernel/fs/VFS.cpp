@@ -13,6 +13,9 @@
 
 #include "MountPoint.h"
 #include "FileSystem.h"
+#include "DentryCache.h"
+
+#include "Config.h"
 
 namespace VFS {
 
@@ -24,6 +27,9 @@ namespace VFS {
         uint8 permissions;
 
         Atomic<uint64> pos;
+
+        // Absolute path of a directory in PreparePath format, nullptr for every other node
+        char* path;
     };
 
     static MountPoint* g_RootMount = nullptr;
@@ -33,13 +39,11 @@ namespace VFS {
         return *path != '/';
     }
 
-    static int64 PrepareRelativePath(char* pathBuffer) {
-        auto tInfo = Scheduler::GetCurrentThreadInfo();
-
+    static int64 PrepareRelativePath(char* pathBuffer, const char* basePath) {
         int lengthA = kstrlen(pathBuffer);
-        int lengthB = kstrlen(tInfo->cwd);
+        int lengthB = kstrlen(basePath);
 
-        // relative path == absolute path (thread cwd is /)
+        // relative path == absolute path (base is /)
         if(lengthB == 0)
             return OK;
 
@@ -47,7 +51,7 @@ namespace VFS {
             return ErrorPathTooLong;
         
         kmemmove(pathBuffer + lengthB + 1, pathBuffer, lengthA);
-        kmemcpy(pathBuffer, tInfo->cwd, lengthB);
+        kmemcpy(pathBuffer, basePath, lengthB);
         pathBuffer[lengthB] = '/';
         pathBuffer[lengthA + lengthB + 1] = '\0';
 
@@ -122,16 +126,21 @@ namespace VFS {
     /**
      * Prepares a path for use with the VFS system by
      *      1. Copying untrusted userPath into pathBuffer
-     *      2. Making path absolute (if it is relative)
+     *      2. Making path absolute (if it is relative), relative paths start at basePath or at the threads cwd
      *      3. Removing unnecessary / . ..
      * Output format: dir/dir2/file (absolute path without leading or trailing slash)
+     * outRelative tells whether userPath was relative, only then may AcquirePath start at the base directory.
      **/
-    static int64 PreparePath(char* pathBuffer, const char* userPath) {
+    static int64 PreparePath(char* pathBuffer, const char* userPath, const char* basePath = nullptr, bool* outRelative = nullptr) {
         if(!kpathcpy_usersafe(pathBuffer, userPath))
             return ErrorInvalidBuffer;
 
-        if(IsPathRelative(pathBuffer)) {
-            auto err = PrepareRelativePath(pathBuffer);
+        bool relative = IsPathRelative(pathBuffer);
+        if(outRelative != nullptr)
+            *outRelative = relative;
+
+        if(relative) {
+            auto err = PrepareRelativePath(pathBuffer, basePath != nullptr ? basePath : Scheduler::GetCurrentThreadInfo()->cwd);
             if(err != OK)
                 return err;
         } else {
@@ -226,31 +235,121 @@ namespace VFS {
         return path;
     }
 
-    static Node* AcquireNode(MountPoint* mp, uint64 nodeID) {
-        mp->nodeCacheLock.Spinlock();
-        for(Node& n : mp->nodeCache) {
-            if(n.id == nodeID) {
-                n.refCount++;
-                mp->nodeCacheLock.Unlock();
-                
-                if(!n.ready) {
-                    n.readyQueue.Lock();   // wait for node to be ready
-                    n.readyQueue.Unlock(); // notify next waiting thread
-                }
+    static NodeCacheBucket& GetNodeBucket(MountPoint* mp, uint64 nodeID) {
+        // TempFS uses pointers as IDs, so the low bits are mostly zero
+        uint64 hash = nodeID * 0x9E3779B97F4A7C15;
+        return mp->nodeCache[(hash >> 32) % MountPoint::NodeCacheBuckets];
+    }
 
+    static Node* FindCachedNode(NodeCacheBucket& bucket, uint64 nodeID) {
+        for(Node& n : bucket.nodes) {
+            if(n.id == nodeID)
                 return &n;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Writes back and evicts a node that was marked as evicting, the node is only removed from its bucket afterwards
+     * so that AcquireNode cannot read it again before the file system is done with it
+     **/
+    static void FreeCachedNode(Node* node) {
+        if(node->dirty)
+            node->mp->fs->WriteNode(node);
+        node->mp->fs->EvictNode(node);
+
+        auto& bucket = GetNodeBucket(node->mp, node->id);
+        bucket.lock.Spinlock();
+        bucket.nodes.erase(node);
+        bucket.evictQueue.WakeAll();
+        bucket.lock.Unlock();
+
+        delete node;
+    }
+
+    /**
+     * Evicts least recently used unreferenced nodes of mp until at most maxNodes are left
+     **/
+    static void ShrinkNodeCache(MountPoint* mp, uint64 maxNodes) {
+        while(true) {
+            mp->lruLock.Spinlock();
+            if(mp->lruSize <= maxNodes) {
+                mp->lruLock.Unlock();
+                return;
+            }
+            uint64 victimID = mp->lru.front().id;
+            mp->lruLock.Unlock();
+
+            // The victim may have been reused or freed while no lock was held, so look it up again
+            auto& bucket = GetNodeBucket(mp, victimID);
+            bucket.lock.Spinlock();
+            Node* victim = FindCachedNode(bucket, victimID);
+            if(victim == nullptr) {
+                bucket.lock.Unlock();
+                continue;
+            }
+
+            mp->lruLock.Spinlock();
+            if(!victim->inLRU) {
+                mp->lruLock.Unlock();
+                bucket.lock.Unlock();
+                continue;
+            }
+            mp->lru.erase(victim);
+            victim->inLRU = false;
+            mp->lruSize--;
+            mp->lruLock.Unlock();
+
+            victim->evicting = true;
+            bucket.lock.Unlock();
+
+            FreeCachedNode(victim);
+        }
+    }
+
+    static Node* AcquireNode(MountPoint* mp, uint64 nodeID) {
+        auto& bucket = GetNodeBucket(mp, nodeID);
+
+        bucket.lock.Spinlock();
+        Node* n = FindCachedNode(bucket, nodeID);
+        // The node may still be written back, so it can only be read again once it is gone
+        while(n != nullptr && n->evicting) {
+            bucket.evictQueue.Wait(bucket.lock);
+            n = FindCachedNode(bucket, nodeID);
+        }
+        if(n != nullptr) {
+            if(n->refCount == 0) {
+                mp->lruLock.Spinlock();
+                if(n->inLRU) {
+                    mp->lru.erase(n);
+                    n->inLRU = false;
+                    mp->lruSize--;
+                }
+                mp->lruLock.Unlock();
+            }
+            n->refCount++;
+            bucket.lock.Unlock();
+            
+            if(!n->ready) {
+                n->readyQueue.Lock();   // wait for node to be ready
+                n->readyQueue.Unlock(); // notify next waiting thread
             }
+
+            return n;
         }
 
         auto newNode = new Node();
         newNode->id = nodeID;
         newNode->mp = mp;
         newNode->refCount = 1;
+        newNode->inLRU = false;
+        newNode->dirty = false;
+        newNode->evicting = false;
         newNode->ready = false;
         newNode->readyQueue.Lock();
         newNode->dirLock.Unlock_Raw();
-        mp->nodeCache.push_back(newNode);
-        mp->nodeCacheLock.Unlock();
+        bucket.nodes.push_back(newNode);
+        bucket.lock.Unlock();
 
         mp->fs->ReadNode(nodeID, newNode);
         newNode->ready = true;
@@ -259,46 +358,46 @@ namespace VFS {
     }
 
     static void ReleaseNode(Node* node, bool decrement = true) {
-        node->mp->nodeCacheLock.Spinlock();
+        MountPoint* mp = node->mp;
+        auto& bucket = GetNodeBucket(mp, node->id);
+
+        bucket.lock.Spinlock();
 
         if(decrement)
             node->refCount--;
 
+        if(node->refCount != 0) {
+            bucket.lock.Unlock();
+            return;
+        }
+
         // Since linkCount only ever changes if refCount != 0, and refCount cannot change, this test is safe
-        if(node->refCount == 0 && node->linkCount.Read() == 0) {
-            node->mp->nodeCache.erase(node);
-            node->mp->nodeCacheLock.Unlock();
+        if(node->linkCount.Read() == 0) {
+            bucket.nodes.erase(node);
+            bucket.lock.Unlock();
 
-            node->mp->fs->DestroyNode(node);
+            mp->fs->DestroyNode(node);
             delete node;
-        } else {
-            node->mp->nodeCacheLock.Unlock();
+            return;
         }
-    }
-
-    static bool PathWalk(const char** pathPtr, const char* entry) {
-        const char* path = *pathPtr;
 
-        while(true) {
-            if(*entry == '\0') {
-                if(*path == '/') {
-                    path++;
-                    *pathPtr = path;
-                    return true;
-                } else if(*path == '\0') {
-                    *pathPtr = path;
-                    return true;
-                } else {
-                    return false;
-                }
-            }
+        mp->lruLock.Spinlock();
+        mp->lru.push_back(node);
+        node->inLRU = true;
+        mp->lruSize++;
+        bool shrink = mp->lruSize > config_NodeCacheLRUSize;
+        mp->lruLock.Unlock();
+        bucket.lock.Unlock();
 
-            if(*entry != *path)
-                return false;
+        if(shrink)
+            ShrinkNodeCache(mp, config_NodeCacheLRUSize);
+    }
 
-            entry++;
-            path++;
-        }
+    static uint64 GetPathEntryLength(const char* path) {
+        uint64 l = 0;
+        while(path[l] != '\0' && path[l] != '/')
+            l++;
+        return l;
     }
 
     static bool IsLastPathEntry(const char* path) {
@@ -338,9 +437,25 @@ namespace VFS {
         node->mp->fs->UpdateDir(node);
         return node->infoFolder.cachedDir;
     }
+    /**
+     * Has to be called before the node's dirLock is taken to look up name in GetNodeDir(node),
+     * or with name == nullptr before the whole directory is used.
+     **/
+    static void LoadNodeDir(Node* node, const char* name = nullptr, uint64 nameLength = 0) {
+        node->mp->fs->LoadDirEntries(node, name, nameLength);
+    }
+    /**
+     * Has to be called after entries of GetNodeDir(node) were added or removed, once the node's dirLock was released
+     **/
+    static void NodeDirChanged(Node* node) {
+        node->mp->fs->DirEntriesChanged(node);
+    }
 
-    static int64 _AcquirePathRec(uint64 uid, uint64 gid, MountPoint* mp, const char*& pathBuffer, bool fileHasToExist, bool deleteMode, Node*& outNode, Node*& outParent) {
-        auto currentNode = AcquireNode(mp, mp->sb.rootNode);
+    /**
+     * Walks pathBuffer starting at startNode, which is consumed, or at the root of mp if startNode is nullptr
+     **/
+    static int64 _AcquirePathRec(uint64 uid, uint64 gid, MountPoint* mp, Node* startNode, const char*& pathBuffer, bool fileHasToExist, bool deleteMode, Node*& outNode, Node*& outParent) {
+        auto currentNode = startNode != nullptr ? startNode : AcquireNode(mp, mp->sb.rootNode);
 
         if(pathBuffer[0] == '\0') {
             outNode = currentNode;
@@ -358,34 +473,56 @@ namespace VFS {
                 return ErrorPermissionDenied;
             }
 
+            const char* name = pathBuffer;
+            uint64 nameLength = GetPathEntryLength(name);
+
+            LoadNodeDir(currentNode, name, nameLength);
             currentNode->dirLock.Spinlock();
-            auto dir = GetNodeDir(currentNode);
+            uint64 nid;
+            bool found = false;
+            auto cached = DentryCache::Lookup(mp, currentNode->id, name, nameLength, nid);
+            if(cached == DentryCache::LOOKUP_FOUND) {
+                found = true;
+                pathBuffer += nameLength;
+                if(*pathBuffer == '/')
+                    pathBuffer++;
+            } else if(cached == DentryCache::LOOKUP_MISS) {
+                uint64 generation = DentryCache::GetGeneration();
+                auto dir = GetNodeDir(currentNode);
+                auto entry = dir->FindEntry(name, nameLength);
+                if(entry != nullptr) {
+                    nid = entry->nodeID;
+                    found = true;
+                    pathBuffer += nameLength;
+                    if(*pathBuffer == '/')
+                        pathBuffer++;
+                    DentryCache::Insert(mp, currentNode->id, name, nameLength, nid, generation);
+                } else {
+                    DentryCache::InsertNegative(mp, currentNode->id, name, nameLength, generation);
+                }
+            }
+
             Node* next = nullptr;
-            for(uint64 i = 0; i < dir->numEntries; i++) {
-                if(PathWalk(&pathBuffer, dir->entries[i].name)) {
-                    uint64 nid = dir->entries[i].nodeID;
-                    currentNode->dirLock.Unlock();
-                    next = AcquireNode(mp, nid);
-
-                    if(deleteMode && *pathBuffer == '\0') {
-                        outNode = next;
-                        outParent = currentNode;
-                        return OK;
-                    }
-
-                    if(next->type == Node::TYPE_SYMLINK) {
-                        outNode = next;
-                        outParent = currentNode;
-                        return ErrorEncounteredSymlink;
-                    }
-
-                    if(*pathBuffer == '\0') {
-                        outNode = next;
-                        outParent = currentNode;
-                        return OK;
-                    }
+            if(found) {
+                currentNode->dirLock.Unlock();
+                next = AcquireNode(mp, nid);
 
-                    break;
+                if(deleteMode && *pathBuffer == '\0') {
+                    outNode = next;
+                    outParent = currentNode;
+                    return OK;
+                }
+
+                if(next->type == Node::TYPE_SYMLINK) {
+                    outNode = next;
+                    outParent = currentNode;
+                    return ErrorEncounteredSymlink;
+                }
+
+                if(*pathBuffer == '\0') {
+                    outNode = next;
+                    outParent = currentNode;
+                    return OK;
                 }
             }
 
@@ -407,14 +544,50 @@ namespace VFS {
     }
 
     /**
-     * If outParent is nullptr, outNode has to be a mountPoint
+     * Returns the part of path behind the directory dirPath, or nullptr if path is not below dirPath.
+     * Both paths have to be in PreparePath format.
      **/
-    static int64 AcquirePath(uint64 uid, uint64 gid, MountPoint*& outMP, char*& inOutPathBuffer, bool fileHasToExist, bool deleteMode, Node*& outNode, Node*& outParent) {
+    static const char* GetPathBelow(const char* path, const char* dirPath) {
+        if(*dirPath == '\0')
+            return *path != '\0' ? path : nullptr;
+
+        while(*dirPath != '\0') {
+            if(*path != *dirPath)
+                return nullptr;
+            path++;
+            dirPath++;
+        }
+        if(*path != '/' || path[1] == '\0')
+            return nullptr;
+        return path + 1;
+    }
+
+    /**
+     * If outParent is nullptr, outNode has to be a mountPoint.
+     * If the path was relative when it was passed to PreparePath, lies below the directory of base (the threads cwd
+     * if base is nullptr) and no other FileSystem is mounted in between, the walk starts at that directory instead of
+     * the root of the mount point. Absolute paths always start at the root, even if the base directory was deleted.
+     **/
+    static int64 AcquirePath(uint64 uid, uint64 gid, MountPoint*& outMP, char*& inOutPathBuffer, bool fileHasToExist, bool deleteMode, Node*& outNode, Node*& outParent, bool relative = false, FileDescriptor* base = nullptr) {
         MountPoint* mp = FindMountPoint(inOutPathBuffer);
         const char* currentPath = AdvancePath(inOutPathBuffer, mp->path);
 
+        if(!relative)
+            base = nullptr;
+        else if(base == nullptr)
+            base = (FileDescriptor*)Scheduler::GetCurrentThreadInfo()->cwdDesc;
+
+        Node* startNode = nullptr;
+        if(base != nullptr && base->node->mp == mp) {
+            const char* rest = GetPathBelow(inOutPathBuffer, base->path);
+            if(rest != nullptr) {
+                startNode = AcquireNode(mp, base->node->id);
+                currentPath = rest;
+            }
+        }
+
         int64 error;
-        while((error = _AcquirePathRec(uid, gid, mp, currentPath, fileHasToExist, deleteMode, outNode, outParent)) == ErrorEncounteredSymlink) {
+        while((error = _AcquirePathRec(uid, gid, mp, startNode, currentPath, fileHasToExist, deleteMode, outNode, outParent)) == ErrorEncounteredSymlink) {
             const char* linkPath = outNode->infoSymlink.linkPath;
             const char* restPath = currentPath;
 
@@ -442,6 +615,7 @@ namespace VFS {
             ReleaseMountPoint(mp);
             mp = FindMountPoint(inOutPathBuffer);
             currentPath = AdvancePath(inOutPathBuffer, mp->path);
+            startNode = nullptr;
         }
 
         if(error == OK) {
@@ -454,18 +628,51 @@ namespace VFS {
         }
     }
 
-    static Node* CreateNode(MountPoint* mp, uint64 softRefs = 1) {
+    /**
+     * Returns the FileDescriptor that lookups of an *At function start at, or nullptr if they start at the threads cwd
+     **/
+    static int64 GetBaseDescriptor(uint64 dirDesc, FileDescriptor*& outBase) {
+        outBase = (FileDescriptor*)dirDesc;
+        if(outBase != nullptr && outBase->node->type != Node::TYPE_DIRECTORY)
+            return ErrorNotAFolder;
+        return OK;
+    }
+    /**
+     * Translates the directory descriptor of an *at syscall, DirFD_CWD becomes 0
+     **/
+    static int64 GetDirFileDescriptor(int64 dirFD, uint64& outDesc) {
+        if(dirFD == DirFD_CWD) {
+            outDesc = 0;
+            return OK;
+        }
+        return Scheduler::ThreadGetSystemFileDescriptor(dirFD, outDesc);
+    }
+
+    /**
+     * Creates a node of the given type on mp, parent is the directory the node will be linked into or nullptr
+     **/
+    static int64 CreateNode(MountPoint* mp, Node* parent, Node::Type type, Node*& outNode, uint64 softRefs = 1) {
         auto newNode = new Node();
-        mp->fs->CreateNode(newNode);
+        newNode->type = type;
+        int64 error = mp->fs->CreateNode(parent, newNode);
+        if(error != OK) {
+            delete newNode;
+            return error;
+        }
         newNode->refCount = softRefs;
         newNode->mp = mp;
+        newNode->inLRU = false;
+        newNode->dirty = true;
+        newNode->evicting = false;
         newNode->dirLock.Unlock_Raw();
 
-        mp->nodeCacheLock.Spinlock();
-        mp->nodeCache.push_back(newNode);
-        mp->nodeCacheLock.Unlock();
+        auto& bucket = GetNodeBucket(mp, newNode->id);
+        bucket.lock.Spinlock();
+        bucket.nodes.push_back(newNode);
+        bucket.lock.Unlock();
 
-        return newNode;
+        outNode = newNode;
+        return OK;
     }
 
     void Init(FileSystem* rootFS) {
@@ -485,7 +692,8 @@ namespace VFS {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        if((error = PreparePath(cleanBuffer, path, nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -496,7 +704,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* parentNode;
         Node* fileNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, false, false, fileNode, parentNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, false, false, fileNode, parentNode, relative);
         if(error != OK)
             return error;
         if(parentNode == nullptr) {
@@ -516,23 +724,27 @@ namespace VFS {
             return ErrorPermissionDenied;
         }
 
-        auto newNode = CreateNode(mp);
+        Node* newNode;
+        if((error = CreateNode(mp, parentNode, Node::TYPE_FILE, newNode)) != OK) {
+            ReleaseNode(parentNode);
+            ReleaseMountPoint(mp);
+            return error;
+        }
         newNode->linkCount.Write(1);
-        newNode->type = Node::TYPE_FILE;
         newNode->infoFile.fileSize = 0;
         newNode->ownerGID = gid;
         newNode->ownerUID = uid;
         newNode->permissions = perms;
 
+        LoadNodeDir(parentNode);
         parentNode->dirLock.Spinlock();
         auto dir = GetNodeDir(parentNode);
-        DirectoryEntry* newEntry;
-        Directory::AddEntry(&dir, &newEntry);
-        parentNode->infoFolder.cachedDir = dir;
-        
-        newEntry->nodeID = newNode->id;
-        kstrcpy(newEntry->name, tmpPath);
+        uint64 nameLength = kstrlen(tmpPath);
+        dir->AddEntry(tmpPath, nameLength, newNode->id);
+        parentNode->dirty = true;
+        DentryCache::Insert(mp, parentNode->id, tmpPath, nameLength, newNode->id, DentryCache::GetGeneration());
         parentNode->dirLock.Unlock();
+        NodeDirChanged(parentNode);
 
         ReleaseNode(parentNode);
         ReleaseNode(newNode);
@@ -551,7 +763,8 @@ namespace VFS {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        if((error = PreparePath(cleanBuffer, path, nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -562,7 +775,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* parentNode;
         Node* fileNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, false, false, fileNode, parentNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, false, false, fileNode, parentNode, relative);
         if(error != OK)
             return error;
         if(parentNode == nullptr) {
@@ -582,23 +795,27 @@ namespace VFS {
             return ErrorPermissionDenied;
         }
 
-        auto newNode = CreateNode(mp);
+        Node* newNode;
+        if((error = CreateNode(mp, parentNode, Node::TYPE_DIRECTORY, newNode)) != OK) {
+            ReleaseNode(parentNode);
+            ReleaseMountPoint(mp);
+            return error;
+        }
         newNode->linkCount.Write(1);
-        newNode->type = Node::TYPE_DIRECTORY;
         newNode->infoFolder.cachedDir = Directory::Create(10);
         newNode->ownerGID = gid;
         newNode->ownerUID = uid;
         newNode->permissions = perms;
 
+        LoadNodeDir(parentNode);
         parentNode->dirLock.Spinlock();
         auto dir = GetNodeDir(parentNode);
-        DirectoryEntry* newEntry;
-        Directory::AddEntry(&dir, &newEntry);
-        parentNode->infoFolder.cachedDir = dir;
-        
-        newEntry->nodeID = newNode->id;
-        kstrcpy(newEntry->name, tmpPath);
+        uint64 nameLength = kstrlen(tmpPath);
+        dir->AddEntry(tmpPath, nameLength, newNode->id);
+        parentNode->dirty = true;
+        DentryCache::Insert(mp, parentNode->id, tmpPath, nameLength, newNode->id, DentryCache::GetGeneration());
         parentNode->dirLock.Unlock();
+        NodeDirChanged(parentNode);
 
         ReleaseNode(parentNode);
         ReleaseNode(newNode);
@@ -617,7 +834,8 @@ namespace VFS {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        if((error = PreparePath(cleanBuffer, path, nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -628,7 +846,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* parentNode;
         Node* fileNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, false, false, fileNode, parentNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, false, false, fileNode, parentNode, relative);
         if(error != OK)
             return error;
         if(parentNode == nullptr) {
@@ -650,24 +868,29 @@ namespace VFS {
 
         auto driver = DeviceDriverRegistry::GetDriver(driverID);
 
-        auto newNode = CreateNode(mp);
+        Node* newNode;
+        Node::Type type = driver->GetType() == DeviceDriver::TYPE_BLOCK ? Node::TYPE_DEVICE_BLOCK : Node::TYPE_DEVICE_CHAR;
+        if((error = CreateNode(mp, parentNode, type, newNode)) != OK) {
+            ReleaseNode(parentNode);
+            ReleaseMountPoint(mp);
+            return error;
+        }
         newNode->linkCount.Write(1);
-        newNode->type = driver->GetType() == DeviceDriver::TYPE_BLOCK ? Node::TYPE_DEVICE_BLOCK : Node::TYPE_DEVICE_CHAR;
         newNode->infoDevice.driverID = driverID;
         newNode->infoDevice.subID = subID;
         newNode->ownerGID = gid;
         newNode->ownerUID = uid;
         newNode->permissions = perms;
 
+        LoadNodeDir(parentNode);
         parentNode->dirLock.Spinlock();
         auto dir = GetNodeDir(parentNode);
-        DirectoryEntry* newEntry;
-        Directory::AddEntry(&dir, &newEntry);
-        parentNode->infoFolder.cachedDir = dir;
-        
-        newEntry->nodeID = newNode->id;
-        kstrcpy(newEntry->name, tmpPath);
+        uint64 nameLength = kstrlen(tmpPath);
+        dir->AddEntry(tmpPath, nameLength, newNode->id);
+        parentNode->dirty = true;
+        DentryCache::Insert(mp, parentNode->id, tmpPath, nameLength, newNode->id, DentryCache::GetGeneration());
         parentNode->dirLock.Unlock();
+        NodeDirChanged(parentNode);
 
         ReleaseNode(parentNode);
         ReleaseNode(newNode);
@@ -683,20 +906,24 @@ namespace VFS {
     }
 
     int64 CreatePipe(uint64* readDesc, uint64* writeDesc) {
-        auto pipeNode = CreateNode(g_PipeMount, 2);
-        pipeNode->type = Node::TYPE_PIPE;
+        Node* pipeNode;
+        int64 error = CreateNode(g_PipeMount, nullptr, Node::TYPE_PIPE, pipeNode, 2);
+        if(error != OK)
+            return error;
 
         FileDescriptor* descRead = new FileDescriptor();
         descRead->node = pipeNode;
         descRead->pos = 0;
         descRead->refCount = 1;
         descRead->permissions = Permissions::Read;
+        descRead->path = nullptr;
 
         FileDescriptor* descWrite = new FileDescriptor();
         descWrite->node = pipeNode;
         descWrite->pos = 0;
         descWrite->refCount = 1;
         descWrite->permissions = Permissions::Write;
+        descWrite->path = nullptr;
 
         *readDesc = (uint64)descRead;
         *writeDesc = (uint64)descWrite;
@@ -707,16 +934,49 @@ namespace VFS {
         uint64 sysRead, sysWrite;
 
         VFS::CreatePipe(&sysRead, &sysWrite);
-        *readDesc = Scheduler::ThreadAddFileDescriptor(sysRead);
-        *writeDesc = Scheduler::ThreadAddFileDescriptor(sysWrite);
+        int64 read = Scheduler::ThreadAddFileDescriptor(sysRead);
+        if(read < 0) {
+            VFS::Close(sysRead);
+            VFS::Close(sysWrite);
+            return read;
+        }
+        int64 write = Scheduler::ThreadAddFileDescriptor(sysWrite);
+        if(write < 0) {
+            Scheduler::ThreadCloseFileDescriptor(read);
+            VFS::Close(sysWrite);
+            return write;
+        }
+
+        *readDesc = read;
+        *writeDesc = write;
         return 0;
     }
 
+    int64 SetPipeCapacity(uint64 descID, uint64 capacity) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        if(desc == nullptr)
+            return ErrorInvalidFD;
+
+        if(desc->node->mp != g_PipeMount)
+            return ErrorInvalidFD;
+
+        return ((PipeFS*)g_PipeMount->fs)->SetCapacity(desc->node, capacity);
+    }
+    SYSCALL_DEFINE2(syscall_pipe_capacity, int64 desc, uint64 capacity) {
+        uint64 sysDesc;
+        int64 error = Scheduler::ThreadGetSystemFileDescriptor(desc, sysDesc);
+        if(error != OK)
+            return error;
+
+        return SetPipeCapacity(sysDesc, capacity);
+    }
+
     int64 CreateSymLink(const char* path, const Permissions& permissions, const char* linkPath) {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        if((error = PreparePath(cleanBuffer, path, nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -727,7 +987,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* parentNode;
         Node* linkNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, false, false, linkNode, parentNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, false, false, linkNode, parentNode, relative);
         if(error != OK)
             return error;
         if(parentNode == nullptr) {
@@ -747,24 +1007,28 @@ namespace VFS {
             return ErrorPermissionDenied;
         }
 
-        auto newNode = CreateNode(mp);
+        Node* newNode;
+        if((error = CreateNode(mp, parentNode, Node::TYPE_SYMLINK, newNode)) != OK) {
+            ReleaseNode(parentNode);
+            ReleaseMountPoint(mp);
+            return error;
+        }
         newNode->linkCount.Write(1);
-        newNode->type = Node::TYPE_SYMLINK;
         newNode->infoSymlink.linkPath = new char[kstrlen(linkPath) + 1];
         kmemcpy(newNode->infoSymlink.linkPath, linkPath, kstrlen(linkPath) + 1);
         newNode->ownerUID = uid;
         newNode->ownerGID = gid;
         newNode->permissions = permissions;
 
+        LoadNodeDir(parentNode);
         parentNode->dirLock.Spinlock();
         auto dir = GetNodeDir(parentNode);
-        DirectoryEntry* newEntry;
-        Directory::AddEntry(&dir, &newEntry);
-        parentNode->infoFolder.cachedDir = dir;
-        
-        newEntry->nodeID = newNode->id;
-        kstrcpy(newEntry->name, tmpPath);
+        uint64 nameLength = kstrlen(tmpPath);
+        dir->AddEntry(tmpPath, nameLength, newNode->id);
+        parentNode->dirty = true;
+        DentryCache::Insert(mp, parentNode->id, tmpPath, nameLength, newNode->id, DentryCache::GetGeneration());
         parentNode->dirLock.Unlock();
+        NodeDirChanged(parentNode);
 
         ReleaseNode(parentNode);
         ReleaseNode(newNode);
@@ -783,7 +1047,8 @@ namespace VFS {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, linkPath)) != OK)
+        bool relative;
+        if((error = PreparePath(cleanBuffer, linkPath, nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -794,7 +1059,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* linkParentNode;
         Node* linkFileNode;
-        error = AcquirePath(uid, gid, linkMP, tmpPath, true, false, linkFileNode, linkParentNode);
+        error = AcquirePath(uid, gid, linkMP, tmpPath, true, false, linkFileNode, linkParentNode, relative);
         if(error != OK)
             return error;
         if(linkParentNode != nullptr)
@@ -806,7 +1071,7 @@ namespace VFS {
             return ErrorHardlinkToFolder;
         }
 
-        if((error = PreparePath(cleanBuffer, path)) != OK) {
+        if((error = PreparePath(cleanBuffer, path, nullptr, &relative)) != OK) {
             ReleaseNode(linkFileNode);
             ReleaseMountPoint(linkMP);
             return error;
@@ -816,7 +1081,7 @@ namespace VFS {
         tmpPath = cleanBuffer;
         Node* parentNode;
         Node* fileNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, false, false, fileNode, parentNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, false, false, fileNode, parentNode, relative);
         if(error != OK) {
             ReleaseNode(linkFileNode);
             ReleaseMountPoint(linkMP);
@@ -854,16 +1119,17 @@ namespace VFS {
         }
 
         linkFileNode->linkCount.Inc();
+        linkFileNode->dirty = true;
 
+        LoadNodeDir(parentNode);
         parentNode->dirLock.Spinlock();
         auto dir = GetNodeDir(parentNode);
-        DirectoryEntry* newEntry;
-        Directory::AddEntry(&dir, &newEntry);
-        parentNode->infoFolder.cachedDir = dir;
-
-        newEntry->nodeID = linkFileNode->id;
-        kstrcpy(newEntry->name, tmpPath);
+        uint64 nameLength = kstrlen(tmpPath);
+        dir->AddEntry(tmpPath, nameLength, linkFileNode->id);
+        parentNode->dirty = true;
+        DentryCache::Insert(mp, parentNode->id, tmpPath, nameLength, linkFileNode->id, DentryCache::GetGeneration());
         parentNode->dirLock.Unlock();
+        NodeDirChanged(parentNode);
 
         ReleaseNode(parentNode);
         ReleaseMountPoint(mp);
@@ -882,7 +1148,8 @@ namespace VFS {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        if((error = PreparePath(cleanBuffer, path, nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -893,7 +1160,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* fileNode;
         Node* parentNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, true, true, fileNode, parentNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, true, true, fileNode, parentNode, relative);
         if(error != OK)
             return error;
         // attempting to delete mountpoint
@@ -909,6 +1176,7 @@ namespace VFS {
             return ErrorPermissionDenied;
         }
         if(fileNode->type == Node::TYPE_DIRECTORY) {
+            LoadNodeDir(fileNode);
             fileNode->dirLock.Spinlock();
             auto dir = GetNodeDir(fileNode);
             if(dir->numEntries != 0) {
@@ -923,22 +1191,30 @@ namespace VFS {
 
         const char* fileName = GetFileName(cleanBuffer);
 
+        LoadNodeDir(parentNode);
         parentNode->dirLock.Spinlock();
         auto dir = GetNodeDir(parentNode);
-        for(uint64 i = 0; i < dir->numEntries; i++) {
-            if(kstrcmp(fileName, dir->entries[i].name) == 0) {
-                Directory::RemoveEntry(&dir, i);
-                parentNode->infoFolder.cachedDir = dir;
-                parentNode->dirLock.Unlock();
-                fileNode->linkCount.Dec();
+        uint64 fileNameLength = kstrlen(fileName);
+        if(dir->RemoveEntry(fileName, fileNameLength)) {
+            parentNode->dirty = true;
+            DentryCache::Remove(mp, parentNode->id, fileName, fileNameLength);
+            parentNode->dirLock.Unlock();
+            NodeDirChanged(parentNode);
+            if(fileNode->type == Node::TYPE_DIRECTORY)
+                DentryCache::InvalidateDir(mp, fileNode->id);
+            fileNode->linkCount.Dec();
+            fileNode->dirty = true;
 
-                ReleaseNode(fileNode);
-                ReleaseNode(parentNode);
-                ReleaseMountPoint(mp);
-                return OK;
-            }
+            ReleaseNode(fileNode);
+            ReleaseNode(parentNode);
+            ReleaseMountPoint(mp);
+            return OK;
         }
-        
+        parentNode->dirLock.Unlock();
+
+        ReleaseNode(fileNode);
+        ReleaseNode(parentNode);
+        ReleaseMountPoint(mp);
         return ErrorFileNotFound;
     }
     SYSCALL_DEFINE1(syscall_delete, const char* filePath) {
@@ -952,7 +1228,8 @@ namespace VFS {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        if((error = PreparePath(cleanBuffer, path, nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -963,7 +1240,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* fileNode;
         Node* folderNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, true, false, fileNode, folderNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, true, false, fileNode, folderNode, relative);
         if(error != OK)
             return error;
         if(folderNode != nullptr)
@@ -976,6 +1253,7 @@ namespace VFS {
         
         fileNode->ownerUID = newUID;
         fileNode->ownerGID = newGID;
+        fileNode->dirty = true;
         ReleaseNode(fileNode);
         ReleaseMountPoint(mp);
 
@@ -992,7 +1270,8 @@ namespace VFS {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        if((error = PreparePath(cleanBuffer, path, nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -1003,7 +1282,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* fileNode;
         Node* folderNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, true, false, fileNode, folderNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, true, false, fileNode, folderNode, relative);
         if(error != OK)
             return error;
         if(folderNode != nullptr)
@@ -1015,6 +1294,7 @@ namespace VFS {
         }
         
         fileNode->permissions = permissions;
+        fileNode->dirty = true;
         ReleaseNode(fileNode);
         ReleaseMountPoint(mp);
 
@@ -1027,11 +1307,27 @@ namespace VFS {
         return ChangePermissions(filePath, { ownerPerm, groupPerm, otherPerm });
     }
 
-    int64 Stat(const char* path, NodeStats& outStats, bool followSymlink) {
+    static void FillNodeStats(Node* node, NodeStats& outStats) {
+        outStats.nodeID = node->id;
+        outStats.type = node->type;
+        outStats.ownerGID = node->ownerGID;
+        outStats.ownerUID = node->ownerUID;
+        outStats.permissions = node->permissions;
+        if(outStats.type == Node::TYPE_FILE)
+            outStats.size = node->infoFile.fileSize.Read();
+        else if(outStats.type == Node::TYPE_SYMLINK)
+            kstrcpy(outStats.linkPath, node->infoSymlink.linkPath);
+    }
+
+    int64 StatAt(uint64 dirDesc, const char* path, NodeStats& outStats, bool followSymlink) {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        FileDescriptor* base;
+        if((error = GetBaseDescriptor(dirDesc, base)) != OK)
+            return error;
+        if((error = PreparePath(cleanBuffer, path, base != nullptr ? base->path : nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -1042,27 +1338,22 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* fileNode;
         Node* folderNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, true, !followSymlink, fileNode, folderNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, true, !followSymlink, fileNode, folderNode, relative, base);
         if(error != OK)
             return error;
         if(folderNode != nullptr)
             ReleaseNode(folderNode);
         
-        outStats.nodeID = fileNode->id;
-        outStats.type = fileNode->type;
-        outStats.ownerGID = fileNode->ownerGID;
-        outStats.ownerUID = fileNode->ownerUID;
-        outStats.permissions = fileNode->permissions;
-        if(outStats.type == Node::TYPE_FILE)
-            outStats.size = fileNode->infoFile.fileSize.Read();
-        else if(outStats.type == Node::TYPE_SYMLINK)
-            kstrcpy(outStats.linkPath, fileNode->infoSymlink.linkPath);
+        FillNodeStats(fileNode, outStats);
 
         ReleaseNode(fileNode);
         ReleaseMountPoint(mp);
 
         return OK;
     }
+    int64 Stat(const char* path, NodeStats& outStats, bool followSymlink) {
+        return StatAt(0, path, outStats, followSymlink);
+    }
     SYSCALL_DEFINE2(syscall_stat, const char* path, NodeStats* stats) {
         NodeStats tmp;
 
@@ -1087,12 +1378,100 @@ namespace VFS {
 
         return OK;
     }
+    SYSCALL_DEFINE4(syscall_statat, int64 dirFD, const char* path, NodeStats* stats, bool followSymlink) {
+        uint64 dirDesc;
+        int64 error = GetDirFileDescriptor(dirFD, dirDesc);
+        if(error != OK)
+            return error;
 
-    int64 List(const char* path, int& numEntries, ListEntry* entries) {
+        NodeStats tmp;
+        error = StatAt(dirDesc, path, tmp, followSymlink);
+        if(error != OK)
+            return error;
+
+        if(!kmemcpy_usersafe(stats, &tmp, sizeof(NodeStats)))
+            Scheduler::ThreadExit(1);
+
+        return OK;
+    }
+
+    int64 FStat(uint64 descID, NodeStats& outStats) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        if(desc == nullptr)
+            return ErrorInvalidFD;
+
+        FillNodeStats(desc->node, outStats);
+        return OK;
+    }
+    SYSCALL_DEFINE2(syscall_fstat, int64 fd, NodeStats* stats) {
+        uint64 sysDesc;
+        int64 error = Scheduler::ThreadGetSystemFileDescriptor(fd, sysDesc);
+        if(error != OK)
+            return error;
+
+        NodeStats tmp;
+        FStat(sysDesc, tmp);
+
+        if(!kmemcpy_usersafe(stats, &tmp, sizeof(NodeStats)))
+            Scheduler::ThreadExit(1);
+
+        return OK;
+    }
+
+    int64 StatFS(const char* path, FileSystemStats& outStats) {
+        char cleanBuffer[255];
+
+        int64 error;
+        bool relative;
+        if((error = PreparePath(cleanBuffer, path, nullptr, &relative)) != OK)
+            return error;
+
+        auto tInfo = Scheduler::GetCurrentThreadInfo();
+        uint64 uid = tInfo->uid;
+        uint64 gid = tInfo->gid;
+
+        MountPoint* mp;
+        char* tmpPath = cleanBuffer;
+        Node* fileNode;
+        Node* folderNode;
+        error = AcquirePath(uid, gid, mp, tmpPath, true, false, fileNode, folderNode, relative);
+        if(error != OK)
+            return error;
+        if(folderNode != nullptr)
+            ReleaseNode(folderNode);
+
+        mp->fs->GetStats(outStats);
+
+        ReleaseNode(fileNode);
+        ReleaseMountPoint(mp);
+
+        return OK;
+    }
+    SYSCALL_DEFINE2(syscall_statfs, const char* path, FileSystemStats* stats) {
+        if(!MemoryManager::IsUserPtr(path))
+            Scheduler::ThreadExit(1);
+
+        FileSystemStats tmp;
+
+        int64 error = StatFS(path, tmp);
+        if(error != OK)
+            return error;
+
+        if(!kmemcpy_usersafe(stats, &tmp, sizeof(FileSystemStats)))
+            Scheduler::ThreadExit(1);
+
+        return OK;
+    }
+
+    int64 ListAt(uint64 dirDesc, const char* path, int& numEntries, ListEntry* entries) {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        FileDescriptor* base;
+        if((error = GetBaseDescriptor(dirDesc, base)) != OK)
+            return error;
+        if((error = PreparePath(cleanBuffer, path, base != nullptr ? base->path : nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -1103,7 +1482,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* node;
         Node* parentNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, true, false, node, parentNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, true, false, node, parentNode, relative, base);
         if(error != OK)
             return error;
         if(parentNode != nullptr)
@@ -1121,15 +1500,21 @@ namespace VFS {
             return ErrorPermissionDenied;
         }
 
+        LoadNodeDir(node);
         node->dirLock.Spinlock();
         auto dir = GetNodeDir(node);
         int rem = numEntries;
         if(rem > dir->numEntries)
             rem = dir->numEntries;
 
-        for(int i = 0; i < rem; i++) {
-            int l = kstrlen(dir->entries[i].name) + 1;
-            if(!kmemcpy_usersafe(entries[i].name, dir->entries[i].name, l)) {
+        auto entry = dir->GetFirstEntry();
+        for(int i = 0; i < rem; i++, entry = dir->GetNextEntry(entry)) {
+            // Names longer than a ListEntry can hold are cut off
+            char name[sizeof(ListEntry::name)];
+            uint64 l = entry->nameLength < sizeof(name) ? entry->nameLength : sizeof(name) - 1;
+            kmemcpy(name, dir->GetName(entry), l);
+            name[l] = '\0';
+            if(!kmemcpy_usersafe(entries[i].name, name, l + 1)) {
                 node->dirLock.Unlock();
                 ReleaseNode(node);
                 ReleaseMountPoint(mp);
@@ -1144,6 +1529,9 @@ namespace VFS {
         ReleaseMountPoint(mp);
         return OK;
     }
+    int64 List(const char* path, int& numEntries, ListEntry* entries) {
+        return ListAt(0, path, numEntries, entries);
+    }
     SYSCALL_DEFINE3(syscall_list, const char* path, int* numEntries, ListEntry* entries) {
         int tmpEntries;
         if(!kmemcpy_usersafe(&tmpEntries, numEntries, sizeof(int)))
@@ -1158,23 +1546,179 @@ namespace VFS {
 
         return error;
     }
+    SYSCALL_DEFINE4(syscall_listat, int64 dirFD, const char* path, int* numEntries, ListEntry* entries) {
+        uint64 dirDesc;
+        int64 error = GetDirFileDescriptor(dirFD, dirDesc);
+        if(error != OK)
+            return error;
 
-    int64 Mount(const char* mountPoint, FileSystem* fs) {
-        char cleanBuffer[255];
+        int tmpEntries;
+        if(!kmemcpy_usersafe(&tmpEntries, numEntries, sizeof(int)))
+            Scheduler::ThreadExit(1);
 
-        int64 error;
-        if((error = PreparePath(cleanBuffer, mountPoint)) != OK)
-            return error;
+        error = ListAt(dirDesc, path, tmpEntries, entries);
+        if(error == ErrorInvalidBuffer)
+            Scheduler::ThreadExit(1);
+        
+        if(!kmemcpy_usersafe(numEntries, &tmpEntries, sizeof(int)))
+            Scheduler::ThreadExit(1);
 
-        auto tInfo = Scheduler::GetCurrentThreadInfo();
-        uint64 uid = tInfo->uid;
-        uint64 gid = tInfo->gid;
+        return error;
+    }
 
-        MountPoint* mp;
-        char* tmpPath = cleanBuffer;
-        Node* folderNode;
+    // Entries are copied out of the directory in batches, because nodes cannot be acquired while the dirLock is held
+    static constexpr uint64 DirEntryBatchSize = 16;
+    struct DirEntryBatchEntry {
+        uint64 nodeID;
+        uint64 cookie;
+        uint64 nameLength;
+        char name[256];
+    };
+
+    static uint64 GetDirEntryRecordLength(uint64 nameLength, bool plus) {
+        uint64 length = sizeof(DirEntryRecord) + (plus ? sizeof(NodeStats) : 0) + nameLength + 1;
+        return (length + 7) & ~(uint64)7;
+    }
+
+    int64 GetDirEntries(uint64 descID, void* buffer, uint64 bufferSize, uint64 flags) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        if(desc == nullptr)
+            return ErrorInvalidFD;
+
+        Node* node = desc->node;
+        if(node->type != Node::TYPE_DIRECTORY)
+            return ErrorNotAFolder;
+        if(!(desc->permissions & Permissions::Read))
+            return ErrorPermissionDenied;
+
+        bool plus = flags & GetDirEntries_Plus;
+        uint8* realBuffer = (uint8*)buffer;
+
+        // The position of a directory FileDescriptor is the cookie of the next entry
+        uint64 cookie = desc->pos.Read();
+        uint64 written = 0;
+        bool tooSmall = false;
+        DirEntryBatchEntry* batch = new DirEntryBatchEntry[DirEntryBatchSize];
+
+        while(true) {
+            uint64 count = 0;
+            uint64 batchEnd = written;
+
+            LoadNodeDir(node);
+            node->dirLock.Spinlock();
+            auto dir = GetNodeDir(node);
+            for(auto entry = dir->GetFirstEntry(cookie); entry != nullptr && count < DirEntryBatchSize; entry = dir->GetNextEntry(entry)) {
+                // No FileSystem supports names longer than 255 characters
+                uint64 nameLength = entry->nameLength < 255 ? entry->nameLength : 255;
+                batchEnd += GetDirEntryRecordLength(nameLength, plus);
+                if(batchEnd > bufferSize) {
+                    tooSmall = written == 0 && count == 0;
+                    break;
+                }
+
+                DirEntryBatchEntry& e = batch[count++];
+                e.nodeID = entry->nodeID;
+                e.cookie = entry->cookie;
+                e.nameLength = nameLength;
+                kmemcpy(e.name, dir->GetName(entry), nameLength);
+                e.name[nameLength] = '\0';
+            }
+            node->dirLock.Unlock();
+
+            for(uint64 i = 0; i < count; i++) {
+                DirEntryBatchEntry& e = batch[i];
+
+                Node* entryNode = AcquireNode(node->mp, e.nodeID);
+                DirEntryRecord record;
+                record.recordLength = GetDirEntryRecordLength(e.nameLength, plus);
+                record.nameLength = e.nameLength;
+                record.nodeID = e.nodeID;
+                record.nextOffset = e.cookie + 1;
+                record.type = entryNode->type;
+                record.flags = plus ? DirEntry_HasStats : 0;
+                NodeStats stats;
+                if(plus)
+                    FillNodeStats(entryNode, stats);
+                ReleaseNode(entryNode);
+
+                uint8* dest = realBuffer + written;
+                uint64 offset = sizeof(DirEntryRecord);
+                bool ok = kmemcpy_usersafe(dest, &record, sizeof(DirEntryRecord));
+                if(ok && plus) {
+                    ok = kmemcpy_usersafe(dest + offset, &stats, sizeof(NodeStats));
+                    offset += sizeof(NodeStats);
+                }
+                if(ok)
+                    ok = kmemcpy_usersafe(dest + offset, e.name, e.nameLength + 1);
+                if(!ok) {
+                    delete[] batch;
+                    return ErrorInvalidBuffer;
+                }
+
+                written += record.recordLength;
+                cookie = e.cookie + 1;
+            }
+
+            // A partial batch means that either the directory or the buffer was exhausted
+            if(count < DirEntryBatchSize)
+                break;
+        }
+
+        delete[] batch;
+        desc->pos.Write(cookie);
+
+        if(tooSmall)
+            return ErrorBufferTooSmall;
+        return written;
+    }
+    SYSCALL_DEFINE4(syscall_getdents, int64 fd, void* buffer, uint64 bufferSize, uint64 flags) {
+        if(!MemoryManager::IsUserPtr(buffer))
+            Scheduler::ThreadExit(1);
+
+        uint64 sysDesc;
+        int64 error = Scheduler::ThreadGetSystemFileDescriptor(fd, sysDesc);
+        if(error != OK)
+            return error;
+
+        int64 res = GetDirEntries(sysDesc, buffer, bufferSize, flags);
+        if(res == ErrorInvalidBuffer)
+            Scheduler::ThreadExit(1);
+        return res;
+    }
+
+    int64 Sync(uint64 descID) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        if(desc == nullptr)
+            return ErrorInvalidFD;
+
+        return desc->node->mp->fs->SyncNode(desc->node);
+    }
+    SYSCALL_DEFINE1(syscall_fsync, int64 fd) {
+        uint64 sysDesc;
+        int64 error = Scheduler::ThreadGetSystemFileDescriptor(fd, sysDesc);
+        if(error != OK)
+            return error;
+
+        return Sync(sysDesc);
+    }
+
+    int64 Mount(const char* mountPoint, FileSystem* fs) {
+        char cleanBuffer[255];
+
+        int64 error;
+        bool relative;
+        if((error = PreparePath(cleanBuffer, mountPoint, nullptr, &relative)) != OK)
+            return error;
+
+        auto tInfo = Scheduler::GetCurrentThreadInfo();
+        uint64 uid = tInfo->uid;
+        uint64 gid = tInfo->gid;
+
+        MountPoint* mp;
+        char* tmpPath = cleanBuffer;
+        Node* folderNode;
         Node* fileNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, true, false, fileNode, folderNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, true, false, fileNode, folderNode, relative);
         if(error != OK)
             return error;
         // Trying to mount onto a mountPoint
@@ -1205,7 +1749,7 @@ namespace VFS {
         newMP->refCount = 0;
         newMP->parent = mp;
         fs->GetSuperBlock(&newMP->sb);
-        fs->SetMountPoint(mp);
+        fs->SetMountPoint(newMP);
         
         mp->childMountLock.Spinlock();
         mp->childMounts.push_back(newMP);
@@ -1238,7 +1782,8 @@ namespace VFS {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, devFile)) != OK)
+        bool relative;
+        if((error = PreparePath(cleanBuffer, devFile, nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -1249,7 +1794,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* folderNode;
         Node* fileNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, true, false, fileNode, folderNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, true, false, fileNode, folderNode, relative);
         if(error != OK)
             return error;
         if(folderNode != nullptr)
@@ -1296,6 +1841,38 @@ namespace VFS {
         return error;
     }
 
+    int64 Remount(const char* mountPoint, const char* options) {
+        char cleanBuffer[255];
+        char optionBuffer[255];
+
+        int64 error;
+        if((error = PreparePath(cleanBuffer, mountPoint)) != OK)
+            return error;
+        // The file system parses the options, so it gets a copy that can neither fault nor change underneath it
+        if(!kpathcpy_usersafe(optionBuffer, options))
+            return ErrorInvalidBuffer;
+
+        if(Scheduler::GetCurrentThreadInfo()->uid != 0)
+            return ErrorPermissionDenied;
+
+        auto mp = FindMountPoint(cleanBuffer);
+        auto path = AdvancePath(cleanBuffer, mp->path);
+        if(*path != '\0') {
+            ReleaseMountPoint(mp);
+            return ErrorNotAMountPoint;
+        }
+
+        error = mp->fs->SetOptions(optionBuffer);
+        ReleaseMountPoint(mp);
+        return error;
+    }
+    SYSCALL_DEFINE2(syscall_remount, const char* mountPoint, const char* options) {
+        if(!MemoryManager::IsUserPtr(mountPoint) || !MemoryManager::IsUserPtr(options))
+            Scheduler::ThreadExit(1);
+
+        return Remount(mountPoint, options);
+    }
+
     int64 Unmount(const char* mountPoint) {
         char cleanBuffer[255];
 
@@ -1319,7 +1896,9 @@ namespace VFS {
             mp->parent->childMounts.erase(mp);
             mp->parent->childMountLock.Unlock();
 
+            ShrinkNodeCache(mp, 0);
             mp->fs->PrepareUnmount();
+            DentryCache::InvalidateMount(mp);
 
             delete mp;
             return OK;
@@ -1335,11 +1914,15 @@ namespace VFS {
         return Unmount(path);
     }
 
-    int64 Open(const char* path, uint64 openMode, uint64& fileDesc) {
+    int64 OpenAt(uint64 dirDesc, const char* path, uint64 openMode, uint64& fileDesc) {
         char cleanBuffer[255];
 
         int64 error;
-        if((error = PreparePath(cleanBuffer, path)) != OK)
+        bool relative;
+        FileDescriptor* base;
+        if((error = GetBaseDescriptor(dirDesc, base)) != OK)
+            return error;
+        if((error = PreparePath(cleanBuffer, path, base != nullptr ? base->path : nullptr, &relative)) != OK)
             return error;
 
         auto tInfo = Scheduler::GetCurrentThreadInfo();
@@ -1350,7 +1933,7 @@ namespace VFS {
         char* tmpPath = cleanBuffer;
         Node* folderNode;
         Node* fileNode;
-        error = AcquirePath(uid, gid, mp, tmpPath, (openMode & OpenMode_Create) ? false : true, false, fileNode, folderNode);
+        error = AcquirePath(uid, gid, mp, tmpPath, (openMode & OpenMode_Create) ? false : true, false, fileNode, folderNode, relative, base);
         if(error != OK)
             return error;
 
@@ -1361,9 +1944,12 @@ namespace VFS {
                 return ErrorPermissionDenied;
             }
 
-            fileNode = CreateNode(mp);
+            if((error = CreateNode(mp, folderNode, Node::TYPE_FILE, fileNode)) != OK) {
+                ReleaseNode(folderNode);
+                ReleaseMountPoint(mp);
+                return error;
+            }
             fileNode->linkCount.Write(1);
-            fileNode->type = Node::TYPE_FILE;
             fileNode->infoFile.fileSize.Write(0);
             fileNode->ownerUID = uid;
             fileNode->ownerGID = gid;
@@ -1373,14 +1959,15 @@ namespace VFS {
             fileNode->permissions.otherPermissions &= ~Permissions::Execute;
             fileNode->permissions.specialFlags = 0;
 
+            LoadNodeDir(folderNode);
             folderNode->dirLock.Spinlock();
             auto dir = GetNodeDir(folderNode);
-            DirectoryEntry* newEntry;
-            Directory::AddEntry(&dir, &newEntry);
-            newEntry->nodeID = fileNode->id;
-            kstrcpy(newEntry->name, tmpPath);
-            folderNode->infoFolder.cachedDir = dir;
+            uint64 nameLength = kstrlen(tmpPath);
+            dir->AddEntry(tmpPath, nameLength, fileNode->id);
+            DentryCache::Insert(mp, folderNode->id, tmpPath, nameLength, fileNode->id, DentryCache::GetGeneration());
+            folderNode->dirty = true;
             folderNode->dirLock.Unlock();
+            NodeDirChanged(folderNode);
         } else if(openMode & OpenMode_FailIfExist) {
             if(folderNode != nullptr)
                 ReleaseNode(folderNode);
@@ -1399,7 +1986,8 @@ namespace VFS {
             return ErrorPermissionDenied;
         }
 
-        if(fileNode->type == Node::TYPE_DIRECTORY) {
+        // Directories can only be opened to list them or to start lookups at them
+        if(fileNode->type == Node::TYPE_DIRECTORY && (openMode & (OpenMode_Write | OpenMode_Clear))) {
             ReleaseNode(fileNode);
             ReleaseMountPoint(mp);
             return ErrorOpenFolder;
@@ -1417,10 +2005,19 @@ namespace VFS {
         desc->pos = 0;
         desc->refCount = 1;
         desc->permissions = openMode & 0xFF;
+        desc->path = nullptr;
+        if(fileNode->type == Node::TYPE_DIRECTORY) {
+            // cleanBuffer now holds the path with all symlinks resolved
+            desc->path = new char[kstrlen(cleanBuffer) + 1];
+            kstrcpy(desc->path, cleanBuffer);
+        }
 
         fileDesc = (uint64)desc;
         return OK;
     }
+    int64 Open(const char* path, uint64 openMode, uint64& fileDesc) {
+        return OpenAt(0, path, openMode, fileDesc);
+    }
     SYSCALL_DEFINE2(syscall_open, const char* filePath, uint64 openMode) {
         uint64 sysDesc;
         int64 error = Open(filePath, openMode, sysDesc);
@@ -1428,6 +2025,23 @@ namespace VFS {
             return error;
         }
         int64 desc = Scheduler::ThreadAddFileDescriptor(sysDesc);
+        if(desc < 0)
+            Close(sysDesc);
+        return desc;
+    }
+    SYSCALL_DEFINE3(syscall_openat, int64 dirFD, const char* filePath, uint64 openMode) {
+        uint64 dirDesc;
+        int64 error = GetDirFileDescriptor(dirFD, dirDesc);
+        if(error != OK)
+            return error;
+
+        uint64 sysDesc;
+        error = OpenAt(dirDesc, filePath, openMode, sysDesc);
+        if(error != OK)
+            return error;
+        int64 desc = Scheduler::ThreadAddFileDescriptor(sysDesc);
+        if(desc < 0)
+            Close(sysDesc);
         return desc;
     }
 
@@ -1440,9 +2054,12 @@ namespace VFS {
         if(desc->refCount == 0) {
             MountPoint* mp = desc->node->mp;
             Node* node = desc->node;
+            mp->fs->CloseNodeDescriptor(node, desc->permissions);
             ReleaseNode(node);
             ReleaseMountPoint(mp);
 
+            if(desc->path != nullptr)
+                delete[] desc->path;
             delete desc;
         }
 
@@ -1493,6 +2110,8 @@ namespace VFS {
 
         if(!(desc->permissions & Permissions::Read))
             return ErrorPermissionDenied;
+        if(desc->node->type == Node::TYPE_DIRECTORY)
+            return ErrorOpenFolder;
         
         uint64 pos = desc->pos.Read();
         int64 res = _Read(desc->node, pos, buffer, bufferSize);
@@ -1571,6 +2190,323 @@ namespace VFS {
         return res;
     }
 
+    int64 ReadAt(uint64 descID, uint64 pos, void* buffer, uint64 bufferSize) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        if(desc == nullptr)
+            return ErrorInvalidFD;
+
+        if(!(desc->permissions & Permissions::Read))
+            return ErrorPermissionDenied;
+        if(desc->node->type == Node::TYPE_DIRECTORY)
+            return ErrorOpenFolder;
+
+        return _Read(desc->node, pos, buffer, bufferSize);
+    }
+    SYSCALL_DEFINE4(syscall_pread, int64 desc, void* buffer, uint64 bufferSize, uint64 pos) {
+        if(!MemoryManager::IsUserPtr(buffer))
+            Scheduler::ThreadExit(1);
+
+        uint64 sysDesc;
+        int64 error = Scheduler::ThreadGetSystemFileDescriptor(desc, sysDesc);
+        if(error != OK)
+            return error;
+
+        int64 res = VFS::ReadAt(sysDesc, pos, buffer, bufferSize);
+        if(res == ErrorInvalidBuffer)
+            Scheduler::ThreadExit(1);
+        return res;
+    }
+
+    const void* GetDirectData(uint64 descID, uint64 pos, uint64 size) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        if(desc == nullptr || !(desc->permissions & Permissions::Read) || desc->node->type != Node::TYPE_FILE)
+            return nullptr;
+
+        return desc->node->mp->fs->GetDirectData(desc->node, pos, size);
+    }
+    void ReleaseDirectData(uint64 descID) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        desc->node->mp->fs->ReleaseDirectData(desc->node);
+    }
+
+    int64 WriteAt(uint64 descID, uint64 pos, const void* buffer, uint64 bufferSize) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        if(desc == nullptr)
+            return ErrorInvalidFD;
+
+        if(!(desc->permissions & Permissions::Write))
+            return ErrorPermissionDenied;
+
+        return _Write(desc->node, pos, buffer, bufferSize);
+    }
+    SYSCALL_DEFINE4(syscall_pwrite, int64 desc, void* buffer, uint64 bufferSize, uint64 pos) {
+        if(!MemoryManager::IsUserPtr(buffer))
+            Scheduler::ThreadExit(1);
+
+        uint64 sysDesc;
+        int64 error = Scheduler::ThreadGetSystemFileDescriptor(desc, sysDesc);
+        if(error != OK)
+            return error;
+
+        int64 res = VFS::WriteAt(sysDesc, pos, buffer, bufferSize);
+        if(res == ErrorInvalidBuffer)
+            Scheduler::ThreadExit(1);
+        return res;
+    }
+
+    static int64 _ReadV(Node* node, uint64 pos, const IOVec* iov, uint64 iovCount) {
+        if(node->type != Node::TYPE_DEVICE_CHAR && node->type != Node::TYPE_DEVICE_BLOCK)
+            return node->mp->fs->ReadNodeDataV(node, pos, iov, iovCount);
+
+        int64 total = 0;
+        for(uint64 i = 0; i < iovCount; i++) {
+            if(iov[i].length == 0)
+                continue;
+
+            int64 res = _Read(node, pos + total, iov[i].base, iov[i].length);
+            if(res < 0)
+                return total == 0 ? res : total;
+
+            total += res;
+            if((uint64)res < iov[i].length)
+                break;
+        }
+        return total;
+    }
+    static int64 _WriteV(Node* node, uint64 pos, const IOVec* iov, uint64 iovCount) {
+        if(node->type != Node::TYPE_DEVICE_CHAR && node->type != Node::TYPE_DEVICE_BLOCK)
+            return node->mp->fs->WriteNodeDataV(node, pos, iov, iovCount);
+
+        int64 total = 0;
+        for(uint64 i = 0; i < iovCount; i++) {
+            if(iov[i].length == 0)
+                continue;
+
+            int64 res = _Write(node, pos + total, iov[i].base, iov[i].length);
+            if(res < 0)
+                return total == 0 ? res : total;
+
+            total += res;
+            if((uint64)res < iov[i].length)
+                break;
+        }
+        return total;
+    }
+
+    /**
+     * Copies an IOVec array from user space and checks that every buffer lies in user space.
+     * Returns nullptr if the array or one of its buffers is invalid.
+     **/
+    static IOVec* CopyUserIOVecs(const IOVec* userIOV, uint64 iovCount) {
+        if(!MemoryManager::IsUserPtr(userIOV) || !MemoryManager::IsUserPtr((const char*)userIOV + iovCount * sizeof(IOVec) - 1))
+            return nullptr;
+
+        IOVec* iov = new IOVec[iovCount];
+        if(!kmemcpy_usersafe(iov, userIOV, iovCount * sizeof(IOVec))) {
+            delete[] iov;
+            return nullptr;
+        }
+
+        uint64 total = 0;
+        for(uint64 i = 0; i < iovCount; i++) {
+            uint64 base = (uint64)iov[i].base;
+            uint64 length = iov[i].length;
+            if(length == 0)
+                continue;
+
+            // The buffer must neither wrap around nor reach into kernel space, and the total size has to fit the return value
+            if(base + length < base || !MemoryManager::IsUserPtr(iov[i].base) || !MemoryManager::IsUserPtr((const char*)base + length - 1)
+                || total + length < total || (int64)(total + length) < 0) {
+                delete[] iov;
+                return nullptr;
+            }
+            total += length;
+        }
+
+        return iov;
+    }
+
+    int64 ReadV(uint64 descID, const IOVec* iov, uint64 iovCount) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        if(desc == nullptr)
+            return ErrorInvalidFD;
+
+        if(!(desc->permissions & Permissions::Read))
+            return ErrorPermissionDenied;
+        if(desc->node->type == Node::TYPE_DIRECTORY)
+            return ErrorOpenFolder;
+
+        uint64 pos = desc->pos.Read();
+        int64 res = _ReadV(desc->node, pos, iov, iovCount);
+        if(res >= 0)
+            desc->pos.Write(pos + res);
+
+        return res;
+    }
+    SYSCALL_DEFINE3(syscall_readv, int64 desc, const IOVec* userIOV, uint64 iovCount) {
+        if(iovCount == 0)
+            return 0;
+        if(iovCount > IOVecMax)
+            return ErrorInvalidBuffer;
+
+        uint64 sysDesc;
+        int64 error = Scheduler::ThreadGetSystemFileDescriptor(desc, sysDesc);
+        if(error != OK)
+            return error;
+
+        IOVec* iov = CopyUserIOVecs(userIOV, iovCount);
+        if(iov == nullptr)
+            Scheduler::ThreadExit(1);
+
+        int64 res = VFS::ReadV(sysDesc, iov, iovCount);
+        delete[] iov;
+        if(res == ErrorInvalidBuffer)
+            Scheduler::ThreadExit(1);
+        return res;
+    }
+
+    int64 WriteV(uint64 descID, const IOVec* iov, uint64 iovCount) {
+        FileDescriptor* desc = (FileDescriptor*)descID;
+        if(desc == nullptr)
+            return ErrorInvalidFD;
+
+        if(!(desc->permissions & Permissions::Write))
+            return ErrorPermissionDenied;
+
+        uint64 pos = desc->pos.Read();
+        int64 res = _WriteV(desc->node, pos, iov, iovCount);
+        if(res >= 0)
+            desc->pos.Write(pos + res);
+
+        return res;
+    }
+    SYSCALL_DEFINE3(syscall_writev, int64 desc, const IOVec* userIOV, uint64 iovCount) {
+        if(iovCount == 0)
+            return 0;
+        if(iovCount > IOVecMax)
+            return ErrorInvalidBuffer;
+
+        uint64 sysDesc;
+        int64 error = Scheduler::ThreadGetSystemFileDescriptor(desc, sysDesc);
+        if(error != OK)
+            return error;
+
+        IOVec* iov = CopyUserIOVecs(userIOV, iovCount);
+        if(iov == nullptr)
+            Scheduler::ThreadExit(1);
+
+        int64 res = VFS::WriteV(sysDesc, iov, iovCount);
+        delete[] iov;
+        if(res == ErrorInvalidBuffer)
+            Scheduler::ThreadExit(1);
+        return res;
+    }
+
+    class NodeSink : public DataSink {
+    public:
+        NodeSink(Node* node, uint64 pos)
+            : m_Node(node), m_Pos(pos) { }
+
+        int64 Put(const void* data, uint64 size) override {
+            int64 res = _Write(m_Node, m_Pos, data, size);
+            if(res > 0)
+                m_Pos += res;
+            return res;
+        }
+
+    private:
+        Node* m_Node;
+        uint64 m_Pos;
+    };
+
+    int64 SendFile(uint64 outDescID, uint64 inDescID, uint64* inPos, uint64 count) {
+        FileDescriptor* outDesc = (FileDescriptor*)outDescID;
+        FileDescriptor* inDesc = (FileDescriptor*)inDescID;
+        if(outDesc == nullptr || inDesc == nullptr)
+            return ErrorInvalidFD;
+
+        if(!(inDesc->permissions & Permissions::Read) || !(outDesc->permissions & Permissions::Write))
+            return ErrorPermissionDenied;
+        if(inDesc->node->type == Node::TYPE_DIRECTORY)
+            return ErrorOpenFolder;
+        // The source data could move while it is written
+        if(inDesc->node == outDesc->node)
+            return ErrorInvalidFD;
+        if(count == 0)
+            return 0;
+
+        Node* inNode = inDesc->node;
+        uint64 readPos = inPos == nullptr ? inDesc->pos.Read() : *inPos;
+        uint64 writePos = outDesc->pos.Read();
+        NodeSink sink(outDesc->node, writePos);
+
+        int64 res;
+        if(inNode->type == Node::TYPE_DEVICE_CHAR || inNode->type == Node::TYPE_DEVICE_BLOCK) {
+            // Devices have no FileSystem that could stream their data, copy it in chunks
+            uint64 chunkSize = count < SendChunkSize ? count : SendChunkSize;
+            char* buffer = new char[chunkSize];
+
+            res = 0;
+            while((uint64)res < count) {
+                uint64 size = count - res < chunkSize ? count - res : chunkSize;
+                int64 read = _Read(inNode, readPos + res, buffer, size);
+                if(read <= 0) {
+                    if(res == 0)
+                        res = read;
+                    break;
+                }
+
+                int64 put = sink.Put(buffer, read);
+                if(put < 0) {
+                    if(res == 0)
+                        res = put;
+                    break;
+                }
+
+                res += put;
+                if(put < read || (uint64)read < size)
+                    break;
+            }
+
+            delete[] buffer;
+        } else {
+            res = inNode->mp->fs->SendNodeData(inNode, readPos, count, sink);
+        }
+
+        if(res > 0) {
+            if(inPos == nullptr)
+                inDesc->pos.Write(readPos + res);
+            else
+                *inPos = readPos + res;
+            outDesc->pos.Write(writePos + res);
+        }
+        return res;
+    }
+    SYSCALL_DEFINE4(syscall_sendfile, int64 outDesc, int64 inDesc, uint64* offset, uint64 count) {
+        if(offset != nullptr && !MemoryManager::IsUserPtr(offset))
+            Scheduler::ThreadExit(1);
+
+        uint64 outSysDesc, inSysDesc;
+        int64 error = Scheduler::ThreadGetSystemFileDescriptor(outDesc, outSysDesc);
+        if(error != OK)
+            return error;
+        error = Scheduler::ThreadGetSystemFileDescriptor(inDesc, inSysDesc);
+        if(error != OK)
+            return error;
+
+        uint64 pos;
+        if(offset != nullptr && !kmemcpy_usersafe(&pos, offset, sizeof(uint64)))
+            Scheduler::ThreadExit(1);
+
+        int64 res = VFS::SendFile(outSysDesc, inSysDesc, offset == nullptr ? nullptr : &pos, count);
+        if(res == ErrorInvalidBuffer)
+            Scheduler::ThreadExit(1);
+
+        if(offset != nullptr && !kmemcpy_usersafe(offset, &pos, sizeof(uint64)))
+            Scheduler::ThreadExit(1);
+        return res;
+    }
+
     int64 DeviceCommand(uint64 descID, int64 command, void* buffer) {
         auto desc = (FileDescriptor*)descID;
         if(desc == nullptr)
@@ -1606,6 +2542,14 @@ namespace VFS {
         if(desc == nullptr)
             return ErrorInvalidFD;
 
+        // The position of a directory is the cookie of the next entry, any value is valid
+        if(desc->node->type == Node::TYPE_DIRECTORY) {
+            if(mode == SEEK_END)
+                offs = 0xFFFFFFFFFFFFFFFF;
+            desc->pos.Write(offs);
+            return OK;
+        }
+
         if(mode == SEEK_END)
             offs = desc->node->infoFile.fileSize.Read();
 
@@ -1628,35 +2572,26 @@ namespace VFS {
     int64 CD(const char* path) {
         auto tInfo = Scheduler::GetCurrentThreadInfo();
 
-        char pathBuffer[256];
-
-        int64 error;
-        if((error = PreparePath(pathBuffer, path)) != OK)
-            return error;
-
-        MountPoint* mp;
-        char* tmpPath = pathBuffer;
-        Node* node;
-        Node* parent;
-        error = AcquirePath(tInfo->uid, tInfo->gid, mp, tmpPath, true, false, node, parent);
-        if(error != 0)
+        uint64 desc;
+        int64 error = Open(path, 0, desc);
+        if(error != OK)
             return error;
 
-        auto type = node->type;
-
-        ReleaseNode(node);
-        if(parent != nullptr)
-            ReleaseNode(parent);
-        ReleaseMountPoint(mp);
-
-        if(type != Node::TYPE_DIRECTORY)
+        FileDescriptor* newCwd = (FileDescriptor*)desc;
+        if(newCwd->node->type != Node::TYPE_DIRECTORY) {
+            Close(desc);
             return ErrorNotAFolder;
-
-        if(!CheckPermissions(tInfo->uid, tInfo->gid, node, Permissions::Execute)) {
+        }
+        if(!CheckPermissions(tInfo->uid, tInfo->gid, newCwd->node, Permissions::Execute)) {
+            Close(desc);
             return ErrorPermissionDenied;
         }
 
-        kstrcpy(tInfo->cwd, pathBuffer);
+        // Keep the directory referenced, so that relative lookups can start at it
+        if(tInfo->cwdDesc != 0)
+            Close(tInfo->cwdDesc);
+        tInfo->cwdDesc = desc;
+        kstrcpy(tInfo->cwd, newCwd->path);
         return OK;
     }
     SYSCALL_DEFINE1(syscall_cd, const char* userPath) {
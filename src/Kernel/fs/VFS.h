@@ -41,6 +41,11 @@ namespace VFS {
      * @param writeDesc Filled with a FileDescriptor that can be used to write to the Pipe.
      **/
     int64 CreatePipe(uint64* readDesc, uint64* writeDesc);
+    /**
+     * Sets the maximum number of bytes the pipe referred to by desc can buffer.
+     * Returns the new capacity, which is rounded up to whole pages, or an error code.
+     **/
+    int64 SetPipeCapacity(uint64 desc, uint64 capacity);
 
     /**
      * Creates a symlink to another file
@@ -77,11 +82,65 @@ namespace VFS {
         };
     };
     int64 Stat(const char* path, NodeStats& outStats, bool followSymlink);
+    /**
+     * Like Stat, but relative paths start at the directory FileDescriptor dirDesc, or at the threads cwd if dirDesc is 0
+     **/
+    int64 StatAt(uint64 dirDesc, const char* path, NodeStats& outStats, bool followSymlink);
+    /**
+     * Returns the stats of the node that the given FileDescriptor refers to
+     **/
+    int64 FStat(uint64 desc, NodeStats& outStats);
+
+    /**
+     * Usage of a mounted FileSystem, a limit of 0 means that there is no limit
+     **/
+    struct FileSystemStats {
+        uint64 usedBytes;
+        uint64 maxBytes;
+        uint64 usedNodes;
+        uint64 maxNodes;
+    };
+    /**
+     * Returns the usage of the FileSystem that contains path
+     **/
+    int64 StatFS(const char* path, FileSystemStats& outStats);
 
     struct ListEntry {
         char name[256];
     };
     int64 List(const char* path, int& numEntries, ListEntry* entries);
+    int64 ListAt(uint64 dirDesc, const char* path, int& numEntries, ListEntry* entries);
+
+    /**
+     * Header of a directory entry returned by GetDirEntries.
+     * Records are packed one after another, every record starts 8 byte aligned.
+     **/
+    struct DirEntryRecord {
+        uint32 recordLength;        // size of the whole record including padding, the next record starts behind it
+        uint32 nameLength;          // length of the name without the null terminator
+        uint64 nodeID;
+        uint64 nextOffset;          // FileDescriptor position that continues the listing behind this entry
+        Node::Type type;
+        uint32 flags;
+        // followed by NodeStats if flags contains DirEntry_HasStats, then by the null terminated name
+    };
+    constexpr uint32 DirEntry_HasStats = 0x1;
+
+    constexpr uint64 GetDirEntries_Plus = 0x1;     // Return the NodeStats of every entry inline
+    /**
+     * Reads as many entries of the directory FileDescriptor desc into buffer as fit, starting at the position of desc.
+     * The position of desc is advanced behind the last returned entry, seeking to 0 restarts the listing.
+     * Entries that are added or removed while listing do not cause other entries to be skipped or returned twice.
+     * @param buffer May be a user pointer, the entries are copied with kmemcpy_usersafe
+     * @returns the number of bytes written, 0 at the end of the directory, ErrorBufferTooSmall if not even one entry fits,
+     *          ErrorInvalidBuffer if buffer is not writable
+     **/
+    int64 GetDirEntries(uint64 desc, void* buffer, uint64 bufferSize, uint64 flags);
+
+    /**
+     * Writes everything that the FileSystem still buffers for the node of the FileDescriptor desc to its device
+     **/
+    int64 Sync(uint64 desc);
 
     /**
      * Mount the given FileSystem at the given path.
@@ -92,6 +151,12 @@ namespace VFS {
     int64 Mount(const char* mountPoint, const char* fsID, const char* devFile);
     int64 Mount(const char* mountPoint, const char* fsID, uint64 driverID, uint64 devID);
 
+    /**
+     * Changes the options of the FileSystem mounted at the given path, only root can do that.
+     * options may be a user pointer and is limited to 254 characters.
+     **/
+    int64 Remount(const char* mountPoint, const char* options);
+
     /**
      * Unmounts the given path
      **/
@@ -103,11 +168,19 @@ namespace VFS {
     constexpr uint64 OpenMode_Clear = 0x200;        // Clear file contents if file exists
     constexpr uint64 OpenMode_FailIfExist = 0x400;  // Fail if the file already exists
 
+    // Directory descriptor of the *at syscalls that refers to the threads cwd
+    constexpr int64 DirFD_CWD = -100;
+
     /**
      * Opens the given path
+     * Directories can be opened without OpenMode_Write, the FileDescriptor can then be used as the start of *At lookups.
      * Returns the FileDescriptor of the opened path, or 0 on error.
      **/
     int64 Open(const char* path, uint64 mode, uint64& fileDesc);
+    /**
+     * Like Open, but relative paths start at the directory FileDescriptor dirDesc, or at the threads cwd if dirDesc is 0
+     **/
+    int64 OpenAt(uint64 dirDesc, const char* path, uint64 mode, uint64& fileDesc);
     /**
      * Closes the given FileDescriptor
      **/
@@ -135,6 +208,50 @@ namespace VFS {
      **/
     int64 Write(uint64 desc, const void* buffer, uint64 bufferSize);
 
+    /**
+     * Like Read() and Write(), but access the File at pos instead of the FileDescriptor position.
+     * The FileDescriptor position is not changed.
+     **/
+    int64 ReadAt(uint64 desc, uint64 pos, void* buffer, uint64 bufferSize);
+    int64 WriteAt(uint64 desc, uint64 pos, const void* buffer, uint64 bufferSize);
+
+    /**
+     * Returns a kernel pointer through which the bytes [pos, pos + size) of the File can be read without copying them,
+     * or nullptr if its FileSystem cannot provide one. Writes and truncation of the File wait until ReleaseDirectData is called,
+     * which has to happen before desc is closed.
+     **/
+    const void* GetDirectData(uint64 desc, uint64 pos, uint64 size);
+    void ReleaseDirectData(uint64 desc);
+
+    struct IOVec {
+        void* base;
+        uint64 length;
+    };
+    // Maximum number of IOVecs accepted by the readv and writev syscalls
+    constexpr uint64 IOVecMax = 1024;
+    /**
+     * Reads into multiple buffers, as if they were a single contiguous buffer, and increases the FileDescriptor position
+     * by the number of bytes read. iov has to be a Kernel pointer, the buffers it points to can be user buffers.
+     * Stops at the first buffer that could not be filled completely.
+     * @returns the total number of bytes read, 0 if the end of file was reached.
+     **/
+    int64 ReadV(uint64 desc, const IOVec* iov, uint64 iovCount);
+    /**
+     * Writes from multiple buffers, as if they were a single contiguous buffer, and increases the FileDescriptor position
+     * by the number of bytes written. iov has to be a Kernel pointer, the buffers it points to can be user buffers.
+     * @returns the total number of bytes written.
+     **/
+    int64 WriteV(uint64 desc, const IOVec* iov, uint64 iovCount);
+
+    /**
+     * Copies up to count bytes from inDesc to outDesc inside the Kernel and increases the position of outDesc.
+     * If inPos is nullptr, the data is read at the position of inDesc, which is increased, otherwise it is read at *inPos,
+     * which is increased instead.
+     * A pipe or char device as inDesc only transfers the data that is currently available.
+     * @returns the number of bytes copied, 0 if the end of inDesc was reached.
+     **/
+    int64 SendFile(uint64 outDesc, uint64 inDesc, uint64* inPos, uint64 count);
+
     int64 DeviceCommand(uint64 desc, int64 command, void* buffer);
 
     enum SeekMode {
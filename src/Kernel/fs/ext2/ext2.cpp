@@ -2,6 +2,8 @@
 
 #include "klib/stdio.h"
 #include "klib/string.h"
+#include "klib/memory.h"
+#include "scheduler/Scheduler.h"
 
 #include "init/Init.h"
 
@@ -9,6 +11,57 @@ using namespace VFS;
 
 namespace Ext2 {
 
+    // Symlink targets shorter than this are stored in the block pointers of the inode
+    constexpr uint64 InlineLinkSize = 60;
+    // dirVersion of a directory whose entries were never written
+    constexpr uint64 DirVersionNone = ~(uint64)0;
+
+    static char* GetInlineLink(INode& inode) {
+        return (char*)&inode + __builtin_offsetof(INode, directPointers);
+    }
+
+    static uint16 GetINodeType(Node::Type type) {
+        switch(type) {
+        case Node::TYPE_FILE: return INode_TypeFile;
+        case Node::TYPE_DIRECTORY: return INode_TypeDirectory;
+        case Node::TYPE_DEVICE_CHAR: return INode_TypeCharDev;
+        case Node::TYPE_DEVICE_BLOCK: return INode_TypeBlockDev;
+        case Node::TYPE_PIPE: return INode_TypeFIFO;
+        case Node::TYPE_SYMLINK: return INode_TypeSymLink;
+        }
+        return INode_TypeFile;
+    }
+    static uint8 GetDirEntryType(uint16 typePermissions) {
+        switch(typePermissions & INode_TypeMask) {
+        case INode_TypeFile: return DirEntry_TypeFile;
+        case INode_TypeDirectory: return DirEntry_TypeDirectory;
+        case INode_TypeCharDev: return DirEntry_TypeCharDev;
+        case INode_TypeBlockDev: return DirEntry_TypeBlockDev;
+        case INode_TypeFIFO: return DirEntry_TypeFIFO;
+        case INode_TypeUnixSocket: return DirEntry_TypeSocket;
+        case INode_TypeSymLink: return DirEntry_TypeSymlink;
+        }
+        return DirEntry_TypeUnknown;
+    }
+
+    // Converts between Permissions flags and the rwx bits of an inode mode
+    static uint8 FromModeBits(uint16 bits) {
+        return ((bits & 4) ? Permissions::Read : 0) | ((bits & 2) ? Permissions::Write : 0) | ((bits & 1) ? Permissions::Execute : 0);
+    }
+    static uint16 ToModeBits(uint8 perms) {
+        return ((perms & Permissions::Read) ? 4 : 0) | ((perms & Permissions::Write) ? 2 : 0) | ((perms & Permissions::Execute) ? 1 : 0);
+    }
+
+    static bool TestBit(const uint8* bitmap, uint64 bit) {
+        return bitmap[bit / 8] & (1 << (bit % 8));
+    }
+    static void SetBit(uint8* bitmap, uint64 bit) {
+        bitmap[bit / 8] |= 1 << (bit % 8);
+    }
+    static void ClearBit(uint8* bitmap, uint64 bit) {
+        bitmap[bit / 8] &= ~(1 << (bit % 8));
+    }
+
     Ext2Driver::Ext2Driver(BlockDeviceDriver* driver, uint64 subID) {
         m_Driver = driver;
         m_Dev = subID;
@@ -19,9 +72,33 @@ namespace Ext2 {
         klog_info("Ext2", "Volume name: %s", m_SB.volumeName);
 
         m_BlockSize = 1024 << m_SB.blockSizeShift;
+        m_DirectAccess = m_Driver->GetDirectAccess(m_Dev, 0, 1) != nullptr;
+
+        // Revision 0 file systems always use 128 byte inodes
+        m_INodeSize = m_SB.versionMajor >= 1 ? m_SB.inodeSize : 128;
+
+        // The group descriptor table starts in the block after the superblock
+        m_FirstDataBlock = m_SB.superBlockBlockID;
+        m_NumGroups = (m_SB.blockCount - m_FirstDataBlock + m_SB.blocksPerGroup - 1) / m_SB.blocksPerGroup;
+        m_Groups = new BlockGroupDesc[m_NumGroups];
+        m_Driver->GetData(m_Dev, (m_FirstDataBlock + 1) * m_BlockSize, m_Groups, m_NumGroups * sizeof(BlockGroupDesc));
+
+        for(uint64 i = 0; i < INodeBlockCacheSize; i++) {
+            m_INodeBlocks[i].blockID = 0;
+            m_INodeBlocks[i].lastUse = 0;
+            m_INodeBlocks[i].data = nullptr;
+        }
+        m_INodeBlockClock = 0;
 
-        uint64 blockAfterSuperBlock = m_BlockSize == 1024 ? 2 : 1;
-        m_BlockGroupDescTableOffset = blockAfterSuperBlock * m_BlockSize;
+        m_GroupStates = new GroupState[m_NumGroups];
+        for(uint64 i = 0; i < m_NumGroups; i++) {
+            m_GroupStates[i].blockBitmap = nullptr;
+            m_GroupStates[i].inodeBitmap = nullptr;
+            m_GroupStates[i].bitmapsDirty = false;
+        }
+        m_GroupsDirty = false;
+        m_ReservedBlocks = 0;
+        m_Unmounting = 0;
     }
 
     void Ext2Driver::GetSuperBlock(VFS::SuperBlock* sb) {
@@ -29,29 +106,123 @@ namespace Ext2 {
     }
     void Ext2Driver::SetMountPoint(MountPoint* mp) {
         m_MP = mp;
+        Scheduler::CreateKernelThread(WritebackThread, (uint64)this);
     }
     void Ext2Driver::PrepareUnmount() {
+        m_Unmounting.Write(1);
+        Sync();
+        m_Driver->Sync(m_Dev);
+    }
 
+    int64 Ext2Driver::WritebackThread(uint64 driver, uint64) {
+        Ext2Driver* fs = (Ext2Driver*)driver;
+        while(fs->m_Unmounting.Read() == 0) {
+            Scheduler::ThreadSleep(WritebackInterval);
+            fs->Sync();
+        }
+        return 0;
     }
 
-    void Ext2Driver::CreateNode(Node* node) {
+    static void InitNodeInfo(Node* node, NodeInfo* info) {
+        info->node = node;
+        info->list = NodeList_None;
+        info->upperBlockIDs[0] = info->upperBlockIDs[1] = 0;
+        info->upperBlocks[0] = info->upperBlocks[1] = nullptr;
+        info->dirScanPos = 0;
+        info->dirComplete = 0;
+        info->parentID = 0;
+        info->subdirCount = 0;
+        info->dirVersion = 0;
+        info->directUsers = 0;
+    }
+
+    int64 Ext2Driver::CreateNode(Node* parent, Node* node) {
+        bool directory = node->type == Node::TYPE_DIRECTORY;
+
+        // Files are kept close to their directory, directories are spread over groups with more than the average number of free inodes and blocks
+        uint64 group = parent != nullptr ? (parent->id - 1) / m_SB.inodesPerGroup : 0;
+        if(directory) {
+            m_AllocLock.Lock();
+            uint64 avgINodes = m_SB.freeINodeCount / m_NumGroups;
+            uint64 avgBlocks = m_SB.freeBlockCount / m_NumGroups;
+            for(uint64 i = 1; i <= m_NumGroups; i++) {
+                uint64 g = (group + i) % m_NumGroups;
+                if(m_Groups[g].freeINodes > 0 && m_Groups[g].freeINodes >= avgINodes && m_Groups[g].freeBlocks >= avgBlocks) {
+                    group = g;
+                    break;
+                }
+            }
+            m_AllocLock.Unlock();
+        }
+
+        uint64 id;
+        int64 error = AllocINode(group, directory, id);
+        if(error != OK)
+            return error;
+
+        NodeInfo* info = new NodeInfo();
+        InitNodeInfo(node, info);
+        // There is nothing on the device that would have to be parsed
+        info->dirComplete = 1;
+        info->dirVersion = DirVersionNone;
+        info->parentID = parent != nullptr ? parent->id : id;
+
+        INode* inode = &info->inode;
+        kmemset(inode, 0, sizeof(INode));
+        inode->typePermissions = GetINodeType(node->type);
+        inode->hardlinkCount = directory ? 2 : 1;
+        // Written right away, so that the type of the node can be read when its directory entry is written
+        WriteINode(id, inode);
+        info->diskINode = *inode;
+
+        node->id = id;
+        node->fsData = info;
+
+        m_DirtyLock.Lock();
+        m_NewNodes.push_back(info);
+        info->list = NodeList_New;
+        m_DirtyLock.Unlock();
+        return OK;
     }
     void Ext2Driver::DestroyNode(Node* node) {
+        NodeInfo* info = (NodeInfo*)node->fsData;
+
+        m_SyncLock.Lock();
+        RemoveDirty(info);
+        m_SyncLock.Unlock();
+
+        info->dataLock.Lock();
+        DropData(info);
+        bool hasBlocks = node->type == Node::TYPE_FILE || node->type == Node::TYPE_DIRECTORY || (node->type == Node::TYPE_SYMLINK && info->inode.sectorCount != 0);
+        if(hasBlocks)
+            FreeAllBlocks(info);
+        info->dataLock.Unlock();
+
+        FreeINode(node->id, node->type == Node::TYPE_DIRECTORY);
+
+        INode* inode = &info->inode;
+        kmemset(inode, 0, sizeof(INode));
+        inode->deletionTime = 1;
+        WriteINode(node->id, inode);
+
+        if(node->type == Node::TYPE_DIRECTORY)
+            Directory::Destroy(node->infoFolder.cachedDir);
+        if(node->type == Node::TYPE_SYMLINK)
+            delete[] node->infoSymlink.linkPath;
+        delete[] info->upperBlocks[0];
+        delete[] info->upperBlocks[1];
+        delete info;
+        node->fsData = nullptr;
     }
 
     void Ext2Driver::ReadNode(uint64 id, Node* node) {
         node->id = id;
 
-        uint64 group = (id - 1) / m_SB.inodesPerGroup;
-        
-        BlockGroupDesc desc;
-        m_Driver->GetData(m_Dev, group * 32 + m_BlockGroupDescTableOffset, &desc, sizeof(BlockGroupDesc));
-
-        uint64 relID = (id - 1) % m_SB.inodesPerGroup;
-
-        uint64 inodePos = desc.inodeTableBlock * m_BlockSize + relID * m_SB.inodeSize;
-        INode* inode = new INode();
-        m_Driver->GetData(m_Dev, inodePos, inode, sizeof(INode));
+        NodeInfo* info = new NodeInfo();
+        InitNodeInfo(node, info);
+        INode* inode = &info->inode;
+        ReadINode(id, inode);
+        info->diskINode = *inode;
 
         uint16 type = inode->typePermissions & INode_TypeMask;
         switch(type) {
@@ -60,105 +231,1420 @@ namespace Ext2 {
         case INode_TypeCharDev: node->type = Node::TYPE_DEVICE_CHAR; break;
         case INode_TypeBlockDev: node->type = Node::TYPE_DEVICE_BLOCK; break;
         case INode_TypeFIFO: node->type = Node::TYPE_PIPE; break;
+        case INode_TypeSymLink: node->type = Node::TYPE_SYMLINK; break;
         }
 
+        node->fsData = info;
+
         if(node->type == Node::TYPE_DIRECTORY) {
-            Directory* dir = Directory::Create(10);
+            // The entries are parsed on demand by LoadDirEntries.
+            // "." and the ".." of every subdirectory count as links, the VFS only counts the entry in the parent.
+            node->infoFolder.cachedDir = Directory::Create(10);
+            info->subdirCount = inode->hardlinkCount > 2 ? inode->hardlinkCount - 2 : 0;
+            node->linkCount = 1;
+        } else {
+            node->linkCount = inode->hardlinkCount;
+        }
+
+        if(node->type == Node::TYPE_FILE)
+            node->infoFile.fileSize = GetSize(*inode);
+        if(node->type == Node::TYPE_DEVICE_CHAR || node->type == Node::TYPE_DEVICE_BLOCK) {
+            node->infoDevice.driverID = inode->directPointers[0];
+            node->infoDevice.subID = inode->directPointers[1];
+        }
+        if(node->type == Node::TYPE_SYMLINK) {
+            uint64 size = GetSize(*inode);
+            char* linkPath = new char[size + 1];
+            if(size < InlineLinkSize && inode->sectorCount == 0)
+                kmemcpy(linkPath, GetInlineLink(*inode), size);
+            else
+                ReadNodeData(node, 0, linkPath, size);
+            linkPath[size] = '\0';
+            node->infoSymlink.linkPath = linkPath;
+        }
 
-            uint64 pos = 0;
-            while(pos < inode->size) {
-                uint64 entryBlock = pos / m_BlockSize;
-                uint64 entryBlockPos = inode->directPointers[entryBlock] * m_BlockSize;
-                uint64 entryOffset = pos % m_BlockSize;
-                
-                DirEntry ext2Entry;
-                m_Driver->GetData(m_Dev, entryBlockPos + entryOffset, &ext2Entry, sizeof(DirEntry));
+        node->ownerUID = inode->userID;
+        node->ownerGID = inode->groupID;
+        node->permissions.ownerPermissions = FromModeBits(inode->typePermissions >> 6);
+        node->permissions.groupPermissions = FromModeBits(inode->typePermissions >> 3);
+        node->permissions.otherPermissions = FromModeBits(inode->typePermissions);
+        node->permissions.specialFlags = (inode->typePermissions & INode_SetUID) ? Permissions::SetUID : 0;
+    }
+    void Ext2Driver::WriteNode(Node* node) {
+        FlushNode(node, (NodeInfo*)node->fsData);
+    }
+    void Ext2Driver::EvictNode(Node* node) {
+        NodeInfo* info = (NodeInfo*)node->fsData;
 
-                DirectoryEntry* vfsEntry;
-                Directory::AddEntry(&dir, &vfsEntry);
+        m_SyncLock.Lock();
+        RemoveDirty(info);
+        m_SyncLock.Unlock();
+        FlushNode(node, info);
 
-                vfsEntry->nodeID = ext2Entry.inode;
-                m_Driver->GetData(m_Dev, entryBlockPos + entryOffset + sizeof(DirEntry), vfsEntry->name, ext2Entry.nameLengthLow);
-                vfsEntry->name[ext2Entry.nameLengthLow] = '\0';
+        if(node->type == Node::TYPE_DIRECTORY)
+            Directory::Destroy(node->infoFolder.cachedDir);
+        if(node->type == Node::TYPE_SYMLINK)
+            delete[] node->infoSymlink.linkPath;
+        delete[] info->upperBlocks[0];
+        delete[] info->upperBlocks[1];
+        delete info;
+    }
 
-                pos += ext2Entry.entrySize;
+    void Ext2Driver::UpdateDir(VFS::Node* node) {
+
+    }
+
+    uint64 Ext2Driver::GetINodePos(uint64 id) const {
+        uint64 group = (id - 1) / m_SB.inodesPerGroup;
+        uint64 relID = (id - 1) % m_SB.inodesPerGroup;
+        return m_Groups[group].inodeTableBlock * m_BlockSize + relID * m_INodeSize;
+    }
+
+    void Ext2Driver::ReadINode(uint64 id, INode* inode) {
+        uint64 inodePos = GetINodePos(id);
+        uint64 blockID = inodePos / m_BlockSize;
+
+        m_INodeBlockLock.Lock();
+
+        INodeBlock* block = nullptr;
+        INodeBlock* victim = &m_INodeBlocks[0];
+        for(uint64 i = 0; i < INodeBlockCacheSize; i++) {
+            if(m_INodeBlocks[i].blockID == blockID) {
+                block = &m_INodeBlocks[i];
+                break;
             }
+            if(m_INodeBlocks[i].lastUse < victim->lastUse)
+                victim = &m_INodeBlocks[i];
+        }
 
-            node->infoFolder.cachedDir = dir;
+        // Replace the least recently used block
+        if(block == nullptr) {
+            block = victim;
+            if(block->data == nullptr)
+                block->data = new uint8[m_BlockSize];
+            m_Driver->GetData(m_Dev, blockID * m_BlockSize, block->data, m_BlockSize);
+            block->blockID = blockID;
         }
-        if(node->type == Node::TYPE_FILE)
-            node->infoFile.fileSize = inode->size;
-        node->linkCount = inode->hardlinkCount;
+        block->lastUse = ++m_INodeBlockClock;
 
-        node->ownerUID = 0;
-        node->ownerGID = 0;
-        node->permissions.ownerPermissions = Permissions::Read | Permissions::Execute;
-        node->permissions.groupPermissions = Permissions::Read | Permissions::Execute;
-        node->permissions.otherPermissions = Permissions::Read | Permissions::Execute;
+        kmemcpy(inode, block->data + inodePos % m_BlockSize, sizeof(INode));
 
-        node->fsData = inode;
+        m_INodeBlockLock.Unlock();
     }
-    void Ext2Driver::WriteNode(Node* node) {
+    void Ext2Driver::WriteINode(uint64 id, const INode* inode) {
+        uint64 inodePos = GetINodePos(id);
+        uint64 blockID = inodePos / m_BlockSize;
+
+        // Keep the cached inode table block in sync, the lock also orders concurrent writes of inodes in the same block
+        m_INodeBlockLock.Lock();
+        for(uint64 i = 0; i < INodeBlockCacheSize; i++) {
+            if(m_INodeBlocks[i].blockID == blockID)
+                kmemcpy(m_INodeBlocks[i].data + inodePos % m_BlockSize, inode, sizeof(INode));
+        }
+        m_Driver->SetData(m_Dev, inodePos, inode, sizeof(INode));
+        m_INodeBlockLock.Unlock();
     }
 
-    void Ext2Driver::UpdateDir(VFS::Node* node) {
-        
+    void Ext2Driver::ScanDirBlock(Node* node, NodeInfo* info) {
+        uint64 size = GetSize(info->inode);
+        if(info->dirScanPos >= size) {
+            info->dirComplete = 1;
+            return;
+        }
+
+        uint64 runLength;
+        uint64 blockID = MapBlock(info, info->dirScanPos / m_BlockSize, runLength);
+        info->dirScanPos += m_BlockSize;
+
+        // A hole contains no entries
+        if(blockID == 0)
+            return;
+
+        uint8* data = new uint8[m_BlockSize];
+        m_Driver->GetData(m_Dev, blockID * m_BlockSize, data, m_BlockSize);
+
+        node->dirLock.Spinlock();
+        Directory* dir = node->infoFolder.cachedDir;
+        // Entries that are only parsed do not have to be written back
+        bool clean = info->dirVersion == dir->version;
+
+        uint64 offset = 0;
+        while(offset + sizeof(DirEntry) <= m_BlockSize) {
+            DirEntry* entry = (DirEntry*)(data + offset);
+            // A corrupted entry would never end the scan
+            if(entry->entrySize < sizeof(DirEntry) || offset + entry->entrySize > m_BlockSize)
+                break;
+
+            uint64 nameLength = entry->nameLengthLow;
+            bool isDot = (nameLength == 1 && entry->name[0] == '.') || (nameLength == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+            // Unused entries have inode 0, "." and ".." are resolved by the VFS
+            if(entry->inode != 0 && !isDot && sizeof(DirEntry) + nameLength <= entry->entrySize)
+                dir->AddEntry(entry->name, nameLength, entry->inode);
+            if(nameLength == 2 && isDot)
+                info->parentID = entry->inode;
+
+            offset += entry->entrySize;
+        }
+
+        if(clean)
+            info->dirVersion = dir->version;
+        node->dirLock.Unlock();
+        delete[] data;
+
+        if(info->dirScanPos >= size)
+            info->dirComplete = 1;
+    }
+
+    void Ext2Driver::LoadDirEntries(Node* node, const char* name, uint64 nameLength) {
+        NodeInfo* info = (NodeInfo*)node->fsData;
+        if(info->dirComplete.Read() == 0)
+            ScanDir(node, info, name, nameLength);
+    }
+    void Ext2Driver::DirEntriesChanged(Node* node) {
+        // Only queued after the change, a writeback that ran in between would otherwise have written the old entries
+        MarkDirty((NodeInfo*)node->fsData);
+    }
+
+    void Ext2Driver::ScanDir(Node* node, NodeInfo* info, const char* name, uint64 nameLength) {
+        info->dirScanLock.Lock();
+        while(info->dirComplete.Read() == 0) {
+            // Stop as soon as the entry was found, it might have been parsed by an earlier scan
+            if(name != nullptr) {
+                node->dirLock.Spinlock();
+                bool found = node->infoFolder.cachedDir->FindEntry(name, nameLength) != nullptr;
+                node->dirLock.Unlock();
+                if(found)
+                    break;
+            }
+
+            ScanDirBlock(node, info);
+        }
+        info->dirScanLock.Unlock();
+    }
+
+    uint64 Ext2Driver::GetSize(const INode& inode) const {
+        // Since revision 1 the upper half of a regular file's size is stored in sizeHigh
+        if(m_SB.versionMajor >= 1 && (inode.typePermissions & INode_TypeMask) == INode_TypeFile)
+            return inode.size | ((uint64)inode.sizeHigh << 32);
+        return inode.size;
+    }
+
+    static bool ContinuesRun(const BlockRun& run, uint64 logicalStart, uint64 physicalStart) {
+        if(run.logicalStart + run.count != logicalStart)
+            return false;
+        if(physicalStart == 0)
+            return run.physicalStart == 0;
+        return run.physicalStart != 0 && run.physicalStart + run.count == physicalStart;
+    }
+
+    const BlockRun* Ext2Driver::FindRun(NodeInfo* info, uint64 index) const {
+        // Find the last run starting at or before index
+        uint64 low = 0;
+        uint64 high = info->runs.size();
+        while(low < high) {
+            uint64 mid = (low + high) / 2;
+            if(info->runs[mid].logicalStart <= index)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        if(low == 0)
+            return nullptr;
+        const BlockRun& run = info->runs[low - 1];
+        if(index >= run.logicalStart + run.count)
+            return nullptr;
+        return &run;
+    }
+
+    void Ext2Driver::AddRun(NodeInfo* info, uint64 logicalStart, uint64 physicalStart, uint64 count) {
+        // Pointers past the end of the file are never used
+        uint64 numBlocks = (GetSize(info->inode) + m_BlockSize - 1) / m_BlockSize;
+        if(logicalStart >= numBlocks)
+            return;
+        if(count > numBlocks - logicalStart)
+            count = numBlocks - logicalStart;
+
+        std::vector<BlockRun>& runs = info->runs;
+
+        uint64 index = 0;
+        while(index < runs.size() && runs[index].logicalStart < logicalStart)
+            index++;
+
+        if(index > 0 && ContinuesRun(runs[index - 1], logicalStart, physicalStart)) {
+            index--;
+            runs[index].count += count;
+        } else {
+            runs.insert(runs.begin() + index, BlockRun { logicalStart, physicalStart, count });
+        }
+
+        if(index + 1 < runs.size() && ContinuesRun(runs[index], runs[index + 1].logicalStart, runs[index + 1].physicalStart)) {
+            runs[index].count += runs[index + 1].count;
+            runs.erase(runs.begin() + index + 1);
+        }
+    }
+
+    void Ext2Driver::AddRuns(NodeInfo* info, uint64 logicalStart, const uint32* pointers, uint64 count) {
+        uint64 start = 0;
+        for(uint64 i = 1; i <= count; i++) {
+            bool contiguous = i < count && (pointers[start] == 0 ? pointers[i] == 0 : pointers[i] == pointers[start] + (i - start));
+            if(contiguous)
+                continue;
+
+            AddRun(info, logicalStart + start, pointers[start], i - start);
+            start = i;
+        }
+    }
+
+    void Ext2Driver::ResolveIndirect(NodeInfo* info, uint64 blockID, uint64 depth, uint64 base, uint64 numBlocks, uint64 index) {
+        if(blockID == 0) {
+            AddRun(info, base, 0, numBlocks);
+            return;
+        }
+
+        uint64 pointersPerBlock = m_BlockSize / 4;
+
+        if(depth == 0) {
+            uint32* pointers = new uint32[pointersPerBlock];
+            m_Driver->GetData(m_Dev, blockID * m_BlockSize, pointers, m_BlockSize);
+            AddRuns(info, base, pointers, pointersPerBlock);
+            delete[] pointers;
+            return;
+        }
+
+        uint32*& upper = info->upperBlocks[depth - 1];
+        if(upper == nullptr)
+            upper = new uint32[pointersPerBlock];
+        if(info->upperBlockIDs[depth - 1] != blockID) {
+            m_Driver->GetData(m_Dev, blockID * m_BlockSize, upper, m_BlockSize);
+            info->upperBlockIDs[depth - 1] = blockID;
+        }
+
+        uint64 span = numBlocks / pointersPerBlock;
+        uint64 entry = (index - base) / span;
+        ResolveIndirect(info, upper[entry], depth - 1, base + entry * span, span, index);
+    }
+
+    void Ext2Driver::ResolveBlocks(NodeInfo* info, uint64 index) {
+        const INode& inode = info->inode;
+
+        if(index < INode_NumDirectPointers) {
+            uint32 pointers[INode_NumDirectPointers];
+            kmemcpy(pointers, inode.directPointers, sizeof(pointers));
+            AddRuns(info, 0, pointers, INode_NumDirectPointers);
+            return;
+        }
+
+        uint32 roots[3] = { inode.indirectPointer, inode.doubleIndirectPointer, inode.tripleIndirectPointer };
+
+        uint64 base = INode_NumDirectPointers;
+        uint64 numBlocks = m_BlockSize / 4;
+        for(uint64 depth = 0; depth < 3; depth++) {
+            if(index < base + numBlocks) {
+                ResolveIndirect(info, roots[depth], depth, base, numBlocks, index);
+                return;
+            }
+            base += numBlocks;
+            numBlocks *= m_BlockSize / 4;
+        }
+    }
+
+    uint64 Ext2Driver::MapBlock(NodeInfo* info, uint64 index, uint64& outCount) {
+        info->mapLock.Lock();
+
+        const BlockRun* run = FindRun(info, index);
+        if(run == nullptr) {
+            ResolveBlocks(info, index);
+            run = FindRun(info, index);
+        }
+
+        uint64 res = 0;
+        outCount = 1;
+        if(run != nullptr) {
+            uint64 offset = index - run->logicalStart;
+            outCount = run->count - offset;
+            if(run->physicalStart != 0)
+                res = run->physicalStart + offset;
+        }
+
+        info->mapLock.Unlock();
+        return res;
+    }
+
+    void Ext2Driver::PrefetchBlocks(NodeInfo* info, uint64 start, uint64 end) {
+        while(start < end) {
+            uint64 runLength;
+            uint64 blockID = MapBlock(info, start, runLength);
+            if(runLength > end - start)
+                runLength = end - start;
+
+            if(blockID != 0)
+                m_Driver->Prefetch(m_Dev, blockID * m_BlockSize, runLength * m_BlockSize);
+            start += runLength;
+        }
+    }
+
+    void Ext2Driver::UpdateReadAhead(NodeInfo* info, uint64 pos, uint64 size, uint64& outStart, uint64& outEnd) {
+        uint64 numBlocks = (GetSize(info->inode) + m_BlockSize - 1) / m_BlockSize;
+        uint64 endBlock = (pos + size + m_BlockSize - 1) / m_BlockSize;
+        uint64 minWindow = ReadAheadMinSize / m_BlockSize;
+        uint64 maxWindow = ReadAheadMaxSize / m_BlockSize;
+        if(minWindow == 0)
+            minWindow = 1;
+
+        outStart = outEnd = 0;
+
+        info->streamLock.Spinlock();
+
+        ReadAheadStream* stream = nullptr;
+        for(uint64 i = 0; i < ReadAheadNumStreams; i++) {
+            if(info->streams[i].window != 0 && info->streams[i].nextPos == pos) {
+                stream = &info->streams[i];
+                break;
+            }
+        }
+
+        bool sequential = stream != nullptr;
+        if(!sequential) {
+            // A seek, start over with the smallest window
+            stream = &info->streams[0];
+            for(uint64 i = 1; i < ReadAheadNumStreams; i++) {
+                if(info->streams[i].lastUse < stream->lastUse)
+                    stream = &info->streams[i];
+            }
+            stream->window = minWindow;
+            stream->aheadEnd = 0;
+        }
+        stream->nextPos = pos + size;
+        stream->lastUse = ++info->streamClock;
+
+        // Reading from the start of a file is treated as sequential, so that small files are read in one go.
+        // The next window is only read once half of the previous one was consumed.
+        bool readAhead = false;
+        if(sequential) {
+            if(endBlock + stream->window / 2 >= stream->aheadEnd) {
+                stream->window *= 2;
+                if(stream->window > maxWindow)
+                    stream->window = maxWindow;
+                readAhead = true;
+            }
+        } else if(pos == 0) {
+            readAhead = true;
+        }
+
+        if(readAhead) {
+            outStart = stream->aheadEnd > endBlock ? stream->aheadEnd : endBlock;
+            outEnd = endBlock + stream->window;
+            if(outEnd > numBlocks)
+                outEnd = numBlocks;
+            if(outStart < outEnd)
+                stream->aheadEnd = outEnd;
+            else
+                outStart = outEnd = 0;
+        }
+
+        info->streamLock.Unlock();
     }
 
     uint64 Ext2Driver::ReadNodeData(Node* node, uint64 pos, void* buffer, uint64 bufferSize) {
         char* realBuffer = (char*)buffer;
 
-        INode* inode = (INode*)node->fsData;
+        NodeInfo* info = (NodeInfo*)node->fsData;
+        info->dataLock.Lock();
+        uint64 size = GetSize(info->inode);
+
+        if(pos >= size) { // eof
+            info->dataLock.Unlock();
+            return 0;
+        }
 
-        uint64 rem = inode->size - pos;
+        uint64 rem = size - pos;
         int64 res = 0;
         if(rem > bufferSize)
             rem = bufferSize;
-        if(rem == 0) // eof
-            return 0;
 
-        bool indirectBufferLoaded = false;
-        uint8* indirectBuffer = nullptr;
+        uint64 firstBlock = pos / m_BlockSize;
+        uint64 endBlock = (pos + rem + m_BlockSize - 1) / m_BlockSize;
+
+        // Read the blocks of this request together with the readahead window, so that contiguous blocks take a single device operation
+        if(!m_DirectAccess) {
+            uint64 aheadStart, aheadEnd;
+            UpdateReadAhead(info, pos, rem, aheadStart, aheadEnd);
+            if(aheadStart == endBlock) {
+                PrefetchBlocks(info, firstBlock, aheadEnd);
+            } else {
+                PrefetchBlocks(info, firstBlock, endBlock);
+                PrefetchBlocks(info, aheadStart, aheadEnd);
+            }
+        }
 
         while(rem > 0) {
-            uint64 blockIndex = pos / m_BlockSize;
-            uint64 blockID;
+            uint64 offset = pos % m_BlockSize;
+            uint64 count;
 
-            if(blockIndex < 12) {
-                blockID = inode->directPointers[blockIndex];
+            DataBlock* dirty = FindDataBlock(info, pos / m_BlockSize);
+            if(dirty != nullptr) {
+                // Written data that is not on the device yet
+                count = m_BlockSize - offset;
+                if(count > rem)
+                    count = rem;
+                if(!kmemcpy_usersafe(realBuffer, dirty->data + offset, count)) {
+                    res = ErrorInvalidBuffer;
+                    break;
+                }
             } else {
-                if(!indirectBufferLoaded) {
-                    indirectBuffer = new uint8[m_BlockSize];
-                    m_Driver->GetData(m_Dev, inode->indirectPointer * (m_BlockSize), indirectBuffer, m_BlockSize);
-                    indirectBufferLoaded = true;
+                uint64 runLength;
+                uint64 blockID = MapBlock(info, pos / m_BlockSize, runLength);
+
+                // Copy up to the end of the physically contiguous run at once, unless written blocks might be part of it
+                if(!info->dirtyBlocks.empty())
+                    runLength = 1;
+                count = runLength * m_BlockSize - offset;
+                if(count > rem)
+                    count = rem;
+
+                const char* direct = nullptr;
+                if(blockID != 0 && m_DirectAccess)
+                    direct = GetDirectBlocks(blockID, (offset + count + m_BlockSize - 1) / m_BlockSize);
+
+                if(blockID == 0) {
+                    if(!kmemset_usersafe(realBuffer, 0, count)) {
+                        res = ErrorInvalidBuffer;
+                        break;
+                    }
+                } else if(direct != nullptr) {
+                    if(!kmemcpy_usersafe(realBuffer, direct + offset, count)) {
+                        res = ErrorInvalidBuffer;
+                        break;
+                    }
+                } else {
+                    uint64 error = m_Driver->GetData(m_Dev, blockID * m_BlockSize + offset, realBuffer, count);
+                    if(error != 0) {
+                        res = error;
+                        break;
+                    }
                 }
-                blockID = ((uint32*)indirectBuffer)[blockIndex - 12];
             }
 
-            uint64 blockPos = blockID * m_BlockSize;
-            uint64 offset = pos % m_BlockSize;
+            realBuffer += count;
+            rem -= count;
+            pos += count;
+            res += count;
+        }
+
+        info->dataLock.Unlock();
+        return res;
+    }
+    const char* Ext2Driver::GetDirectBlocks(uint64 blockID, uint64 count) const {
+        uint64 devBlocks = m_BlockSize / m_Driver->GetBlockSize(m_Dev);
+        return (const char*)m_Driver->GetDirectAccess(m_Dev, blockID * devBlocks, count * devBlocks);
+    }
 
-            uint64 leftInBlock = m_BlockSize - offset;
-            if(leftInBlock > rem)
-                leftInBlock = rem;
+    const void* Ext2Driver::GetDirectData(Node* node, uint64 pos, uint64 size) {
+        if(!m_DirectAccess || size == 0)
+            return nullptr;
 
-            m_Driver->GetData(m_Dev, blockPos + offset, realBuffer, leftInBlock);
+        NodeInfo* info = (NodeInfo*)node->fsData;
+        const char* res = nullptr;
 
-            realBuffer += leftInBlock;
-            rem -= leftInBlock;
-            pos += leftInBlock;
-            res += leftInBlock;
-        }
+        info->dataLock.Lock();
+        // Written data that was not allocated yet is not on the device
+        if(info->dirtyBlocks.empty() && pos + size <= GetSize(info->inode)) {
+            uint64 firstBlock = pos / m_BlockSize;
+            uint64 numBlocks = (pos + size + m_BlockSize - 1) / m_BlockSize - firstBlock;
 
-        if(indirectBufferLoaded)
-            delete[] indirectBuffer;
+            uint64 runLength;
+            uint64 blockID = MapBlock(info, firstBlock, runLength);
+            if(blockID != 0 && runLength >= numBlocks) {
+                res = GetDirectBlocks(blockID, numBlocks);
+                if(res != nullptr)
+                    res += pos % m_BlockSize;
+            }
+        }
+        if(res != nullptr) {
+            info->directLock.Spinlock();
+            info->directUsers++;
+            info->directLock.Unlock();
+        }
+        info->dataLock.Unlock();
 
         return res;
     }
+    void Ext2Driver::ReleaseDirectData(Node* node) {
+        NodeInfo* info = (NodeInfo*)node->fsData;
+        info->directLock.Spinlock();
+        info->directUsers--;
+        if(info->directUsers == 0)
+            info->directWaiters.WakeAll();
+        info->directLock.Unlock();
+    }
+    /**
+     * Waits until every pointer returned by GetDirectData was released, info->dataLock has to be held
+     * so that no new ones are handed out
+     **/
+    static void WaitForDirectUsers(NodeInfo* info) {
+        info->directLock.Spinlock();
+        while(info->directUsers != 0)
+            info->directWaiters.Wait(info->directLock);
+        info->directLock.Unlock();
+    }
+
     uint64 Ext2Driver::WriteNodeData(Node* node, uint64 pos, const void* buffer, uint64 bufferSize) {
+        if(bufferSize == 0)
+            return 0;
+
+        NodeInfo* info = (NodeInfo*)node->fsData;
+        info->dataLock.Lock();
+        WaitForDirectUsers(info);
+        int64 res = WriteData(node, info, pos, buffer, bufferSize);
+        // A single writer must not pile up an unbounded amount of unwritten data
+        if(info->dirtyBlocks.size() * m_BlockSize > WritebackMaxDirtySize)
+            FlushData(info);
+        info->dataLock.Unlock();
+
+        MarkDirty(info);
+        return res;
+    }
+    void Ext2Driver::ClearNodeData(VFS::Node* node) {
+        NodeInfo* info = (NodeInfo*)node->fsData;
+        info->dataLock.Lock();
+        WaitForDirectUsers(info);
+        DropData(info);
+        FreeAllBlocks(info);
+        SetSize(node, info, 0);
+        info->dataLock.Unlock();
+
+        MarkDirty(info);
+    }
+
+    int64 Ext2Driver::SyncNode(Node* node) {
+        FlushNode(node, (NodeInfo*)node->fsData);
+        FlushAllocState();
+        // The block cache only writes the modified blocks back later
+        return m_Driver->Sync(m_Dev);
+    }
+
+    void Ext2Driver::InvalidateBlockMap(NodeInfo* info) {
+        info->mapLock.Lock();
+        info->runs.clear();
+        info->upperBlockIDs[0] = info->upperBlockIDs[1] = 0;
+        info->mapLock.Unlock();
+    }
+
+    void Ext2Driver::SetSize(Node* node, NodeInfo* info, uint64 size) {
+        uint64 oldSize = GetSize(info->inode);
+
+        info->inode.size = (uint32)size;
+        if(node->type == Node::TYPE_FILE) {
+            if(m_SB.versionMajor >= 1)
+                info->inode.sizeHigh = (uint32)(size >> 32);
+            node->infoFile.fileSize.Write(size);
+        }
+
+        // The cached runs end at the old end of the node
+        if(size > oldSize)
+            InvalidateBlockMap(info);
+    }
+
+    void Ext2Driver::LoadBitmaps(uint64 group) {
+        GroupState& state = m_GroupStates[group];
+        if(state.blockBitmap != nullptr)
+            return;
+
+        state.blockBitmap = new uint8[m_BlockSize];
+        state.inodeBitmap = new uint8[m_BlockSize];
+        m_Driver->GetData(m_Dev, m_Groups[group].blockBitmapBlock * m_BlockSize, state.blockBitmap, m_BlockSize);
+        m_Driver->GetData(m_Dev, m_Groups[group].inodeBitmapBlock * m_BlockSize, state.inodeBitmap, m_BlockSize);
+    }
+
+    int64 Ext2Driver::AllocINode(uint64 group, bool directory, uint64& outID) {
+        // Revision 0 reserves the first 10 inodes
+        uint64 firstINode = m_SB.versionMajor >= 1 ? m_SB.firstUsableINode : 11;
+
+        m_AllocLock.Lock();
+        for(uint64 i = 0; i < m_NumGroups; i++) {
+            uint64 g = (group + i) % m_NumGroups;
+            if(m_Groups[g].freeINodes == 0)
+                continue;
+
+            LoadBitmaps(g);
+            GroupState& state = m_GroupStates[g];
+            for(uint64 bit = 0; bit < m_SB.inodesPerGroup; bit++) {
+                uint64 id = g * m_SB.inodesPerGroup + bit + 1;
+                if(id < firstINode || TestBit(state.inodeBitmap, bit))
+                    continue;
+
+                SetBit(state.inodeBitmap, bit);
+                m_Groups[g].freeINodes--;
+                m_SB.freeINodeCount--;
+                if(directory)
+                    m_Groups[g].numDirectories++;
+                state.bitmapsDirty = true;
+                m_GroupsDirty = true;
+
+                m_AllocLock.Unlock();
+                outID = id;
+                return OK;
+            }
+        }
+        m_AllocLock.Unlock();
+        return ErrorNoSpace;
+    }
+    void Ext2Driver::FreeINode(uint64 id, bool directory) {
+        uint64 group = (id - 1) / m_SB.inodesPerGroup;
+        uint64 bit = (id - 1) % m_SB.inodesPerGroup;
+
+        m_AllocLock.Lock();
+        LoadBitmaps(group);
+        GroupState& state = m_GroupStates[group];
+        if(TestBit(state.inodeBitmap, bit)) {
+            ClearBit(state.inodeBitmap, bit);
+            m_Groups[group].freeINodes++;
+            m_SB.freeINodeCount++;
+            if(directory)
+                m_Groups[group].numDirectories--;
+            state.bitmapsDirty = true;
+            m_GroupsDirty = true;
+        }
+        m_AllocLock.Unlock();
+    }
+
+    uint64 Ext2Driver::AllocBlocks(uint64 goal, uint64 count, uint64& outCount) {
+        uint64 blocksPerGroup = m_SB.blocksPerGroup;
+        if(goal < m_FirstDataBlock || goal >= m_SB.blockCount)
+            goal = m_FirstDataBlock;
+        uint64 goalGroup = (goal - m_FirstDataBlock) / blocksPerGroup;
+
+        m_AllocLock.Lock();
+        // The group of the goal is searched twice, first from the goal onwards and at the end from its start
+        for(uint64 i = 0; i <= m_NumGroups; i++) {
+            uint64 g = (goalGroup + i) % m_NumGroups;
+            if(m_Groups[g].freeBlocks == 0)
+                continue;
+
+            uint64 groupStart = m_FirstDataBlock + g * blocksPerGroup;
+            uint64 groupBlocks = blocksPerGroup;
+            if(groupStart + groupBlocks > m_SB.blockCount)
+                groupBlocks = m_SB.blockCount - groupStart;
+
+            LoadBitmaps(g);
+            GroupState& state = m_GroupStates[g];
+            for(uint64 bit = (i == 0 ? goal - groupStart : 0); bit < groupBlocks; bit++) {
+                // Skip over completely used bytes
+                if(bit % 8 == 0 && state.blockBitmap[bit / 8] == 0xFF) {
+                    bit += 7;
+                    continue;
+                }
+                if(TestBit(state.blockBitmap, bit))
+                    continue;
+
+                uint64 n = 0;
+                while(n < count && bit + n < groupBlocks && !TestBit(state.blockBitmap, bit + n)) {
+                    SetBit(state.blockBitmap, bit + n);
+                    n++;
+                }
+                m_Groups[g].freeBlocks -= n;
+                m_SB.freeBlockCount -= n;
+                state.bitmapsDirty = true;
+                m_GroupsDirty = true;
+
+                m_AllocLock.Unlock();
+                outCount = n;
+                return groupStart + bit;
+            }
+        }
+        m_AllocLock.Unlock();
+
+        outCount = 0;
         return 0;
     }
-    void Ext2Driver::ClearNodeData(VFS::Node* node) { }
+    void Ext2Driver::FreeBlocks(uint64 start, uint64 count) {
+        m_AllocLock.Lock();
+        for(uint64 block = start; block < start + count; block++) {
+            uint64 group = (block - m_FirstDataBlock) / m_SB.blocksPerGroup;
+            uint64 bit = (block - m_FirstDataBlock) % m_SB.blocksPerGroup;
+
+            LoadBitmaps(group);
+            GroupState& state = m_GroupStates[group];
+            if(!TestBit(state.blockBitmap, bit))
+                continue;
+
+            ClearBit(state.blockBitmap, bit);
+            m_Groups[group].freeBlocks++;
+            m_SB.freeBlockCount++;
+            state.bitmapsDirty = true;
+            m_GroupsDirty = true;
+        }
+        m_AllocLock.Unlock();
+    }
+    void Ext2Driver::FreeBlockList(const uint32* pointers, uint64 count) {
+        // Free physically contiguous blocks together
+        uint64 start = 0;
+        for(uint64 i = 1; i <= count; i++) {
+            if(i < count && pointers[start] != 0 && pointers[i] == pointers[start] + (i - start))
+                continue;
+
+            if(pointers[start] != 0)
+                FreeBlocks(pointers[start], i - start);
+            start = i;
+        }
+    }
+    void Ext2Driver::FreePointerTree(uint64 blockID, uint64 depth) {
+        if(blockID == 0)
+            return;
+
+        uint64 pointersPerBlock = m_BlockSize / 4;
+        uint32* pointers = new uint32[pointersPerBlock];
+        m_Driver->GetData(m_Dev, blockID * m_BlockSize, pointers, m_BlockSize);
+        if(depth == 0) {
+            FreeBlockList(pointers, pointersPerBlock);
+        } else {
+            for(uint64 i = 0; i < pointersPerBlock; i++)
+                FreePointerTree(pointers[i], depth - 1);
+        }
+        delete[] pointers;
+
+        FreeBlocks(blockID, 1);
+    }
+    void Ext2Driver::FreeAllBlocks(NodeInfo* info) {
+        INode& inode = info->inode;
+
+        uint32 pointers[INode_NumDirectPointers];
+        kmemcpy(pointers, inode.directPointers, sizeof(pointers));
+        FreeBlockList(pointers, INode_NumDirectPointers);
+        FreePointerTree(inode.indirectPointer, 0);
+        FreePointerTree(inode.doubleIndirectPointer, 1);
+        FreePointerTree(inode.tripleIndirectPointer, 2);
+
+        for(uint64 i = 0; i < INode_NumDirectPointers; i++)
+            inode.directPointers[i] = 0;
+        inode.indirectPointer = 0;
+        inode.doubleIndirectPointer = 0;
+        inode.tripleIndirectPointer = 0;
+        inode.sectorCount = 0;
+
+        InvalidateBlockMap(info);
+    }
+
+    bool Ext2Driver::ReserveBlocks(uint64 count) {
+        m_AllocLock.Lock();
+        // Leave room for the pointer blocks that the reserved blocks are going to need
+        uint64 needed = m_ReservedBlocks + count;
+        needed += needed / (m_BlockSize / 4) + 3;
+        bool res = m_SB.freeBlockCount >= needed;
+        if(res)
+            m_ReservedBlocks += count;
+        m_AllocLock.Unlock();
+        return res;
+    }
+    void Ext2Driver::UnreserveBlocks(uint64 count) {
+        m_AllocLock.Lock();
+        m_ReservedBlocks -= count;
+        m_AllocLock.Unlock();
+    }
+
+    static uint32 GetRootPointer(const INode& inode, uint64 depth) {
+        if(depth == 0)
+            return inode.indirectPointer;
+        if(depth == 1)
+            return inode.doubleIndirectPointer;
+        return inode.tripleIndirectPointer;
+    }
+    static void SetRootPointer(INode& inode, uint64 depth, uint32 blockID) {
+        if(depth == 0)
+            inode.indirectPointer = blockID;
+        else if(depth == 1)
+            inode.doubleIndirectPointer = blockID;
+        else
+            inode.tripleIndirectPointer = blockID;
+    }
+
+    uint64 Ext2Driver::AllocPointerBlock(NodeInfo* info, uint64 goal) {
+        uint64 count;
+        uint64 blockID = AllocBlocks(goal, 1, count);
+        if(blockID == 0)
+            return 0;
+
+        uint8* zero = new uint8[m_BlockSize];
+        kmemset(zero, 0, m_BlockSize);
+        m_Driver->SetData(m_Dev, blockID * m_BlockSize, zero, m_BlockSize);
+        delete[] zero;
+
+        info->inode.sectorCount += m_BlockSize / 512;
+        return blockID;
+    }
+
+    bool Ext2Driver::GetLeafBlock(NodeInfo* info, uint64 index, uint64 goal, uint64& outLeaf, uint64& outBase) {
+        uint64 pointersPerBlock = m_BlockSize / 4;
+
+        uint64 base = INode_NumDirectPointers;
+        uint64 numBlocks = pointersPerBlock;
+        for(uint64 depth = 0; depth < 3; depth++) {
+            if(index >= base + numBlocks) {
+                base += numBlocks;
+                numBlocks *= pointersPerBlock;
+                continue;
+            }
+
+            uint64 blockID = GetRootPointer(info->inode, depth);
+            if(blockID == 0) {
+                blockID = AllocPointerBlock(info, goal);
+                if(blockID == 0)
+                    return false;
+                SetRootPointer(info->inode, depth, blockID);
+            }
+
+            for(uint64 level = depth; level > 0; level--) {
+                uint64 span = numBlocks / pointersPerBlock;
+                uint64 entry = (index - base) / span;
+                uint64 entryPos = blockID * m_BlockSize + entry * 4;
+
+                uint32 next;
+                m_Driver->GetData(m_Dev, entryPos, &next, sizeof(next));
+                if(next == 0) {
+                    next = (uint32)AllocPointerBlock(info, goal);
+                    if(next == 0)
+                        return false;
+                    m_Driver->SetData(m_Dev, entryPos, &next, sizeof(next));
+                }
+
+                blockID = next;
+                base += entry * span;
+                numBlocks = span;
+            }
+
+            outLeaf = blockID;
+            outBase = base;
+            return true;
+        }
+        return false;
+    }
+
+    uint64 Ext2Driver::SetBlockPointers(NodeInfo* info, uint64 index, uint64 physical, uint64 count) {
+        uint64 pointersPerBlock = m_BlockSize / 4;
+
+        uint64 done = 0;
+        while(done < count) {
+            if(index + done < INode_NumDirectPointers) {
+                info->inode.directPointers[index + done] = (uint32)(physical + done);
+                done++;
+                continue;
+            }
+
+            uint64 leaf, base;
+            if(!GetLeafBlock(info, index + done, physical + done, leaf, base))
+                break;
+
+            // Set all entries of the leaf that belong to the range at once
+            uint64 n = base + pointersPerBlock - (index + done);
+            if(n > count - done)
+                n = count - done;
+
+            uint32* pointers = new uint32[n];
+            for(uint64 i = 0; i < n; i++)
+                pointers[i] = (uint32)(physical + done + i);
+            m_Driver->SetData(m_Dev, leaf * m_BlockSize + (index + done - base) * 4, pointers, n * 4);
+            delete[] pointers;
+
+            done += n;
+        }
+        return done;
+    }
+
+    uint64 Ext2Driver::GetAllocGoal(NodeInfo* info, uint64 index) {
+        // Continue behind the block before, so that the node stays contiguous
+        if(index > 0) {
+            uint64 runLength;
+            uint64 prev = MapBlock(info, index - 1, runLength);
+            if(prev != 0)
+                return prev + 1;
+        }
+
+        // Otherwise start in the group of the inode
+        uint64 group = (info->node->id - 1) / m_SB.inodesPerGroup;
+        return m_FirstDataBlock + group * m_SB.blocksPerGroup;
+    }
+
+    // Returns the position of the first block in blocks whose index is not below index
+    static uint64 FindDataBlockPos(const std::vector<DataBlock>& blocks, uint64 index) {
+        uint64 low = 0;
+        uint64 high = blocks.size();
+        while(low < high) {
+            uint64 mid = (low + high) / 2;
+            if(blocks[mid].index < index)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return low;
+    }
+
+    DataBlock* Ext2Driver::FindDataBlock(NodeInfo* info, uint64 index) {
+        std::vector<DataBlock>& blocks = info->dirtyBlocks;
+        uint64 pos = FindDataBlockPos(blocks, index);
+        if(pos < blocks.size() && blocks[pos].index == index)
+            return &blocks[pos];
+        return nullptr;
+    }
+
+    DataBlock* Ext2Driver::GetDataBlock(NodeInfo* info, uint64 index, bool overwrite, bool& outCreated) {
+        std::vector<DataBlock>& blocks = info->dirtyBlocks;
+        uint64 pos = FindDataBlockPos(blocks, index);
+        outCreated = false;
+        if(pos < blocks.size() && blocks[pos].index == index)
+            return &blocks[pos];
+
+        uint64 size = GetSize(info->inode);
+        uint64 runLength;
+        uint64 physical = index * m_BlockSize < size ? MapBlock(info, index, runLength) : 0;
+        // The block is only allocated by the writeback, but there has to be space for it already
+        if(physical == 0 && !ReserveBlocks(1))
+            return nullptr;
+
+        uint8* data = new uint8[m_BlockSize];
+        if(physical == 0) {
+            kmemset(data, 0, m_BlockSize);
+        } else if(!overwrite) {
+            m_Driver->GetData(m_Dev, physical * m_BlockSize, data, m_BlockSize);
+            // Everything behind the end of the node reads as zeros
+            uint64 blockEnd = (index + 1) * m_BlockSize;
+            if(size < blockEnd)
+                kmemset(data + size - index * m_BlockSize, 0, blockEnd - size);
+        }
+
+        blocks.insert(blocks.begin() + pos, DataBlock { index, data, physical == 0 });
+        outCreated = true;
+        return &blocks[pos];
+    }
+
+    int64 Ext2Driver::WriteData(Node* node, NodeInfo* info, uint64 pos, const void* buffer, uint64 size) {
+        const uint8* realBuffer = (const uint8*)buffer;
+        uint64 oldSize = GetSize(info->inode);
+        bool created;
+
+        // The rest of the old last block has to read as zeros once the node grows behind it
+        if(pos > oldSize && oldSize % m_BlockSize != 0) {
+            if(GetDataBlock(info, oldSize / m_BlockSize, false, created) == nullptr)
+                return ErrorNoSpace;
+        }
+
+        uint64 written = 0;
+        int64 error = OK;
+        while(written < size) {
+            uint64 index = (pos + written) / m_BlockSize;
+            uint64 offset = (pos + written) % m_BlockSize;
+            uint64 count = m_BlockSize - offset;
+            if(count > size - written)
+                count = size - written;
+
+            // A block that is overwritten completely does not have to be read first
+            DataBlock* block = GetDataBlock(info, index, count == m_BlockSize, created);
+            if(block == nullptr) {
+                error = ErrorNoSpace;
+                break;
+            }
+            if(!kmemcpy_usersafe(block->data + offset, realBuffer + written, count)) {
+                // A new block might not have been read, so it must not stay around
+                if(created) {
+                    if(block->reserved)
+                        UnreserveBlocks(1);
+                    delete[] block->data;
+                    info->dirtyBlocks.erase(info->dirtyBlocks.begin() + (block - info->dirtyBlocks.data()));
+                }
+                error = ErrorInvalidBuffer;
+                break;
+            }
+            written += count;
+        }
+
+        if(pos + written > oldSize)
+            SetSize(node, info, pos + written);
+
+        if(error == ErrorInvalidBuffer || (error != OK && written == 0))
+            return error;
+        return written;
+    }
+
+    void Ext2Driver::DropData(NodeInfo* info) {
+        uint64 reserved = 0;
+        for(DataBlock& block : info->dirtyBlocks) {
+            if(block.reserved)
+                reserved++;
+            delete[] block.data;
+        }
+        info->dirtyBlocks.clear();
+
+        if(reserved != 0)
+            UnreserveBlocks(reserved);
+    }
+
+    void Ext2Driver::FlushData(NodeInfo* info) {
+        std::vector<DataBlock>& blocks = info->dirtyBlocks;
+        uint64 sectorsPerBlock = m_BlockSize / 512;
+
+        uint64 i = 0;
+        while(i < blocks.size()) {
+            uint64 first = blocks[i].index;
+            uint64 count = 1;
+            uint64 physical;
+
+            if(blocks[i].reserved) {
+                // Delayed allocation, a run of new blocks is allocated at once right behind the block before it
+                while(i + count < blocks.size() && blocks[i + count].reserved && blocks[i + count].index == first + count)
+                    count++;
+
+                uint64 allocated;
+                physical = AllocBlocks(GetAllocGoal(info, first), count, allocated);
+                if(physical == 0)
+                    break;
+
+                uint64 mapped = SetBlockPointers(info, first, physical, allocated);
+                if(mapped < allocated)
+                    FreeBlocks(physical + mapped, allocated - mapped);
+                info->inode.sectorCount += mapped * sectorsPerBlock;
+                InvalidateBlockMap(info);
+                if(mapped == 0)
+                    break;
+
+                count = mapped;
+                for(uint64 j = 0; j < count; j++)
+                    blocks[i + j].reserved = false;
+                UnreserveBlocks(count);
+            } else {
+                // Already allocated, continue over the blocks that are physically contiguous
+                uint64 runLength;
+                physical = MapBlock(info, first, runLength);
+                if(physical == 0)
+                    break;
+                while(i + count < blocks.size() && count < runLength && !blocks[i + count].reserved && blocks[i + count].index == first + count)
+                    count++;
+            }
+
+            // One device operation per physically contiguous run
+            if(count == 1) {
+                m_Driver->SetData(m_Dev, physical * m_BlockSize, blocks[i].data, m_BlockSize);
+            } else {
+                uint8* buffer = new uint8[count * m_BlockSize];
+                for(uint64 j = 0; j < count; j++)
+                    kmemcpy(buffer + j * m_BlockSize, blocks[i + j].data, m_BlockSize);
+                m_Driver->SetData(m_Dev, physical * m_BlockSize, buffer, count * m_BlockSize);
+                delete[] buffer;
+            }
+
+            for(uint64 j = 0; j < count; j++)
+                delete[] blocks[i + j].data;
+            i += count;
+        }
+
+        if(i < blocks.size()) {
+            klog_error("Ext2", "Device is full, dropping %i unwritten blocks of node %i", blocks.size() - i, info->node->id);
+
+            uint64 reserved = 0;
+            for(; i < blocks.size(); i++) {
+                if(blocks[i].reserved)
+                    reserved++;
+                delete[] blocks[i].data;
+            }
+            UnreserveBlocks(reserved);
+        }
+        blocks.clear();
+    }
+
+    /**
+     * Appends a directory entry at pos. Entries never cross a block boundary, the entry before a boundary covers the
+     * rest of its block.
+     **/
+    static void AppendDirEntry(uint8* buffer, uint64 blockSize, uint64& pos, uint64& lastEntry, uint64 inode, const char* name, uint64 nameLength, uint8 type) {
+        uint64 entrySize = (sizeof(DirEntry) + nameLength + 3) & ~(uint64)3;
+        if(pos % blockSize + entrySize > blockSize) {
+            uint64 rest = blockSize - pos % blockSize;
+            ((DirEntry*)(buffer + lastEntry))->entrySize += rest;
+            pos += rest;
+        }
+
+        DirEntry* entry = (DirEntry*)(buffer + pos);
+        entry->inode = (uint32)inode;
+        entry->entrySize = (uint16)entrySize;
+        entry->nameLengthLow = (uint8)nameLength;
+        entry->type = type;
+        kmemcpy(entry->name, name, nameLength);
+
+        lastEntry = pos;
+        pos += entrySize;
+    }
+
+    // Sorts ids in place, heapsort
+    static void SortIDs(uint64* ids, uint64 count) {
+        auto siftDown = [ids](uint64 root, uint64 end) {
+            while(root * 2 + 1 < end) {
+                uint64 child = root * 2 + 1;
+                if(child + 1 < end && ids[child + 1] > ids[child])
+                    child++;
+                if(ids[root] >= ids[child])
+                    return;
+                uint64 tmp = ids[root];
+                ids[root] = ids[child];
+                ids[child] = tmp;
+                root = child;
+            }
+        };
+
+        for(uint64 i = count / 2; i > 0; i--)
+            siftDown(i - 1, count);
+        for(uint64 end = count; end > 1; end--) {
+            uint64 tmp = ids[0];
+            ids[0] = ids[end - 1];
+            ids[end - 1] = tmp;
+            siftDown(0, end - 1);
+        }
+    }
+    static bool ContainsID(const uint64* ids, uint64 count, uint64 id) {
+        uint64 low = 0;
+        uint64 high = count;
+        while(low < high) {
+            uint64 mid = (low + high) / 2;
+            if(ids[mid] < id)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return low < count && ids[low] == id;
+    }
+
+    void Ext2Driver::WriteDir(Node* node, NodeInfo* info) {
+        // Entries that are still on the device would be lost otherwise
+        if(info->dirComplete.Read() == 0)
+            ScanDir(node, info, nullptr, 0);
+
+        // Copy the entries out, the types of the entries cannot be read while the dirLock is held
+        node->dirLock.Spinlock();
+        Directory* dir = node->infoFolder.cachedDir;
+        if(dir->version == info->dirVersion) {
+            node->dirLock.Unlock();
+            return;
+        }
+        uint64 version = dir->version;
+        uint64 numEntries = dir->numEntries;
+        uint64 namesSize = 0;
+        for(DirectoryEntry* e = dir->GetFirstEntry(); e != nullptr; e = dir->GetNextEntry(e))
+            namesSize += e->nameLength;
+
+        uint64* ids = new uint64[numEntries];
+        uint64* nameLengths = new uint64[numEntries];
+        char* names = new char[namesSize];
+        uint64 n = 0;
+        uint64 nameOffset = 0;
+        for(DirectoryEntry* e = dir->GetFirstEntry(); e != nullptr; e = dir->GetNextEntry(e)) {
+            ids[n] = e->nodeID;
+            nameLengths[n] = e->nameLength;
+            kmemcpy(names + nameOffset, dir->GetName(e), e->nameLength);
+            nameOffset += e->nameLength;
+            n++;
+        }
+        node->dirLock.Unlock();
+
+        bool hasTypes = m_SB.versionMajor >= 1 && (m_SB.requiredFeatures & RequiredFeature_DirectoryType);
+        uint64 oldSize = GetSize(info->inode);
+        uint64 oldBlocks = (oldSize + m_BlockSize - 1) / m_BlockSize;
+
+        // Every block is filled at least until the largest possible entry does not fit anymore
+        uint64 maxEntrySize = (sizeof(DirEntry) + 255 + 3) & ~(uint64)3;
+        uint64 contentSize = 2 * maxEntrySize + numEntries * (sizeof(DirEntry) + 3) + namesSize;
+        uint64 numBlocks = contentSize / (m_BlockSize - maxEntrySize) + 1;
+        if(numBlocks < oldBlocks)
+            numBlocks = oldBlocks;
+
+        uint8* buffer = new uint8[numBlocks * m_BlockSize];
+        kmemset(buffer, 0, numBlocks * m_BlockSize);
+
+        uint64 pos = 0;
+        uint64 lastEntry = 0;
+        uint8 dirType = hasTypes ? DirEntry_TypeDirectory : DirEntry_TypeUnknown;
+        AppendDirEntry(buffer, m_BlockSize, pos, lastEntry, node->id, ".", 1, dirType);
+        AppendDirEntry(buffer, m_BlockSize, pos, lastEntry, info->parentID != 0 ? info->parentID : node->id, "..", 2, dirType);
+
+        uint64 subdirCount = 0;
+        nameOffset = 0;
+        for(uint64 i = 0; i < numEntries; i++) {
+            INode child;
+            ReadINode(ids[i], &child);
+            uint8 type = GetDirEntryType(child.typePermissions);
+            if(type == DirEntry_TypeDirectory)
+                subdirCount++;
+
+            AppendDirEntry(buffer, m_BlockSize, pos, lastEntry, ids[i], names + nameOffset, nameLengths[i], hasTypes ? type : DirEntry_TypeUnknown);
+            nameOffset += nameLengths[i];
+        }
+        if(pos % m_BlockSize != 0) {
+            uint64 rest = m_BlockSize - pos % m_BlockSize;
+            ((DirEntry*)(buffer + lastEntry))->entrySize += rest;
+            pos += rest;
+        }
+
+        // Directories never shrink, blocks that are not needed anymore keep a single unused entry
+        for(; pos < oldBlocks * m_BlockSize; pos += m_BlockSize)
+            ((DirEntry*)(buffer + pos))->entrySize = m_BlockSize;
+
+        int64 error = WriteData(node, info, 0, buffer, pos);
+        delete[] buffer;
+        delete[] names;
+        delete[] nameLengths;
+
+        if(error < 0) {
+            klog_error("Ext2", "Failed to write directory %i", node->id);
+        } else {
+            info->subdirCount = subdirCount;
+            info->dirVersion = version;
+            ReleaseNewNodes(node->id, ids, numEntries);
+        }
+        delete[] ids;
+    }
+
+    void Ext2Driver::BuildINode(Node* node, NodeInfo* info) {
+        INode& inode = info->inode;
+
+        // The setgid and sticky bits have no counterpart in the VFS and are kept as they are
+        uint16 mode = inode.typePermissions & 0x0600;
+        mode |= ToModeBits(node->permissions.ownerPermissions) << 6;
+        mode |= ToModeBits(node->permissions.groupPermissions) << 3;
+        mode |= ToModeBits(node->permissions.otherPermissions);
+        if(node->permissions.specialFlags & Permissions::SetUID)
+            mode |= INode_SetUID;
+        inode.typePermissions = GetINodeType(node->type) | mode;
+
+        inode.userID = (uint16)node->ownerUID;
+        inode.groupID = (uint16)node->ownerGID;
+
+        // "." and the ".." of every subdirectory count as links of a directory
+        if(node->type == Node::TYPE_DIRECTORY)
+            inode.hardlinkCount = (uint16)(node->linkCount.Read() + 1 + info->subdirCount);
+        else
+            inode.hardlinkCount = (uint16)node->linkCount.Read();
+
+        if(node->type == Node::TYPE_DEVICE_CHAR || node->type == Node::TYPE_DEVICE_BLOCK) {
+            inode.directPointers[0] = (uint32)node->infoDevice.driverID;
+            inode.directPointers[1] = (uint32)node->infoDevice.subID;
+        }
+    }
+
+    void Ext2Driver::FlushNode(Node* node, NodeInfo* info) {
+        info->dataLock.Lock();
+
+        if(node->type == Node::TYPE_DIRECTORY)
+            WriteDir(node, info);
+
+        const char* linkPath = node->type == Node::TYPE_SYMLINK ? node->infoSymlink.linkPath : nullptr;
+        if(linkPath != nullptr && GetSize(info->inode) == 0) {
+            uint64 length = kstrlen(linkPath);
+            if(length < InlineLinkSize) {
+                kmemcpy(GetInlineLink(info->inode), linkPath, length);
+                info->inode.size = (uint32)length;
+            } else if(WriteData(node, info, 0, linkPath, length) < 0) {
+                klog_error("Ext2", "Failed to write symlink %i", node->id);
+            }
+        }
+
+        FlushData(info);
+        BuildINode(node, info);
+
+        // Nodes are flushed on every writeback, most of them without any change to their inode
+        const uint8* a = (const uint8*)&info->inode;
+        const uint8* b = (const uint8*)&info->diskINode;
+        bool changed = false;
+        for(uint64 i = 0; i < sizeof(INode) && !changed; i++)
+            changed = a[i] != b[i];
+        if(changed) {
+            WriteINode(node->id, &info->inode);
+            info->diskINode = info->inode;
+        }
+
+        info->dataLock.Unlock();
+    }
+
+    void Ext2Driver::FlushAllocState() {
+        m_AllocLock.Lock();
+        for(uint64 i = 0; i < m_NumGroups; i++) {
+            GroupState& state = m_GroupStates[i];
+            if(!state.bitmapsDirty)
+                continue;
+
+            m_Driver->SetData(m_Dev, m_Groups[i].blockBitmapBlock * m_BlockSize, state.blockBitmap, m_BlockSize);
+            m_Driver->SetData(m_Dev, m_Groups[i].inodeBitmapBlock * m_BlockSize, state.inodeBitmap, m_BlockSize);
+            state.bitmapsDirty = false;
+        }
+        if(m_GroupsDirty) {
+            m_Driver->SetData(m_Dev, (m_FirstDataBlock + 1) * m_BlockSize, m_Groups, m_NumGroups * sizeof(BlockGroupDesc));
+            m_Driver->SetData(m_Dev, 1024, &m_SB, sizeof(SuperBlock));
+            m_GroupsDirty = false;
+        }
+        m_AllocLock.Unlock();
+    }
+
+    void Ext2Driver::MarkDirty(NodeInfo* info) {
+        m_DirtyLock.Lock();
+        // New nodes are moved to the dirty list once their directory entry was written
+        if(info->list == NodeList_None) {
+            m_DirtyNodes.push_back(info);
+            info->list = NodeList_Dirty;
+        }
+        m_DirtyLock.Unlock();
+    }
+    void Ext2Driver::RemoveDirty(NodeInfo* info) {
+        m_DirtyLock.Lock();
+        if(info->list == NodeList_Dirty)
+            m_DirtyNodes.erase(NodeList::Iterator(info));
+        else if(info->list == NodeList_New)
+            m_NewNodes.erase(NodeList::Iterator(info));
+        info->list = NodeList_None;
+        m_DirtyLock.Unlock();
+    }
+
+    void Ext2Driver::ReleaseNewNodes(uint64 dirID, uint64* ids, uint64 numIDs) {
+        bool sorted = false;
+
+        m_DirtyLock.Lock();
+        NodeInfo* info = m_NewNodes.empty() ? nullptr : &m_NewNodes.front();
+        while(info != nullptr) {
+            NodeInfo* next = info->dirtyAnchor.next;
+            if(info->parentID == dirID) {
+                if(!sorted) {
+                    SortIDs(ids, numIDs);
+                    sorted = true;
+                }
+                if(ContainsID(ids, numIDs, info->node->id)) {
+                    m_NewNodes.erase(NodeList::Iterator(info));
+                    m_DirtyNodes.push_back(info);
+                    info->list = NodeList_Dirty;
+                }
+            }
+            info = next;
+        }
+        m_DirtyLock.Unlock();
+    }
+
+    void Ext2Driver::Sync() {
+        m_SyncLock.Lock();
+
+        // Nodes that become dirty while the writeback runs are left for the next one
+        m_DirtyLock.Lock();
+        NodeInfo* last = m_DirtyNodes.empty() ? nullptr : &m_DirtyNodes.back();
+        m_DirtyLock.Unlock();
+
+        while(last != nullptr) {
+            m_DirtyLock.Lock();
+            NodeInfo* info = &m_DirtyNodes.front();
+            m_DirtyNodes.pop_front();
+            info->list = NodeList_None;
+            m_DirtyLock.Unlock();
+
+            // Nodes are only freed while m_SyncLock is not held, so info stays valid
+            FlushNode(info->node, info);
+            if(info == last)
+                break;
+        }
+        FlushAllocState();
+        m_SyncLock.Unlock();
+    }
 
     static FileSystem* Ext2Factory(BlockDeviceDriver* driver, uint64 subID) {
         return new Ext2Driver(driver, subID);
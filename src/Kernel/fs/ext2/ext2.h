@@ -1,6 +1,11 @@
 #pragma once
 
 #include "../FileSystem.h"
+#include "locks/QueueLock.h"
+#include "locks/WaitQueue.h"
+#include "ktl/AnchorList.h"
+
+#include <vector>
 
 namespace Ext2 {
 
@@ -62,6 +67,8 @@ namespace Ext2 {
         uint16 freeBlocks;
         uint16 freeINodes;
         uint16 numDirectories;
+        uint16 padding;
+        char reserved[12];
     };
 
     struct __attribute__((packed)) INode {
@@ -99,6 +106,111 @@ namespace Ext2 {
     constexpr uint16 INode_TypeSymLink = 0xA000;
     constexpr uint16 INode_TypeUnixSocket = 0xC000;
     constexpr uint16 INode_TypeMask = 0xF000;
+    constexpr uint16 INode_SetUID = 0x0800;
+
+    // Number of block pointers stored directly in an INode
+    constexpr uint64 INode_NumDirectPointers = 12;
+
+    // Logically consecutive blocks of a node that are also physically consecutive on the device
+    struct BlockRun {
+        uint64 logicalStart;
+        uint64 physicalStart;   // 0 for a run of holes
+        uint64 count;
+    };
+
+    // Number of inode table blocks that are kept in memory
+    constexpr uint64 INodeBlockCacheSize = 16;
+
+    struct INodeBlock {
+        uint64 blockID;     // 0 if the slot is unused
+        uint64 lastUse;
+        uint8* data;
+    };
+
+    // Sequential readahead starts with ReadAheadMinSize bytes and doubles up to ReadAheadMaxSize while reads stay sequential
+    constexpr uint64 ReadAheadMinSize = 16 * 1024;
+    constexpr uint64 ReadAheadMaxSize = 512 * 1024;
+    // Number of sequential readers of a node whose readahead is tracked independently
+    constexpr uint64 ReadAheadNumStreams = 4;
+
+    // Written data is kept in memory and only allocated on the device by the writeback, which runs every WritebackInterval ms
+    constexpr uint64 WritebackInterval = 5000;
+    // A node with more unwritten data than this is written back by the writing thread itself
+    constexpr uint64 WritebackMaxDirtySize = 1024 * 1024;
+
+    // A block of written data that is not on the device yet
+    struct DataBlock {
+        uint64 index;       // logical block index
+        uint8* data;
+        bool reserved;      // the block has no physical block yet, one free block is reserved for it
+    };
+
+    // The bitmaps of a block group, read when the group is used for the first time
+    struct GroupState {
+        uint8* blockBitmap;
+        uint8* inodeBitmap;
+        bool bitmapsDirty;
+    };
+
+    // The node list of the driver that NodeInfo::dirtyAnchor is linked into
+    constexpr uint8 NodeList_None = 0;
+    constexpr uint8 NodeList_Dirty = 1;
+    constexpr uint8 NodeList_New = 2;
+
+    struct ReadAheadStream {
+        uint64 nextPos;     // position at which the last read of the stream ended
+        uint64 window;      // readahead window in blocks, 0 if the stream is unused
+        uint64 aheadEnd;    // logical block up to which the stream has read ahead
+        uint64 lastUse;
+    };
+
+    /**
+     * The in-memory data of a node, Node::fsData points to it.
+     * runs caches every logical to physical block mapping that was resolved so far, sorted by logicalStart.
+     * Pointer blocks are read once per resolve, the upper levels of double and triple indirect lookups are kept
+     * so that neighbouring lookups do not read them again.
+     **/
+    struct NodeInfo {
+        INode inode;
+
+        QueueLock mapLock;
+        std::vector<BlockRun> runs;
+        // upperBlocks[d] is the last pointer block read d + 1 levels above the leaf pointer blocks
+        uint32 upperBlockIDs[2];
+        uint32* upperBlocks[2];
+
+        // A read continues a stream if it starts where the stream's last read ended, otherwise it replaces the least recently used one
+        StickyLock streamLock;
+        ReadAheadStream streams[ReadAheadNumStreams];
+        uint64 streamClock;
+
+        // Directories are parsed one block at a time when a name is looked up, dirScanPos is the position of the next block to parse
+        QueueLock dirScanLock;
+        uint64 dirScanPos;
+        Atomic<uint64> dirComplete;
+
+        VFS::Node* node;
+        ktl::Anchor<NodeInfo> dirtyAnchor;
+        uint8 list;
+
+        // Serializes reads, writes, writeback and truncation of the node's data
+        QueueLock dataLock;
+        // Sorted by index
+        std::vector<DataBlock> dirtyBlocks;
+        // The inode as it was last written to the device
+        INode diskINode;
+
+        // Number of GetDirectData pointers that were not released yet, writes and truncation wait until there are none
+        StickyLock directLock;
+        uint64 directUsers;
+        WaitQueue directWaiters;
+
+        // For directories the ID of the parent directory, for nodes on the new list the directory they are created in
+        uint64 parentID;
+        // Directories only
+        uint64 subdirCount;
+        uint64 dirVersion;      // version of cachedDir that was last written
+    };
 
     struct __attribute__((packed)) DirEntry {
         uint32 inode;
@@ -128,25 +240,179 @@ namespace Ext2 {
         void SetMountPoint(VFS::MountPoint* mp) override;
         void PrepareUnmount() override;
 
-        void CreateNode(VFS::Node* node) override;
+        int64 CreateNode(VFS::Node* parent, VFS::Node* node) override;
         void DestroyNode(VFS::Node* node) override;
 
         void UpdateDir(VFS::Node* node) override;
+        void LoadDirEntries(VFS::Node* node, const char* name, uint64 nameLength) override;
+        void DirEntriesChanged(VFS::Node* node) override;
 
         void ReadNode(uint64 id, VFS::Node* node) override; 
         void WriteNode(VFS::Node* node) override;
+        void EvictNode(VFS::Node* node) override;
 
         uint64 ReadNodeData(VFS::Node* node, uint64 pos, void* buffer, uint64 bufferSize) override;
         uint64 WriteNodeData(VFS::Node* node, uint64 pos, const void* buffer, uint64 bufferSize) override;
         void ClearNodeData(VFS::Node* node) override;
 
+        int64 SyncNode(VFS::Node* node) override;
+
+        const void* GetDirectData(VFS::Node* node, uint64 pos, uint64 size) override;
+        void ReleaseDirectData(VFS::Node* node) override;
+
+    private:
+        uint64 GetSize(const INode& inode) const;
+
+        /**
+         * Copies the inode with the given ID out of the inode table block cache
+         **/
+        void ReadINode(uint64 id, INode* inode);
+        uint64 GetINodePos(uint64 id) const;
+        /**
+         * Parses the directory block at info->dirScanPos into the node's cachedDir.
+         * info->dirScanLock has to be held.
+         **/
+        void ScanDirBlock(VFS::Node* node, NodeInfo* info);
+
+        /**
+         * Returns the physical block of the given logical block of the node, or 0 if the block is a hole.
+         * outCount receives the number of blocks from index to the end of its run.
+         **/
+        uint64 MapBlock(NodeInfo* info, uint64 index, uint64& outCount);
+        const BlockRun* FindRun(NodeInfo* info, uint64 index) const;
+        void AddRun(NodeInfo* info, uint64 logicalStart, uint64 physicalStart, uint64 count);
+        void AddRuns(NodeInfo* info, uint64 logicalStart, const uint32* pointers, uint64 count);
+        /**
+         * Resolves all blocks mapped by the pointer block blockID that covers index.
+         * depth is the number of pointer levels below blockID, every entry of blockID maps numBlocks / (m_BlockSize / 4) blocks.
+         **/
+        void ResolveIndirect(NodeInfo* info, uint64 blockID, uint64 depth, uint64 base, uint64 numBlocks, uint64 index);
+        void ResolveBlocks(NodeInfo* info, uint64 index);
+
+        /**
+         * Loads the logical blocks [start, end) of the node into the device cache, one device operation per physically contiguous run
+         **/
+        void PrefetchBlocks(NodeInfo* info, uint64 start, uint64 end);
+        /**
+         * Returns a kernel pointer to the physical blocks [blockID, blockID + count) if the device supports direct access, or nullptr
+         **/
+        const char* GetDirectBlocks(uint64 blockID, uint64 count) const;
+        /**
+         * Updates the readahead stream of a read of size bytes at pos and returns the logical blocks [outStart, outEnd)
+         * that should be read ahead, outStart == outEnd if there are none.
+         **/
+        void UpdateReadAhead(NodeInfo* info, uint64 pos, uint64 size, uint64& outStart, uint64& outEnd);
+        /**
+         * Drops all cached block mappings, has to be called whenever block pointers or the size of the node change
+         **/
+        void InvalidateBlockMap(NodeInfo* info);
+
+        void SetSize(VFS::Node* node, NodeInfo* info, uint64 size);
+        void WriteINode(uint64 id, const INode* inode);
+        /**
+         * Parses the directory until name was found or, if name is nullptr, until it is parsed completely
+         **/
+        void ScanDir(VFS::Node* node, NodeInfo* info, const char* name, uint64 nameLength);
+
+        // m_AllocLock has to be held, the other allocation functions take it themselves
+        void LoadBitmaps(uint64 group);
+        int64 AllocINode(uint64 group, bool directory, uint64& outID);
+        void FreeINode(uint64 id, bool directory);
+        /**
+         * Allocates up to count consecutive blocks, starting at the first free block at or behind goal.
+         * Returns the first allocated block, or 0 if the device is full.
+         **/
+        uint64 AllocBlocks(uint64 goal, uint64 count, uint64& outCount);
+        void FreeBlocks(uint64 start, uint64 count);
+        void FreeBlockList(const uint32* pointers, uint64 count);
+        void FreePointerTree(uint64 blockID, uint64 depth);
+        void FreeAllBlocks(NodeInfo* info);
+        /**
+         * Reserves free blocks for delayed allocation, returns false if there are not enough.
+         **/
+        bool ReserveBlocks(uint64 count);
+        void UnreserveBlocks(uint64 count);
+
+        uint64 AllocPointerBlock(NodeInfo* info, uint64 goal);
+        /**
+         * Finds the leaf pointer block that maps the logical block index, allocating missing pointer blocks.
+         * outBase receives the logical block mapped by the first entry of the leaf.
+         **/
+        bool GetLeafBlock(NodeInfo* info, uint64 index, uint64 goal, uint64& outLeaf, uint64& outBase);
+        /**
+         * Maps the logical blocks [index, index + count) to the physical blocks [physical, physical + count).
+         * Returns the number of blocks that were mapped, which is only less than count if no pointer block could be allocated.
+         **/
+        uint64 SetBlockPointers(NodeInfo* info, uint64 index, uint64 physical, uint64 count);
+        uint64 GetAllocGoal(NodeInfo* info, uint64 index);
+
+        // info->dataLock has to be held
+        DataBlock* FindDataBlock(NodeInfo* info, uint64 index);
+        /**
+         * Returns the DataBlock of the given logical block, creating it with the current data of the block unless overwrite is set.
+         * Returns nullptr if no block could be reserved for it.
+         **/
+        DataBlock* GetDataBlock(NodeInfo* info, uint64 index, bool overwrite, bool& outCreated);
+        int64 WriteData(VFS::Node* node, NodeInfo* info, uint64 pos, const void* buffer, uint64 size);
+        void DropData(NodeInfo* info);
+        void FlushData(NodeInfo* info);
+        void WriteDir(VFS::Node* node, NodeInfo* info);
+        void BuildINode(VFS::Node* node, NodeInfo* info);
+
+        /**
+         * Writes the data, directory entries and inode of the node to the device
+         **/
+        void FlushNode(VFS::Node* node, NodeInfo* info);
+        void FlushAllocState();
+        void MarkDirty(NodeInfo* info);
+        void RemoveDirty(NodeInfo* info);
+        /**
+         * Moves the new nodes created in the directory dirID that have an entry in ids to the dirty list, ids gets sorted
+         **/
+        void ReleaseNewNodes(uint64 dirID, uint64* ids, uint64 numIDs);
+        /**
+         * Writes back every dirty node and the allocation state
+         **/
+        void Sync();
+
+        static int64 WritebackThread(uint64 driver, uint64);
+
     private:
         VFS::MountPoint* m_MP;
         BlockDeviceDriver* m_Driver;
         uint64 m_Dev;
         SuperBlock m_SB;
         uint64 m_BlockSize;
-        uint64 m_BlockGroupDescTableOffset;
+        uint64 m_INodeSize;
+        // The device resides in memory, file data is copied straight from it without readahead
+        bool m_DirectAccess;
+
+        // The block group descriptor table, read once at mount time
+        BlockGroupDesc* m_Groups;
+        uint64 m_NumGroups;
+
+        QueueLock m_INodeBlockLock;
+        INodeBlock m_INodeBlocks[INodeBlockCacheSize];
+        uint64 m_INodeBlockClock;
+
+        // Protects the bitmaps, the free counters in m_Groups and m_SB, and m_ReservedBlocks.
+        // Allocations only change the cached bitmaps, FlushAllocState writes them back in one go.
+        QueueLock m_AllocLock;
+        GroupState* m_GroupStates;
+        bool m_GroupsDirty;
+        uint64 m_ReservedBlocks;
+        uint64 m_FirstDataBlock;
+
+        typedef ktl::AnchorList<NodeInfo, &NodeInfo::dirtyAnchor> NodeList;
+
+        // Held by Sync, nodes are only freed while no Sync is running
+        QueueLock m_SyncLock;
+        QueueLock m_DirtyLock;
+        // Nodes with data, directory entries or inode fields that were not written back yet
+        NodeList m_DirtyNodes;
+        // Nodes that were created but whose directory entry was not written yet, the VFS might still be setting them up
+        NodeList m_NewNodes;
+        Atomic<uint64> m_Unmounting;
     };
 
 }
\ No newline at end of file
@@ -1,35 +1,198 @@
 #include "memory.h"
 
+#include "arch/CPUFeatures.h"
+#include "arch/Alternatives.h"
+#include "scheduler/Scheduler.h"
+
+typedef uint64 __attribute__((may_alias)) uint64_alias;
+
+// Copies below this size are done with plain qword moves, the setup cost of rep movs is too high for them
+static constexpr uint64 SmallSize = 64;
+// Copies of at least this size bypass the cache with non-temporal stores, saving the FPU state is cheap compared to the copy
+static constexpr uint64 NonTemporalSize = 64 * 1024;
+
+static inline void CopySmall(char* d, const char* s, uint64 size) {
+    while(size >= 8) {
+        *(uint64_alias*)d = *(const uint64_alias*)s;
+        d += 8;
+        s += 8;
+        size -= 8;
+    }
+    while(size > 0) {
+        *d++ = *s++;
+        size--;
+    }
+}
+
+static inline void CopyRep(char* d, const char* s, uint64 size) {
+    uint64 tmp;
+    __asm__ __volatile__ (
+        ALTERNATIVE(
+            "movq %%rcx, %[tmp]\n\t"
+            "shrq $3, %%rcx\n\t"
+            "rep movsq\n\t"
+            "movq %[tmp], %%rcx\n\t"
+            "andq $7, %%rcx\n\t"
+            "rep movsb",
+            "rep movsb",
+            "%c[erms]")
+        : "+S"(s), "+D"(d), "+c"(size), [tmp] "=&r"(tmp)
+        : [erms] "i"(CPUFeatures::FEATURE_ERMS)
+        : "memory"
+    );
+}
+
+// The kernel is compiled with -mno-sse, so the compiler never keeps values in vector registers
+// and the asm blocks below do not have to declare them as clobbered.
+
+// Copies 64 byte chunks with aligned non-temporal stores, d has to be 16 byte aligned
+static void CopyNonTemporalSSE(char* d, const char* s, uint64 numChunks) {
+    __asm__ __volatile__ (
+        "1:\n"
+        "movdqu (%1), %%xmm0\n"
+        "movdqu 16(%1), %%xmm1\n"
+        "movdqu 32(%1), %%xmm2\n"
+        "movdqu 48(%1), %%xmm3\n"
+        "movntdq %%xmm0, (%0)\n"
+        "movntdq %%xmm1, 16(%0)\n"
+        "movntdq %%xmm2, 32(%0)\n"
+        "movntdq %%xmm3, 48(%0)\n"
+        "addq $64, %0\n"
+        "addq $64, %1\n"
+        "decq %2\n"
+        "jnz 1b\n"
+        "sfence"
+        : "+r"(d), "+r"(s), "+r"(numChunks)
+        : : "memory"
+    );
+}
+// Copies 128 byte chunks with aligned non-temporal stores, d has to be 32 byte aligned
+static void CopyNonTemporalAVX(char* d, const char* s, uint64 numChunks) {
+    __asm__ __volatile__ (
+        "1:\n"
+        "vmovdqu (%1), %%ymm0\n"
+        "vmovdqu 32(%1), %%ymm1\n"
+        "vmovdqu 64(%1), %%ymm2\n"
+        "vmovdqu 96(%1), %%ymm3\n"
+        "vmovntdq %%ymm0, (%0)\n"
+        "vmovntdq %%ymm1, 32(%0)\n"
+        "vmovntdq %%ymm2, 64(%0)\n"
+        "vmovntdq %%ymm3, 96(%0)\n"
+        "addq $128, %0\n"
+        "addq $128, %1\n"
+        "decq %2\n"
+        "jnz 1b\n"
+        "sfence\n"
+        "vzeroupper"
+        : "+r"(d), "+r"(s), "+r"(numChunks)
+        : : "memory"
+    );
+}
+
+static bool CopyNonTemporal(char* d, const char* s, uint64 size) {
+    if(!Scheduler::KernelFPUBegin())
+        return false;
+
+    bool avx = CPUFeatures::Has(CPUFeatures::FEATURE_AVX);
+    uint64 align = avx ? 32 : 16;
+    uint64 head = (align - ((uint64)d & (align - 1))) & (align - 1);
+    CopySmall(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    uint64 chunkSize = align * 4;
+    uint64 numChunks = size / chunkSize;
+    if(avx)
+        CopyNonTemporalAVX(d, s, numChunks);
+    else
+        CopyNonTemporalSSE(d, s, numChunks);
+
+    Scheduler::KernelFPUEnd();
+
+    uint64 done = numChunks * chunkSize;
+    CopyRep(d + done, s + done, size - done);
+    return true;
+}
+
 void kmemset(void* dest, int value, uint64 size)
 {
-    for(uint64 i = 0; i < size; i++)
-        ((char*)dest)[i] = value;
+    char* d = (char*)dest;
+
+    if(size < SmallSize) {
+        uint64 pattern = (uint8)value * 0x0101010101010101ULL;
+        while(size >= 8) {
+            *(uint64_alias*)d = pattern;
+            d += 8;
+            size -= 8;
+        }
+        while(size > 0) {
+            *d++ = value;
+            size--;
+        }
+        return;
+    }
+
+    // The low byte of the pattern is the value, so both variants can use rax
+    uint64 pattern = (uint8)value * 0x0101010101010101ULL;
+    uint64 tmp;
+    __asm__ __volatile__ (
+        ALTERNATIVE(
+            "movq %%rcx, %[tmp]\n\t"
+            "shrq $3, %%rcx\n\t"
+            "rep stosq\n\t"
+            "movq %[tmp], %%rcx\n\t"
+            "andq $7, %%rcx\n\t"
+            "rep stosb",
+            "rep stosb",
+            "%c[erms]")
+        : "+D"(d), "+c"(size), [tmp] "=&r"(tmp)
+        : "a"(pattern), [erms] "i"(CPUFeatures::FEATURE_ERMS)
+        : "memory"
+    );
 }
 
 void kmemcpy(void* dest, const void* src, uint64 size) {
     char* d = (char*)dest;
-    char* s = (char*)src;
+    const char* s = (const char*)src;
 
-    uint64 numq = size >> 3;
-    kmemcpyq(dest, src, numq);
+    if(size < SmallSize) {
+        CopySmall(d, s, size);
+        return;
+    }
+    if(size >= NonTemporalSize && CopyNonTemporal(d, s, size))
+        return;
 
-    uint64 rem = size & 0x7;
-    kmemcpyb(d + (numq << 3), s + (numq << 3), rem);
+    CopyRep(d, s, size);
 }
 
 void kmemmove(void* dest, const void* src, uint64 size) {
     char* d = (char*)dest;
     const char* s = (const char*)src;
 
-    if(d == s)
+    if(d == s || size == 0)
         return;
-    if(d < s) {
+
+    // Every kmemcpy variant copies forward and reads a chunk before storing it,
+    // so it never overwrites source bytes it still needs if the destination lies below the source
+    if(d < s || d >= s + size) {
         kmemcpy(dest, src, size);
-    } else {
-        for(uint64 i = size; i > 0; i--) {
-            d[i-1] = s[i-1];
-        }
+        return;
     }
+
+    // Destination overlaps the end of the source, copy backwards
+    uint64 rem = size & 0x7;
+    while(rem > 0) {
+        size--;
+        rem--;
+        d[size] = s[size];
+    }
+
+    // A plain loop instead of std; rep movsq, interrupt handlers expect the direction flag to be clear
+    uint64_alias* dq = (uint64_alias*)d;
+    const uint64_alias* sq = (const uint64_alias*)s;
+    for(uint64 i = size >> 3; i > 0; i--)
+        dq[i - 1] = sq[i - 1];
 }
 
 void kmemcpyb(void* dest, const void* src, uint64 size)
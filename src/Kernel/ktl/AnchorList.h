@@ -84,8 +84,8 @@ namespace ktl {
 		}
 
 		void push_front(T* t) {
-			(t.*AnchorMember).next = m_Head;
-			(t.*AnchorMember).prev = nullptr;
+			(t->*AnchorMember).next = m_Head;
+			(t->*AnchorMember).prev = nullptr;
 			if(m_Head == nullptr) {
 				m_Head = m_Tail = t;
 			} else {
@@ -97,6 +97,27 @@ namespace ktl {
 			erase(begin());
 		}
 
+		/**
+		 * Inserts t in front of pos, inserting in front of end() appends t
+		 **/
+		void insert(const Iterator& pos, T* t) {
+			T* next = pos.m_Node;
+			if(next == nullptr) {
+				push_back(t);
+				return;
+			}
+
+			T* prev = (next->*AnchorMember).prev;
+			(t->*AnchorMember).next = next;
+			(t->*AnchorMember).prev = prev;
+			(next->*AnchorMember).prev = t;
+			if(prev != nullptr) {
+				(prev->*AnchorMember).next = t;
+			} else {
+				m_Head = t;
+			}
+		}
+
 		const T& back() const {
 			return *m_Tail;
 		}
@@ -0,0 +1,127 @@
+#include "RCU.h"
+
+#include "StickyLock.h"
+#include "atomic/Atomics.h"
+#include "percpu/PerCPU.h"
+#include "multicore/SMP.h"
+#include "scheduler/Scheduler.h"
+#include "klib/stdio.h"
+
+namespace RCU {
+
+    struct CPUData {
+        volatile uint64 qsSeq;
+        volatile bool online;
+    };
+
+    static DECLARE_PER_CPU(CPUData, g_RCUData);
+
+    // Number of the most recently started grace period
+    static Atomic<uint64> g_GPSeq = 0;
+
+    static StickyLock g_CallbackLock;
+    static ktl::AnchorList<Callback, &Callback::anchor> g_Callbacks;
+
+    static bool GracePeriodDone(uint64 seq) {
+        for(uint64 c = 0; c < SMP::GetCoreCount(); c++) {
+            auto& data = g_RCUData.Get(c);
+            if(data.online && data.qsSeq < seq)
+                return false;
+        }
+        return true;
+    }
+
+    // Only ever called by the RCU thread, so grace periods never overlap
+    static void RunGracePeriod() {
+        uint64 seq = g_GPSeq.PostInc() + 1;
+
+        // Sleeping counts as a quiescent state for our own core
+        while(!GracePeriodDone(seq))
+            Scheduler::ThreadSleep(1);
+    }
+
+    static int64 RCUThread(uint64, uint64) {
+        while(true) {
+            g_CallbackLock.Spinlock();
+            Callback* first = g_Callbacks.empty() ? nullptr : &g_Callbacks.front();
+            g_CallbackLock.Unlock();
+
+            if(first == nullptr) {
+                Scheduler::ThreadSleep(10);
+                continue;
+            }
+
+            // Every callback that was queued before this grace period started can be run afterwards
+            uint64 target = g_GPSeq.Read() + 1;
+            RunGracePeriod();
+
+            while(true) {
+                g_CallbackLock.Spinlock();
+                Callback* cb = nullptr;
+                if(!g_Callbacks.empty() && g_Callbacks.front().gracePeriod <= target) {
+                    cb = &g_Callbacks.front();
+                    g_Callbacks.pop_front();
+                }
+                g_CallbackLock.Unlock();
+
+                if(cb == nullptr)
+                    break;
+                cb->func(cb);
+            }
+        }
+
+        return 0;
+    }
+
+    void Init() {
+        Scheduler::CreateKernelThread(RCUThread);
+        klog_info("RCU", "Reclaim thread started");
+    }
+
+    void InitCore() {
+        auto& data = g_RCUData.Get();
+        data.qsSeq = g_GPSeq.Read();
+        data.online = true;
+    }
+
+    void ReadLock() {
+        Scheduler::ThreadSetSticky();
+        __asm__ __volatile__ ("" : : : "memory");
+    }
+    void ReadUnlock() {
+        __asm__ __volatile__ ("" : : : "memory");
+        Scheduler::ThreadUnsetSticky();
+    }
+
+    void NoteQuiescentState() {
+        g_RCUData.Get().qsSeq = g_GPSeq.Read();
+    }
+
+    void CallAfterGracePeriod(Callback* cb, void (*func)(Callback* cb)) {
+        cb->func = func;
+
+        g_CallbackLock.Spinlock();
+        cb->gracePeriod = g_GPSeq.Read() + 1;
+        g_Callbacks.push_back(cb);
+        g_CallbackLock.Unlock();
+    }
+
+    struct SyncCallback {
+        Callback cb;
+        volatile bool done;
+    };
+
+    static void SyncDone(Callback* cb) {
+        ((SyncCallback*)cb)->done = true;
+    }
+
+    void Synchronize() {
+        SyncCallback sync;
+        sync.done = false;
+        CallAfterGracePeriod(&sync.cb, SyncDone);
+
+        while(!sync.done)
+            Scheduler::ThreadSleep(1);
+    }
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "types.h"
+#include "ktl/AnchorList.h"
+
+/**
+ * Quiescent state based deferred reclamation (read-copy-update).
+ *
+ * Readers enclose their accesses to RCU protected data in ReadLock() / ReadUnlock().
+ * A read section only marks the calling thread sticky, so it can neither be preempted nor migrated.
+ * A CPU core that switches threads or runs its idle loop while not being sticky therefore can no longer hold any reference
+ * obtained in an earlier read section. Once every core passed through such a quiescent state, a grace period is over
+ * and objects that were unpublished before the grace period started can safely be freed.
+ *
+ * Read sections must not block or yield.
+ **/
+namespace RCU {
+
+    struct Callback {
+        ktl::Anchor<Callback> anchor;
+        void (*func)(Callback* cb);
+        uint64 gracePeriod;
+    };
+
+    /**
+     * Starts the kernel thread that processes the callbacks given to CallAfterGracePeriod().
+     * Can only be called from a thread.
+     **/
+    void Init();
+    /**
+     * Registers the calling CPU core with the grace period machinery.
+     * Has to be called once on every core after Scheduler::MakeMeIdleThread().
+     **/
+    void InitCore();
+
+    /**
+     * Enters a read section.
+     * Read sections can be nested.
+     **/
+    void ReadLock();
+    /**
+     * Leaves a read section entered with ReadLock()
+     **/
+    void ReadUnlock();
+
+    /**
+     * Tells the grace period machinery that the calling CPU core is not inside any read section.
+     * Called by the Scheduler on every context switch of a non sticky thread and while idling.
+     **/
+    void NoteQuiescentState();
+
+    /**
+     * Schedules func to be called with cb as its argument once every read section that could still see the
+     * object containing cb has finished.
+     * cb has to stay valid until func was called, it is usually embedded in the object that should be freed.
+     **/
+    void CallAfterGracePeriod(Callback* cb, void (*func)(Callback* cb));
+    /**
+     * Blocks the calling thread until a full grace period has passed.
+     * Must not be called from inside a read section.
+     **/
+    void Synchronize();
+
+    /**
+     * Reads an RCU protected pointer. Should only be called inside a read section.
+     **/
+    template<typename T>
+    inline T* Dereference(T* const& ptr) {
+        return *(T* const volatile*)&ptr;
+    }
+    /**
+     * Publishes val to readers.
+     * Every initialization of *val is visible to a reader that sees the new pointer.
+     **/
+    template<typename T>
+    inline void Assign(T*& ptr, T* val) {
+        __asm__ __volatile__ ("" : : : "memory");
+        *(T* volatile*)&ptr = val;
+    }
+
+}
@@ -0,0 +1,61 @@
+#include "WaitQueue.h"
+
+#include "scheduler/Scheduler.h"
+#include "errno.h"
+
+int64 WaitQueue::Wait(StickyLock& lock) {
+    return DoWait(lock, false);
+}
+int64 WaitQueue::Wait_Cli(StickyLock& lock) {
+    return DoWait(lock, true);
+}
+
+int64 WaitQueue::DoWait(StickyLock& lock, bool cli) {
+    Scheduler::ThreadSetSticky();
+
+    WaitQueueEntry entry;
+    entry.thread = Scheduler::GetCurrentThreadInfo();
+    entry.woken = false;
+    m_Queue.push_back(&entry);
+    if(cli)
+        lock.Unlock_Cli();
+    else
+        lock.Unlock();
+
+    // A wakeup can arrive before the thread is blocked, the Scheduler checks entry.woken in that case
+    Scheduler::ThreadBlock(ThreadState::WAIT_QUEUE, (uint64)&entry);
+
+    if(cli)
+        lock.Spinlock_Cli();
+    else
+        lock.Spinlock();
+    Scheduler::ThreadUnsetSticky();
+
+    if(entry.woken)
+        return OK;
+
+    m_Queue.erase(&entry);
+    return ErrorInterrupted;
+}
+
+void WaitQueue::Wake(WaitQueueEntry* e) {
+    e->woken = true;
+    e->thread->state.type = ThreadState::READY;
+}
+
+void WaitQueue::WakeOne() {
+    if(m_Queue.empty())
+        return;
+
+    WaitQueueEntry* e = &m_Queue.front();
+    m_Queue.pop_front();
+    Wake(e);
+}
+
+void WaitQueue::WakeAll() {
+    while(!m_Queue.empty()) {
+        WaitQueueEntry* e = &m_Queue.front();
+        m_Queue.pop_front();
+        Wake(e);
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "types.h"
+#include "StickyLock.h"
+#include "ktl/AnchorList.h"
+
+#include "scheduler/Thread.h"
+
+struct WaitQueueEntry {
+    ktl::Anchor<WaitQueueEntry> anchor;
+
+    ThreadInfo* thread;
+    volatile bool woken;
+};
+
+/**
+ * A queue of threads that sleep until some condition changes.
+ * The queue has no lock of its own, it is protected by the StickyLock that guards the condition.
+ */
+class WaitQueue {
+public:
+    /**
+     * Puts the calling thread to sleep until it is woken up by WakeOne() or WakeAll().
+     * lock has to be held by the caller, it is released while sleeping and held again when this function returns.
+     * The condition should be checked again after waking up.
+     * @returns OK if the thread was woken up, ErrorInterrupted if the thread is about to be killed
+     **/
+    int64 Wait(StickyLock& lock);
+    /**
+     * Same as Wait(), for conditions that are changed from interrupt handlers.
+     * lock has to be held with Spinlock_Cli(), wakeups may then come from interrupt context.
+     **/
+    int64 Wait_Cli(StickyLock& lock);
+
+    /**
+     * Wakes up the thread that has been waiting the longest. lock has to be held.
+     **/
+    void WakeOne();
+    /**
+     * Wakes up every waiting thread. lock has to be held.
+     **/
+    void WakeAll();
+
+    bool Empty() const { return m_Queue.empty(); }
+
+private:
+    int64 DoWait(StickyLock& lock, bool cli);
+    void Wake(WaitQueueEntry* e);
+
+private:
+    ktl::AnchorList<WaitQueueEntry, &WaitQueueEntry::anchor> m_Queue;
+};
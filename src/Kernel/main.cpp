@@ -17,6 +17,7 @@
 #include "devices/DevFS.h"
 
 #include "scheduler/Scheduler.h"
+#include "locks/RCU.h"
 #include "klib/string.h"
 
 #include "exec/ExecHandler.h"
@@ -24,6 +25,8 @@
 #include "Config.h"
 
 #include "arch/SSE.h"
+#include "arch/CPUFeatures.h"
+#include "arch/Alternatives.h"
 
 #include "errno.h"
 
@@ -63,26 +66,35 @@ static int64 SetupInitProcess(uint64, uint64) {
         return 1;
     }
     
-    uint8* buffer = new uint8[stats.size];
-    error = VFS::Read(file, buffer, stats.size);
-    if(error < 0) {
-        klog_fatal("Init", "Failed to read %s (%s)", config_Init_Command, ErrorToString(error));
-        delete[] buffer;
-        return 1;
+    // The init program usually lives on the ramdisk and can be loaded straight from it,
+    // writes to the file wait until the data is released
+    uint8* buffer = nullptr;
+    const uint8* data = (const uint8*)VFS::GetDirectData(file, 0, stats.size);
+    if(data == nullptr) {
+        buffer = new uint8[stats.size];
+        error = VFS::Read(file, buffer, stats.size);
+        if(error < 0) {
+            klog_fatal("Init", "Failed to read %s (%s)", config_Init_Command, ErrorToString(error));
+            VFS::Close(file);
+            delete[] buffer;
+            return 1;
+        }
+        data = buffer;
     }
-    VFS::Close(file);
 
     uint64 pml4Entry = MemoryManager::CreateProcessMap();
     IDT::Registers regs;
-    if(!ExecHandlerRegistry::Prepare(buffer, stats.size, pml4Entry, &regs, 0, nullptr)) {
+    bool prepared = ExecHandlerRegistry::Prepare(data, stats.size, pml4Entry, &regs, 0, nullptr);
+    if(buffer == nullptr)
+        VFS::ReleaseDirectData(file);
+    VFS::Close(file);
+    delete[] buffer;
+    if(!prepared) {
         klog_error("Init", "Failed to execute init process, aborting boot");
         MemoryManager::FreeProcessMap(pml4Entry);
-        delete[] buffer;
         return 1;
     }
 
-    delete[] buffer;
-
     klog_info("Init", "Executing init program");
     Scheduler::ThreadExec(pml4Entry, &regs);
     return 1;
@@ -110,11 +122,16 @@ static int64 SpamThread(uint64, uint64) {
 static int64 InitThread(uint64, uint64) {
     klog_info("Boot", "Init KernelThread starting");
 
+    RCU::Init();
+
     VFS::FileSystem* rootFS = new TempFS();
+    int64 error = rootFS->SetOptions(config_RootFS_Options);
+    if(error < 0)
+        klog_error("Init", "Failed to apply root filesystem options (%s)", ErrorToString(error));
     VFS::Init(rootFS);
 
     VFS::FileSystem* devFS = new DevFS();
-    int64 error = VFS::CreateFolder("/dev", { 5, 5, 5 });
+    error = VFS::CreateFolder("/dev", { 5, 5, 5 });
     if(error < 0) {
         klog_fatal("Init", "Failed to create /dev folder (%s)", ErrorToString(error));
         return 1;
@@ -179,6 +196,8 @@ extern "C" void __attribute__((noreturn)) main(KernelHeader* info) {
     kprintf_isr("%CStarting SimpleOS2 Kernel\n", 40, 200, 40);
     klog_info_isr("Boot", "Kernel at 0x%016X", info->kernelImage.buffer);
 
+    CPUFeatures::Init();
+
     if(!MemoryManager::Init(info))
         goto bootFailed;
     ACPI::InitEarlyTables(info);
@@ -188,6 +207,7 @@ extern "C" void __attribute__((noreturn)) main(KernelHeader* info) {
     MemoryManager::InitCore();
 
     Scheduler::MakeMeIdleThread();
+    RCU::InitCore();
 
     if(!Time::Init())
         goto bootFailed;
@@ -201,6 +221,7 @@ extern "C" void __attribute__((noreturn)) main(KernelHeader* info) {
     SyscallHandler::InitCore();
     if(!SSE::InitBootCore())
         goto bootFailed;
+    Alternatives::Apply();
 
     Scheduler::ThreadEnableInterrupts();
     APIC::StartTimer(10);
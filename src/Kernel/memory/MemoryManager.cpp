@@ -5,7 +5,7 @@
 #include "ktl/FreeList.h"
 #include "locks/StickyLock.h"
 #include "arch/APIC.h"
-#include "arch/CPU.h"
+#include "arch/CPUFeatures.h"
 #include "multicore/SMP.h"
 
 #include "syscalls/SyscallDefine.h"
@@ -29,6 +29,7 @@
 #define PML_GET_US(entry)           ((entry) & 0x4)
 #define PML_GET_RW(entry)           ((entry) & 0x2)
 #define PML_GET_P(entry)            ((entry) & 0x1)
+#define PML_GET_PS(entry)           ((entry) & 0x80)
 
 #define PML_SET_A(a)                ((a) ? 0x20 : 0)
 #define PML_SET_PCD(a)              ((a) ? 0x10 : 0)
@@ -76,9 +77,7 @@ namespace MemoryManager {
 
     bool Init(KernelHeader* header)
     {
-        uint64 eax, ebx, ecx, edx;
-        CPU::CPUID(0x1, 0, eax, ebx, ecx, edx);
-        if((edx & (1 << 16)) == 0) {
+        if(!CPUFeatures::Has(CPUFeatures::FEATURE_PAT)) {
             klog_fatal("Boot", "PAT not supported");
             return false;
         }
@@ -181,6 +180,36 @@ namespace MemoryManager {
         return (char*)ptr - g_HighMemBase;
     }
 
+    void* TranslateKernelPtr(const void* ptr)
+    {
+        uint64 virt = (uint64)ptr;
+        volatile uint64* myPML4 = g_CorePageTables.Get();
+
+        uint64 pml4Entry = myPML4[GET_PML4_INDEX(virt)];
+        if(!PML_GET_P(pml4Entry))
+            return nullptr;
+        volatile uint64* pml3 = (uint64*)PhysToKernelPtr((void*)PML_GET_ADDR(pml4Entry));
+
+        uint64 pml3Entry = pml3[GET_PML3_INDEX(virt)];
+        if(!PML_GET_P(pml3Entry))
+            return nullptr;
+        if(PML_GET_PS(pml3Entry))
+            return (void*)((PML_GET_ADDR(pml3Entry) & ~0x3FFFFFFFull) + (virt & 0x3FFFFFFF));
+        volatile uint64* pml2 = (uint64*)PhysToKernelPtr((void*)PML_GET_ADDR(pml3Entry));
+
+        uint64 pml2Entry = pml2[GET_PML2_INDEX(virt)];
+        if(!PML_GET_P(pml2Entry))
+            return nullptr;
+        if(PML_GET_PS(pml2Entry))
+            return (void*)((PML_GET_ADDR(pml2Entry) & ~0x1FFFFFull) + (virt & 0x1FFFFF));
+        volatile uint64* pml1 = (uint64*)PhysToKernelPtr((void*)PML_GET_ADDR(pml2Entry));
+
+        uint64 pml1Entry = pml1[GET_PML1_INDEX(virt)];
+        if(!PML_GET_P(pml1Entry))
+            return nullptr;
+        return (void*)(PML_GET_ADDR(pml1Entry) + (virt & 0xFFF));
+    }
+
     static void FreeProcessPML1(volatile uint64* pml1)
     {
         for(int i = 0; i < 512; i++) {
@@ -273,7 +302,7 @@ namespace MemoryManager {
         );
     }
 
-    void MapKernelPage(void* phys, void* virt)
+    static void _MapKernelPage(void* phys, void* virt, uint64 flags)
     {
         volatile uint64* myPML4 = g_CorePageTables.Get();
 
@@ -309,9 +338,34 @@ namespace MemoryManager {
             pml1 = (uint64*)PhysToKernelPtr((void*)PML_GET_ADDR(pml2Entry));
         }
 
-        pml1[pml1Index] = PML_SET_ADDR((uint64)phys) | PML_SET_P(1) | PML_SET_RW(1);
+        pml1[pml1Index] = PML_SET_ADDR((uint64)phys) | PML_SET_P(1) | PML_SET_RW(1) | flags;
+
+        g_Lock.Unlock();
+    }
+    void MapKernelPage(void* phys, void* virt)
+    {
+        _MapKernelPage(phys, virt, 0);
+    }
+
+    // Device memory is mapped behind the kernel heap, in the upper half of its PML4 entry
+    static constexpr uint64 DeviceMemoryBase = (((uint64)510 << 39) | 0xFFFF000000000000) + ((uint64)1 << 38);
+    static uint64 g_DeviceMemoryPos = DeviceMemoryBase;
+
+    void* MapDeviceMemory(void* phys, uint64 size)
+    {
+        uint64 offset = (uint64)phys & 0xFFF;
+        uint64 physPage = (uint64)phys - offset;
+        uint64 numPages = NUM_PAGES(offset + size);
 
+        g_Lock.Spinlock();
+        uint64 virt = g_DeviceMemoryPos;
+        g_DeviceMemoryPos += numPages * 4096;
         g_Lock.Unlock();
+
+        for(uint64 i = 0; i < numPages; i++)
+            _MapKernelPage((void*)(physPage + i * 4096), (void*)(virt + i * 4096), PML_SET_PCD(1) | PML_SET_PWT(1));
+
+        return (void*)(virt + offset);
     }
     void DisableChacheOnLargePage(void* virt) {
         volatile uint64* myPML4 = g_CorePageTables.Get();
@@ -47,6 +47,11 @@ namespace MemoryManager {
      * Convert the given Kernel pointer to the physical address it represents
      **/
     void* KernelToPhysPtr(const void* ptr);
+    /**
+     * Look up the physical address of any mapped kernel pointer, including kernel heap memory.
+     * Returns nullptr if the address is not mapped.
+     **/
+    void* TranslateKernelPtr(const void* ptr);
 
     /**
      * Create a new Paging structure to be used by a user process
@@ -70,6 +75,11 @@ namespace MemoryManager {
      * Map a physical page to be accessible by the kernel only
      **/
     void MapKernelPage(void* phys, void* virt);
+    /**
+     * Map the physical range [phys, phys + size) of device registers to a new uncached kernel address range.
+     * Unlike PhysToKernelPtr this also works for addresses above the memory that the kernel maps directly.
+     **/
+    void* MapDeviceMemory(void* phys, uint64 size);
     /**
      * Map a physical page into the given User Memory Space
      **/
@@ -11,6 +11,7 @@
 #include "scheduler/Scheduler.h"
 #include "arch/SSE.h"
 #include "arch/port.h"
+#include "locks/RCU.h"
 
 namespace SMP {
 
@@ -33,6 +34,7 @@ namespace SMP {
 
         MemoryManager::InitCore();
         Scheduler::MakeMeIdleThread();
+        RCU::InitCore();
 
         GDT::InitCore(logicalID);
         IDT::InitCore(logicalID);
@@ -15,6 +15,8 @@
 #include "percpu/PerCPU.h"
 #include "klib/string.h"
 #include "klib/memory.h"
+#include "locks/RCU.h"
+#include "locks/WaitQueue.h"
 
 #include <new>
 
@@ -119,6 +121,13 @@ namespace Scheduler {
                         tInfo.state.type = ThreadState::READY;
                         tInfo.registers.rax = 0;
                     }
+                } else if(tInfo.state.type == ThreadState::WAIT_QUEUE) {
+                    // The thread was woken up before it was blocked
+                    auto entry = (WaitQueueEntry*)tInfo.state.arg;
+                    if(entry->woken) {
+                        tInfo.state.type = ThreadState::READY;
+                        tInfo.registers.rax = OK;
+                    }
                 }
 
                 ++a;
@@ -187,6 +196,7 @@ namespace Scheduler {
         cpuData.idleThread.abortPending = false;
         cpuData.idleThread.killHandlerRip = 0;
         cpuData.idleThread.memSpace = &cpuData.idleThreadMemSpace;
+        cpuData.idleThreadFDs.table = nullptr;
         cpuData.idleThread.fds = &cpuData.idleThreadFDs;
         cpuData.idleThread.uid = 0;
         cpuData.idleThread.gid = 0;
@@ -197,10 +207,65 @@ namespace Scheduler {
         cpuData.idleThread.fpuBuffer = nullptr;
 
         kstrcpy(cpuData.idleThread.cwd, "");
+        cpuData.idleThread.cwdDesc = 0;
 
         cpuData.currentThread = &cpuData.idleThread;
     }
 
+    static ThreadFileDescriptorTable* CreateFDTable(uint64 capacity) {
+        uint64 bitmapSize = capacity / 64 * sizeof(uint64);
+        char* mem = new char[sizeof(ThreadFileDescriptorTable) + capacity * sizeof(uint64) + bitmapSize];
+
+        auto table = new(mem) ThreadFileDescriptorTable();
+        table->capacity = capacity;
+        table->usedBitmap = (uint64*)(mem + sizeof(ThreadFileDescriptorTable) + capacity * sizeof(uint64));
+        kmemset(table->sysDescs, 0, capacity * sizeof(uint64));
+        kmemset(table->usedBitmap, 0, bitmapSize);
+        return table;
+    }
+    static void FreeFDTable(ThreadFileDescriptorTable* table) {
+        delete[] (char*)table;
+    }
+    static void FreeFDTableRCU(RCU::Callback* cb) {
+        // rcu is the first member of the table
+        FreeFDTable((ThreadFileDescriptorTable*)cb);
+    }
+
+    /**
+     * Makes sure that the table of fds can hold the descriptor minDesc.
+     * fds->lock has to be held.
+     **/
+    static ThreadFileDescriptorTable* GrowFDTable(ThreadFileDescriptors* fds, uint64 minDesc) {
+        auto oldTable = fds->table;
+        uint64 oldCapacity = oldTable == nullptr ? 0 : oldTable->capacity;
+        if(minDesc < oldCapacity)
+            return oldTable;
+
+        uint64 newCapacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+        while(newCapacity <= minDesc)
+            newCapacity *= 2;
+
+        auto newTable = CreateFDTable(newCapacity);
+        if(oldTable != nullptr) {
+            kmemcpy(newTable->sysDescs, oldTable->sysDescs, oldCapacity * sizeof(uint64));
+            kmemcpy(newTable->usedBitmap, oldTable->usedBitmap, oldCapacity / 64 * sizeof(uint64));
+        }
+        RCU::Assign(fds->table, newTable);
+
+        // Readers might still look at the old table
+        if(oldTable != nullptr)
+            RCU::CallAfterGracePeriod(&oldTable->rcu, FreeFDTableRCU);
+        return newTable;
+    }
+
+    static void SetFD(ThreadFileDescriptorTable* table, uint64 desc, uint64 sysDesc) {
+        *(volatile uint64*)&table->sysDescs[desc] = sysDesc;
+        if(sysDesc == 0)
+            table->usedBitmap[desc / 64] &= ~(1ull << (desc % 64));
+        else
+            table->usedBitmap[desc / 64] |= 1ull << (desc % 64);
+    }
+
     static ThreadInfo* _CreateKernelThread(int64 (*func)(uint64, uint64), uint64 arg1 = 0, uint64 arg2 = 0) {
         auto memSpace = new ThreadMemSpace();
         memSpace->pml4Entry = 0;
@@ -208,6 +273,7 @@ namespace Scheduler {
 
         auto fds = new ThreadFileDescriptors();
         fds->refCount = 1;
+        fds->table = nullptr;
 
         auto tInfo = new ThreadInfo();
         tInfo->mainThread = tInfo;
@@ -226,6 +292,7 @@ namespace Scheduler {
         tInfo->faultRip = 0;
         tInfo->fpuBuffer = nullptr;
         kstrcpy(tInfo->cwd, "");
+        tInfo->cwdDesc = 0;
 
         tInfo->registers.cs = GDT::KernelCode;
         tInfo->registers.ds = GDT::KernelData;
@@ -285,12 +352,17 @@ namespace Scheduler {
         } else {
             fds = new ThreadFileDescriptors();
             fds->refCount = 1;
+            fds->table = nullptr;
 
             tInfo->fds->lock.Spinlock();
-            for(const auto& fd : tInfo->fds->fds) {
-                if(fd.sysDesc != 0) {
-                    fds->fds.push_back( fd );
-                    VFS::AddRef(fd.sysDesc);
+            auto table = tInfo->fds->table;
+            if(table != nullptr) {
+                fds->table = CreateFDTable(table->capacity);
+                kmemcpy(fds->table->sysDescs, table->sysDescs, table->capacity * sizeof(uint64));
+                kmemcpy(fds->table->usedBitmap, table->usedBitmap, table->capacity / 64 * sizeof(uint64));
+                for(uint64 i = 0; i < table->capacity; i++) {
+                    if(table->sysDescs[i] != 0)
+                        VFS::AddRef(table->sysDescs[i]);
                 }
             }
             tInfo->fds->lock.Unlock();
@@ -312,6 +384,9 @@ namespace Scheduler {
         newT->cliCount = 0;
         newT->faultRip = 0;
         kstrcpy(newT->cwd, tInfo->cwd);
+        newT->cwdDesc = tInfo->cwdDesc;
+        if(newT->cwdDesc != 0)
+            VFS::AddRef(newT->cwdDesc);
         newT->registers = *regs;
         newT->registers.rflags |= CPU::FLAGS_IF;
         newT->fpuBuffer = new char[SSE::GetFPUBlockSize()];
@@ -350,6 +425,8 @@ namespace Scheduler {
         auto tInfo = cpuData.currentThread;
         
         ThreadSetSticky();
+        if(tInfo->stickyCount == 1)
+            RCU::NoteQuiescentState();
 
         tInfo->state.arg = arg;
         tInfo->state.type = type;
@@ -547,6 +624,9 @@ namespace Scheduler {
         if(cpuData.currentThread->stickyCount != 0)
             return;
 
+        // A thread that is not sticky cannot be inside an RCU read section
+        RCU::NoteQuiescentState();
+
         cpuData.activeListLock.Spinlock_Raw();
         UpdateEvents();
         auto next = FindNextThread();
@@ -561,6 +641,8 @@ namespace Scheduler {
         auto tInfo = cpuData.currentThread;
 
         ThreadSetSticky();
+        if(tInfo->stickyCount == 1)
+            RCU::NoteQuiescentState();
 
         cpuData.activeListLock.Spinlock_Cli();
         auto next = FindNextThread();
@@ -618,12 +700,19 @@ namespace Scheduler {
         ThreadSetSticky();
 
         if(tInfo->fds->refCount.DecAndCheckZero()) {
-            for(const auto& fd : tInfo->fds->fds) {
-                if(fd.sysDesc != 0)
-                    VFS::Close(fd.sysDesc);
+            // No other thread uses the table anymore, so it can be freed right away
+            auto table = tInfo->fds->table;
+            if(table != nullptr) {
+                for(uint64 i = 0; i < table->capacity; i++) {
+                    if(table->sysDescs[i] != 0)
+                        VFS::Close(table->sysDescs[i]);
+                }
+                FreeFDTable(table);
             }
             delete tInfo->fds;
         }
+        if(tInfo->cwdDesc != 0)
+            VFS::Close(tInfo->cwdDesc);
 
         if(tInfo->memSpace->refCount.DecAndCheckZero()) {
             if(tInfo->memSpace->pml4Entry != 0)
@@ -674,123 +763,105 @@ namespace Scheduler {
         return ThreadSetUser(uid, gid);
     }
 
-    static ThreadFileDescriptor* FindFreeFD(ThreadInfo* tInfo) {
-        int64 lastFD = -1;
-        for(auto a = tInfo->fds->fds.begin(); a != tInfo->fds->fds.end(); ++a) {
-            if(a->id != lastFD + 1) {
-                auto res = tInfo->fds->fds.insert(a, { lastFD + 1, 0 });
-                return &*res;
-            } else {
-                lastFD = a->id;
+    int64 ThreadAddFileDescriptor(uint64 sysDesc) {
+        auto fds = g_CPUData.Get().currentThread->fds;
+
+        fds->lock.Spinlock();
+        auto table = fds->table;
+
+        uint64 desc = table == nullptr ? 0 : table->capacity;
+        if(table != nullptr) {
+            for(uint64 i = 0; i < table->capacity / 64; i++) {
+                uint64 freeBits = ~table->usedBitmap[i];
+                if(freeBits != 0) {
+                    desc = i * 64 + __builtin_ctzll(freeBits);
+                    break;
+                }
             }
         }
 
-        tInfo->fds->fds.push_back({ lastFD + 1, 0 });
-        return &tInfo->fds->fds.back();
-    }
-
-    int64 ThreadAddFileDescriptor(uint64 sysDesc) {
-        auto tInfo = g_CPUData.Get().currentThread;
+        if(desc >= MaxFileDescriptors) {
+            fds->lock.Unlock();
+            return ErrorTooManyFDs;
+        }
 
-        tInfo->fds->lock.Spinlock();
-        auto fd = FindFreeFD(tInfo);
-        fd->sysDesc = sysDesc;
-        tInfo->fds->lock.Unlock();
+        table = GrowFDTable(fds, desc);
+        SetFD(table, desc, sysDesc);
+        fds->lock.Unlock();
 
-        return fd->id;
+        return desc;
     }
 
     int64 ThreadReplaceFileDescriptor(int64 oldPDesc, int64 newPDesc) {
         if(oldPDesc == newPDesc)
             return OK;
+        if(oldPDesc < 0 || oldPDesc >= (int64)MaxFileDescriptors || newPDesc < 0)
+            return ErrorInvalidFD;
         
-        auto tInfo = g_CPUData.Get().currentThread;
-
-        ThreadFileDescriptor* oldFD = nullptr;
-        ThreadFileDescriptor* newFD = nullptr;
+        auto fds = g_CPUData.Get().currentThread->fds;
 
-        tInfo->fds->lock.Spinlock();
-        for(auto& fd : tInfo->fds->fds) {
-            if(fd.id == oldPDesc)
-                oldFD = &fd;
-            if(fd.id == newPDesc)
-                newFD = &fd;
-        }
-        tInfo->fds->lock.Unlock();
-
-        if(newFD == nullptr || newFD->sysDesc == 0)
+        fds->lock.Spinlock();
+        auto table = fds->table;
+        if(table == nullptr || (uint64)newPDesc >= table->capacity || table->sysDescs[newPDesc] == 0) {
+            fds->lock.Unlock();
             return ErrorInvalidFD;
-
-        if(oldFD == nullptr) {
-            auto a = tInfo->fds->fds.begin();
-
-            tInfo->fds->lock.Spinlock();
-            for(; a != tInfo->fds->fds.end(); ++a) {
-                if(a->id > oldPDesc)
-                    break;
-            }
-
-            auto n = tInfo->fds->fds.insert(a, { oldPDesc, 0 });
-            oldFD = &*n;
-            tInfo->fds->lock.Unlock();
         }
 
-        if(oldFD->sysDesc == 0) {
-            oldFD->sysDesc = newFD->sysDesc;
-            VFS::AddRef(oldFD->sysDesc);
-            return OK;
-        } else if(oldFD->sysDesc == newFD->sysDesc) {
-            return OK;
-        } else {
-            VFS::Close(oldFD->sysDesc);
-            VFS::AddRef(newFD->sysDesc);
-            oldFD->sysDesc = newFD->sysDesc;
+        table = GrowFDTable(fds, oldPDesc);
+
+        uint64 newSysDesc = table->sysDescs[newPDesc];
+        uint64 oldSysDesc = table->sysDescs[oldPDesc];
+        if(oldSysDesc == newSysDesc) {
+            fds->lock.Unlock();
             return OK;
         }
+
+        VFS::AddRef(newSysDesc);
+        SetFD(table, oldPDesc, newSysDesc);
+        fds->lock.Unlock();
+
+        if(oldSysDesc != 0)
+            VFS::Close(oldSysDesc);
+        return OK;
     }
     SYSCALL_DEFINE2(syscall_copyfd, int64 oldFD, int64 newFD) {
         return ThreadReplaceFileDescriptor(oldFD, newFD);
     }
 
     int64 ThreadCloseFileDescriptor(int64 desc) {
-        auto tInfo = g_CPUData.Get().currentThread;
+        auto fds = g_CPUData.Get().currentThread->fds;
 
-        tInfo->fds->lock.Spinlock();
-        for(auto a = tInfo->fds->fds.begin(); a != tInfo->fds->fds.end(); ++a) {
-            if(a->id == desc) {
-                if(a->sysDesc == 0) {
-                    tInfo->fds->lock.Unlock();
-                    return ErrorInvalidFD;
-                } else {
-                    VFS::Close(a->sysDesc);
-                    a->sysDesc = 0;
-                    tInfo->fds->lock.Unlock();
-                    return OK;
-                }
-            }
+        fds->lock.Spinlock();
+        auto table = fds->table;
+        if(desc < 0 || table == nullptr || (uint64)desc >= table->capacity || table->sysDescs[desc] == 0) {
+            fds->lock.Unlock();
+            return ErrorInvalidFD;
         }
-        tInfo->fds->lock.Unlock();
-        return ErrorInvalidFD;
+
+        uint64 sysDesc = table->sysDescs[desc];
+        SetFD(table, desc, 0);
+        fds->lock.Unlock();
+
+        VFS::Close(sysDesc);
+        return OK;
     }
 
     int64 ThreadGetSystemFileDescriptor(int64 pDesc, uint64& sysDesc) {
-        auto tInfo = g_CPUData.Get().currentThread;
+        auto fds = g_CPUData.Get().currentThread->fds;
+        if(pDesc < 0)
+            return ErrorInvalidFD;
 
-        tInfo->fds->lock.Spinlock();
-        for(auto a = tInfo->fds->fds.begin(); a != tInfo->fds->fds.end(); ++a) {
-            if(a->id == pDesc) {
-                if(a->sysDesc == 0) {
-                    tInfo->fds->lock.Unlock();
-                    return ErrorInvalidFD;
-                } else {
-                    sysDesc = a->sysDesc;
-                    tInfo->fds->lock.Unlock();
-                    return OK;
-                }
-            }
-        }
-        tInfo->fds->lock.Unlock();
-        return ErrorInvalidFD;
+        RCU::ReadLock();
+        auto table = RCU::Dereference(fds->table);
+        uint64 desc = 0;
+        if(table != nullptr && (uint64)pDesc < table->capacity)
+            desc = *(volatile uint64*)&table->sysDescs[pDesc];
+        RCU::ReadUnlock();
+
+        if(desc == 0)
+            return ErrorInvalidFD;
+        sysDesc = desc;
+        return OK;
     }
 
     void ThreadSetFS(uint64 val) {
@@ -844,6 +915,27 @@ namespace Scheduler {
         tInfo->stickyCount--;
     }
 
+    bool KernelFPUBegin() {
+        uint64 rflags;
+        __asm__ __volatile__ ("pushfq; popq %0" : "=r"(rflags));
+
+        // Interrupt handlers and cli sections could have interrupted another FPU section on this core
+        if(!(rflags & CPU::FLAGS_IF))
+            return false;
+
+        ThreadSetSticky();
+        auto tInfo = g_CPUData.Get().currentThread;
+        if(tInfo->fpuBuffer != nullptr)
+            SSE::SaveFPUBlock(tInfo->fpuBuffer);
+        return true;
+    }
+    void KernelFPUEnd() {
+        auto tInfo = g_CPUData.Get().currentThread;
+        if(tInfo->fpuBuffer != nullptr)
+            SSE::RestoreFPUBlock(tInfo->fpuBuffer);
+        ThreadUnsetSticky();
+    }
+
     void ThreadDisableInterrupts() {
         g_CPUData.Get().currentThread->cliCount++;
         IDT::DisableInterrupts();
@@ -130,6 +130,10 @@ namespace Scheduler {
      **/
     const char* ThreadGetUserName();
 
+    /**
+     * Adds sysDescriptor to the file descriptor table of the current thread, using the lowest free descriptor number.
+     * Returns the descriptor number, or ErrorTooManyFDs if the table is full.
+     **/
     int64 ThreadAddFileDescriptor(uint64 sysDescriptor);
     /**
      * Copies oldPDesc to newPDesc.
@@ -141,6 +145,9 @@ namespace Scheduler {
      **/
     int64 ThreadReplaceFileDescriptor(int64 oldPDesc, int64 newPDesc);
     int64 ThreadCloseFileDescriptor(int64 desc);
+    /**
+     * Looks up the system descriptor of pDesc without taking any lock.
+     **/
     int64 ThreadGetSystemFileDescriptor(int64 pDesc, uint64& sysDesc);
 
     void ThreadSetFS(uint64 val);
@@ -154,6 +161,17 @@ namespace Scheduler {
     void ThreadSetSticky();
     void ThreadUnsetSticky();
 
+    /**
+     * Allows the calling kernel code to use SSE/AVX registers until KernelFPUEnd() is called.
+     * The FPU state of the current thread is saved and the thread is made sticky.
+     * Returns false if the FPU cannot be used right now (interrupts disabled), KernelFPUEnd() must not be called in that case.
+     **/
+    bool KernelFPUBegin();
+    /**
+     * Restores the FPU state saved by KernelFPUBegin()
+     **/
+    void KernelFPUEnd();
+
     void ThreadDisableInterrupts();
     void ThreadEnableInterrupts();
 
@@ -4,6 +4,7 @@
 #include "interrupts/IDT.h"
 #include "atomic/Atomics.h"
 #include "locks/StickyLock.h"
+#include "locks/RCU.h"
 #include "ktl/AnchorList.h"
 #include "syscalls/SyscallDefine.h"
 
@@ -13,6 +14,7 @@ constexpr uint64 KernelStackPages = 3;
 constexpr uint64 KernelStackSize = KernelStackPages * 4096;
 constexpr uint64 UserStackPages = 4;
 constexpr uint64 UserStackSize = UserStackPages * 4096;
+constexpr uint64 MaxFileDescriptors = 4096;
 
 struct ThreadInfo;
 
@@ -23,6 +25,7 @@ struct ThreadState {
         SLEEP,
         QUEUE_LOCK,
         JOIN,
+        WAIT_QUEUE,
 
         FINISHED,
         EXITED,
@@ -36,15 +39,17 @@ struct ThreadMemSpace {
     uint64 pml4Entry;
 };
 
-struct ThreadFileDescriptor {
-    int64 id;
-    uint64 sysDesc;
+struct ThreadFileDescriptorTable {
+    RCU::Callback rcu;
+    uint64 capacity;        // always a multiple of 64
+    uint64* usedBitmap;     // one bit per descriptor, stored behind sysDescs
+    uint64 sysDescs[];      // indexed by descriptor number, 0 if the descriptor is not open
 };
 
 struct ThreadFileDescriptors {
     Atomic<uint64> refCount;
-    StickyLock lock;
-    std::vector<ThreadFileDescriptor> fds;
+    StickyLock lock;                        // held while modifying the table
+    ThreadFileDescriptorTable* table;       // RCU protected, can be nullptr if no descriptor was ever opened
 };
 
 struct ThreadInfo {
@@ -60,6 +65,7 @@ struct ThreadInfo {
     int64 tid;
 
     char cwd[256];
+    uint64 cwdDesc;                         // directory FileDescriptor of cwd, relative lookups start there, 0 if cwd was never changed
     
     int64 exitCode;
 
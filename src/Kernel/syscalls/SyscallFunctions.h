@@ -49,6 +49,20 @@ constexpr uint64 syscall_create_hardlink = 68;
 constexpr uint64 syscall_unmount = 69;
 constexpr uint64 syscall_stat = 70;
 constexpr uint64 syscall_dev_cmd = 71;
+constexpr uint64 syscall_pread = 72;
+constexpr uint64 syscall_pwrite = 73;
+constexpr uint64 syscall_readv = 74;
+constexpr uint64 syscall_writev = 75;
+constexpr uint64 syscall_sendfile = 76;
+constexpr uint64 syscall_pipe_capacity = 77;
+constexpr uint64 syscall_remount = 78;
+constexpr uint64 syscall_statfs = 79;
+constexpr uint64 syscall_openat = 80;
+constexpr uint64 syscall_statat = 81;
+constexpr uint64 syscall_listat = 82;
+constexpr uint64 syscall_fstat = 83;
+constexpr uint64 syscall_getdents = 84;
+constexpr uint64 syscall_fsync = 85;
 
 constexpr uint64 syscall_alloc = 100;
 constexpr uint64 syscall_free = 101;
@@ -87,61 +87,76 @@ namespace SyscallHandler {
 
         ThreadInfo* tInfo = Scheduler::GetCurrentThreadInfo();
 
-        VFS::NodeStats stats;
-        int64 error = VFS::Stat(command, stats, true);
-        if(error != OK) {
+        // Stat the opened file, so that the path is only walked once
+        uint64 file;
+        int64 error = VFS::Open(command, VFS::OpenMode_Read, file);
+        if(error != OK)
             return error;
+
+        VFS::NodeStats stats;
+        VFS::FStat(file, stats);
+        if(stats.type == VFS::Node::TYPE_DIRECTORY) {
+            VFS::Close(file);
+            return ErrorOpenFolder;
         }
+
+        bool canExecute = true;
         if(tInfo->uid != 0) {
-            if(stats.ownerUID == tInfo->uid) {
-                if((stats.permissions.ownerPermissions & VFS::Permissions::Execute) == 0)
-                    return ErrorPermissionDenied;
-            } else if(stats.ownerGID == tInfo->gid) {
-                if((stats.permissions.groupPermissions & VFS::Permissions::Execute) == 0)
-                    return ErrorPermissionDenied;
-            } else {
-                if((stats.permissions.otherPermissions & VFS::Permissions::Execute) == 0)
-                    return ErrorPermissionDenied;
-            }
+            if(stats.ownerUID == tInfo->uid)
+                canExecute = stats.permissions.ownerPermissions & VFS::Permissions::Execute;
+            else if(stats.ownerGID == tInfo->gid)
+                canExecute = stats.permissions.groupPermissions & VFS::Permissions::Execute;
+            else
+                canExecute = stats.permissions.otherPermissions & VFS::Permissions::Execute;
+        }
+        if(!canExecute) {
+            VFS::Close(file);
+            return ErrorPermissionDenied;
         }
 
         bool setUID = false;
         if(stats.permissions.specialFlags & VFS::Permissions::SetUID)
             setUID = true;
 
-        uint64 file;
-        error = VFS::Open(command, VFS::OpenMode_Read, file);
-        if(error != OK)
-            return error;
-
-        uint8* buffer = new uint8[stats.size];
-        VFS::Read(file, buffer, stats.size);
-        VFS::Close(file);
-
         char** argPtrBuffer = new char*[argc];
         if(!kmemcpy_usersafe(argPtrBuffer, argv, argc * sizeof(char*))) {
-            delete[] buffer;
+            VFS::Close(file);
             delete[] argPtrBuffer;
             Scheduler::ThreadExit(1);
         }
 
         for(int i = 0; i < argc; i++) {
             char* a = new char[256];
-            if(!kpathcpy_usersafe(a, argv[i]))
+            if(!kpathcpy_usersafe(a, argv[i])) {
+                VFS::Close(file);
                 Scheduler::ThreadExit(1);
+            }
 
             argPtrBuffer[i] = a;
         }
 
+        // Executables that can be read in place (e.g. from the ramdisk) are not copied first,
+        // writes to the file wait until the data is released
+        uint8* buffer = nullptr;
+        const uint8* data = (const uint8*)VFS::GetDirectData(file, 0, stats.size);
+        if(data == nullptr) {
+            buffer = new uint8[stats.size];
+            VFS::Read(file, buffer, stats.size);
+            data = buffer;
+        }
+
         uint64 pml4Entry = MemoryManager::CreateProcessMap();
         IDT::Registers regs;
-        if(!ExecHandlerRegistry::Prepare(buffer, stats.size, pml4Entry, &regs, argc, argPtrBuffer)) {
-            delete[] buffer;
+        bool prepared = ExecHandlerRegistry::Prepare(data, stats.size, pml4Entry, &regs, argc, argPtrBuffer);
+        if(buffer == nullptr)
+            VFS::ReleaseDirectData(file);
+        VFS::Close(file);
+        delete[] buffer;
+        if(!prepared) {
             MemoryManager::FreeProcessMap(pml4Entry);
             return ErrorInvalidPath;
         }
 
-        delete[] buffer;
         for(int i = 0; i < argc; i++)
             delete[] (argPtrBuffer[i]);
         delete[] argPtrBuffer;
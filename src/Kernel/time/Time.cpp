@@ -1,7 +1,7 @@
 #include "Time.h"
 
 #include "arch/MSR.h"
-#include "arch/CPU.h"
+#include "arch/CPUFeatures.h"
 #include "arch/port.h"
 
 #include "klib/stdio.h"
@@ -55,21 +55,17 @@ namespace Time {
     }
 
     bool Init() {
-        uint64 eax, ebx, ecx, edx;
-        CPU::CPUID(1, 0, eax, ebx, ecx, edx);
-        if((edx & (1 << 4)) == 0) {
+        if(!CPUFeatures::Has(CPUFeatures::FEATURE_TSC)) {
             klog_fatal("Time", "CPU Time stamp counter not supported");
             return false;
         }
 
-        /*CPU::CPUID(0x80000001, 0, eax, ebx, ecx, edx);
-        if((edx & (1 << 27)) == 0) {
+        /*if(!CPUFeatures::Has(CPUFeatures::FEATURE_RDTSCP)) {
             klog_fatal("Time", "RDTSCP instruction not supported");
             return false;
         }
 
-        CPU::CPUID(0x80000007, 0, eax, ebx, ecx, edx);
-        if((edx & (1 << 8)) == 0) {
+        if(!CPUFeatures::Has(CPUFeatures::FEATURE_INVARIANT_TSC)) {
             klog_fatal("Time", "TSC is not invariant");
             return false;
         }*/
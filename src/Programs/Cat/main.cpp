@@ -15,15 +15,12 @@ int main(int argc, char** argv) {
         return fd;
     }
 
-    char buffer[128];
     while(true) {
-        int64 count = read(fd, buffer, sizeof(buffer));
+        int64 count = sendfile(stdoutfd, fd, nullptr, 64 * 1024);
         if(count < 0)
             return count;
         if(count == 0)
             break;
-
-        write(stdoutfd, buffer, count);
     }
 
     puts("\n");
@@ -175,115 +175,104 @@ static int64 BuiltinLS(int argc, char** argv) {
         path = argv[1];
     }
 
-    int numEntries = 10;
-    ListEntry* entries = (ListEntry*)malloc(numEntries * sizeof(ListEntry));
-    Stats* stats = (Stats*)malloc(numEntries * sizeof(Stats));
-
-    int64 error = list(path, &numEntries, entries);
-    if(error != 0) {
-        puts(ErrorToString(error));
+    int64 fd = open(path, open_mode_read);
+    if(fd < 0) {
+        puts(ErrorToString(fd));
         puts("\n");
-        return error;
+        return fd;
     }
 
-    if(numEntries > 10) {
-        free(entries);
-        free(stats);
-        entries = (ListEntry*)malloc(numEntries * sizeof(ListEntry));
-        stats = (Stats*)malloc(numEntries * sizeof(Stats));
+    // The stats come with the entries, so no stat call per entry is needed
+    constexpr uint64 bufferSize = 4096;
+    char* buffer = (char*)malloc(bufferSize);
 
-        error = list(path, &numEntries, entries);
-        if(error != 0) {
+    int64 error = 0;
+    while(true) {
+        int64 size = getdents(fd, buffer, bufferSize, getdents_plus);
+        if(size < 0) {
+            error = size;
             puts(ErrorToString(error));
             puts("\n");
-            return error;
+            break;
         }
-    }
+        if(size == 0)
+            break;
 
-    char pathBuffer[256];
-    strcpy(pathBuffer, path);
-    int l = strlen(pathBuffer);
-    pathBuffer[l] = '/';
-    l++;
+        for(const DirEntry* entry = (const DirEntry*)buffer; (const char*)entry < buffer + size; entry = dirent_next(entry)) {
+            const Stats* stats = dirent_stats(entry);
 
-    for(int i = 0; i < numEntries; i++) {
-        strcpy(&pathBuffer[l], entries[i].name);
-        
-        statl(pathBuffer, &stats[i]);
-    }
+            switch(stats->type) {
+            case NODE_FILE: puts("-"); break;
+            case NODE_DIRECTORY: puts("d"); break;
+            case NODE_DEVICE_CHAR: puts("c"); break;
+            case NODE_DEVICE_BLOCK: puts("b"); break;
+            case NODE_PIPE: puts("p"); break;
+            case NODE_SYMLINK: puts("l"); break;
+            }
 
-    for(int i = 0; i < numEntries; i++) {
-        switch(stats[i].type) {
-        case NODE_FILE: puts("-"); break;
-        case NODE_DIRECTORY: puts("d"); break;
-        case NODE_DEVICE_CHAR: puts("c"); break;
-        case NODE_DEVICE_BLOCK: puts("b"); break;
-        case NODE_PIPE: puts("p"); break;
-        case NODE_SYMLINK: puts("l"); break;
-        }
+            if(stats->perms.specialFlags & PermSetUID)
+                puts("s");
+            else
+                puts("-");
+
+            if(stats->perms.owner & PermRead)
+                puts("r");
+            else
+                puts("-");
+            if(stats->perms.owner & PermWrite)
+                puts("w");
+            else
+                puts("-");
+            if(stats->perms.owner & PermExecute)
+                puts("x");
+            else
+                puts("-");
+
+            if(stats->perms.group & PermRead)
+                puts("r");
+            else
+                puts("-");
+            if(stats->perms.group & PermWrite)
+                puts("w");
+            else
+                puts("-");
+            if(stats->perms.group & PermExecute)
+                puts("x");
+            else
+                puts("-");
+
+            if(stats->perms.other & PermRead)
+                puts("r");
+            else
+                puts("-");
+            if(stats->perms.other & PermWrite)
+                puts("w");
+            else
+                puts("-");
+            if(stats->perms.other & PermExecute)
+                puts("x");
+            else
+                puts("-");
+
+            puts("    ");
+
+            const char* name = dirent_name(entry);
+            puts(name);
+            for(int i = entry->nameLength; i < 20; i++)
+                puts(" ");
+
+            if(stats->type == NODE_SYMLINK) {
+                puts("-> ");
+                puts(stats->linkPath);
+            }
 
-        if(stats[i].perms.specialFlags & PermSetUID)
-            puts("s");
-        else
-            puts("-");
-
-        if(stats[i].perms.owner & PermRead)
-            puts("r");
-        else
-            puts("-");
-        if(stats[i].perms.owner & PermWrite)
-            puts("w");
-        else
-            puts("-");
-        if(stats[i].perms.owner & PermExecute)
-            puts("x");
-        else
-            puts("-");
-
-        if(stats[i].perms.group & PermRead)
-            puts("r");
-        else
-            puts("-");
-        if(stats[i].perms.group & PermWrite)
-            puts("w");
-        else
-            puts("-");
-        if(stats[i].perms.group & PermExecute)
-            puts("x");
-        else
-            puts("-");
-
-        if(stats[i].perms.other & PermRead)
-            puts("r");
-        else
-            puts("-");
-        if(stats[i].perms.other & PermWrite)
-            puts("w");
-        else
-            puts("-");
-        if(stats[i].perms.other & PermExecute)
-            puts("x");
-        else
-            puts("-");
-
-        puts("    ");
-
-        puts(entries[i].name);
-        int p = strlen(entries[i].name);
-
-        for(int i = p; i < 20; i++)
-            puts(" ");
-
-        if(stats[i].type == NODE_SYMLINK) {
-            puts("-> ");
-            puts(stats[i].linkPath);
+            puts("\n");
         }
-
-        puts("\n");
     }
 
-    free(entries);
-    return 0;
+    free(buffer);
+    close(fd);
+    return error;
 }
 
 static int64 BuiltinMkdir(int argc, char** argv) {
@@ -25,6 +25,9 @@ int64 create_hardlink(const char* path, const char* linkPath) {
 void pipe(int64* readFD, int64* writeFD) {
     syscall_invoke(syscall_pipe, (uint64)readFD, (uint64)writeFD);
 }
+int64 pipe_capacity(int64 fd, uint64 capacity) {
+    return syscall_invoke(syscall_pipe_capacity, fd, capacity);
+}
 
 int64 change_perm(const char* path, uint8 ownerPerm, uint8 groupPerm, uint8 otherPerm) {
     return syscall_invoke(syscall_change_perm, (uint64)path, ownerPerm, groupPerm, otherPerm);
@@ -36,6 +39,9 @@ int64 change_owner(const char* path, uint64 uid, uint64 gid) {
 int64 open(const char* path, uint64 mode) {
     return syscall_invoke(syscall_open, (uint64)path, mode);
 }
+int64 openat(int64 dirFD, const char* path, uint64 mode) {
+    return syscall_invoke(syscall_openat, (uint64)dirFD, (uint64)path, mode);
+}
 int64 close(int64 fd) {
     return syscall_invoke(syscall_close, fd);
 }
@@ -57,6 +63,28 @@ int64 write(int64 fd, const void* buffer, uint64 bufferSize) {
     return syscall_invoke(syscall_write, fd, (uint64)buffer, bufferSize);
 }
 
+int64 pread(int64 fd, void* buffer, uint64 bufferSize, uint64 pos) {
+    return syscall_invoke(syscall_pread, fd, (uint64)buffer, bufferSize, pos);
+}
+int64 pwrite(int64 fd, const void* buffer, uint64 bufferSize, uint64 pos) {
+    return syscall_invoke(syscall_pwrite, fd, (uint64)buffer, bufferSize, pos);
+}
+
+int64 readv(int64 fd, const IOVec* iov, uint64 iovCount) {
+    return syscall_invoke(syscall_readv, fd, (uint64)iov, iovCount);
+}
+int64 writev(int64 fd, const IOVec* iov, uint64 iovCount) {
+    return syscall_invoke(syscall_writev, fd, (uint64)iov, iovCount);
+}
+
+int64 sendfile(int64 outFD, int64 inFD, uint64* offset, uint64 count) {
+    return syscall_invoke(syscall_sendfile, outFD, inFD, (uint64)offset, count);
+}
+
+int64 fsync(int64 fd) {
+    return syscall_invoke(syscall_fsync, fd);
+}
+
 int64 devcmd(int64 fd, int64 cmd, void* arg) {
     return syscall_invoke(syscall_dev_cmd, fd, cmd, (uint64)arg);
 }
@@ -68,6 +96,10 @@ int64 mount(const char* mountPoint, const char* fsID, const char* dev) {
     return syscall_invoke(syscall_mount_dev, (uint64)mountPoint, (uint64)fsID, (uint64)dev);
 }
 
+int64 remount(const char* mountPoint, const char* options) {
+    return syscall_invoke(syscall_remount, (uint64)mountPoint, (uint64)options);
+}
+
 int64 unmount(const char* mountPoint) {
     return syscall_invoke(syscall_unmount, (uint64)mountPoint);
 }
@@ -75,6 +107,9 @@ int64 unmount(const char* mountPoint) {
 int64 list(const char* path, int* numEntries, ListEntry* entries) {
     return syscall_invoke(syscall_list, (uint64)path, (uint64)numEntries, (uint64)entries);
 }
+int64 listat(int64 dirFD, const char* path, int* numEntries, ListEntry* entries) {
+    return syscall_invoke(syscall_listat, (uint64)dirFD, (uint64)path, (uint64)numEntries, (uint64)entries);
+}
 
 int64 stat(const char* path, Stats* stats) {
     return syscall_invoke(syscall_stat, (uint64)path, (uint64)stats);
@@ -82,6 +117,32 @@ int64 stat(const char* path, Stats* stats) {
 int64 statl(const char* path, Stats* stats) {
     return syscall_invoke(syscall_statl, (uint64)path, (uint64)stats);
 }
+int64 statat(int64 dirFD, const char* path, Stats* stats, bool followSymlink) {
+    return syscall_invoke(syscall_statat, (uint64)dirFD, (uint64)path, (uint64)stats, followSymlink ? 1 : 0);
+}
+int64 fstat(int64 fd, Stats* stats) {
+    return syscall_invoke(syscall_fstat, (uint64)fd, (uint64)stats);
+}
+int64 statfs(const char* path, FileSystemStats* stats) {
+    return syscall_invoke(syscall_statfs, (uint64)path, (uint64)stats);
+}
+
+int64 getdents(int64 fd, void* buffer, uint64 bufferSize, uint64 flags) {
+    return syscall_invoke(syscall_getdents, (uint64)fd, (uint64)buffer, bufferSize, flags);
+}
+const Stats* dirent_stats(const DirEntry* entry) {
+    if(!(entry->flags & dirent_has_stats))
+        return nullptr;
+    return (const Stats*)(entry + 1);
+}
+const char* dirent_name(const DirEntry* entry) {
+    if(entry->flags & dirent_has_stats)
+        return (const char*)((const Stats*)(entry + 1) + 1);
+    return (const char*)(entry + 1);
+}
+const DirEntry* dirent_next(const DirEntry* entry) {
+    return (const DirEntry*)((const char*)entry + entry->recordLength);
+}
 
 int64 changedir(const char* path) {
     return syscall_invoke(syscall_cd, (uint64)path);
@@ -37,6 +37,13 @@ int64 create_hardlink(const char* path, const char* linkPath);
  * @param writeFD       Pointer to a variable that will hold a file descriptor to write to the pipe.
  **/
 void pipe(int64* readFD, int64* writeFD);
+/**
+ * Sets the maximum number of bytes a pipe can buffer before writers have to wait.
+ * Writes of up to 4096 bytes are never interleaved with other writes.
+ * @param fd            Either end of the pipe
+ * @returns the new capacity, rounded up to whole pages
+ **/
+int64 pipe_capacity(int64 fd, uint64 capacity);
 
 int64 change_perm(const char* path, uint8 ownerPerm, uint8 groupPerm, uint8 otherPerm);
 int64 change_owner(const char* path, uint64 uid, uint64 gid);
@@ -47,6 +54,15 @@ constexpr uint64 open_mode_create = 0x100;
 constexpr uint64 open_mode_clear = 0x200;
 constexpr uint64 open_mode_failexist = 0x400;
 int64 open(const char* path, uint64 mode);
+/**
+ * Directory descriptor that makes the *at functions resolve relative paths from the working directory.
+ **/
+constexpr int64 fd_cwd = -100;
+/**
+ * Like open, but a relative path is resolved from the directory dirFD instead of the working directory.
+ * Directories can be opened without open_mode_write to be used as dirFD.
+ **/
+int64 openat(int64 dirFD, const char* path, uint64 mode);
 int64 close(int64 fd);
 
 int64 copyfd(int64 destFD, int64 srcFD);
@@ -59,11 +75,51 @@ int64 seekfd(int64 fd, int64 mode, uint64 pos);
 int64 read(int64 fd, void* buffer, uint64 bufferSize);
 int64 write(int64 fd, const void* buffer, uint64 bufferSize);
 
+/**
+ * Reads from / writes to fd at the given position.
+ * The position of fd is neither used nor changed.
+ **/
+int64 pread(int64 fd, void* buffer, uint64 bufferSize, uint64 pos);
+int64 pwrite(int64 fd, const void* buffer, uint64 bufferSize, uint64 pos);
+
+struct IOVec {
+    void* base;
+    uint64 length;
+};
+constexpr uint64 iovec_max = 1024;
+/**
+ * Reads into / writes from multiple buffers with a single system call.
+ * The buffers are filled / written in order, as if they were one contiguous buffer.
+ * @param iovCount      The number of entries in iov, at most iovec_max
+ **/
+int64 readv(int64 fd, const IOVec* iov, uint64 iovCount);
+int64 writev(int64 fd, const IOVec* iov, uint64 iovCount);
+
+/**
+ * Copies up to count bytes from inFD to outFD without passing the data through user space.
+ * Either descriptor can refer to a pipe. A pipe as inFD only transfers the data that is currently available.
+ * @param offset        If not nullptr, data is read from inFD starting at *offset, which is updated afterwards,
+ *                      and the position of inFD is not changed.
+ * @returns the number of bytes copied, 0 if the end of inFD was reached.
+ **/
+int64 sendfile(int64 outFD, int64 inFD, uint64* offset, uint64 count);
+
+/**
+ * Writes all data of fd that is still buffered by its file system to the device.
+ **/
+int64 fsync(int64 fd);
+
 int64 devcmd(int64 fd, int64 cmd, void* arg);
 
 int64 mount(const char* mountPoint, const char* fsID);
 int64 mount(const char* mountPoint, const char* fsID, const char* dev);
 
+/**
+ * Changes the options of the file system mounted at mountPoint, only root can do that.
+ * @param options       comma separated list of key=value pairs, e.g. "size=16M,nr_inodes=1024" for tempfs
+ **/
+int64 remount(const char* mountPoint, const char* options);
+
 int64 unmount(const char* mountPoint);
 
 struct ListEntry {
@@ -76,6 +132,10 @@ struct ListEntry {
  * @param entries           The buffer to write the entries to
  **/
 int64 list(const char* path, int* numEntries, ListEntry* entries);
+/**
+ * Like list, but a relative path is resolved from the directory dirFD.
+ **/
+int64 listat(int64 dirFD, const char* path, int* numEntries, ListEntry* entries);
 
 enum NodeType {
     NODE_FILE,
@@ -118,6 +178,57 @@ int64 stat(const char* path, Stats* stats);
  * @note if path points to a symlink, stat will return information about the symlink.
  **/
 int64 statl(const char* path, Stats* stats);
+/**
+ * Like stat / statl, but a relative path is resolved from the directory dirFD.
+ **/
+int64 statat(int64 dirFD, const char* path, Stats* stats, bool followSymlink);
+/**
+ * Returns information about the file that fd refers to.
+ **/
+int64 fstat(int64 fd, Stats* stats);
+
+/**
+ * Usage of a file system, a limit of 0 means that there is no limit.
+ **/
+struct FileSystemStats {
+    uint64 usedBytes;
+    uint64 maxBytes;
+    uint64 usedNodes;
+    uint64 maxNodes;
+};
+/**
+ * Returns the usage of the file system that contains path.
+ **/
+int64 statfs(const char* path, FileSystemStats* stats);
+
+/**
+ * A directory entry returned by getdents.
+ * Entries are packed one after another and are followed by their Stats (with getdents_plus) and their null terminated name,
+ * use dirent_stats, dirent_name and dirent_next to access them.
+ **/
+struct DirEntry {
+    uint32 recordLength;
+    uint32 nameLength;
+    uint64 nodeID;
+    uint64 nextOffset;      // position of the directory descriptor that continues the listing behind this entry
+    NodeType type;
+    uint32 flags;
+};
+constexpr uint32 dirent_has_stats = 0x1;
+constexpr uint64 getdents_plus = 0x1;
+/**
+ * Reads as many entries of the directory opened as fd into buffer as fit, continuing where the last call stopped.
+ * Seeking fd to 0 restarts the listing.
+ * @param flags         getdents_plus to also return the Stats of every entry
+ * @returns the number of bytes written, 0 at the end of the directory, ErrorBufferTooSmall if not even one entry fits.
+ **/
+int64 getdents(int64 fd, void* buffer, uint64 bufferSize, uint64 flags);
+/**
+ * Returns the Stats of the entry, or nullptr if getdents was called without getdents_plus.
+ **/
+const Stats* dirent_stats(const DirEntry* entry);
+const char* dirent_name(const DirEntry* entry);
+const DirEntry* dirent_next(const DirEntry* entry);
 
 /**
  * Changes the working directory of the calling thread.